@@ -1,39 +1,207 @@
+#ifdef AVOCC_TRACE
+#define _POSIX_C_SOURCE 199309L // clock_gettime()
+#endif
+
 #include "avocc.h"
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <threads.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+// AVX2 kernels are compiled apart and picked at runtime, see simd_level()
+#define AVOC_AVX2
+#include <immintrin.h>
+#endif
 
-void avoc_source_init(avoc_source *src, const char *name, const char *buf_data,
-                      size_t buf_len) {
-  assert(src != NULL);
+#ifdef AVOCC_TRACE
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
-  if (buf_data != NULL) {
-    src->buf_data = calloc(buf_len, sizeof(unsigned char));
-    memset(src->buf_data, 0L, buf_len);
-    memcpy(src->buf_data, buf_data, buf_len);
-  } else {
-    src->buf_data = NULL;
+// Traced functions are defined as <name>_untraced and wrapped at the end of
+// this file, without AVOCC_TRACE they are defined under their own name.
+#define TRACED(fn) fn##_untraced
+#define TRACE_SPAN_BEGIN(start) const uint64_t start = trace_now_us()
+#define TRACE_SPAN_END(name, src, start) trace_span(name, src, start)
+
+static uint64_t trace_now_us(void);
+static void trace_span(const char *name, const avoc_source *src,
+                       uint64_t start);
+#else
+#define TRACED(fn) fn
+#define TRACE_SPAN_BEGIN(start)
+#define TRACE_SPAN_END(name, src, start)
+#endif
+
+// Asks the cache for ptr ahead of reading it
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(ptr) __builtin_prefetch(ptr)
+#else
+#define PREFETCH(ptr) ((void)(ptr))
+#endif
+
+static void *std_malloc(void *ctx, size_t size) {
+  (void)ctx;
+  return malloc(size);
+}
+
+static void *std_realloc(void *ctx, void *ptr, size_t old_size,
+                         size_t new_size) {
+  (void)ctx;
+  (void)old_size;
+  return realloc(ptr, new_size);
+}
+
+static void std_free(void *ctx, void *ptr, size_t size) {
+  (void)ctx;
+  (void)size;
+  free(ptr);
+}
+
+static const avoc_allocator std_allocator = {std_malloc, std_realloc,
+                                             std_free, NULL};
+static avoc_allocator allocator = {std_malloc, std_realloc, std_free, NULL};
+static avoc_alloc_stats alloc_stats = {0L, 0L, 0L, 0L};
+
+static void alloc_stats_grow(size_t size) {
+  alloc_stats.bytes_in_use += size;
+  if (alloc_stats.bytes_in_use > alloc_stats.peak_bytes) {
+    alloc_stats.peak_bytes = alloc_stats.bytes_in_use;
+  }
+}
+
+void avoc_set_allocator(const avoc_allocator *alloc) {
+  allocator = alloc != NULL ? *alloc : std_allocator;
+}
+
+void avoc_get_alloc_stats(avoc_alloc_stats *stats) {
+  assert(stats != NULL);
+  *stats = alloc_stats;
+}
+
+void avoc_reset_alloc_stats(void) {
+  alloc_stats.alloc_count = 0L;
+  alloc_stats.free_count = 0L;
+  alloc_stats.peak_bytes = alloc_stats.bytes_in_use;
+}
+
+void *avoc_malloc(size_t size) {
+  void *ptr = allocator.alloc_fn(allocator.ctx, size);
+  if (ptr != NULL) {
+    alloc_stats.alloc_count++;
+    alloc_stats_grow(size);
+  }
+
+  return ptr;
+}
+
+void avoc_free(void *ptr, size_t size) {
+  if (ptr == NULL) {
+    return;
+  }
+
+  alloc_stats.free_count++;
+  alloc_stats.bytes_in_use -= size;
+  allocator.free_fn(allocator.ctx, ptr, size);
+}
+
+static void *avoc_calloc(size_t count, size_t size) {
+  void *ptr = avoc_malloc(count * size);
+  if (ptr != NULL) {
+    memset(ptr, 0L, count * size);
   }
 
+  return ptr;
+}
+
+static void *avoc_realloc(void *ptr, size_t old_size, size_t new_size) {
+  if (ptr == NULL) {
+    return avoc_malloc(new_size);
+  }
+
+  void *new_ptr = allocator.realloc_fn(allocator.ctx, ptr, old_size, new_size);
+  if (new_ptr != NULL) {
+    alloc_stats.alloc_count++;
+    alloc_stats.bytes_in_use -= old_size;
+    alloc_stats_grow(new_size);
+  }
+
+  return new_ptr;
+}
+
+// Scratch stacks of the traversals are allocated through the hooks too.
+// Returns array grown to twice *cap elements, or 16 when empty, or NULL
+// leaving array and *cap untouched when out of memory.
+static void *scratch_grow(void *array, size_t *cap, size_t elem_size) {
+  const size_t new_cap = *cap > 0 ? *cap * 2 : 16L;
+  void *grown = avoc_realloc(array, *cap * elem_size, new_cap * elem_size);
+  if (grown != NULL) {
+    *cap = new_cap;
+  }
+
+  return grown;
+}
+
+avoc_status avoc_source_init(avoc_source *src, const char *name,
+                             const char *buf_data, size_t buf_len) {
+  assert(src != NULL);
+
+  src->buf_data = NULL;
+  src->name = NULL;
   src->buf_len = buf_len;
+  src->buf_owned = buf_data != NULL;
   src->buf_pos = 0L;
   src->cur_cp = 0L;
   src->nxt_cp = 0L;
   src->cur_cp_pos = 0L;
   src->nxt_cp_pos = 0L;
-  src->row = 1L;
-  src->col = 1L;
+  src->line_starts = NULL;
+  src->line_count = 0L;
+  src->line_cap = 0L;
+  src->str_buf = NULL;
+  src->str_cap = 0L;
+  src->cons = NULL;
+  src->depth = 0L;
+  src->tok_end = 0L;
+
+  if (buf_data != NULL) {
+    src->buf_data = avoc_malloc(buf_len);
+    if (src->buf_data == NULL && buf_len > 0) {
+      src->buf_len = 0L;
+      return FAILED;
+    }
+
+    memcpy(src->buf_data, buf_data, buf_len);
+  }
 
   if (name != NULL) {
     size_t name_len = strlen(name) + 1;
-    src->name = calloc(name_len, sizeof(char));
-    memset(src->name, 0L, name_len);
+    src->name = avoc_malloc(name_len);
+    if (src->name == NULL) {
+      avoc_source_free(src);
+      return FAILED;
+    }
+
     memcpy(src->name, name, name_len);
-  } else {
-    src->name = NULL;
   }
+
+  return OK;
+}
+
+avoc_status avoc_source_init_view(avoc_source *src, const char *name,
+                                  const char *buf_data, size_t buf_len) {
+  avoc_status status = avoc_source_init(src, name, NULL, buf_len);
+  src->buf_data = (unsigned char *)buf_data;
+  return status;
 }
 
 void avoc_token_init(avoc_token *token) {
@@ -51,6 +219,12 @@ void avoc_item_init(avoc_item *item) {
   item->prev_sibling = NULL;
   item->sym_ordinary_type = NULL;
   item->sym_composed_type = NULL;
+  item->str_len = 0L;
+  item->sym_ordinary_type_len = 0L;
+  item->str_owned = 0;
+  item->hash = 0UL;
+  item->offset = 0L;
+  item->length = 0L;
 }
 
 void avoc_list_init(avoc_list *list) {
@@ -58,67 +232,461 @@ void avoc_list_init(avoc_list *list) {
   list->head = NULL;
   list->tail = NULL;
   list->item_count = 0L;
+  list->hash = 0UL;
+  list->refs = 1L;
+  list->item_type = -1;
+}
+
+// Releases the line index, which is built again on the next lookup.
+static void source_drop_lines(avoc_source *src) {
+  if (src->line_starts != NULL) {
+    avoc_free(src->line_starts, src->line_cap * sizeof(size_t));
+    src->line_starts = NULL;
+    src->line_count = 0L;
+    src->line_cap = 0L;
+  }
 }
 
 void avoc_source_free(avoc_source *src) {
   assert(src != NULL);
 
-  if (src->buf_data != NULL) {
-    free(src->buf_data);
-    src->buf_data = NULL;
+  if (src->buf_data != NULL && src->buf_owned) {
+    avoc_free(src->buf_data, src->buf_len);
   }
 
+  src->buf_data = NULL;
+
   if (src->name != NULL) {
-    free(src->name);
+    avoc_free(src->name, strlen(src->name) + 1);
     src->name = NULL;
   }
+
+  if (src->str_buf != NULL) {
+    avoc_free(src->str_buf, src->str_cap);
+    src->str_buf = NULL;
+    src->str_cap = 0L;
+  }
+
+  source_drop_lines(src);
+}
+
+static avoc_status source_push_line(avoc_source *src, size_t start) {
+  if (src->line_count == src->line_cap) {
+    size_t *grown = scratch_grow(src->line_starts, &src->line_cap,
+                                 sizeof(size_t));
+    if (grown == NULL) {
+      return FAILED;
+    }
+
+    src->line_starts = grown;
+  }
+
+  src->line_starts[src->line_count++] = start;
+  return OK;
+}
+
+// Builds the offsets where each line starts, none when out of memory.
+static avoc_status source_index_lines(avoc_source *src) {
+  const unsigned char *data = src->buf_data;
+  const size_t len = data != NULL ? src->buf_len : 0L;
+  size_t i = 0;
+  avoc_status status = source_push_line(src, 0L);
+#ifdef __SSE2__
+  const __m128i newl = _mm_set1_epi8('\n');
+  for (; status == OK && i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newl));
+    while (status == OK && mask != 0) {
+      status = source_push_line(src, i + __builtin_ctz(mask) + 1);
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; status == OK && i < len; i++) {
+    if (data[i] == '\n') {
+      status = source_push_line(src, i + 1);
+    }
+  }
+
+  if (status != OK) {
+    source_drop_lines(src);
+  }
+
+  return status;
+}
+
+void avoc_source_position(avoc_source *src, size_t offset, size_t *row,
+                          size_t *col) {
+  assert(src != NULL);
+  assert(row != NULL);
+  assert(col != NULL);
+
+  if (src->buf_data == NULL) {
+    offset = 0L;
+  } else if (offset > src->buf_len) {
+    offset = src->buf_len;
+  }
+
+  // Last line starting at or before offset, counted from the start of the
+  // buffer when there is no memory for the index
+  size_t lo = 0L;
+  size_t start = 0L;
+  if (src->line_starts != NULL || source_index_lines(src) == OK) {
+    size_t hi = src->line_count;
+    while (hi - lo > 1) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (src->line_starts[mid] <= offset) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+
+    start = src->line_starts[lo];
+  } else {
+    for (size_t i = 0; i < offset; i++) {
+      if (src->buf_data[i] == '\n') {
+        lo++;
+        start = i + 1;
+      }
+    }
+  }
+
+  // Columns count codepoints, continuation bytes are skipped
+  size_t column = 1L;
+  for (size_t i = start; i < offset; i++) {
+    column += (src->buf_data[i] & 0xC0u) != 0x80u;
+  }
+
+  *row = lo + 1;
+  *col = column;
+}
+
+// Frees the strings owned by an item, child lists are left untouched.
+static void item_free_strings(avoc_item *item) {
+  if (!item->str_owned) {
+    return;
+  }
+
+  switch (item->type) {
+  case ITEM_COMMENT:
+  case ITEM_LIT_STR:
+    avoc_free(item->as_str, item->str_len + 1);
+    break;
+  case ITEM_SYM:
+    if (item->sym_ordinary_type != NULL) {
+      avoc_free(item->sym_ordinary_type, item->sym_ordinary_type_len + 1);
+    }
+
+    avoc_free(item->as_sym, item->str_len + 1);
+    break;
+  default:
+    break;
+  }
+}
+
+// Returns the child list owned by an item, if any.
+static avoc_list *item_child_list(avoc_item *item) {
+  switch (item->type) {
+  case ITEM_CALL:
+  case ITEM_LIT_LST:
+    return item->as_list;
+  case ITEM_SYM:
+    return item->sym_composed_type;
+  default:
+    return NULL;
+  }
 }
 
 void avoc_item_free(avoc_item *item) {
   assert(item != NULL);
+  avoc_list *child = item_child_list(item);
+
+  item_free_strings(item);
+  if (child != NULL && child->refs > 1) {
+    child->refs--;
+  } else if (child != NULL) {
+    avoc_list_free(child);
+    avoc_free(child, sizeof(avoc_list));
+  }
+}
+
+// Copies a string view into a new NUL terminated buffer, NULL when out of
+// memory.
+static char *view_dup(const char *view, size_t len) {
+  char *cpy = avoc_malloc(len + 1);
+  if (cpy != NULL) {
+    memcpy(cpy, view, len);
+    cpy[len] = '\0';
+  }
+
+  return cpy;
+}
+
+avoc_status avoc_item_materialize(avoc_item *item) {
+  assert(item != NULL);
+  if (item->str_owned) {
+    return OK;
+  }
 
-  // all of those are the same, but let's keep it named
+  char *str = NULL;
+  char *type = NULL;
   switch (item->type) {
   case ITEM_COMMENT:
   case ITEM_LIT_STR:
-    free(item->as_str);
+  case ITEM_SYM:
+    str = view_dup(item->as_str, item->str_len);
+    if (str == NULL) {
+      return FAILED;
+    }
     break;
+  default:
+    return OK;
+  }
+
+  if (item->type == ITEM_SYM && item->sym_ordinary_type != NULL) {
+    type = view_dup(item->sym_ordinary_type, item->sym_ordinary_type_len);
+    if (type == NULL) {
+      avoc_free(str, item->str_len + 1);
+      return FAILED;
+    }
+
+    item->sym_ordinary_type = type;
+  }
+
+  item->as_str = str;
+  item->str_owned = 1;
+  return OK;
+}
+
+void avoc_list_free(avoc_list *list) {
+  assert(list != NULL);
+  avoc_item *cur = list->head != NULL ? list->head : list->tail;
+  if (cur == NULL) {
+    return;
+  }
+
+  // Child lists are spliced after the last pending item instead of being
+  // freed recursively, so the stack usage does not depend on the depth.
+  avoc_item *last = cur;
+  while (last->next_sibling != NULL) {
+    last = last->next_sibling;
+  }
+
+  while (cur != NULL) {
+    avoc_list *child = item_child_list(cur);
+    if (child != NULL && child->refs > 1) {
+      child->refs--;
+    } else if (child != NULL) {
+      avoc_item *child_head = child->head != NULL ? child->head : child->tail;
+      if (child_head != NULL) {
+        last->next_sibling = child_head;
+        while (last->next_sibling != NULL) {
+          last = last->next_sibling;
+        }
+      }
+
+      avoc_free(child, sizeof(avoc_list));
+    }
+
+    avoc_item *nxt = cur->next_sibling;
+    item_free_strings(cur);
+    avoc_free(cur, sizeof(avoc_item));
+    cur = nxt;
+  }
+}
+
+// Finalizer of splitmix64, every input bit affects every output bit.
+static uint64_t hash_mix(uint64_t h) {
+  h ^= h >> 30;
+  h *= 0xBF58476D1CE4E5B9UL;
+  h ^= h >> 27;
+  h *= 0x94D049BB133111EBUL;
+  return h ^ (h >> 31);
+}
+
+// FNV-1a of a byte string continuing from h.
+static uint64_t hash_bytes(uint64_t h, const char *data, size_t len) {
+  h ^= 0xCBF29CE484222325UL;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)data[i]) * 0x100000001B3UL;
+  }
+
+  return h;
+}
+
+// Hash of an item, child lists must be complete as their hash is used.
+static uint64_t item_hash(const avoc_item *item) {
+  uint64_t h = hash_mix((uint64_t)item->type + 1);
+  switch (item->type) {
+  case ITEM_LIT_STR:
+  case ITEM_COMMENT:
+  case ITEM_LAZY:
+    return hash_mix(hash_bytes(h, item->as_str, item->str_len));
   case ITEM_SYM:
+    h = hash_bytes(h, item->as_sym, item->str_len);
     if (item->sym_ordinary_type != NULL) {
-      free(item->sym_ordinary_type);
+      h = hash_bytes(h + 1, item->sym_ordinary_type,
+                     item->sym_ordinary_type_len);
     }
 
     if (item->sym_composed_type != NULL) {
-      avoc_list_free(item->sym_composed_type);
-      free(item->sym_composed_type);
+      h = hash_mix(h + 2) ^ item->sym_composed_type->hash;
     }
 
-    free(item->as_sym);
-    break;
+    return hash_mix(h);
   case ITEM_CALL:
   case ITEM_LIT_LST:
-    avoc_list_free(item->as_list);
-    free(item->as_list);
-    break;
+    return hash_mix(h ^ item->as_list->hash);
   default:
-    break;
+    // Scalars are stored over a zeroed payload
+    return hash_mix(h ^ item->as_u64);
   }
 }
 
-void avoc_list_free(avoc_list *list) {
-  assert(list != NULL);
-  if (list->head != NULL) {
-    avoc_item *cur = list->head;
-    do {
-      avoc_item *nxt = cur->next_sibling;
-      avoc_item_free(cur);
-      free(cur);
-      cur = nxt;
-    } while (cur != NULL);
-  } else if (list->tail != NULL) {
-    avoc_item_free(list->tail);
-    free(list->tail);
+static int view_equal(const char *a, size_t alen, const char *b, size_t blen) {
+  if (a == NULL || b == NULL) {
+    return a == b;
+  }
+
+  return alen == blen && memcmp(a, b, alen) == 0;
+}
+
+// Compares two items whose child lists are already shared, so equal child
+// lists are the same list.
+static int item_shallow_equal(const avoc_item *a, const avoc_item *b) {
+  if (a->hash != b->hash || a->type != b->type) {
+    return 0;
+  }
+
+  switch (a->type) {
+  case ITEM_LIT_STR:
+  case ITEM_COMMENT:
+  case ITEM_LAZY:
+    return view_equal(a->as_str, a->str_len, b->as_str, b->str_len);
+  case ITEM_SYM:
+    return view_equal(a->as_sym, a->str_len, b->as_sym, b->str_len) &&
+           view_equal(a->sym_ordinary_type, a->sym_ordinary_type_len,
+                      b->sym_ordinary_type, b->sym_ordinary_type_len) &&
+           a->sym_composed_type == b->sym_composed_type;
+  case ITEM_CALL:
+  case ITEM_LIT_LST:
+    return a->as_list == b->as_list;
+  default:
+    return a->as_u64 == b->as_u64;
+  }
+}
+
+static int list_shallow_equal(const avoc_list *a, const avoc_list *b) {
+  if (a->hash != b->hash || a->item_count != b->item_count) {
+    return 0;
+  }
+
+  const avoc_item *x = a->head;
+  const avoc_item *y = b->head;
+  for (; x != NULL && y != NULL; x = x->next_sibling, y = y->next_sibling) {
+    if (!item_shallow_equal(x, y)) {
+      return 0;
+    }
+  }
+
+  return x == NULL && y == NULL;
+}
+
+// Lists parsed by avoc_parse_source_shared(), open addressing on their hash.
+// The table does not own the lists and only lives while parsing.
+typedef struct _avoc_cons_table {
+  avoc_list **slots;
+  size_t cap; // Power of two
+  size_t count;
+} avoc_cons_table;
+
+static void cons_insert(avoc_cons_table *table, avoc_list *list) {
+  size_t i = list->hash & (table->cap - 1);
+  while (table->slots[i] != NULL) {
+    i = (i + 1) & (table->cap - 1);
+  }
+
+  table->slots[i] = list;
+  table->count++;
+}
+
+static avoc_status cons_grow(avoc_cons_table *table) {
+  avoc_list **slots = table->slots;
+  size_t cap = table->cap;
+  const size_t new_cap = cap == 0 ? 256 : cap * 2;
+  avoc_list **grown = avoc_calloc(new_cap, sizeof(avoc_list *));
+  if (grown == NULL) {
+    return FAILED;
+  }
+
+  table->cap = new_cap;
+  table->slots = grown;
+  table->count = 0L;
+  for (size_t i = 0; i < cap; i++) {
+    if (slots[i] != NULL) {
+      cons_insert(table, slots[i]);
+    }
+  }
+
+  avoc_free(slots, cap * sizeof(avoc_list *));
+  return OK;
+}
+
+// Returns the shared list equal to list, releasing list, or adds list to
+// the table when it is the first one with its structure. NULL leaving list
+// untouched when out of memory.
+static avoc_list *cons_list(avoc_cons_table *table, avoc_list *list) {
+  if ((table->count + 1) * 2 > table->cap && cons_grow(table) != OK) {
+    return NULL;
+  }
+
+  for (size_t i = list->hash & (table->cap - 1); table->slots[i] != NULL;
+       i = (i + 1) & (table->cap - 1)) {
+    avoc_list *shared = table->slots[i];
+    if (list_shallow_equal(shared, list)) {
+      avoc_list_free(list);
+      avoc_free(list, sizeof(avoc_list));
+      shared->refs++;
+      return shared;
+    }
   }
+
+  cons_insert(table, list);
+  return list;
+}
+
+// Completes a parsed item, sharing its child list when parsing with a cons
+// table and computing its hash. Children are finished before their parent.
+static avoc_status item_finish(avoc_source *src, avoc_item *item) {
+  avoc_list **child = NULL;
+  if (src->cons != NULL) {
+    switch (item->type) {
+    case ITEM_CALL:
+    case ITEM_LIT_LST:
+      child = &item->as_list;
+      break;
+    case ITEM_SYM:
+      if (item->sym_composed_type != NULL) {
+        child = &item->sym_composed_type;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (child != NULL) {
+    avoc_list *shared = cons_list(src->cons, *child);
+    if (shared == NULL) {
+      return FAILED;
+    }
+
+    *child = shared;
+  }
+
+  item->hash = item_hash(item);
+  return OK;
 }
 
 int utf8_encode(char *dest, unsigned ch) {
@@ -131,6 +699,9 @@ int utf8_encode(char *dest, unsigned ch) {
     dest[1] = (ch & 0x3F) | 0x80;
     return 2;
   }
+  if (ch >= 0xD800 && ch <= 0xDFFF) {
+    return 0; // Surrogates are not valid in UTF-8
+  }
   if (ch < 0x10000) {
     dest[0] = (ch >> 12) | 0xE0;
     dest[1] = ((ch >> 6) & 0x3F) | 0x80;
@@ -173,6 +744,9 @@ static int utf8_cp_size(int cp) {
   return len;
 }
 
+// isspace() is only defined for unsigned char values, codepoints are not
+static int cp_isspace(int cp) { return cp >= 0 && cp < 0x80 && isspace(cp); }
+
 static int utf8_next_cp(avoc_source *src) {
   assert(src != NULL);
   int c0 = utf8_get(src);
@@ -248,30 +822,348 @@ int avoc_source_fwd(avoc_source *src) {
     src->nxt_cp = utf8_next_cp(src);
   }
 
-  if (src->cur_cp == '\n') {
-    src->row++;
-    src->col = 1L;
-  } else {
-    src->col++;
-  }
-
   return src->cur_cp;
 }
 
-avoc_status avoc_next_token(avoc_source *src, avoc_token *token) {
-  assert(src != NULL);
-  assert(token != NULL);
+// Grows the string scratch buffer so it can hold len bytes after used ones.
+static avoc_status source_str_reserve(avoc_source *src, size_t used,
+                                      size_t len) {
+  if (used + len <= src->str_cap) {
+    return OK;
+  }
 
-  avoc_token_init(token);
+  size_t cap = src->str_cap == 0 ? 64 : src->str_cap;
+  while (cap < used + len) {
+    cap *= 2;
+  }
 
-  int cur = avoc_source_fwd(src);
-  // clean whitespaces
-  while (isspace(cur) && cur != '\n' && cur != EOF) {
+  char *grown = avoc_realloc(src->str_buf, src->str_cap, cap);
+  if (grown == NULL) {
+    return FAILED;
+  }
+
+  src->str_buf = grown;
+  src->str_cap = cap;
+  return OK;
+}
+
+// Moves the source to the codepoint at pos, as if avoc_source_fwd had
+// stopped there.
+static void source_seek(avoc_source *src, size_t pos) {
+  src->buf_pos = pos;
+  src->cur_cp_pos = (long)pos;
+  src->cur_cp = utf8_next_cp(src);
+  src->nxt_cp_pos = (long)src->buf_pos;
+  src->nxt_cp = utf8_next_cp(src);
+}
+
+// Value of a hexadecimal digit, -1 if it is not one.
+static int hex_digit(int c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+
+  return -1;
+}
+
+// Decodes count hexadecimal digits, -1 if any of them is not valid.
+static long hex_decode(const unsigned char *data, int count) {
+  long value = 0;
+  for (int i = 0; i < count; i++) {
+    int digit = hex_digit(data[i]);
+    if (digit < 0) {
+      return -1;
+    }
+
+    value = (value << 4) | digit;
+  }
+
+  return value;
+}
+
+// Length of the leading run of ASCII bytes which are neither the terminator,
+// a backslash nor a new line, so they can be taken as they are.
+static size_t str_run_len(const unsigned char *data, size_t len,
+                          int terminator) {
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i term = _mm_set1_epi8((char)terminator);
+  const __m128i bslash = _mm_set1_epi8('\\');
+  const __m128i newl = _mm_set1_epi8('\n');
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+    __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(chunk, term),
+                                _mm_cmpeq_epi8(chunk, bslash));
+    hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, newl));
+    // the sign bit of the chunk itself flags non-ASCII bytes
+    int mask = _mm_movemask_epi8(_mm_or_si128(hits, chunk));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; i < len; i++) {
+    int c = data[i];
+    if (c == terminator || c == '\\' || c == '\n' || c >= 0x80) {
+      break;
+    }
+  }
+
+  return i;
+}
+
+typedef struct {
+  const char *name;
+  size_t len;
+  avoc_keyword keyword;
+} keyword_entry;
+
+// Perfect hash table of the keywords, KEYWORD_HASH() gives each one its own
+// slot. The multipliers were found by search, test_keywords fails if a new
+// keyword collides, search again (or grow the table) in that case.
+#define KEYWORD_HASH(str, len)                                                 \
+  ((3u * (unsigned char)(str)[0] + (unsigned char)(str)[(len)-1] +             \
+    2u * (unsigned)(len)) &                                                    \
+   15u)
+#define KEYWORD_MIN_LEN 2
+#define KEYWORD_MAX_LEN 5
+
+static const keyword_entry keyword_table[16] = {
+    {"macro", 5, KEYWORD_MACRO},
+    {"false", 5, KEYWORD_FALSE},
+    {"quote", 5, KEYWORD_QUOTE},
+    {NULL, 0, KEYWORD_NONE},
+    {"fn", 2, KEYWORD_FN},
+    {"if", 2, KEYWORD_IF},
+    {NULL, 0, KEYWORD_NONE},
+    {NULL, 0, KEYWORD_NONE},
+    {"def", 3, KEYWORD_DEF},
+    {"true", 4, KEYWORD_TRUE},
+    {NULL, 0, KEYWORD_NONE},
+    {NULL, 0, KEYWORD_NONE},
+    {"nil", 3, KEYWORD_NIL},
+    {NULL, 0, KEYWORD_NONE},
+    {"let", 3, KEYWORD_LET},
+    {"do", 2, KEYWORD_DO},
+};
+
+avoc_keyword avoc_keyword_lookup(const char *str, size_t len) {
+  assert(str != NULL || len == 0);
+  if (len < KEYWORD_MIN_LEN || len > KEYWORD_MAX_LEN) {
+    return KEYWORD_NONE;
+  }
+
+  const keyword_entry *entry = &keyword_table[KEYWORD_HASH(str, len)];
+  if (entry->len == len && memcmp(entry->name, str, len) == 0) {
+    return entry->keyword;
+  }
+
+  return KEYWORD_NONE;
+}
+
+// Lexes a string literal starting at token->offset. The contents are
+// validated and, when they contain escape sequences, unescaped into
+// src->str_buf in the same pass, token->auxlen is the unescaped length.
+// Backtick strings are raw, a backslash only prevents '`' from ending them.
+static avoc_status lex_string(avoc_source *src, avoc_token *token,
+                              int terminator) {
+  const unsigned char *data = src->buf_data;
+  const size_t len = src->buf_len;
+  const int raw = terminator == '`';
+  size_t pos = token->offset + 1;
+  size_t out = 0;
+  int escaped = 0;
+
+  for (;;) {
+    size_t run = str_run_len(data + pos, len - pos, terminator);
+    if (escaped && run > 0) {
+      if (source_str_reserve(src, out, run) != OK) {
+        return FAILED;
+      }
+
+      memcpy(src->str_buf + out, data + pos, run);
+      out += run;
+    }
+
+    pos += run;
+    if (pos >= len) {
+      source_seek(src, token->offset);
+      PRINT_ERROR(src, "unterminated string");
+      return FAILED;
+    }
+
+    int c = data[pos];
+    if (c == terminator) {
+      pos++;
+      break;
+    }
+
+    if (c == '\n') {
+      if (!raw) {
+        source_seek(src, token->offset);
+        PRINT_ERROR(src, "unterminated string");
+        return FAILED;
+      }
+
+      pos++;
+      continue;
+    }
+
+    if (c >= 0x80) {
+      src->buf_pos = pos;
+      int cp = utf8_next_cp(src);
+      if (cp == UTF8_ERROR || utf8_cp_size(cp) == -1) {
+        source_seek(src, pos);
+        PRINT_ERROR(src, "utf-8 encoding error");
+        return FAILED;
+      }
+
+      size_t cp_len = src->buf_pos - pos;
+      if (escaped) {
+        if (source_str_reserve(src, out, cp_len) != OK) {
+          return FAILED;
+        }
+
+        memcpy(src->str_buf + out, data + pos, cp_len);
+        out += cp_len;
+      }
+
+      pos += cp_len;
+      continue;
+    }
+
+    // c is a backslash
+    if (raw) {
+      size_t skip = pos + 1 < len && data[pos + 1] == '`' ? 2 : 1;
+      pos += skip;
+      continue;
+    }
+
+    if (!escaped) {
+      escaped = 1;
+      out = pos - token->offset - 1;
+      if (source_str_reserve(src, 0, out + 4) != OK) {
+        return FAILED;
+      }
+
+      memcpy(src->str_buf, data + token->offset + 1, out);
+    }
+
+    if (pos + 1 >= len) {
+      source_seek(src, token->offset);
+      PRINT_ERROR(src, "unterminated string");
+      return FAILED;
+    }
+
+    int esc = data[pos + 1];
+    int ch = 0;
+    int take = 0;
+    switch (esc) {
+    case 'a':
+      ch = '\a';
+      break;
+    case 'b':
+      ch = '\b';
+      break;
+    case 'e':
+      ch = 0x1B;
+      break;
+    case 'f':
+      ch = '\f';
+      break;
+    case 'n':
+      ch = '\n';
+      break;
+    case 'r':
+      ch = '\r';
+      break;
+    case 't':
+      ch = '\t';
+      break;
+    case 'v':
+      ch = '\v';
+      break;
+    case '\\':
+    case '?':
+    case '\'':
+    case '"':
+      ch = esc;
+      break;
+    case 'x':
+      take = 2;
+      break;
+    case 'u':
+      take = 4;
+      break;
+    case 'U':
+      take = 8;
+      break;
+    default:
+      source_seek(src, pos);
+      PRINT_ERRORF(src, "unknown escape sequence: \\%c", esc);
+      return FAILED;
+    }
+
+    pos += 2;
+    if (source_str_reserve(src, out, 4) != OK) {
+      return FAILED;
+    }
+
+    if (take == 0) {
+      src->str_buf[out++] = (char)ch;
+      continue;
+    }
+
+    if (pos + take > len) {
+      source_seek(src, token->offset);
+      PRINT_ERROR(src, "unterminated string");
+      return FAILED;
+    }
+
+    long code = hex_decode(data + pos, take);
+    if (code < 0) {
+      source_seek(src, pos - 2);
+      PRINT_ERROR(src, "invalid hexadecimal escape sequence");
+      return FAILED;
+    }
+
+    // \xHH is the code point U+00HH, two bytes above 0x7F, so strings stay
+    // valid UTF-8
+    pos += take;
+    int cp_len = utf8_encode(src->str_buf + out, (unsigned)code);
+    if (cp_len == 0) {
+      source_seek(src, pos - take - 2);
+      PRINT_ERROR(src, "invalid unicode escape sequence");
+      return FAILED;
+    }
+
+    out += cp_len;
+  }
+
+  token->length = pos - token->offset;
+  token->auxlen = escaped ? out : token->length - 2;
+  source_seek(src, pos - 1);
+  return OK;
+}
+
+avoc_status TRACED(avoc_next_token)(avoc_source *src, avoc_token *token) {
+  assert(src != NULL);
+  assert(token != NULL);
+
+  src->tok_end = token->offset + token->length;
+  avoc_token_init(token);
+
+  int cur = avoc_source_fwd(src);
+  // clean whitespaces
+  while (cp_isspace(cur) && cur != '\n' && cur != EOF) {
     cur = avoc_source_fwd(src);
   }
 
   int allow_newl = 0;
-  int terminator = 0;
   token->offset = src->cur_cp_pos;
   int cp_size = utf8_cp_size(cur);
   if (cp_size == -1) {
@@ -343,83 +1235,7 @@ avoc_status avoc_next_token(avoc_source *src, avoc_token *token) {
   case '`':
   case '"':
     token->type = TOKEN_LIT_STR;
-    terminator = cur;
-    if (cur == '`') {
-      allow_newl = 1;
-    }
-
-    while ((cur = avoc_source_fwd(src)) != UTF8_END) {
-      if (cur == UTF8_ERROR) {
-        PRINT_ERROR(src, "utf-8 encoding error");
-        return FAILED;
-      }
-
-      if (cur == '\n' && !allow_newl) {
-        PRINT_ERROR(src, "unterminated string");
-        return FAILED;
-      }
-
-      cp_size = utf8_cp_size(cur);
-      if (cp_size == -1) {
-        PRINT_ERROR(src, "utf-8 encoding error");
-        return FAILED;
-      }
-
-      if (cur == '\\') {
-        char codebuf[9] = "\0\0\0\0\0\0\0\0\0"; // to convert into int
-        int taken_cps = 0; // how many codepoints takes the escaped char
-        if (src->nxt_cp == terminator ||
-            strchr("abefnrtv\\?", src->nxt_cp) != NULL) {
-          taken_cps = 1;
-        } else if (src->nxt_cp == 'x') {
-          taken_cps = 3;
-        } else if (src->nxt_cp == 'u') {
-          taken_cps = 5;
-          memcpy(codebuf, (const char *)(src->buf_data + src->buf_pos), 4);
-        } else if (src->nxt_cp == 'U') {
-          taken_cps = 9;
-          memcpy(codebuf, (const char *)(src->buf_data + src->buf_pos), 8);
-        } else {
-          PRINT_ERRORF(src, "unknown escape sequence: \\%c", src->nxt_cp);
-          return FAILED;
-        }
-
-        // Skip this character '\\'
-        token->length += cp_size;
-
-        // Predict length bases on the codepoint size of the future unescaped
-        // character
-        if (codebuf[0] != 0) {
-          int codelen = (int)strtol(codebuf, NULL, 16);
-          token->auxlen += utf8_cp_size(codelen);
-        } else {
-          token->auxlen += cp_size;
-        }
-
-        // Skip number of characters after '\\'
-        for (int i = 0; i < taken_cps; i++) {
-          int cp = avoc_source_fwd(src);
-          token->length += utf8_cp_size(cp);
-        }
-
-        continue;
-      } else {
-        token->length += cp_size;
-        token->auxlen += cp_size;
-      }
-
-      if (cur == terminator) {
-        token->auxlen--;
-        break;
-      }
-    }
-
-    if (cur == UTF8_END) {
-      PRINT_ERROR(src, "unterminated string");
-      return FAILED;
-    }
-
-    return OK;
+    return lex_string(src, token, cur);
   case '{':
   case '}':
     PRINT_ERROR(src,
@@ -437,7 +1253,8 @@ avoc_status avoc_next_token(avoc_source *src, avoc_token *token) {
       }
 
       token->length += utf8_cp_size(cur);
-      if (strchr(":<([{}])>", src->nxt_cp) != NULL || isspace(src->nxt_cp)) {
+      if (strchr(":<([{}])>", src->nxt_cp) != NULL ||
+          cp_isspace(src->nxt_cp)) {
         break;
       }
     } while ((cur = avoc_source_fwd(src)) != UTF8_END);
@@ -445,15 +1262,16 @@ avoc_status avoc_next_token(avoc_source *src, avoc_token *token) {
     const char *str_start = (const char *)src->buf_data + token->offset;
     const size_t str_len = token->length;
     if (str_len >= 1) {
-      if ((strncmp("false", str_start, 5) == 0 && str_len == 5) ||
-          (strncmp("true", str_start, 4) == 0 && str_len == 4)) {
+      switch (avoc_keyword_lookup(str_start, str_len)) {
+      case KEYWORD_TRUE:
+      case KEYWORD_FALSE:
         token->type = TOKEN_LIT_BOL;
         return OK;
-      }
-
-      if (strncmp("nil", str_start, 3) == 0 && str_len == 3) {
+      case KEYWORD_NIL:
         token->type = TOKEN_NIL;
         return OK;
+      default:
+        break;
       }
 
       if (isdigit(str_start[0]) ||
@@ -479,7 +1297,12 @@ avoc_status avoc_next_token(avoc_source *src, avoc_token *token) {
 void avoc_list_push(avoc_list *dest, avoc_item *item) {
   assert(dest != NULL);
   assert(item != NULL);
-  dest->item_count++;
+  if (dest->item_count++ == 0) {
+    dest->item_type = (int)item->type;
+  } else if (dest->item_type != (int)item->type) {
+    dest->item_type = -1;
+  }
+  dest->hash = hash_mix(dest->hash + item->hash);
 
   if (dest->head == NULL) {
     dest->head = item;
@@ -497,7 +1320,16 @@ void avoc_list_push(avoc_list *dest, avoc_item *item) {
 void avoc_list_merge(avoc_list *left, avoc_list *right) {
   assert(left != NULL);
   assert(right != NULL);
+  if (left->item_count == 0) {
+    left->item_type = right->item_type;
+  } else if (right->item_count != 0 && left->item_type != right->item_type) {
+    left->item_type = -1;
+  }
   left->item_count = left->item_count + right->item_count;
+  for (avoc_item *cur = right->head; cur != NULL; cur = cur->next_sibling) {
+    left->hash = hash_mix(left->hash + cur->hash);
+  }
+
   if (left->tail == NULL) {
     left->tail = right->head;
   } else {
@@ -507,8 +1339,23 @@ void avoc_list_merge(avoc_list *left, avoc_list *right) {
   }
 }
 
-avoc_status avoc_parse_lit(avoc_source *src, avoc_token *token,
-                           avoc_item *item) {
+// Counts and hashes the items of list again after editing them in place.
+static void list_recount(avoc_list *list) {
+  list->item_count = 0L;
+  list->hash = 0UL;
+  list->item_type = -1;
+  for (avoc_item *item = list->head; item != NULL; item = item->next_sibling) {
+    if (list->item_count++ == 0) {
+      list->item_type = (int)item->type;
+    } else if (list->item_type != (int)item->type) {
+      list->item_type = -1;
+    }
+    list->hash = hash_mix(list->hash + item->hash);
+  }
+}
+
+avoc_status TRACED(avoc_parse_lit)(avoc_source *src, avoc_token *token,
+                                   avoc_item *item) {
   assert(src != NULL);
   assert(token != NULL);
   assert(item != NULL);
@@ -521,11 +1368,14 @@ avoc_status avoc_parse_lit(avoc_source *src, avoc_token *token,
 
   if (token->type == TOKEN_LIT_BOL) {
     item->type = ITEM_LIT_BOL;
-    if (strncmp("true", contents, 4) == 0 && contents_len == 4) {
+    switch (avoc_keyword_lookup(contents, contents_len)) {
+    case KEYWORD_TRUE:
       item->as_bol = 1;
-    } else if (strncmp("false", contents, 5) == 0 && contents_len == 5) {
+      break;
+    case KEYWORD_FALSE:
       item->as_bol = 0;
-    } else {
+      break;
+    default:
       assert(0 && "should not reach");
     }
 
@@ -676,9 +1526,10 @@ avoc_status avoc_parse_lit(avoc_source *src, avoc_token *token,
       item->type = ITEM_LIT_F32;
     }
 
-    contents_cpy = calloc(contents_len + 1, sizeof(char));
-    memset(contents_cpy, 0L, contents_len + 1);
-    memcpy(contents_cpy, contents, contents_len);
+    contents_cpy = view_dup((const char *)contents, contents_len);
+    if (contents_cpy == NULL) {
+      return FAILED;
+    }
 
     switch (item->type) {
     case ITEM_LIT_I32:
@@ -704,117 +1555,47 @@ avoc_status avoc_parse_lit(avoc_source *src, avoc_token *token,
       item->as_f64 = is_neg ? -item->as_f64 : item->as_f64;
       break;
     default:
-      free(contents_cpy);
+      avoc_free(contents_cpy, contents_len + 1);
       assert(0 && "unexpected literal type");
       return FAILED;
     }
 
-    free(contents_cpy);
+    avoc_free(contents_cpy, contents_len + 1);
+    // Infinities have no literal, so they could not be written back
+    if ((item->type == ITEM_LIT_F32 && !isfinite(item->as_f32)) ||
+        (item->type == ITEM_LIT_F64 && !isfinite(item->as_f64))) {
+      PRINT_ERROR(src, "floating point literal out of range");
+      return FAILED;
+    }
+
     return avoc_next_token(src, token);
   } else if (token->type == TOKEN_LIT_STR) {
     item->type = ITEM_LIT_STR;
-    contents_cpy = calloc(token->auxlen + 1, sizeof(char));
-
-    for (size_t i = 1, j = 0; i < token->length - 1; i++, j++) {
-      int peek = contents[i];
-      int mask = peek & 0xFF;
-      int skip = 0;
-
-      if ((mask & 0x80) == 0) {
-        skip = 0;
-
-        if (peek == '\\' && i < token->length - 2 && contents[0] != '`') {
-          peek = contents[++i];
-          char codebuf[9] = "\0\0\0\0\0\0\0\0\0";
-          int ch = 0;
-          int take = 0;
-
-          switch (peek) {
-          case 'e':
-          case '\\':
-            ch = '\\';
-            break;
-          case 'a':
-            ch = '\a';
-            break;
-          case 'b':
-            ch = '\b';
-            break;
-          case 'f':
-            ch = '\f';
-            break;
-          case 'n':
-            ch = '\n';
-            break;
-          case 'r':
-            ch = '\r';
-            break;
-          case 't':
-            ch = '\t';
-            break;
-          case 'v':
-            ch = '\v';
-            break;
-          case '"':
-            ch = '"';
-            break;
-          case '\'':
-            ch = '\'';
-            break;
-          case 'x':
-            take = 2;
-            break;
-          case 'u':
-            take = 4;
-            break;
-          case 'U':
-            take = 8;
-            break;
-          default:
-            PRINT_ERROR(src, "unknown escape sequence");
-            free(contents_cpy);
-            return FAILED;
-          }
 
-          if (take > 0) {
-            for (int k = 0; k < take; k++) {
-              codebuf[k] = contents[++i];
-            }
-
-            ch = strtol(codebuf, NULL, 16);
-          }
-
-          int cp_size = utf8_encode(contents_cpy + j, ch);
-          j += cp_size - 1;
-          continue;
-        } else if (peek == '\\' && contents[0] != '`') {
-          PRINT_ERROR(src, "unterminated escape sequence");
-          free(contents_cpy);
-          return FAILED;
-        }
-      } else if ((mask & 0xE0) == 0xC0) {
-        skip = 1;
-      } else if ((mask & 0xF0) == 0xE0) {
-        skip = 2;
-      } else if ((mask & 0xF8) == 0xF0) {
-        skip = 3;
-      } else {
-        PRINT_ERROR(src, "utf-8 decode error");
-        free(contents_cpy);
-        return FAILED;
-      }
+    // Strings without escape sequences are a view into the source buffer
+    if (token->auxlen == token->length - 2) {
+      item->as_str = (char *)contents + 1;
+      item->str_len = token->length - 2;
+      item->str_owned = 0;
+      return avoc_next_token(src, token);
+    }
 
-      contents_cpy[j] = contents[i];
-      for (int k = 0; k < skip; k++) {
-        i++;
-        contents_cpy[k] = contents[i];
-      }
+    // The lexer left the unescaped contents in the scratch buffer
+    contents_cpy = view_dup(src->str_buf, token->auxlen);
+    if (contents_cpy == NULL) {
+      return FAILED;
     }
 
     item->as_str = contents_cpy;
+    item->str_len = token->auxlen;
+    item->str_owned = 1;
     return avoc_next_token(src, token);
   } else if (token->type == TOKEN_LIST_S) {
-    item->as_list = malloc(sizeof(avoc_list));
+    item->as_list = avoc_malloc(sizeof(avoc_list));
+    if (item->as_list == NULL) {
+      return FAILED;
+    }
+
     item->type = ITEM_LIT_LST;
     avoc_list_init(item->as_list);
     return avoc_parse_list(src, token, item->as_list, TOKEN_LIST_E);
@@ -827,8 +1608,8 @@ avoc_status avoc_parse_lit(avoc_source *src, avoc_token *token,
   return FAILED;
 }
 
-avoc_status avoc_parse_sym(avoc_source *src, avoc_token *token,
-                           avoc_item *item) {
+avoc_status TRACED(avoc_parse_sym)(avoc_source *src, avoc_token *token,
+                                   avoc_item *item) {
   assert(src != NULL);
   assert(token != NULL);
   assert(item != NULL);
@@ -836,9 +1617,9 @@ avoc_status avoc_parse_sym(avoc_source *src, avoc_token *token,
   avoc_status status = OK;
 
   item->type = ITEM_SYM;
-  item->as_sym = calloc(token->type, sizeof(char) + 1);
-  memset(item->as_sym, 0L, token->length + 1);
-  memcpy(item->as_sym, src->buf_data + token->offset, token->length);
+  item->as_sym = (char *)src->buf_data + token->offset;
+  item->str_len = token->length;
+  item->str_owned = 0;
 
   status = avoc_next_token(src, token);
   if (status != OK) {
@@ -854,17 +1635,23 @@ avoc_status avoc_parse_sym(avoc_source *src, avoc_token *token,
     } while (token->type == TOKEN_EOL || token->type == TOKEN_COMMENT);
 
     if (token->type == TOKEN_ID) {
-      item->sym_ordinary_type = calloc(token->length + 1, sizeof(char));
-      memset(item->sym_ordinary_type, 0L, token->length + 1);
-      memcpy(item->sym_ordinary_type, src->buf_data + token->offset,
-             token->length);
+      item->sym_ordinary_type = (char *)src->buf_data + token->offset;
+      item->sym_ordinary_type_len = token->length;
+      status = avoc_next_token(src, token);
     } else if (token->type == TOKEN_CALL_S) {
-      item->sym_composed_type = malloc(sizeof(avoc_list));
+      // avoc_parse_list leaves the token after the closing bracket
+      item->sym_composed_type = avoc_malloc(sizeof(avoc_list));
+      if (item->sym_composed_type == NULL) {
+        return FAILED;
+      }
+
       avoc_list_init(item->sym_composed_type);
       status =
           avoc_parse_list(src, token, item->sym_composed_type, TOKEN_CALL_E);
       if (status != OK) {
-        free(item->sym_composed_type);
+        avoc_list_free(item->sym_composed_type);
+        avoc_free(item->sym_composed_type, sizeof(avoc_list));
+        item->sym_composed_type = NULL;
         return status;
       }
     } else {
@@ -872,11 +1659,6 @@ avoc_status avoc_parse_sym(avoc_source *src, avoc_token *token,
       PRINT_UNEXPECTED_TOKEN_ERROR(src, TOKEN_CALL_S, token->type);
       return FAILED;
     }
-
-    status = avoc_next_token(src, token);
-    if (status != OK) {
-      return status;
-    }
   }
 
   return status;
@@ -889,9 +1671,9 @@ avoc_status avoc_parse_comment(avoc_source *src, avoc_token *token,
   assert(item != NULL);
 
   item->type = ITEM_COMMENT;
-  item->as_str = calloc(token->length, sizeof(char) + 1);
-  memset(item->as_str, 0L, token->length + 1);
-  memcpy(item->as_str, src->buf_data + token->offset, token->length);
+  item->as_str = (char *)src->buf_data + token->offset;
+  item->str_len = token->length;
+  item->str_owned = 0;
   return OK;
 }
 
@@ -901,13 +1683,18 @@ avoc_status avoc_parse_item(avoc_source *src, avoc_token *token,
   assert(token != NULL);
   assert(item != NULL);
   avoc_status status = OK;
+  const size_t start = token->offset;
 
   switch (token->type) {
   case TOKEN_ID:
     status = avoc_parse_sym(src, token, item);
     break;
   case TOKEN_CALL_S:
-    item->as_list = malloc(sizeof(avoc_list));
+    item->as_list = avoc_malloc(sizeof(avoc_list));
+    if (item->as_list == NULL) {
+      return FAILED;
+    }
+
     item->type = ITEM_CALL;
     avoc_list_init(item->as_list);
     status = avoc_parse_list(src, token, item->as_list, TOKEN_CALL_E);
@@ -935,15 +1722,18 @@ avoc_status avoc_parse_item(avoc_source *src, avoc_token *token,
     return FAILED;
   }
 
+  if (status == OK) {
+    item->offset = start;
+    item->length = src->tok_end - start;
+    status = item_finish(src, item);
+  }
+
   return status;
 }
 
-avoc_status avoc_parse_list(avoc_source *src, avoc_token *token,
-                            avoc_list *list, avoc_token_type term) {
-  assert(src != NULL);
-  assert(token != NULL);
-  assert(list != NULL);
-
+// Parses the items of a list up to term, see avoc_parse_list.
+static avoc_status parse_list_items(avoc_source *src, avoc_token *token,
+                                    avoc_list *list, avoc_token_type term) {
   avoc_status status = avoc_next_token(src, token);
   if (status != OK) {
     return status;
@@ -959,12 +1749,16 @@ avoc_status avoc_parse_list(avoc_source *src, avoc_token *token,
       continue;
     }
 
-    avoc_item *item = malloc(sizeof(avoc_item));
-    avoc_item_init(item);
+    avoc_item *item = avoc_malloc(sizeof(avoc_item));
+    if (item == NULL) {
+      return FAILED;
+    }
 
+    avoc_item_init(item);
     status = avoc_parse_item(src, token, item);
     if (status != OK) {
-      free(item);
+      avoc_item_free(item);
+      avoc_free(item, sizeof(avoc_item));
       return status;
     }
 
@@ -984,42 +1778,129 @@ avoc_status avoc_parse_list(avoc_source *src, avoc_token *token,
   return OK;
 }
 
-avoc_status avoc_parse_source(avoc_source *src, avoc_list *list) {
+avoc_status TRACED(avoc_parse_list)(avoc_source *src, avoc_token *token,
+                                    avoc_list *list, avoc_token_type term) {
   assert(src != NULL);
+  assert(token != NULL);
   assert(list != NULL);
 
-  avoc_token token;
-  avoc_token_init(&token);
-
-  avoc_status status = avoc_next_token(src, &token);
-  if (status != OK) {
-    return status;
+  if (src->depth >= AVOC_MAX_DEPTH) {
+    PRINT_ERRORF(src, "lists nested deeper than %d levels", AVOC_MAX_DEPTH);
+    return FAILED;
   }
 
-  while (token.type != TOKEN_EOF) {
-    if (token.type == TOKEN_EOL) {
-      status = avoc_next_token(src, &token);
-      if (status != OK) {
-        return status;
-      }
+  src->depth++;
+  avoc_status status = parse_list_items(src, token, list, term);
+  src->depth--;
+  return status;
+}
 
-      continue;
+// Moves token past the form it starts, keeping track of the nesting of any
+// kind of bracket without building items. Mismatched brackets are left for
+// the parser to report once the form is forced.
+static avoc_status skip_form(avoc_source *src, avoc_token *token) {
+  size_t depth = 1L;
+  while (depth > 0) {
+    avoc_status status = avoc_next_token(src, token);
+    if (status != OK) {
+      return status;
     }
 
-    if (token.type == TOKEN_CALL_S) {
-      avoc_list *child = malloc(sizeof(avoc_list));
-      avoc_list_init(child);
-
-      status = avoc_parse_list(src, &token, child, TOKEN_CALL_E);
+    switch (token->type) {
+    case TOKEN_CALL_S:
+    case TOKEN_LIST_S:
+      depth++;
+      break;
+    case TOKEN_CALL_E:
+    case TOKEN_LIST_E:
+      depth--;
+      break;
+    case TOKEN_EOF:
+      PRINT_UNEXPECTED_TOKEN_ERROR(src, TOKEN_CALL_E, token->type);
+      return FAILED;
+    default:
+      break;
+    }
+  }
+
+  return OK;
+}
+
+static avoc_status parse_source(avoc_source *src, avoc_list *list, int lazy) {
+  assert(src != NULL);
+  assert(list != NULL);
+
+  avoc_token token;
+  avoc_token_init(&token);
+
+  avoc_status status = avoc_next_token(src, &token);
+  if (status != OK) {
+    return status;
+  }
+
+  while (token.type != TOKEN_EOF) {
+    if (token.type == TOKEN_EOL) {
+      status = avoc_next_token(src, &token);
+      if (status != OK) {
+        return status;
+      }
+
+      continue;
+    }
+
+    if (token.type == TOKEN_CALL_S && lazy) {
+      size_t offset = token.offset;
+      status = skip_form(src, &token);
       if (status != OK) {
-        free(child);
         return status;
       }
 
-      avoc_item *child_item = malloc(sizeof(avoc_item));
+      avoc_item *child_item = avoc_malloc(sizeof(avoc_item));
+      if (child_item == NULL) {
+        return FAILED;
+      }
+
+      avoc_item_init(child_item);
+      child_item->type = ITEM_LAZY;
+      child_item->as_str = (char *)src->buf_data + offset;
+      child_item->str_len = token.offset + token.length - offset;
+      child_item->offset = offset;
+      child_item->length = child_item->str_len;
+      child_item->hash = item_hash(child_item);
+      avoc_list_push(list, child_item);
+
+      status = avoc_next_token(src, &token);
+      if (status != OK) {
+        return status;
+      }
+    } else if (token.type == TOKEN_CALL_S) {
+      size_t offset = token.offset;
+      avoc_list *child = avoc_malloc(sizeof(avoc_list));
+      if (child == NULL) {
+        return FAILED;
+      }
+
+      avoc_list_init(child);
+      status = avoc_parse_list(src, &token, child, TOKEN_CALL_E);
+      avoc_item *child_item =
+          status == OK ? avoc_malloc(sizeof(avoc_item)) : NULL;
+      if (child_item == NULL) {
+        avoc_list_free(child);
+        avoc_free(child, sizeof(avoc_list));
+        return FAILED;
+      }
+
       avoc_item_init(child_item);
       child_item->type = ITEM_CALL;
       child_item->as_list = child;
+      child_item->offset = offset;
+      child_item->length = src->tok_end - offset;
+      if (item_finish(src, child_item) != OK) {
+        avoc_item_free(child_item);
+        avoc_free(child_item, sizeof(avoc_item));
+        return FAILED;
+      }
+
       avoc_list_push(list, child_item);
     } else {
       PRINT_UNEXPECTED_TOKEN_ERROR(src, TOKEN_CALL_E, token.type);
@@ -1029,3 +1910,5338 @@ avoc_status avoc_parse_source(avoc_source *src, avoc_list *list) {
 
   return OK;
 }
+
+avoc_status avoc_parse_source(avoc_source *src, avoc_list *list) {
+  TRACE_SPAN_BEGIN(start);
+  avoc_status status = parse_source(src, list, 0);
+  TRACE_SPAN_END("parse", src, start);
+  return status;
+}
+
+avoc_status avoc_parse_source_lazy(avoc_source *src, avoc_list *list) {
+  TRACE_SPAN_BEGIN(start);
+  avoc_status status = parse_source(src, list, 1);
+  TRACE_SPAN_END("parse_lazy", src, start);
+  return status;
+}
+
+avoc_status avoc_parse_source_shared(avoc_source *src, avoc_list *list) {
+  TRACE_SPAN_BEGIN(start);
+  avoc_cons_table table = {NULL, 0L, 0L};
+  src->cons = &table;
+  avoc_status status = parse_source(src, list, 0);
+  src->cons = NULL;
+  avoc_free(table.slots, table.cap * sizeof(avoc_list *));
+  TRACE_SPAN_END("parse_shared", src, start);
+  return status;
+}
+
+avoc_status avoc_item_force(avoc_source *src, avoc_item *item) {
+  assert(src != NULL);
+  assert(item != NULL);
+  if (item->type != ITEM_LAZY) {
+    return OK;
+  }
+
+  size_t offset = (unsigned char *)item->as_str - src->buf_data;
+  assert(offset < src->buf_len);
+
+  // Leave the source as if the opening bracket was just read
+  source_seek(src, offset);
+
+  // The text kept by an edit that broke the syntax may not start a list
+  if (item->as_str[0] != '(') {
+    PRINT_UNEXPECTED_CHAR_ERROR(src, '(', item->as_str[0]);
+    return FAILED;
+  }
+
+  avoc_token token;
+  avoc_token_init(&token);
+  avoc_list *child = avoc_malloc(sizeof(avoc_list));
+  if (child == NULL) {
+    return FAILED;
+  }
+
+  avoc_list_init(child);
+  avoc_status status = avoc_parse_list(src, &token, child, TOKEN_CALL_E);
+  if (status == OK && src->tok_end != offset + item->str_len) {
+    // Nor end where the list does
+    PRINT_ERROR(src, "unexpected text after the list");
+    status = FAILED;
+  }
+
+  if (status == OK) {
+    // Finished as a call, so the list is shared before the item changes
+    avoc_item call = *item;
+    call.type = ITEM_CALL;
+    call.as_list = child;
+    call.str_len = 0L;
+    status = item_finish(src, &call);
+    if (status == OK) {
+      *item = call;
+      return OK;
+    }
+  }
+
+  avoc_list_free(child);
+  avoc_free(child, sizeof(avoc_list));
+  return status;
+}
+
+const avoc_item *avoc_item_at(const avoc_list *list, size_t offset) {
+  assert(list != NULL);
+  const avoc_item *found = NULL;
+
+  while (list != NULL) {
+    const avoc_item *item = list->head;
+    while (item != NULL &&
+           (offset < item->offset || offset >= item->offset + item->length)) {
+      item = item->next_sibling;
+    }
+
+    if (item == NULL) {
+      break;
+    }
+
+    found = item;
+    list = item_child_list((avoc_item *)item);
+  }
+
+  return found;
+}
+
+// Where the bytes of a source moved after an edit replacing removed bytes
+// before edit_end by len bytes.
+typedef struct {
+  const unsigned char *old_buf;
+  unsigned char *new_buf;
+  size_t edit_end;
+  size_t removed;
+  size_t len;
+} source_move;
+
+static size_t move_pos(const source_move *move, size_t pos) {
+  return pos >= move->edit_end ? pos - move->removed + move->len : pos;
+}
+
+static char *move_view(const source_move *move, const char *view) {
+  const size_t pos = (const unsigned char *)view - move->old_buf;
+  return (char *)move->new_buf + move_pos(move, pos);
+}
+
+// Moves the span and string views of an item, not those of its children.
+static void item_move(const source_move *move, avoc_item *item) {
+  item->offset = move_pos(move, item->offset);
+  if (item->str_owned) {
+    return;
+  }
+
+  switch (item->type) {
+  case ITEM_LIT_STR:
+  case ITEM_COMMENT:
+  case ITEM_LAZY:
+    item->as_str = move_view(move, item->as_str);
+    break;
+  case ITEM_SYM:
+    item->as_sym = move_view(move, item->as_sym);
+    if (item->sym_ordinary_type != NULL) {
+      item->sym_ordinary_type = move_view(move, item->sym_ordinary_type);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+// Items of a tree collected before changing it, so running out of memory
+// leaves the tree untouched
+typedef struct {
+  avoc_item **items;
+  size_t count;
+  size_t cap;
+} item_set;
+
+static avoc_status item_set_push(item_set *set, avoc_item *first,
+                                 avoc_item *end) {
+  for (avoc_item *item = first; item != end; item = item->next_sibling) {
+    if (set->count == set->cap) {
+      avoc_item **grown = scratch_grow(set->items, &set->cap, sizeof(item));
+      if (grown == NULL) {
+        return FAILED;
+      }
+
+      set->items = grown;
+    }
+
+    set->items[set->count++] = item;
+  }
+
+  return OK;
+}
+
+// Adds the forms from first up to end and all their children to set.
+static avoc_status item_set_add(item_set *set, avoc_item *first,
+                                avoc_item *end) {
+  size_t i = set->count;
+  if (item_set_push(set, first, end) != OK) {
+    return FAILED;
+  }
+
+  // Children are appended as their owners are reached, breadth first
+  for (; i < set->count; i++) {
+    avoc_list *child = item_child_list(set->items[i]);
+    if (child != NULL && item_set_push(set, child->head, NULL) != OK) {
+      return FAILED;
+    }
+  }
+
+  return OK;
+}
+
+static void item_set_free(item_set *set) {
+  avoc_free(set->items, set->cap * sizeof(avoc_item *));
+}
+
+avoc_status avoc_source_edit(avoc_source *src, avoc_list *list, size_t offset,
+                             size_t removed, const char *text, size_t len) {
+  assert(src != NULL);
+  assert(list != NULL);
+  assert(offset + removed <= src->buf_len);
+  const size_t new_len = src->buf_len - removed + len;
+  const source_move move = {src->buf_data, avoc_malloc(new_len),
+                            offset + removed, removed, len};
+  if (move.new_buf == NULL && new_len > 0) {
+    return FAILED;
+  }
+
+  if (offset > 0) {
+    memcpy(move.new_buf, src->buf_data, offset);
+  }
+
+  if (len > 0) {
+    memcpy(move.new_buf + offset, text, len);
+  }
+
+  if (move.edit_end < src->buf_len) {
+    memcpy(move.new_buf + offset + len, src->buf_data + move.edit_end,
+           src->buf_len - move.edit_end);
+  }
+
+  // Forms from first up to next touch the edit and are parsed again
+  avoc_item *prev = NULL;
+  avoc_item *first = list->head;
+  while (first != NULL && first->offset + first->length < offset) {
+    prev = first;
+    first = first->next_sibling;
+  }
+
+  avoc_item *next = first;
+  while (next != NULL && next->offset <= move.edit_end) {
+    next = next->next_sibling;
+  }
+
+  item_set kept = {NULL, 0L, 0L};
+  if (item_set_add(&kept, list->head, first) != OK ||
+      item_set_add(&kept, next, NULL) != OK) {
+    item_set_free(&kept);
+    avoc_free(move.new_buf, new_len);
+    return FAILED;
+  }
+
+  // The edited region is parsed in the new buffer before the tree changes,
+  // the lexer sees the start of next as the end of the buffer
+  const avoc_source saved = *src;
+  const size_t start = prev != NULL ? prev->offset + prev->length : 0L;
+  const size_t end = next != NULL ? move_pos(&move, next->offset) : new_len;
+  avoc_list fresh;
+  avoc_list_init(&fresh);
+  source_drop_lines(src);
+  src->buf_data = move.new_buf;
+  src->buf_len = end;
+  if (start > 0) {
+    source_seek(src, start - 1);
+  } else {
+    src->buf_pos = 0L;
+    src->cur_cp = 0;
+    src->nxt_cp = 0;
+    src->cur_cp_pos = 0L;
+    src->nxt_cp_pos = 0L;
+  }
+
+  avoc_status status = parse_source(src, &fresh, 0);
+  source_drop_lines(src);
+  avoc_item *broken = NULL;
+  if (status != OK) {
+    // The text is applied anyway to stay in step with the editor. The forms
+    // parsed before the error are kept and the rest of the region becomes
+    // one lazy item until an edit repairs it.
+    broken = avoc_malloc(sizeof(avoc_item));
+  }
+
+  if (status != OK && broken == NULL) {
+    avoc_list_free(&fresh);
+    item_set_free(&kept);
+    avoc_free(move.new_buf, new_len);
+    src->buf_data = saved.buf_data;
+    src->buf_len = saved.buf_len;
+    src->buf_pos = saved.buf_pos;
+    src->cur_pos = saved.cur_pos;
+    src->cur_cp = saved.cur_cp;
+    src->nxt_cp = saved.nxt_cp;
+    src->cur_cp_pos = saved.cur_cp_pos;
+    src->nxt_cp_pos = saved.nxt_cp_pos;
+    src->depth = saved.depth;
+    src->tok_end = saved.tok_end;
+    return FAILED;
+  }
+
+  if (broken != NULL) {
+    size_t from =
+        fresh.tail != NULL ? fresh.tail->offset + fresh.tail->length : start;
+    size_t to = end;
+    while (from < to && isspace(move.new_buf[from])) {
+      from++;
+    }
+
+    while (to > from && isspace(move.new_buf[to - 1])) {
+      to--;
+    }
+
+    avoc_item_init(broken);
+    broken->type = ITEM_LAZY;
+    broken->as_str = (char *)move.new_buf + from;
+    broken->str_len = to - from;
+    broken->offset = from;
+    broken->length = to - from;
+    broken->hash = item_hash(broken);
+    avoc_list_push(&fresh, broken);
+  }
+
+  for (size_t i = 0; i < kept.count; i++) {
+    item_move(&move, kept.items[i]);
+  }
+
+  item_set_free(&kept);
+
+  for (avoc_item *item = first; item != next;) {
+    avoc_item *nxt = item->next_sibling;
+    avoc_item_free(item);
+    avoc_free(item, sizeof(avoc_item));
+    item = nxt;
+  }
+
+  if (saved.buf_owned) {
+    avoc_free(saved.buf_data, saved.buf_len);
+  }
+
+  src->buf_len = new_len;
+  src->buf_owned = 1;
+
+  avoc_item *head = fresh.head != NULL ? fresh.head : next;
+  avoc_item *tail = fresh.tail != NULL ? fresh.tail : prev;
+  if (fresh.head != NULL) {
+    fresh.head->prev_sibling = prev;
+    fresh.tail->next_sibling = next;
+  }
+
+  if (prev != NULL) {
+    prev->next_sibling = head;
+  } else {
+    list->head = head;
+  }
+
+  if (next != NULL) {
+    next->prev_sibling = tail;
+  } else {
+    list->tail = tail;
+  }
+
+  list_recount(list);
+  return status;
+}
+
+avoc_status avoc_value_from_item(const avoc_item *item, avoc_value *value) {
+  assert(item != NULL);
+  assert(value != NULL);
+
+  switch (item->type) {
+  case ITEM_LIT_BOL:
+    *value = avoc_value_bol(item->as_bol);
+    return OK;
+  case ITEM_NIL:
+    *value = avoc_value_nil();
+    return OK;
+  case ITEM_LIT_I32:
+    *value = avoc_value_i32(item->as_i32);
+    return OK;
+  case ITEM_LIT_F32:
+    *value = avoc_value_f64(item->as_f32);
+    return OK;
+  case ITEM_LIT_F64:
+    *value = avoc_value_f64(item->as_f64);
+    return OK;
+  case ITEM_LIT_U32:
+    *value = item->as_u32 <= INT_MAX ? avoc_value_i32((int)item->as_u32)
+                                     : avoc_value_f64(item->as_u32);
+    return OK;
+  case ITEM_LIT_I64:
+    if (item->as_i64 >= INT_MIN && item->as_i64 <= INT_MAX) {
+      *value = avoc_value_i32((int)item->as_i64);
+      return OK;
+    }
+
+    // Only integers within the 53 bits of the mantissa are exact
+    if (item->as_i64 >= -(1L << 53) && item->as_i64 <= (1L << 53)) {
+      *value = avoc_value_f64((double)item->as_i64);
+      return OK;
+    }
+
+    return FAILED;
+  case ITEM_LIT_U64:
+    if (item->as_u64 <= INT_MAX) {
+      *value = avoc_value_i32((int)item->as_u64);
+      return OK;
+    }
+
+    if (item->as_u64 <= (1UL << 53)) {
+      *value = avoc_value_f64((double)item->as_u64);
+      return OK;
+    }
+
+    return FAILED;
+  default:
+    *value = avoc_value_ptr(item);
+    return OK;
+  }
+}
+
+avoc_status avoc_list_stats(const avoc_list *list, avoc_tree_stats *stats) {
+  assert(list != NULL);
+  assert(stats != NULL);
+  memset(stats, 0L, sizeof(avoc_tree_stats));
+
+  // Lists pending to visit
+  size_t pending_cap = 16L;
+  size_t pending_len = 0L;
+  const avoc_list **pending = avoc_malloc(pending_cap * sizeof(avoc_list *));
+  if (pending == NULL) {
+    return FAILED;
+  }
+
+  pending[pending_len++] = list;
+
+  while (pending_len > 0) {
+    const avoc_list *cur = pending[--pending_len];
+    for (const avoc_item *item = cur->head; item != NULL;
+         item = item->next_sibling) {
+      stats->item_count++;
+      stats->item_kinds[item->type]++;
+
+      switch (item->type) {
+      case ITEM_COMMENT:
+      case ITEM_LIT_STR:
+        if (item->str_owned) {
+          stats->str_bytes += item->str_len + 1;
+        } else {
+          stats->view_bytes += item->str_len;
+        }
+        break;
+      case ITEM_SYM:
+        if (item->str_owned) {
+          stats->sym_bytes += item->str_len + 1;
+        } else {
+          stats->view_bytes += item->str_len;
+        }
+
+        if (item->sym_ordinary_type != NULL && item->str_owned) {
+          stats->sym_bytes += item->sym_ordinary_type_len + 1;
+        } else if (item->sym_ordinary_type != NULL) {
+          stats->view_bytes += item->sym_ordinary_type_len;
+        }
+        break;
+      case ITEM_LAZY:
+        stats->view_bytes += item->str_len;
+        break;
+      default:
+        break;
+      }
+
+      const avoc_list *child = item_child_list((avoc_item *)item);
+      if (child == NULL) {
+        continue;
+      }
+
+      if (pending_len == pending_cap) {
+        const avoc_list **grown =
+            scratch_grow(pending, &pending_cap, sizeof(avoc_list *));
+        if (grown == NULL) {
+          avoc_free(pending, pending_cap * sizeof(avoc_list *));
+          return FAILED;
+        }
+
+        pending = grown;
+      }
+
+      stats->list_count++;
+      pending[pending_len++] = child;
+    }
+  }
+
+  avoc_free(pending, pending_cap * sizeof(avoc_list *));
+  stats->item_bytes = stats->item_count * sizeof(avoc_item);
+  stats->list_bytes = stats->list_count * sizeof(avoc_list);
+  return OK;
+}
+
+// A list being visited
+typedef struct {
+  const avoc_item *parent; // Item holding the list, NULL for the root
+  const avoc_item *next;   // Next item to visit
+} visit_frame;
+
+avoc_visit avoc_list_visit(const avoc_list *list, avoc_visit_fn pre,
+                           avoc_visit_fn post, void *ctx) {
+  assert(list != NULL);
+
+  size_t stack_cap = 16L;
+  size_t stack_len = 0L;
+  visit_frame *stack = avoc_malloc(stack_cap * sizeof(visit_frame));
+  if (stack == NULL) {
+    return AVOC_VISIT_STOP;
+  }
+
+  stack[stack_len].parent = NULL;
+  stack[stack_len++].next = list->head;
+
+  avoc_visit result = AVOC_VISIT_NEXT;
+  while (stack_len > 0 && result != AVOC_VISIT_STOP) {
+    visit_frame *top = &stack[stack_len - 1];
+    const avoc_item *item = top->next;
+    if (item == NULL) {
+      stack_len--;
+      if (top->parent != NULL && post != NULL) {
+        result = post(ctx, top->parent, stack_len - 1);
+      }
+
+      continue;
+    }
+
+    // The next sibling loads while the children of item are visited
+    top->next = item->next_sibling;
+    PREFETCH(top->next);
+
+    avoc_visit action = pre != NULL ? pre(ctx, item, stack_len - 1)
+                                    : AVOC_VISIT_NEXT;
+    if (action == AVOC_VISIT_STOP) {
+      result = action;
+      break;
+    }
+
+    const avoc_list *child =
+        action == AVOC_VISIT_NEXT ? item_child_list((avoc_item *)item) : NULL;
+    if (child == NULL) {
+      result = post != NULL ? post(ctx, item, stack_len - 1) : result;
+      continue;
+    }
+
+    if (stack_len == stack_cap) {
+      visit_frame *grown =
+          scratch_grow(stack, &stack_cap, sizeof(visit_frame));
+      if (grown == NULL) {
+        result = AVOC_VISIT_STOP;
+        break;
+      }
+
+      stack = grown;
+    }
+
+    stack[stack_len].parent = item;
+    stack[stack_len++].next = child->head;
+  }
+
+  avoc_free(stack, stack_cap * sizeof(visit_frame));
+  return result == AVOC_VISIT_STOP ? result : AVOC_VISIT_NEXT;
+}
+
+// Symbols with a meaning in query patterns
+typedef enum {
+  PATTERN_SYM,     // Plain symbol, matches itself
+  PATTERN_ANY,     // _
+  PATTERN_CAPTURE, // ?name
+  PATTERN_REST,    // ...
+} pattern_kind;
+
+static pattern_kind pattern_sym_kind(const char *sym, size_t len) {
+  if (len == 1 && sym[0] == '_') {
+    return PATTERN_ANY;
+  } else if (len > 1 && sym[0] == '?') {
+    return PATTERN_CAPTURE;
+  } else if (len == 3 && memcmp(sym, "...", 3) == 0) {
+    return PATTERN_REST;
+  }
+
+  return PATTERN_SYM;
+}
+
+static int pattern_is_rest(const avoc_item *pat) {
+  return pat->type == ITEM_SYM && pat->sym_ordinary_type == NULL &&
+         pat->sym_composed_type == NULL &&
+         pattern_sym_kind(pat->as_sym, pat->str_len) == PATTERN_REST;
+}
+
+static const avoc_item *skip_comments(const avoc_item *item) {
+  while (item != NULL && item->type == ITEM_COMMENT) {
+    item = item->next_sibling;
+  }
+
+  return item;
+}
+
+// A pattern list and a tree list being matched item by item
+typedef struct {
+  const avoc_item *pat;
+  const avoc_item *item;
+} query_frame;
+
+// Matching state of a query, frames holds the pending lists of the pattern
+typedef struct {
+  query_frame *frames;
+  size_t frame_count;
+  avoc_match *match;
+  size_t capture_count;
+} query_matcher;
+
+static void matcher_push(query_matcher *m, const avoc_list *pat,
+                         const avoc_list *item) {
+  m->frames[m->frame_count].pat = pat->head;
+  m->frames[m->frame_count++].item = item->head;
+}
+
+static void matcher_capture(query_matcher *m, const avoc_item *item) {
+  m->match->captures[m->capture_count++] = item;
+}
+
+// Matches a pattern symbol against an item, the composed types are pushed to
+// be matched later.
+static int match_sym(query_matcher *m, const avoc_item *pat,
+                     const avoc_item *item) {
+  const pattern_kind kind = pattern_sym_kind(pat->as_sym, pat->str_len);
+  const int typed =
+      pat->sym_ordinary_type != NULL || pat->sym_composed_type != NULL;
+  if (kind == PATTERN_CAPTURE) {
+    matcher_capture(m, item);
+  }
+
+  if (kind != PATTERN_SYM && !typed) {
+    return 1;
+  } else if (item->type != ITEM_SYM) {
+    return 0;
+  } else if (kind == PATTERN_SYM &&
+             !view_equal(pat->as_sym, pat->str_len, item->as_sym,
+                         item->str_len)) {
+    return 0;
+  }
+
+  if (pat->sym_composed_type != NULL) {
+    if (item->sym_composed_type == NULL) {
+      return 0;
+    }
+
+    matcher_push(m, pat->sym_composed_type, item->sym_composed_type);
+    return 1;
+  } else if (pat->sym_ordinary_type == NULL) {
+    return 1;
+  }
+
+  switch (pattern_sym_kind(pat->sym_ordinary_type,
+                           pat->sym_ordinary_type_len)) {
+  case PATTERN_SYM:
+  case PATTERN_REST:
+    return view_equal(pat->sym_ordinary_type, pat->sym_ordinary_type_len,
+                      item->sym_ordinary_type, item->sym_ordinary_type_len);
+  case PATTERN_CAPTURE:
+    matcher_capture(m, item);
+    break;
+  default:
+    break;
+  }
+
+  return item->sym_ordinary_type != NULL || item->sym_composed_type != NULL;
+}
+
+// Matches a pattern item against an item, the lists are pushed to be matched
+// later.
+static int match_item(query_matcher *m, const avoc_item *pat,
+                      const avoc_item *item) {
+  if (pat->type == ITEM_SYM) {
+    return match_sym(m, pat, item);
+  } else if (pat->type != item->type) {
+    return 0;
+  }
+
+  switch (pat->type) {
+  case ITEM_CALL:
+  case ITEM_LIT_LST:
+    matcher_push(m, pat->as_list, item->as_list);
+    return 1;
+  case ITEM_LIT_STR:
+    return view_equal(pat->as_str, pat->str_len, item->as_str, item->str_len);
+  default:
+    return pat->as_u64 == item->as_u64;
+  }
+}
+
+static int query_match(query_matcher *m, const avoc_query *query,
+                       const avoc_item *item) {
+  m->frame_count = 0L;
+  m->capture_count = 0L;
+  if (!match_item(m, &query->pattern, item)) {
+    return 0;
+  }
+
+  while (m->frame_count > 0) {
+    query_frame *top = &m->frames[m->frame_count - 1];
+    const avoc_item *pat = skip_comments(top->pat);
+    const avoc_item *cur = skip_comments(top->item);
+    if (pat == NULL && cur != NULL) {
+      return 0;
+    } else if (pat == NULL || pattern_is_rest(pat)) {
+      m->frame_count--;
+      continue;
+    } else if (cur == NULL) {
+      return 0;
+    }
+
+    top->pat = pat->next_sibling;
+    top->item = cur->next_sibling;
+    if (!match_item(m, pat, cur)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+// Measures the pattern while it is compiled
+static avoc_visit query_measure(void *ctx, const avoc_item *item,
+                                size_t depth) {
+  avoc_query *query = ctx;
+  if (item_child_list((avoc_item *)item) != NULL && depth + 1 > query->depth) {
+    query->depth = depth + 1;
+  }
+
+  if (item->type != ITEM_SYM) {
+    return AVOC_VISIT_NEXT;
+  }
+
+  query->capture_count +=
+      pattern_sym_kind(item->as_sym, item->str_len) == PATTERN_CAPTURE;
+  if (item->sym_ordinary_type != NULL &&
+      pattern_sym_kind(item->sym_ordinary_type,
+                       item->sym_ordinary_type_len) == PATTERN_CAPTURE) {
+    query->capture_count++;
+  }
+
+  return AVOC_VISIT_NEXT;
+}
+
+// Moves token past the line breaks and comments.
+static avoc_status skip_blank(avoc_source *src, avoc_token *token) {
+  avoc_status status = OK;
+  while (status == OK &&
+         (token->type == TOKEN_EOL || token->type == TOKEN_COMMENT)) {
+    status = avoc_next_token(src, token);
+  }
+
+  return status;
+}
+
+avoc_status avoc_query_init(avoc_query *query, const char *pattern,
+                            size_t len) {
+  assert(query != NULL);
+  assert(pattern != NULL);
+  avoc_item_init(&query->pattern);
+  query->depth = 0L;
+  query->capture_count = 0L;
+
+  avoc_token token;
+  avoc_token_init(&token);
+  avoc_status status = avoc_source_init(&query->src, "pattern", pattern, len);
+  if (status == OK) {
+    status = avoc_next_token(&query->src, &token);
+  }
+
+  if (status == OK) {
+    status = skip_blank(&query->src, &token);
+  }
+
+  if (status == OK && token.type == TOKEN_EOF) {
+    PRINT_ERROR(&query->src, "empty pattern");
+    status = FAILED;
+  } else if (status == OK) {
+    status = avoc_parse_item(&query->src, &token, &query->pattern);
+  }
+
+  if (status == OK) {
+    status = skip_blank(&query->src, &token);
+  }
+
+  if (status == OK && token.type != TOKEN_EOF) {
+    PRINT_ERROR(&query->src, "a pattern must be a single item");
+    status = FAILED;
+  }
+
+  if (status != OK) {
+    avoc_query_free(query);
+    return status;
+  }
+
+  avoc_list root;
+  avoc_list_init(&root);
+  root.head = root.tail = &query->pattern;
+  if (avoc_list_visit(&root, query_measure, NULL, query) == AVOC_VISIT_STOP) {
+    avoc_query_free(query);
+    return FAILED;
+  }
+
+  if (query->capture_count > AVOC_QUERY_MAX_CAPTURES) {
+    PRINT_ERRORF(&query->src, "patterns capture at most %d items",
+                 AVOC_QUERY_MAX_CAPTURES);
+    avoc_query_free(query);
+    return FAILED;
+  }
+
+  return OK;
+}
+
+void avoc_query_free(avoc_query *query) {
+  assert(query != NULL);
+  avoc_item_free(&query->pattern);
+  avoc_item_init(&query->pattern);
+  avoc_source_free(&query->src);
+}
+
+// State of avoc_query_run() shared by every visited item
+typedef struct {
+  const avoc_query *queries;
+  size_t count;
+  avoc_match_fn match_fn;
+  void *ctx;
+  query_matcher matcher;
+  avoc_match match;
+} query_run;
+
+static avoc_visit query_visit(void *ctx, const avoc_item *item,
+                              size_t depth) {
+  query_run *run = ctx;
+  avoc_visit result = AVOC_VISIT_NEXT;
+  for (size_t i = 0; i < run->count; i++) {
+    if (!query_match(&run->matcher, &run->queries[i], item)) {
+      continue;
+    }
+
+    run->match.query = i;
+    run->match.item = item;
+    run->match.depth = depth;
+    avoc_visit action = run->match_fn(run->ctx, &run->match);
+    if (action == AVOC_VISIT_STOP) {
+      return action;
+    } else if (action == AVOC_VISIT_SKIP) {
+      result = action;
+    }
+  }
+
+  return result;
+}
+
+avoc_visit avoc_query_run(const avoc_list *list, const avoc_query *queries,
+                          size_t count, avoc_match_fn match_fn, void *ctx) {
+  assert(list != NULL);
+  assert(queries != NULL || count == 0);
+  assert(match_fn != NULL);
+
+  query_run run;
+  memset(&run, 0, sizeof(run));
+  run.queries = queries;
+  run.count = count;
+  run.match_fn = match_fn;
+  run.ctx = ctx;
+  run.matcher.match = &run.match;
+
+  // A single matching stack fits the deepest pattern
+  size_t depth = 1L;
+  for (size_t i = 0; i < count; i++) {
+    depth = queries[i].depth > depth ? queries[i].depth : depth;
+  }
+
+  run.matcher.frames = avoc_malloc(depth * sizeof(query_frame));
+  if (run.matcher.frames == NULL) {
+    return AVOC_VISIT_STOP;
+  }
+
+  avoc_visit result = avoc_list_visit(list, query_visit, NULL, &run);
+  avoc_free(run.matcher.frames, depth * sizeof(query_frame));
+  return result;
+}
+
+// Interned string of an expander. Each string is allocated on its own, so
+// it keeps its address when the table grows.
+typedef struct _avoc_symbol {
+  char *str; // NUL terminated copy, NULL for an empty slot
+  size_t len;
+  uint64_t hash;
+  size_t macro; // 1 + index of the macro with this name, 0 for none
+} avoc_symbol;
+
+// A string interned by an expander
+typedef struct {
+  const char *str;
+  size_t len;
+} sym_view;
+
+typedef struct _avoc_macro {
+  sym_view *params; // Parameters, the rest one without its &
+  size_t param_count;
+  short rest;      // The last parameter takes the remaining arguments
+  sym_view *bound; // Names bound by the template, renamed on expansion
+  size_t bound_count;
+  size_t bound_cap;
+  avoc_item *body; // Template, copied from the definition
+} avoc_macro;
+
+// A cached expansion, key is a copy of the call it expands
+typedef struct _avoc_expansion {
+  uint64_t hash;
+  avoc_item *key;   // NULL for an empty slot
+  avoc_item *value; // Expansion, its lists are shared by the calls
+} avoc_expansion;
+
+void avoc_expander_init(avoc_expander *exp) {
+  assert(exp != NULL);
+  memset(exp, 0, sizeof(avoc_expander));
+}
+
+// Drops the cached expansions, the trees they were placed in keep their
+// references to the shared lists.
+static void cache_clear(avoc_expander *exp) {
+  for (size_t i = 0; i < exp->cache_cap; i++) {
+    avoc_expansion *entry = &exp->cache[i];
+    if (entry->key != NULL) {
+      avoc_item_free(entry->key);
+      avoc_free(entry->key, sizeof(avoc_item));
+      avoc_item_free(entry->value);
+      avoc_free(entry->value, sizeof(avoc_item));
+      entry->key = NULL;
+      entry->value = NULL;
+    }
+  }
+
+  exp->cache_count = 0L;
+}
+
+static void symbol_insert(avoc_expander *exp, const avoc_symbol *symbol) {
+  size_t i = symbol->hash & (exp->symbol_cap - 1);
+  while (exp->symbols[i].str != NULL) {
+    i = (i + 1) & (exp->symbol_cap - 1);
+  }
+
+  exp->symbols[i] = *symbol;
+  exp->symbol_count++;
+}
+
+static avoc_status symbol_grow(avoc_expander *exp) {
+  avoc_symbol *symbols = exp->symbols;
+  size_t cap = exp->symbol_cap;
+  const size_t new_cap = cap == 0 ? 256 : cap * 2;
+  avoc_symbol *grown = avoc_calloc(new_cap, sizeof(avoc_symbol));
+  if (grown == NULL) {
+    return FAILED;
+  }
+
+  exp->symbol_cap = new_cap;
+  exp->symbols = grown;
+  exp->symbol_count = 0L;
+  for (size_t i = 0; i < cap; i++) {
+    if (symbols[i].str != NULL) {
+      symbol_insert(exp, &symbols[i]);
+    }
+  }
+
+  avoc_free(symbols, cap * sizeof(avoc_symbol));
+  return OK;
+}
+
+// Finds the symbol of str, NULL if it was never interned. Symbols are valid
+// until the next one is interned.
+static avoc_symbol *symbol_find(const avoc_expander *exp, const char *str,
+                                size_t len, uint64_t hash) {
+  if (exp->symbol_cap == 0) {
+    return NULL;
+  }
+
+  for (size_t i = hash & (exp->symbol_cap - 1); exp->symbols[i].str != NULL;
+       i = (i + 1) & (exp->symbol_cap - 1)) {
+    avoc_symbol *symbol = &exp->symbols[i];
+    if (symbol->hash == hash &&
+        view_equal(symbol->str, symbol->len, str, len)) {
+      return symbol;
+    }
+  }
+
+  return NULL;
+}
+
+// NULL when out of memory.
+static avoc_symbol *symbol_intern(avoc_expander *exp, const char *str,
+                                  size_t len) {
+  const uint64_t hash = hash_bytes(0UL, str, len);
+  avoc_symbol *found = symbol_find(exp, str, len, hash);
+  if (found != NULL) {
+    return found;
+  }
+
+  if ((exp->symbol_count + 1) * 2 > exp->symbol_cap &&
+      symbol_grow(exp) != OK) {
+    return NULL;
+  }
+
+  avoc_symbol symbol = {view_dup(str, len), len, hash, 0L};
+  if (symbol.str == NULL) {
+    return NULL;
+  }
+
+  symbol_insert(exp, &symbol);
+  return symbol_find(exp, str, len, hash);
+}
+
+// Interned copy of str, NULL when out of memory.
+static char *intern(avoc_expander *exp, const char *str, size_t len) {
+  avoc_symbol *symbol = symbol_intern(exp, str, len);
+  return symbol != NULL ? symbol->str : NULL;
+}
+
+static int macro_binds(const avoc_macro *macro, const char *str, size_t len) {
+  for (size_t i = 0; i < macro->bound_count; i++) {
+    if (view_equal(macro->bound[i].str, macro->bound[i].len, str, len)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Tells whether item is a ,param or ,@param symbol, storing the index of the
+// parameter, param_count when it is unknown.
+static int macro_unquote(const avoc_macro *macro, const avoc_item *item,
+                         size_t *param, short *splice) {
+  if (item->type != ITEM_SYM || item->str_len < 2 || item->as_sym[0] != ',' ||
+      item->sym_ordinary_type != NULL || item->sym_composed_type != NULL) {
+    return 0;
+  }
+
+  *splice = item->as_sym[1] == '@';
+  const char *name = item->as_sym + 1 + *splice;
+  const size_t len = item->str_len - 1 - *splice;
+  for (*param = 0; *param < macro->param_count; (*param)++) {
+    if (view_equal(macro->params[*param].str, macro->params[*param].len,
+                   name, len)) {
+      break;
+    }
+  }
+
+  return 1;
+}
+
+static void macro_free(avoc_macro *macro) {
+  avoc_free(macro->params, macro->param_count * sizeof(sym_view));
+  avoc_free(macro->bound, macro->bound_cap * sizeof(sym_view));
+  if (macro->body != NULL) {
+    avoc_item_free(macro->body);
+    avoc_free(macro->body, sizeof(avoc_item));
+  }
+}
+
+// A macro call being expanded
+typedef struct {
+  const avoc_macro *macro;
+  const avoc_item **args; // Argument of each parameter, first one of rest
+  size_t id;              // Suffix of the renamed names
+  size_t offset;          // Span of the call, given to the template items
+  size_t length;
+} macro_call;
+
+// A range of items being copied into out. The copy of a list is pushed into
+// owner_out once its items are complete, so its hash is final.
+typedef struct {
+  const avoc_item *cur;
+  const avoc_item *end;
+  avoc_list *out;
+  avoc_item *owner;
+  avoc_list *owner_out;
+  short verbatim; // Copied as they are, i.e. the arguments
+} copy_frame;
+
+// Spells name#id in a new buffer of *len bytes, NULL when out of memory.
+static char *rename_spell(const char *name, size_t name_len, size_t id,
+                          size_t *len) {
+  char suffix[24];
+  const size_t suffix_len =
+      (size_t)snprintf(suffix, sizeof(suffix), "#%zu", id);
+  *len = name_len + suffix_len;
+  char *spelled = avoc_malloc(*len);
+  if (spelled != NULL) {
+    memcpy(spelled, name, name_len);
+    memcpy(spelled + name_len, suffix, suffix_len);
+  }
+
+  return spelled;
+}
+
+// Picks the id of an expansion of macro. Every symbol of the program is
+// interned before expanding and users can spell name#id too, so ids are
+// skipped until no bound name renamed with them was interned.
+static avoc_status rename_pick(avoc_expander *exp, const avoc_macro *macro,
+                               size_t *id) {
+  size_t i = 0;
+  *id = ++exp->gensym;
+  while (i < macro->bound_count) {
+    size_t len;
+    char *name = rename_spell(macro->bound[i].str, macro->bound[i].len, *id,
+                              &len);
+    if (name == NULL) {
+      return FAILED;
+    }
+
+    const avoc_symbol *taken =
+        symbol_find(exp, name, len, hash_bytes(0UL, name, len));
+    avoc_free(name, len);
+    if (taken != NULL) {
+      *id = ++exp->gensym;
+      i = 0L;
+    } else {
+      i++;
+    }
+  }
+
+  return OK;
+}
+
+// Names a symbol bound by a template after the expansion it belongs to,
+// NULL when out of memory.
+static char *sym_rename(avoc_expander *exp, const macro_call *call,
+                        const avoc_item *item, size_t *len) {
+  size_t name_len;
+  char *name = rename_spell(item->as_sym, item->str_len, call->id, &name_len);
+  if (name == NULL) {
+    return NULL;
+  }
+
+  avoc_symbol *symbol = symbol_intern(exp, name, name_len);
+  avoc_free(name, name_len);
+  if (symbol == NULL) {
+    return NULL;
+  }
+
+  *len = symbol->len;
+  return symbol->str;
+}
+
+// Copies the items from first up to end into out, interning their strings.
+// With a call, the items are the template of its macro: the parameters are
+// replaced by the arguments and the bound names renamed. When out of memory
+// it fails leaving the items copied so far in out.
+static avoc_status expand_copy(avoc_expander *exp, const avoc_item *first,
+                               const avoc_item *end, avoc_list *out,
+                               const macro_call *call) {
+  size_t stack_cap = 16L;
+  size_t stack_len = 0L;
+  copy_frame *stack = avoc_malloc(stack_cap * sizeof(copy_frame));
+  if (stack == NULL) {
+    return FAILED;
+  }
+
+  copy_frame root = {first, end, out, NULL, NULL, call == NULL};
+  stack[stack_len++] = root;
+
+  avoc_status status = OK;
+  while (stack_len > 0 && status == OK) {
+    copy_frame *top = &stack[stack_len - 1];
+    if (top->cur == top->end) {
+      stack_len--;
+      if (top->owner != NULL) {
+        top->owner->hash = item_hash(top->owner);
+        avoc_list_push(top->owner_out, top->owner);
+      }
+
+      continue;
+    }
+
+    const avoc_item *item = top->cur;
+    top->cur = item->next_sibling;
+
+    size_t param;
+    short splice;
+    copy_frame next = {NULL, NULL, top->out, NULL, NULL, 1};
+    if (!top->verbatim && macro_unquote(call->macro, item, &param, &splice)) {
+      // Checked when the macro was defined
+      next.cur = call->args[param];
+      next.end = splice || next.cur == NULL ? NULL : next.cur->next_sibling;
+    } else {
+      avoc_item *copy = avoc_malloc(sizeof(avoc_item));
+      if (copy == NULL) {
+        status = FAILED;
+        break;
+      }
+
+      *copy = *item;
+      copy->next_sibling = NULL;
+      copy->prev_sibling = NULL;
+      copy->str_owned = 0;
+      if (!top->verbatim) {
+        copy->offset = call->offset;
+        copy->length = call->length;
+      }
+
+      switch (item->type) {
+      case ITEM_LIT_STR:
+      case ITEM_COMMENT:
+      case ITEM_LAZY:
+        copy->as_str = intern(exp, item->as_str, item->str_len);
+        status = copy->as_str != NULL ? OK : FAILED;
+        break;
+      case ITEM_SYM:
+        if (!top->verbatim &&
+            macro_binds(call->macro, item->as_sym, item->str_len)) {
+          copy->as_sym = sym_rename(exp, call, item, &copy->str_len);
+          status = copy->as_sym != NULL ? OK : FAILED;
+        } else {
+          copy->as_sym = intern(exp, item->as_sym, item->str_len);
+          status = copy->as_sym != NULL ? OK : FAILED;
+        }
+
+        if (status == OK && item->sym_ordinary_type != NULL) {
+          copy->sym_ordinary_type = intern(exp, item->sym_ordinary_type,
+                                           item->sym_ordinary_type_len);
+          status = copy->sym_ordinary_type != NULL ? OK : FAILED;
+        }
+        break;
+      default:
+        break;
+      }
+
+      if (status != OK) {
+        avoc_free(copy, sizeof(avoc_item));
+        break;
+      }
+
+      exp->stats.output_items += call != NULL;
+      const avoc_list *child = item_child_list((avoc_item *)item);
+      if (child == NULL) {
+        copy->hash = item_hash(copy);
+        avoc_list_push(top->out, copy);
+        continue;
+      }
+
+      avoc_list *child_copy = avoc_malloc(sizeof(avoc_list));
+      if (child_copy == NULL) {
+        avoc_free(copy, sizeof(avoc_item));
+        status = FAILED;
+        break;
+      }
+
+      avoc_list_init(child_copy);
+      if (item->type == ITEM_SYM) {
+        copy->sym_composed_type = child_copy;
+      } else {
+        copy->as_list = child_copy;
+      }
+
+      next.cur = child->head;
+      next.out = child_copy;
+      next.owner = copy;
+      next.owner_out = top->out;
+      next.verbatim = top->verbatim;
+    }
+
+    if (stack_len == stack_cap) {
+      copy_frame *grown = scratch_grow(stack, &stack_cap, sizeof(copy_frame));
+      if (grown == NULL) {
+        if (next.owner != NULL) {
+          avoc_item_free(next.owner);
+          avoc_free(next.owner, sizeof(avoc_item));
+        }
+
+        status = FAILED;
+        break;
+      }
+
+      stack = grown;
+    }
+
+    stack[stack_len++] = next;
+  }
+
+  // Copies of lists not complete yet are not in out
+  while (stack_len > 1) {
+    avoc_item *owner = stack[--stack_len].owner;
+    if (owner != NULL) {
+      avoc_item_free(owner);
+      avoc_free(owner, sizeof(avoc_item));
+    }
+  }
+
+  avoc_free(stack, stack_cap * sizeof(copy_frame));
+  return status;
+}
+
+// Names bound by the template of a macro being defined, and the first
+// unquoted symbol that is not a parameter
+typedef struct {
+  avoc_macro *macro;
+  const avoc_item *unknown;
+} macro_scan;
+
+static avoc_status macro_bind(avoc_macro *macro, const avoc_item *item) {
+  if (item->type != ITEM_SYM || item->as_sym[0] == ',' ||
+      macro_binds(macro, item->as_sym, item->str_len)) {
+    return OK;
+  }
+
+  if (macro->bound_count == macro->bound_cap) {
+    size_t cap = macro->bound_cap == 0 ? 4 : macro->bound_cap * 2;
+    sym_view *grown = avoc_realloc(macro->bound,
+                                   macro->bound_cap * sizeof(sym_view),
+                                   cap * sizeof(sym_view));
+    if (grown == NULL) {
+      return FAILED;
+    }
+
+    macro->bound = grown;
+    macro->bound_cap = cap;
+  }
+
+  // The template is interned, so are its names
+  macro->bound[macro->bound_count].str = item->as_sym;
+  macro->bound[macro->bound_count++].len = item->str_len;
+  return OK;
+}
+
+static avoc_visit macro_scan_item(void *ctx, const avoc_item *item,
+                                  size_t depth) {
+  macro_scan *scan = ctx;
+  const avoc_macro *macro = scan->macro;
+  size_t param;
+  short splice;
+  (void)depth;
+  if (macro_unquote(macro, item, &param, &splice) &&
+      (param == macro->param_count ||
+       splice != (macro->rest && param + 1 == macro->param_count))) {
+    scan->unknown = item;
+    return AVOC_VISIT_STOP;
+  } else if (item->type != ITEM_CALL) {
+    return AVOC_VISIT_NEXT;
+  }
+
+  const avoc_item *head = skip_comments(item->as_list->head);
+  if (head == NULL || head->type != ITEM_SYM) {
+    return AVOC_VISIT_NEXT;
+  }
+
+  // (let [name value ...] ...) and (fn name? [params] ...)
+  const avoc_keyword keyword = avoc_keyword_lookup(head->as_sym, head->str_len);
+  const avoc_item *names = skip_comments(head->next_sibling);
+  if (keyword == KEYWORD_FN && names != NULL && names->type == ITEM_SYM) {
+    names = skip_comments(names->next_sibling);
+  }
+
+  if ((keyword != KEYWORD_LET && keyword != KEYWORD_FN) || names == NULL ||
+      names->type != ITEM_LIT_LST) {
+    return AVOC_VISIT_NEXT;
+  }
+
+  size_t i = 0L;
+  for (const avoc_item *name = skip_comments(names->as_list->head);
+       name != NULL; name = skip_comments(name->next_sibling), i++) {
+    // Out of memory the scan stops without an unknown symbol
+    if ((keyword == KEYWORD_FN || i % 2 == 0) &&
+        macro_bind(scan->macro, name) != OK) {
+      return AVOC_VISIT_STOP;
+    }
+  }
+
+  return AVOC_VISIT_NEXT;
+}
+
+static int is_plain_sym(const avoc_item *item) {
+  return item->type == ITEM_SYM && item->sym_ordinary_type == NULL &&
+         item->sym_composed_type == NULL;
+}
+
+// Whether item is a (macro ...) definition
+static int is_macro_form(const avoc_item *item) {
+  if (item->type != ITEM_CALL) {
+    return 0;
+  }
+
+  const avoc_item *head = skip_comments(item->as_list->head);
+  return head != NULL && is_plain_sym(head) &&
+         avoc_keyword_lookup(head->as_sym, head->str_len) == KEYWORD_MACRO;
+}
+
+// Reads the parameters of a macro, a & before the last one makes it take
+// the remaining arguments. Fails storing the parameter in bad when it is
+// not one, and with bad NULL when out of memory.
+static avoc_status macro_params(avoc_expander *exp, avoc_macro *macro,
+                                const avoc_list *params,
+                                const avoc_item **bad) {
+  size_t count = 0L;
+  *bad = NULL;
+  for (const avoc_item *param = skip_comments(params->head); param != NULL;
+       param = skip_comments(param->next_sibling)) {
+    if (!is_plain_sym(param) || macro->rest > 1 ||
+        (macro->rest == 1 && param->str_len == 1 && param->as_sym[0] == '&')) {
+      *bad = param;
+      return FAILED;
+    } else if (macro->rest == 0 && param->str_len == 1 &&
+               param->as_sym[0] == '&') {
+      macro->rest = 1;
+      continue;
+    }
+
+    macro->rest += macro->rest;
+    count++;
+  }
+
+  if (macro->rest == 1) {
+    *bad = params->tail;
+    return FAILED;
+  }
+
+  macro->rest = macro->rest != 0;
+  macro->params = avoc_malloc(count * sizeof(sym_view));
+  if (macro->params == NULL && count > 0) {
+    return FAILED;
+  }
+
+  // Counted first so macro_free() releases the parameters on failure
+  macro->param_count = count;
+  size_t i = 0L;
+  for (const avoc_item *param = skip_comments(params->head); param != NULL;
+       param = skip_comments(param->next_sibling)) {
+    if (param->str_len != 1 || param->as_sym[0] != '&') {
+      sym_view *view = &macro->params[i++];
+      view->str = intern(exp, param->as_sym, param->str_len);
+      view->len = param->str_len;
+      if (view->str == NULL) {
+        return FAILED;
+      }
+    }
+  }
+
+  return OK;
+}
+
+static avoc_status macro_define(avoc_expander *exp, avoc_source *src,
+                                const avoc_item *form) {
+  // The form is known to start with macro, maybe after comments
+  const avoc_item *head = skip_comments(form->as_list->head);
+  const avoc_item *name = skip_comments(head->next_sibling);
+  const avoc_item *params =
+      name != NULL ? skip_comments(name->next_sibling) : NULL;
+  const avoc_item *body =
+      params != NULL ? skip_comments(params->next_sibling) : NULL;
+  if (name == NULL || !is_plain_sym(name) || params == NULL ||
+      params->type != ITEM_LIT_LST || body == NULL ||
+      skip_comments(body->next_sibling) != NULL) {
+    source_seek(src, form->offset);
+    PRINT_ERROR(src, "macro expects a name, a parameter list and a template");
+    return FAILED;
+  }
+
+  const uint64_t hash = hash_bytes(0UL, name->as_sym, name->str_len);
+  avoc_symbol *symbol = symbol_find(exp, name->as_sym, name->str_len, hash);
+  if (symbol != NULL && symbol->macro != 0) {
+    source_seek(src, name->offset);
+    PRINT_ERRORF(src, "macro already defined: %.*s", (int)name->str_len,
+                 name->as_sym);
+    return FAILED;
+  }
+
+  avoc_macro macro;
+  memset(&macro, 0, sizeof(avoc_macro));
+  const avoc_item *bad;
+  if (macro_params(exp, &macro, params->as_list, &bad) != OK) {
+    if (bad != NULL) {
+      source_seek(src, bad->offset);
+      PRINT_ERROR(src,
+                  "macro parameters are symbols, the last one after an &");
+    }
+
+    macro_free(&macro);
+    return FAILED;
+  }
+
+  size_t param;
+  short splice;
+  if (macro_unquote(&macro, body, &param, &splice) && splice) {
+    source_seek(src, body->offset);
+    PRINT_ERROR(src, "a macro template must be a single item");
+    macro_free(&macro);
+    return FAILED;
+  }
+
+  avoc_list copy;
+  avoc_list_init(&copy);
+  avoc_status status = expand_copy(exp, body, body->next_sibling, &copy, NULL);
+  macro.body = copy.head;
+  if (status != OK) {
+    macro_free(&macro);
+    return FAILED;
+  }
+
+  avoc_list root;
+  avoc_list_init(&root);
+  root.head = root.tail = macro.body;
+  macro_scan scan = {&macro, NULL};
+  if (avoc_list_visit(&root, macro_scan_item, NULL, &scan) ==
+          AVOC_VISIT_STOP &&
+      scan.unknown == NULL) {
+    macro_free(&macro);
+    return FAILED;
+  }
+
+  if (scan.unknown != NULL) {
+    source_seek(src, scan.unknown->offset);
+    PRINT_ERRORF(src, "not a parameter of the macro: %.*s",
+                 (int)scan.unknown->str_len, scan.unknown->as_sym);
+    macro_free(&macro);
+    return FAILED;
+  }
+
+  avoc_symbol *named = symbol_intern(exp, name->as_sym, name->str_len);
+  if (named != NULL && exp->macro_count == exp->macro_cap) {
+    size_t cap = exp->macro_cap == 0 ? 8 : exp->macro_cap * 2;
+    avoc_macro *grown =
+        avoc_realloc(exp->macros, exp->macro_cap * sizeof(avoc_macro),
+                     cap * sizeof(avoc_macro));
+    if (grown != NULL) {
+      exp->macros = grown;
+      exp->macro_cap = cap;
+    }
+  }
+
+  if (named == NULL || exp->macro_count == exp->macro_cap) {
+    macro_free(&macro);
+    return FAILED;
+  }
+
+  exp->macros[exp->macro_count++] = macro;
+  named->macro = exp->macro_count;
+  exp->stats.macros++;
+  // Cached expansions may hold calls to the new macro left unexpanded
+  cache_clear(exp);
+  return OK;
+}
+
+// The macro called by item, NULL if it is not a macro call.
+static const avoc_macro *macro_of(const avoc_expander *exp,
+                                  const avoc_item *item) {
+  if (item->type != ITEM_CALL) {
+    return NULL;
+  }
+
+  const avoc_item *head = skip_comments(item->as_list->head);
+  if (head == NULL || !is_plain_sym(head)) {
+    return NULL;
+  }
+
+  const uint64_t hash = hash_bytes(0UL, head->as_sym, head->str_len);
+  avoc_symbol *symbol = symbol_find(exp, head->as_sym, head->str_len, hash);
+  return symbol != NULL && symbol->macro != 0
+             ? &exp->macros[symbol->macro - 1]
+             : NULL;
+}
+
+// Compares the contents of two items, but for the items of their lists.
+static int item_flat_equal(const avoc_item *a, const avoc_item *b) {
+  const avoc_list *a_child = item_child_list((avoc_item *)a);
+  const avoc_list *b_child = item_child_list((avoc_item *)b);
+  if (a->hash != b->hash || a->type != b->type ||
+      (a_child == NULL) != (b_child == NULL) ||
+      (a_child != NULL && a_child->item_count != b_child->item_count)) {
+    return 0;
+  }
+
+  switch (a->type) {
+  case ITEM_LIT_STR:
+  case ITEM_COMMENT:
+  case ITEM_LAZY:
+    return view_equal(a->as_str, a->str_len, b->as_str, b->str_len);
+  case ITEM_SYM:
+    return view_equal(a->as_sym, a->str_len, b->as_sym, b->str_len) &&
+           view_equal(a->sym_ordinary_type, a->sym_ordinary_type_len,
+                      b->sym_ordinary_type, b->sym_ordinary_type_len);
+  case ITEM_CALL:
+  case ITEM_LIT_LST:
+    return 1;
+  default:
+    return a->as_u64 == b->as_u64;
+  }
+}
+
+// Compares two trees item by item, without recursion.
+static int tree_equal(const avoc_item *a, const avoc_item *b) {
+  if (!item_flat_equal(a, b)) {
+    return 0;
+  } else if (item_child_list((avoc_item *)a) == NULL) {
+    return 1;
+  }
+
+  // Out of memory the trees are taken as different, missing the cache
+  size_t stack_cap = 16L;
+  size_t stack_len = 0L;
+  query_frame *stack = avoc_malloc(stack_cap * sizeof(query_frame));
+  if (stack == NULL) {
+    return 0;
+  }
+
+  stack[stack_len].pat = item_child_list((avoc_item *)a)->head;
+  stack[stack_len++].item = item_child_list((avoc_item *)b)->head;
+
+  int equal = 1;
+  while (stack_len > 0 && equal) {
+    query_frame *top = &stack[stack_len - 1];
+    const avoc_item *x = top->pat;
+    const avoc_item *y = top->item;
+    if (x == NULL) {
+      stack_len--;
+      continue;
+    }
+
+    top->pat = x->next_sibling;
+    top->item = y->next_sibling;
+    equal = item_flat_equal(x, y);
+    const avoc_list *x_child = item_child_list((avoc_item *)x);
+    if (!equal || x_child == NULL) {
+      continue;
+    }
+
+    if (stack_len == stack_cap) {
+      query_frame *grown =
+          scratch_grow(stack, &stack_cap, sizeof(query_frame));
+      if (grown == NULL) {
+        equal = 0;
+        break;
+      }
+
+      stack = grown;
+    }
+
+    stack[stack_len].pat = x_child->head;
+    stack[stack_len++].item = item_child_list((avoc_item *)y)->head;
+  }
+
+  avoc_free(stack, stack_cap * sizeof(query_frame));
+  return equal;
+}
+
+static void cache_insert(avoc_expander *exp, const avoc_expansion *entry) {
+  size_t i = entry->hash & (exp->cache_cap - 1);
+  while (exp->cache[i].key != NULL) {
+    i = (i + 1) & (exp->cache_cap - 1);
+  }
+
+  exp->cache[i] = *entry;
+  exp->cache_count++;
+}
+
+static avoc_status cache_grow(avoc_expander *exp) {
+  avoc_expansion *cache = exp->cache;
+  size_t cap = exp->cache_cap;
+  const size_t new_cap = cap == 0 ? 64 : cap * 2;
+  avoc_expansion *grown = avoc_calloc(new_cap, sizeof(avoc_expansion));
+  if (grown == NULL) {
+    return FAILED;
+  }
+
+  exp->cache_cap = new_cap;
+  exp->cache = grown;
+  exp->cache_count = 0L;
+  for (size_t i = 0; i < cap; i++) {
+    if (cache[i].key != NULL) {
+      cache_insert(exp, &cache[i]);
+    }
+  }
+
+  avoc_free(cache, cap * sizeof(avoc_expansion));
+  return OK;
+}
+
+static const avoc_expansion *cache_find(const avoc_expander *exp,
+                                        const avoc_item *call) {
+  if (exp->cache_cap == 0) {
+    return NULL;
+  }
+
+  for (size_t i = call->hash & (exp->cache_cap - 1); exp->cache[i].key != NULL;
+       i = (i + 1) & (exp->cache_cap - 1)) {
+    const avoc_expansion *entry = &exp->cache[i];
+    if (entry->hash == call->hash && tree_equal(entry->key, call)) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+// Replaces a call by an expansion, sharing its child list.
+static void expansion_place(avoc_item *call, const avoc_item *value) {
+  avoc_item *prev = call->prev_sibling;
+  avoc_item *next = call->next_sibling;
+  const size_t offset = call->offset;
+  const size_t length = call->length;
+
+  avoc_item_free(call);
+  *call = *value;
+  call->prev_sibling = prev;
+  call->next_sibling = next;
+  call->offset = offset;
+  call->length = length;
+
+  avoc_list *child = item_child_list(call);
+  if (child != NULL) {
+    child->refs++;
+  }
+}
+
+static avoc_status expand_list(avoc_expander *exp, avoc_source *src,
+                               avoc_list *list, size_t level, short changed);
+
+static avoc_status expand_call(avoc_expander *exp, avoc_source *src,
+                               avoc_item *call, const avoc_macro *macro,
+                               size_t level) {
+  const avoc_expansion *cached = cache_find(exp, call);
+  if (cached != NULL) {
+    expansion_place(call, cached->value);
+    exp->stats.expansions++;
+    exp->stats.cache_hits++;
+    return OK;
+  } else if (level >= AVOC_MAX_EXPANSION) {
+    source_seek(src, call->offset);
+    PRINT_ERRORF(src, "macro calls expand deeper than %d levels",
+                 AVOC_MAX_EXPANSION);
+    return FAILED;
+  }
+
+  const avoc_item *name = skip_comments(call->as_list->head);
+  const size_t fixed = macro->param_count - macro->rest;
+  const size_t args_size = (macro->param_count + 1) * sizeof(avoc_item *);
+  const avoc_item **args = avoc_malloc(args_size);
+  if (args == NULL) {
+    return FAILED;
+  }
+
+  const avoc_item *arg = skip_comments(name->next_sibling);
+  size_t count = 0L;
+  for (; arg != NULL && count < fixed; arg = skip_comments(arg->next_sibling)) {
+    args[count++] = arg;
+  }
+
+  if (count < fixed || (arg != NULL && !macro->rest)) {
+    source_seek(src, call->offset);
+    PRINT_ERRORF(src, "wrong number of arguments for %.*s, expected %s%zu",
+                 (int)name->str_len, name->as_sym,
+                 macro->rest ? "at least " : "", fixed);
+    avoc_free(args, args_size);
+    return FAILED;
+  }
+
+  args[fixed] = arg;
+  macro_call expansion = {macro, args, 0L, call->offset, call->length};
+  avoc_list out;
+  avoc_list_init(&out);
+  avoc_status status = rename_pick(exp, macro, &expansion.id);
+  if (status == OK) {
+    status = expand_copy(exp, macro->body, NULL, &out, &expansion);
+  }
+
+  avoc_free(args, args_size);
+  if (status == OK) {
+    status = expand_list(exp, src, &out, level + 1, 0);
+  }
+
+  avoc_list key;
+  avoc_list_init(&key);
+  if (status == OK) {
+    status = expand_copy(exp, call, call->next_sibling, &key, NULL);
+  }
+
+  if (status == OK && (exp->cache_count + 1) * 2 > exp->cache_cap) {
+    status = cache_grow(exp);
+  }
+
+  if (status != OK) {
+    avoc_list_free(&key);
+    avoc_list_free(&out);
+    return status;
+  }
+
+  avoc_expansion entry = {call->hash, key.head, out.head};
+  cache_insert(exp, &entry);
+  expansion_place(call, out.head);
+  exp->stats.expansions++;
+  return OK;
+}
+
+// A list whose calls are being expanded
+typedef struct {
+  avoc_item *owner; // Item holding the list, NULL for the root
+  avoc_list *list;
+  avoc_item *next; // Next item to expand
+  short changed;   // Some item was expanded, the hashes are stale
+} expand_frame;
+
+// Expands the macro calls under list, expansions are not visited again as
+// they come expanded.
+static avoc_status expand_list(avoc_expander *exp, avoc_source *src,
+                               avoc_list *list, size_t level, short changed) {
+  size_t stack_cap = 16L;
+  size_t stack_len = 0L;
+  expand_frame *stack = avoc_malloc(stack_cap * sizeof(expand_frame));
+  if (stack == NULL) {
+    return FAILED;
+  }
+
+  expand_frame root = {NULL, list, list->head, changed};
+  stack[stack_len++] = root;
+
+  avoc_status status = OK;
+  while (stack_len > 0 && status == OK) {
+    expand_frame *top = &stack[stack_len - 1];
+    avoc_item *item = top->next;
+    if (item == NULL) {
+      stack_len--;
+      if (top->changed) {
+        list_recount(top->list);
+      }
+
+      if (top->changed && top->owner != NULL) {
+        top->owner->hash = item_hash(top->owner);
+        stack[stack_len - 1].changed = 1;
+      }
+
+      continue;
+    }
+
+    top->next = item->next_sibling;
+    const avoc_macro *macro = macro_of(exp, item);
+    if (macro != NULL) {
+      status = expand_call(exp, src, item, macro, level);
+      top->changed = 1;
+      continue;
+    }
+
+    avoc_list *child = item_child_list(item);
+    if (child == NULL || child->refs > 1) {
+      continue;
+    }
+
+    if (stack_len == stack_cap) {
+      expand_frame *grown =
+          scratch_grow(stack, &stack_cap, sizeof(expand_frame));
+      if (grown == NULL) {
+        status = FAILED;
+        break;
+      }
+
+      stack = grown;
+    }
+
+    expand_frame frame = {item, child, child->head, 0};
+    stack[stack_len++] = frame;
+  }
+
+  avoc_free(stack, stack_cap * sizeof(expand_frame));
+  return status;
+}
+
+// Interns the symbols of the program, see rename_pick().
+static avoc_visit intern_sym(void *ctx, const avoc_item *item, size_t depth) {
+  (void)depth;
+  if (item->type == ITEM_SYM &&
+      intern(ctx, item->as_sym, item->str_len) == NULL) {
+    return AVOC_VISIT_STOP;
+  }
+
+  return AVOC_VISIT_NEXT;
+}
+
+avoc_status avoc_expand(avoc_expander *exp, avoc_source *src,
+                        avoc_list *list) {
+  assert(exp != NULL);
+  assert(src != NULL);
+  assert(list != NULL);
+
+  if (avoc_list_visit(list, intern_sym, NULL, exp) == AVOC_VISIT_STOP) {
+    return FAILED;
+  }
+
+  short changed = 0;
+  avoc_item *item = list->head;
+  while (item != NULL) {
+    avoc_item *next = item->next_sibling;
+    if (!is_macro_form(item)) {
+      item = next;
+      continue;
+    }
+
+    if (macro_define(exp, src, item) != OK) {
+      list_recount(list);
+      return FAILED;
+    }
+
+    if (item->prev_sibling != NULL) {
+      item->prev_sibling->next_sibling = next;
+    } else {
+      list->head = next;
+    }
+
+    if (next != NULL) {
+      next->prev_sibling = item->prev_sibling;
+    } else {
+      list->tail = item->prev_sibling;
+    }
+
+    list->item_count--;
+    avoc_item_free(item);
+    avoc_free(item, sizeof(avoc_item));
+    changed = 1;
+    item = next;
+  }
+
+  return expand_list(exp, src, list, 0L, changed);
+}
+
+void avoc_expander_free(avoc_expander *exp) {
+  assert(exp != NULL);
+  cache_clear(exp);
+  for (size_t i = 0; i < exp->macro_count; i++) {
+    macro_free(&exp->macros[i]);
+  }
+
+  for (size_t i = 0; i < exp->symbol_cap; i++) {
+    if (exp->symbols[i].str != NULL) {
+      avoc_free(exp->symbols[i].str, exp->symbols[i].len + 1);
+    }
+  }
+
+  avoc_free(exp->cache, exp->cache_cap * sizeof(avoc_expansion));
+  avoc_free(exp->macros, exp->macro_cap * sizeof(avoc_macro));
+  avoc_free(exp->symbols, exp->symbol_cap * sizeof(avoc_symbol));
+  avoc_expander_init(exp);
+}
+
+// Output buffer of the formatter, written in large blocks
+#define FMT_BUF_SIZE 65536
+
+typedef struct {
+  char buf[FMT_BUF_SIZE];
+  size_t len;
+  avoc_write_fn write_fn;
+  void *ctx;
+  avoc_status status;
+  size_t col;        // Codepoints written in the current line
+  size_t width;      // Preferred maximum line width
+  size_t indent;     // Indentation step
+  size_t line_depth; // Indentation level of the current line
+  struct _fmt_span *spans; // Scratch stack of flat_width()
+  size_t span_cap;
+} fmt_state;
+
+// Items of a list being measured by flat_width()
+typedef struct _fmt_span {
+  const avoc_item *cur;  // Next item to measure
+  const avoc_item *head; // First item, not preceded by a space
+} fmt_span;
+
+// A list being printed
+typedef struct {
+  const avoc_item *cur; // Next child to print
+  size_t depth;         // Indentation level of broken children
+  char close;           // Closing bracket
+  short broken;         // Children go on their own lines
+  short first;          // No child printed yet
+  short after_comment;  // Last child was a line comment
+} fmt_frame;
+
+static size_t cp_count(const char *data, size_t len) {
+  size_t count = 0L;
+  for (size_t i = 0; i < len; i++) {
+    count += ((unsigned char)data[i] & 0xC0u) != 0x80u;
+  }
+
+  return count;
+}
+
+static void fmt_flush(fmt_state *f) {
+  if (f->len > 0 && f->status == OK &&
+      f->write_fn(f->ctx, f->buf, f->len) != f->len) {
+    f->status = FAILED;
+  }
+
+  f->len = 0L;
+}
+
+static void fmt_write(fmt_state *f, const char *data, size_t len) {
+  const char *newl = NULL;
+  for (size_t i = len; i > 0; i--) {
+    if (data[i - 1] == '\n') {
+      newl = data + i - 1;
+      break;
+    }
+  }
+
+  if (newl != NULL) {
+    f->col = cp_count(newl + 1, len - (newl + 1 - data));
+  } else {
+    f->col += cp_count(data, len);
+  }
+
+  if (f->len + len > FMT_BUF_SIZE) {
+    fmt_flush(f);
+  }
+
+  if (len >= FMT_BUF_SIZE) {
+    if (f->status == OK && f->write_fn(f->ctx, data, len) != len) {
+      f->status = FAILED;
+    }
+    return;
+  }
+
+  memcpy(f->buf + f->len, data, len);
+  f->len += len;
+}
+
+static void fmt_newline(fmt_state *f, size_t depth) {
+  static const char spaces[] = "                                ";
+  size_t pending = depth * f->indent;
+
+  fmt_write(f, "\n", 1);
+  while (pending > 0) {
+    size_t chunk = pending < sizeof(spaces) - 1 ? pending : sizeof(spaces) - 1;
+    fmt_write(f, spaces, chunk);
+    pending -= chunk;
+  }
+
+  f->line_depth = depth;
+}
+
+// Length of the UTF-8 sequence str starts with, 0 unless the lexer accepts
+// it as one code point.
+static size_t utf8_valid_len(const unsigned char *str, size_t len) {
+  static const unsigned int mins[] = {0u, 0x80u, 0x800u, 0x10000u};
+  size_t size = (str[0] & 0xE0u) == 0xC0u   ? 2L
+                : (str[0] & 0xF0u) == 0xE0u ? 3L
+                : (str[0] & 0xF8u) == 0xF0u ? 4L
+                                            : 0L;
+  if (size == 0 || size > len) {
+    return 0L;
+  }
+
+  unsigned int cp = str[0] & (0x7Fu >> size);
+  for (size_t i = 1; i < size; i++) {
+    if ((str[i] & 0xC0u) != 0x80u) {
+      return 0L;
+    }
+
+    cp = cp << 6 | (str[i] & 0x3Fu);
+  }
+
+  return cp >= mins[size - 1] && utf8_cp_size((int)cp) != -1 ? size : 0L;
+}
+
+// Escape sequence for the character at str[*pos], NULL if it is written as it
+// is. Moves pos past the character. Bytes that are not valid UTF-8 are
+// written as \xHH, which reads back as U+00HH.
+static const char *str_escape(const char *str, size_t len, size_t *pos,
+                              char hex[5]) {
+  const unsigned char c = (unsigned char)str[*pos];
+  if (c >= 0x80) {
+    const size_t size = utf8_valid_len((const unsigned char *)str + *pos,
+                                       len - *pos);
+    *pos += size > 0 ? size : 1L;
+    if (size > 0) {
+      return NULL;
+    }
+
+    snprintf(hex, 5, "\\x%02X", c);
+    return hex;
+  }
+
+  (*pos)++;
+  switch (c) {
+  case '"':
+    return "\\\"";
+  case '\\':
+    return "\\\\";
+  case '\n':
+    return "\\n";
+  case '\t':
+    return "\\t";
+  case '\r':
+    return "\\r";
+  default:
+    break;
+  }
+
+  if (c < 0x20 || c == 0x7F) {
+    snprintf(hex, 5, "\\x%02X", c);
+    return hex;
+  }
+
+  return NULL;
+}
+
+// Width of a string literal written in canonical form, stops counting once
+// it goes over limit.
+static size_t str_width(const char *str, size_t len, size_t limit) {
+  size_t width = 2L;
+  char hex[5];
+  for (size_t i = 0; i < len && width <= limit;) {
+    const char *esc = str_escape(str, len, &i, hex);
+    width += esc != NULL ? strlen(esc) : 1L;
+  }
+
+  return width;
+}
+
+static void fmt_str(fmt_state *f, const char *str, size_t len) {
+  char hex[5];
+  size_t run = 0L;
+
+  fmt_write(f, "\"", 1);
+  for (size_t i = 0; i < len;) {
+    const size_t start = i;
+    const char *esc = str_escape(str, len, &i, hex);
+    if (esc != NULL) {
+      fmt_write(f, str + run, start - run);
+      fmt_write(f, esc, strlen(esc));
+      run = i;
+    }
+  }
+
+  fmt_write(f, str + run, len - run);
+  fmt_write(f, "\"", 1);
+}
+
+// Writes the shortest form of a float which reads back to the same value,
+// always with a decimal point and without '+' in the exponent.
+static size_t float_text(char *dest, size_t cap, double value, int is_f64) {
+  char tmp[48];
+  for (int prec = is_f64 ? 15 : 6; prec <= 17; prec++) {
+    snprintf(tmp, sizeof(tmp), "%.*g", prec, value);
+    if ((is_f64 && strtod(tmp, NULL) == value) ||
+        (!is_f64 && strtof(tmp, NULL) == (float)value)) {
+      break;
+    }
+  }
+
+  size_t len = 0L;
+  int has_point = strchr(tmp, '.') != NULL || strchr(tmp, 'n') != NULL;
+  for (const char *c = tmp; *c != 0 && len + 3 < cap; c++) {
+    if (*c == 'e' && !has_point) {
+      dest[len++] = '.';
+      dest[len++] = '0';
+      has_point = 1;
+    }
+
+    if (*c != '+') {
+      dest[len++] = *c;
+    }
+  }
+
+  if (!has_point && len + 3 < cap) {
+    dest[len++] = '.';
+    dest[len++] = '0';
+  }
+
+  if (is_f64 && len + 4 < cap) {
+    memcpy(dest + len, "f64", 3);
+    len += 3;
+  }
+
+  dest[len] = 0;
+  return len;
+}
+
+// Text of a literal, nil or comment item, NULL for strings and lists. Line
+// comments are returned without their new line.
+static const char *atom_text(const avoc_item *item, char *scratch, size_t cap,
+                             size_t *len) {
+  switch (item->type) {
+  case ITEM_LIT_BOL:
+    *len = item->as_bol ? 4 : 5;
+    return item->as_bol ? "true" : "false";
+  case ITEM_NIL:
+    *len = 3;
+    return "nil";
+  case ITEM_LIT_I32:
+    *len = snprintf(scratch, cap, "%d", item->as_i32);
+    return scratch;
+  case ITEM_LIT_I64:
+    *len = snprintf(scratch, cap, "%ldi64", item->as_i64);
+    return scratch;
+  case ITEM_LIT_U32:
+    *len = snprintf(scratch, cap, "%uu32", item->as_u32);
+    return scratch;
+  case ITEM_LIT_U64:
+    *len = snprintf(scratch, cap, "%luu64", item->as_u64);
+    return scratch;
+  case ITEM_LIT_F32:
+    *len = float_text(scratch, cap, item->as_f32, 0);
+    return scratch;
+  case ITEM_LIT_F64:
+    *len = float_text(scratch, cap, item->as_f64, 1);
+    return scratch;
+  case ITEM_COMMENT:
+  case ITEM_LAZY:
+    *len = item->str_len;
+    if (*len > 0 && item->as_str[*len - 1] == '\n') {
+      (*len)--;
+    }
+    return item->as_str;
+  default:
+    return NULL;
+  }
+}
+
+static int is_line_comment(const avoc_item *item) {
+  return item->type == ITEM_COMMENT && item->str_len > 0 &&
+         item->as_str[item->str_len - 1] == '\n';
+}
+
+// Width of an item written in a single line without its children, any value
+// over limit means it does not fit.
+static size_t flat_item_width(const avoc_item *item, size_t limit) {
+  char scratch[64];
+  size_t width = 0L;
+  size_t len = 0L;
+
+  if (is_line_comment(item)) {
+    return limit + 1;
+  }
+
+  const char *text = atom_text(item, scratch, sizeof(scratch), &len);
+  if (text != NULL) {
+    for (size_t i = 0; i < len; i++) {
+      if (text[i] == '\n') {
+        return limit + 1;
+      }
+    }
+
+    return cp_count(text, len);
+  }
+
+  if (item->type == ITEM_LIT_STR) {
+    return str_width(item->as_str, item->str_len, limit);
+  }
+
+  if (item->type == ITEM_SYM) {
+    width = cp_count(item->as_sym, item->str_len);
+    if (item->sym_ordinary_type != NULL) {
+      width += 1 + cp_count(item->sym_ordinary_type,
+                            item->sym_ordinary_type_len);
+    } else if (item->sym_composed_type != NULL) {
+      width += 1;
+    }
+  }
+
+  return item_child_list((avoc_item *)item) != NULL ? width + 2 : width;
+}
+
+// Width of an item and its children written in a single line, any value
+// over limit means it does not fit. Measuring stops once over limit, and
+// when the scratch stack cannot grow the item is taken as too wide.
+static size_t flat_width(fmt_state *f, const avoc_item *item, size_t limit) {
+  size_t width = flat_item_width(item, limit);
+  const avoc_list *child = item_child_list((avoc_item *)item);
+  if (child == NULL || width > limit) {
+    return width;
+  }
+
+  size_t len = 0L;
+  fmt_span root = {child->head, child->head};
+  if (f->span_cap == 0) {
+    f->spans = scratch_grow(NULL, &f->span_cap, sizeof(fmt_span));
+    if (f->spans == NULL) {
+      return limit + 1;
+    }
+  }
+
+  f->spans[len++] = root;
+  while (len > 0 && width <= limit) {
+    fmt_span *top = &f->spans[len - 1];
+    const avoc_item *cur = top->cur;
+    if (cur == NULL) {
+      len--;
+      continue;
+    }
+
+    top->cur = cur->next_sibling;
+    width += cur != top->head;
+    if (width > limit) {
+      break;
+    }
+
+    width += flat_item_width(cur, limit - width);
+    child = item_child_list((avoc_item *)cur);
+    if (child == NULL || width > limit) {
+      continue;
+    }
+
+    if (len == f->span_cap) {
+      fmt_span *grown = scratch_grow(f->spans, &f->span_cap, sizeof(fmt_span));
+      if (grown == NULL) {
+        return limit + 1;
+      }
+
+      f->spans = grown;
+    }
+
+    fmt_span span = {child->head, child->head};
+    f->spans[len++] = span;
+  }
+
+  return width;
+}
+
+static avoc_status fmt_push(fmt_frame **stack, size_t *len, size_t *cap,
+                            fmt_frame frame) {
+  if (*len == *cap) {
+    fmt_frame *grown = scratch_grow(*stack, cap, sizeof(fmt_frame));
+    if (grown == NULL) {
+      return FAILED;
+    }
+
+    *stack = grown;
+  }
+
+  (*stack)[(*len)++] = frame;
+  return OK;
+}
+
+avoc_status avoc_format_list(const avoc_list *list,
+                             const avoc_format_options *opts,
+                             avoc_write_fn write_fn, void *ctx) {
+  assert(list != NULL);
+  assert(write_fn != NULL);
+
+  avoc_format_options defaults;
+  avoc_format_options_init(&defaults);
+  if (opts == NULL) {
+    opts = &defaults;
+  }
+
+  fmt_state *f = avoc_malloc(sizeof(fmt_state));
+  if (f == NULL) {
+    return FAILED;
+  }
+
+  f->len = 0L;
+  f->write_fn = write_fn;
+  f->ctx = ctx;
+  f->status = OK;
+  f->col = 0L;
+  f->width = opts->width;
+  f->indent = opts->indent;
+  f->line_depth = 0L;
+  f->spans = NULL;
+  f->span_cap = 0L;
+
+  // Lists being printed, kept off the C stack so depth is not a problem
+  size_t stack_cap = 16L;
+  size_t stack_len = 0L;
+  fmt_frame *stack = avoc_malloc(stack_cap * sizeof(fmt_frame));
+  if (stack == NULL) {
+    avoc_free(f, sizeof(fmt_state));
+    return FAILED;
+  }
+
+  char scratch[64];
+  for (const avoc_item *top = list->head; top != NULL && f->status == OK;
+       top = top->next_sibling) {
+    const avoc_item *item = top;
+
+    do {
+      if (stack_len > 0) {
+        fmt_frame *frame = &stack[stack_len - 1];
+        if (frame->cur == NULL) {
+          if (frame->after_comment) {
+            fmt_newline(f, frame->depth - 1);
+          }
+
+          fmt_write(f, &frame->close, 1);
+          stack_len--;
+          continue;
+        }
+
+        item = frame->cur;
+        frame->cur = item->next_sibling;
+        if (frame->after_comment || (!frame->first && frame->broken)) {
+          fmt_newline(f, frame->depth);
+        } else if (!frame->first) {
+          fmt_write(f, " ", 1);
+        }
+
+        frame->first = 0;
+        frame->after_comment = is_line_comment(item);
+      }
+
+      // Infinities and NaNs built by hand have no literal to write
+      if ((item->type == ITEM_LIT_F32 && !isfinite(item->as_f32)) ||
+          (item->type == ITEM_LIT_F64 && !isfinite(item->as_f64))) {
+        f->status = FAILED;
+        break;
+      }
+
+      size_t len = 0L;
+      const char *text = atom_text(item, scratch, sizeof(scratch), &len);
+      if (text != NULL) {
+        fmt_write(f, text, len);
+        continue;
+      } else if (item->type == ITEM_LIT_STR) {
+        fmt_str(f, item->as_str, item->str_len);
+        continue;
+      }
+
+      char open = '(';
+      fmt_frame frame = {NULL, f->line_depth + 1, ')', 0, 1, 0};
+      if (item->type == ITEM_SYM) {
+        fmt_write(f, item->as_sym, item->str_len);
+        if (item->sym_ordinary_type != NULL) {
+          fmt_write(f, ":", 1);
+          fmt_write(f, item->sym_ordinary_type, item->sym_ordinary_type_len);
+        }
+
+        if (item->sym_composed_type == NULL) {
+          continue;
+        }
+
+        fmt_write(f, ":", 1);
+      } else if (item->type == ITEM_LIT_LST) {
+        open = '[';
+        frame.close = ']';
+      }
+
+      const avoc_list *child = item_child_list((avoc_item *)item);
+      frame.cur = child->head;
+      // Lists inside a list written in a single line follow it
+      if (stack_len == 0 || stack[stack_len - 1].broken) {
+        size_t room = f->width > f->col ? f->width - f->col : 0L;
+        size_t width = flat_width(f, item, room + 1);
+        if (item->type == ITEM_SYM) {
+          width -= cp_count(item->as_sym, item->str_len) + 1;
+        }
+
+        frame.broken = width > room;
+      }
+
+      fmt_write(f, &open, 1);
+      if (fmt_push(&stack, &stack_len, &stack_cap, frame) != OK) {
+        f->status = FAILED;
+        break;
+      }
+    } while (stack_len > 0);
+
+    fmt_write(f, "\n", 1);
+    f->line_depth = 0L;
+  }
+
+  fmt_flush(f);
+  avoc_status status = f->status;
+  avoc_free(stack, stack_cap * sizeof(fmt_frame));
+  avoc_free(f->spans, f->span_cap * sizeof(fmt_span));
+  avoc_free(f, sizeof(fmt_state));
+  return status;
+}
+
+void avoc_format_options_init(avoc_format_options *opts) {
+  assert(opts != NULL);
+  opts->width = 80L;
+  opts->indent = 2L;
+}
+
+size_t avoc_file_write(void *ctx, const char *data, size_t len) {
+  return fwrite(data, sizeof(char), len, (FILE *)ctx);
+}
+
+// Snapshots start with this tag, the last character is the format version
+#define SNAP_MAGIC "AVOCSNP1"
+#define SNAP_MAGIC_LEN 8
+#define SNAP_BUF_SIZE 65536
+
+// Record flags of a symbol
+#define SNAP_ORDINARY_TYPE 1
+#define SNAP_COMPOSED_TYPE 2
+
+// Output buffer of a snapshot, written in large blocks
+typedef struct {
+  unsigned char buf[SNAP_BUF_SIZE];
+  size_t len;
+  avoc_write_fn write_fn;
+  void *ctx;
+  avoc_status status;
+} snap_writer;
+
+static void snap_flush(snap_writer *w) {
+  if (w->len > 0 && w->status == OK &&
+      w->write_fn(w->ctx, (const char *)w->buf, w->len) != w->len) {
+    w->status = FAILED;
+  }
+
+  w->len = 0L;
+}
+
+static void snap_bytes(snap_writer *w, const void *data, size_t len) {
+  if (w->len + len > SNAP_BUF_SIZE) {
+    snap_flush(w);
+  }
+
+  if (len >= SNAP_BUF_SIZE) {
+    if (w->status == OK && w->write_fn(w->ctx, data, len) != len) {
+      w->status = FAILED;
+    }
+    return;
+  }
+
+  if (len > 0) {
+    memcpy(w->buf + w->len, data, len);
+  }
+
+  w->len += len;
+}
+
+// Numbers are little endian whatever the host is
+static void snap_u64(snap_writer *w, uint64_t value) {
+  unsigned char bytes[8];
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = (unsigned char)(value >> (8 * i));
+  }
+
+  snap_bytes(w, bytes, sizeof(bytes));
+}
+
+static void snap_str(snap_writer *w, const char *str, size_t len) {
+  snap_u64(w, len);
+  snap_bytes(w, str, len);
+}
+
+// Writes the record of an item, its children follow it in depth first order
+static avoc_visit snap_item(void *ctx, const avoc_item *item, size_t depth) {
+  snap_writer *w = ctx;
+  unsigned char head[2] = {(unsigned char)item->type, 0};
+  (void)depth;
+  if (item->type == ITEM_SYM) {
+    head[1] = (item->sym_ordinary_type != NULL ? SNAP_ORDINARY_TYPE : 0) |
+              (item->sym_composed_type != NULL ? SNAP_COMPOSED_TYPE : 0);
+  }
+
+  snap_bytes(w, head, sizeof(head));
+  snap_u64(w, item->offset);
+  snap_u64(w, item->length);
+  switch (item->type) {
+  case ITEM_LIT_STR:
+  case ITEM_COMMENT:
+    snap_str(w, item->as_str, item->str_len);
+    break;
+  case ITEM_SYM:
+    snap_str(w, item->as_sym, item->str_len);
+    if (item->sym_ordinary_type != NULL) {
+      snap_str(w, item->sym_ordinary_type, item->sym_ordinary_type_len);
+    }
+
+    if (item->sym_composed_type != NULL) {
+      snap_u64(w, item->sym_composed_type->item_count);
+    }
+    break;
+  case ITEM_CALL:
+  case ITEM_LIT_LST:
+    snap_u64(w, item->as_list->item_count);
+    break;
+  default:
+    snap_u64(w, item->as_u64);
+    break;
+  }
+
+  return w->status == OK ? AVOC_VISIT_NEXT : AVOC_VISIT_STOP;
+}
+
+static void snap_error(const char *msg, size_t pos) {
+#ifdef AVOCC_QUIET
+  (void)msg;
+  (void)pos;
+#else
+  fprintf(stderr, "snapshot:%zu: %s\n", pos, msg);
+#endif
+}
+
+avoc_status avoc_snapshot_write(const avoc_list *list, avoc_write_fn write_fn,
+                                void *ctx) {
+  assert(list != NULL);
+  assert(write_fn != NULL);
+
+  // Lazy forms can only be forced from their source, which a snapshot drops
+  for (const avoc_item *item = list->head; item != NULL;
+       item = item->next_sibling) {
+    if (item->type == ITEM_LAZY) {
+      snap_error("lazy form not forced", item->offset);
+      return FAILED;
+    }
+  }
+
+  snap_writer *w = avoc_malloc(sizeof(snap_writer));
+  if (w == NULL) {
+    return FAILED;
+  }
+
+  w->len = 0L;
+  w->write_fn = write_fn;
+  w->ctx = ctx;
+  w->status = OK;
+
+  snap_bytes(w, SNAP_MAGIC, SNAP_MAGIC_LEN);
+  snap_u64(w, list->item_count);
+  if (avoc_list_visit(list, snap_item, NULL, w) == AVOC_VISIT_STOP) {
+    w->status = FAILED;
+  }
+
+  snap_flush(w);
+  avoc_status status = w->status;
+  avoc_free(w, sizeof(snap_writer));
+  return status;
+}
+
+// Reading position in a snapshot
+typedef struct {
+  const unsigned char *data;
+  size_t len;
+  size_t pos;
+} snap_reader;
+
+static int snap_read_u64(snap_reader *r, uint64_t *value) {
+  if (r->len - r->pos < 8) {
+    return 0;
+  }
+
+  *value = 0UL;
+  for (int i = 0; i < 8; i++) {
+    *value |= (uint64_t)r->data[r->pos++] << (8 * i);
+  }
+
+  return 1;
+}
+
+// Reads a string as a view into the snapshot.
+static int snap_read_str(snap_reader *r, char **str, size_t *len) {
+  uint64_t size;
+  if (!snap_read_u64(r, &size) || size > r->len - r->pos) {
+    return 0;
+  }
+
+  *str = (char *)r->data + r->pos;
+  *len = size;
+  r->pos += size;
+  return 1;
+}
+
+// Whether the payload of a scalar, read as 64 bits, holds a value of its
+// type over zeroed bits, as the parser leaves it for item_hash().
+static int snap_scalar_valid(const avoc_item *item) {
+  avoc_item narrow;
+  narrow.as_u64 = 0UL;
+  switch (item->type) {
+  case ITEM_LIT_BOL:
+    narrow.as_bol = item->as_bol != 0;
+    break;
+  case ITEM_LIT_U32:
+  case ITEM_LIT_I32:
+  case ITEM_LIT_F32:
+    narrow.as_u32 = item->as_u32;
+    break;
+  case ITEM_NIL:
+    break;
+  default:
+    return 1;
+  }
+
+  return narrow.as_u64 == item->as_u64;
+}
+
+// Reads the record of an item, count is the number of children that follow
+// it when it has a list. Returns 1 when read, 0 when corrupt and -1 when out
+// of memory.
+static int snap_read_item(snap_reader *r, avoc_item *item, uint64_t *count) {
+  if (r->len - r->pos < 2 || r->data[r->pos] >= ITEM_LAZY) {
+    return 0;
+  }
+
+  item->type = r->data[r->pos];
+  const unsigned char flags = r->data[r->pos + 1];
+  r->pos += 2;
+  uint64_t offset, length;
+  if (!snap_read_u64(r, &offset) || !snap_read_u64(r, &length)) {
+    return 0;
+  }
+
+  item->offset = offset;
+  item->length = length;
+  switch (item->type) {
+  case ITEM_LIT_STR:
+  case ITEM_COMMENT:
+    return flags == 0 && snap_read_str(r, &item->as_str, &item->str_len);
+  case ITEM_SYM:
+    if (flags > (SNAP_ORDINARY_TYPE | SNAP_COMPOSED_TYPE) ||
+        !snap_read_str(r, &item->as_sym, &item->str_len) ||
+        item->str_len == 0) {
+      return 0;
+    } else if ((flags & SNAP_ORDINARY_TYPE) &&
+               !snap_read_str(r, &item->sym_ordinary_type,
+                              &item->sym_ordinary_type_len)) {
+      return 0;
+    } else if (flags & SNAP_COMPOSED_TYPE) {
+      if (!snap_read_u64(r, count)) {
+        return 0;
+      }
+
+      item->sym_composed_type = avoc_malloc(sizeof(avoc_list));
+      if (item->sym_composed_type == NULL) {
+        return -1;
+      }
+
+      avoc_list_init(item->sym_composed_type);
+    }
+
+    return 1;
+  case ITEM_CALL:
+  case ITEM_LIT_LST:
+    if (flags != 0 || !snap_read_u64(r, count)) {
+      return 0;
+    }
+
+    item->as_list = avoc_malloc(sizeof(avoc_list));
+    if (item->as_list == NULL) {
+      return -1;
+    }
+
+    avoc_list_init(item->as_list);
+    return 1;
+  default:
+    return flags == 0 && snap_read_u64(r, &item->as_u64) &&
+           snap_scalar_valid(item);
+  }
+}
+
+// A list being loaded, its owner is pushed into owner_out once the list is
+// complete so their hashes are final.
+typedef struct {
+  avoc_list *out;
+  uint64_t remaining; // Items of the list still to read
+  avoc_item *owner;
+  avoc_list *owner_out;
+} snap_frame;
+
+avoc_status avoc_snapshot_load(const void *image, size_t len,
+                               avoc_list *list) {
+  assert(image != NULL || len == 0);
+  assert(list != NULL);
+  snap_reader r = {image, len, 0L};
+  uint64_t count;
+  if (len < SNAP_MAGIC_LEN ||
+      memcmp(image, SNAP_MAGIC, SNAP_MAGIC_LEN) != 0) {
+    snap_error("not a snapshot of this version", 0L);
+    return FAILED;
+  }
+
+  r.pos = SNAP_MAGIC_LEN;
+  if (!snap_read_u64(&r, &count)) {
+    snap_error("truncated snapshot", r.pos);
+    return FAILED;
+  }
+
+  size_t stack_cap = 16L;
+  size_t stack_len = 0L;
+  snap_frame *stack = avoc_malloc(stack_cap * sizeof(snap_frame));
+  if (stack == NULL) {
+    return FAILED;
+  }
+
+  snap_frame root = {list, count, NULL, NULL};
+  stack[stack_len++] = root;
+
+  avoc_status status = OK;
+  const char *error = "corrupt snapshot";
+  while (stack_len > 0) {
+    snap_frame *top = &stack[stack_len - 1];
+    if (top->remaining == 0) {
+      stack_len--;
+      if (top->owner != NULL) {
+        top->owner->hash = item_hash(top->owner);
+        avoc_list_push(top->owner_out, top->owner);
+      }
+
+      continue;
+    }
+
+    top->remaining--;
+    avoc_item *item = avoc_malloc(sizeof(avoc_item));
+    if (item == NULL) {
+      error = "out of memory";
+      status = FAILED;
+      break;
+    }
+
+    avoc_item_init(item);
+    uint64_t children = 0UL;
+    const int read = snap_read_item(&r, item, &children);
+    if (read != 1) {
+      avoc_item_free(item);
+      avoc_free(item, sizeof(avoc_item));
+      if (read < 0) {
+        error = "out of memory";
+      }
+
+      status = FAILED;
+      break;
+    }
+
+    avoc_list *child = item_child_list(item);
+    if (child == NULL) {
+      item->hash = item_hash(item);
+      avoc_list_push(top->out, item);
+      continue;
+    }
+
+    snap_frame frame = {child, children, item, top->out};
+    if (stack_len == stack_cap) {
+      snap_frame *grown = scratch_grow(stack, &stack_cap, sizeof(snap_frame));
+      if (grown == NULL) {
+        avoc_item_free(item);
+        avoc_free(item, sizeof(avoc_item));
+        error = "out of memory";
+        status = FAILED;
+        break;
+      }
+
+      stack = grown;
+    }
+
+    stack[stack_len++] = frame;
+  }
+
+  if (status == OK && r.pos != len) {
+    status = FAILED;
+  }
+
+  if (status != OK) {
+    snap_error(error, r.pos);
+    // Lists still being read hold their items but not their owners yet
+    while (stack_len > 1) {
+      avoc_item *owner = stack[--stack_len].owner;
+      avoc_item_free(owner);
+      avoc_free(owner, sizeof(avoc_item));
+    }
+
+    avoc_list_free(list);
+    avoc_list_init(list);
+  }
+
+  avoc_free(stack, stack_cap * sizeof(snap_frame));
+  return status;
+}
+
+// Bytes of an element of each array kind
+static size_t array_elem_size(avoc_array_kind kind) {
+  switch (kind) {
+  case AVOC_ARRAY_I32:
+  case AVOC_ARRAY_U32:
+    return sizeof(int);
+  case AVOC_ARRAY_I64:
+  case AVOC_ARRAY_U64:
+    return sizeof(long);
+  case AVOC_ARRAY_F32:
+    return sizeof(float);
+  default:
+    return sizeof(double);
+  }
+}
+
+avoc_status avoc_array_init(avoc_array *array, avoc_array_kind kind,
+                            size_t count) {
+  assert(array != NULL);
+  array->kind = kind;
+  array->count = count;
+  array->data = NULL;
+  if (count > 0) {
+    array->data = avoc_calloc(count, array_elem_size(kind));
+    if (array->data == NULL) {
+      array->count = 0L;
+      return FAILED;
+    }
+  }
+
+  return OK;
+}
+
+void avoc_array_free(avoc_array *array) {
+  assert(array != NULL);
+  if (array->data != NULL) {
+    avoc_free(array->data, array->count * array_elem_size(array->kind));
+  }
+
+  array->data = NULL;
+  array->count = 0L;
+}
+
+avoc_status avoc_array_from_list(const avoc_list *list, avoc_array *array) {
+  assert(list != NULL);
+  assert(array != NULL);
+  switch (list->item_type) {
+  case ITEM_LIT_U32:
+  case ITEM_LIT_U64:
+  case ITEM_LIT_I32:
+  case ITEM_LIT_I64:
+  case ITEM_LIT_F32:
+  case ITEM_LIT_F64:
+    break;
+  default:
+    return FAILED;
+  }
+
+  if (avoc_array_init(array, (avoc_array_kind)list->item_type,
+                      list->item_count) != OK) {
+    return FAILED;
+  }
+
+  size_t i = 0;
+  for (const avoc_item *item = list->head; item != NULL;
+       item = item->next_sibling, i++) {
+    switch (array->kind) {
+    case AVOC_ARRAY_U32:
+      ((unsigned int *)array->data)[i] = item->as_u32;
+      break;
+    case AVOC_ARRAY_U64:
+      ((unsigned long *)array->data)[i] = item->as_u64;
+      break;
+    case AVOC_ARRAY_I32:
+      ((int *)array->data)[i] = item->as_i32;
+      break;
+    case AVOC_ARRAY_I64:
+      ((long *)array->data)[i] = item->as_i64;
+      break;
+    case AVOC_ARRAY_F32:
+      ((float *)array->data)[i] = item->as_f32;
+      break;
+    case AVOC_ARRAY_F64:
+      ((double *)array->data)[i] = item->as_f64;
+      break;
+    }
+  }
+
+  return OK;
+}
+
+// Vector instructions of the array kernels, -1 until the first use
+static int array_simd = -1;
+
+// Best vector instructions supported by the CPU.
+static avoc_simd simd_supported(void) {
+#ifdef AVOC_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return AVOC_SIMD_AVX2;
+  }
+#endif
+#ifdef __SSE2__
+  return AVOC_SIMD_SSE2;
+#else
+  return AVOC_SIMD_NONE;
+#endif
+}
+
+static avoc_simd simd_level(void) {
+  if (array_simd < 0) {
+    array_simd = simd_supported();
+  }
+
+  return (avoc_simd)array_simd;
+}
+
+avoc_simd avoc_array_set_simd(avoc_simd simd) {
+  avoc_simd supported = simd_supported();
+  array_simd = simd < supported ? simd : supported;
+  return (avoc_simd)array_simd;
+}
+
+// Low bits of x as a signed integer, without relying on the implementation
+// defined conversion of out of range values.
+static int wrap_i32(unsigned long x) {
+  const unsigned int low = (unsigned int)x;
+  return low <= INT_MAX ? (int)low : (int)(low - INT_MAX - 1) + INT_MIN;
+}
+
+static long wrap_i64(unsigned long x) {
+  return x <= LONG_MAX ? (long)x : (long)(x - LONG_MAX - 1) + LONG_MIN;
+}
+
+// Integer arithmetic wrapping around, y is not zero when dividing. Narrower
+// integers wrap when the result is converted back with wrap_i32().
+static long int_op(long x, long y, avoc_array_op op) {
+  switch (op) {
+  case AVOC_ARRAY_ADD:
+    return wrap_i64((unsigned long)x + (unsigned long)y);
+  case AVOC_ARRAY_SUB:
+    return wrap_i64((unsigned long)x - (unsigned long)y);
+  case AVOC_ARRAY_MUL:
+    return wrap_i64((unsigned long)x * (unsigned long)y);
+  default:
+    // LONG_MIN / -1 overflows, which C leaves undefined: negate instead, so
+    // it wraps around to LONG_MIN like the other operations
+    if (y == -1) {
+      return wrap_i64(0UL - (unsigned long)x);
+    }
+
+    return x / y;
+  }
+}
+
+static unsigned long uint_op(unsigned long x, unsigned long y,
+                             avoc_array_op op) {
+  switch (op) {
+  case AVOC_ARRAY_ADD:
+    return x + y;
+  case AVOC_ARRAY_SUB:
+    return x - y;
+  case AVOC_ARRAY_MUL:
+    return x * y;
+  default:
+    return x / y;
+  }
+}
+
+// Exactly rounded for floats too, as doubles hold their products
+static double float_op(double x, double y, avoc_array_op op) {
+  switch (op) {
+  case AVOC_ARRAY_ADD:
+    return x + y;
+  case AVOC_ARRAY_SUB:
+    return x - y;
+  case AVOC_ARRAY_MUL:
+    return x * y;
+  default:
+    return x / y;
+  }
+}
+
+static long int_reduce(long acc, long x, avoc_array_reduction op) {
+  switch (op) {
+  case AVOC_ARRAY_SUM:
+    return int_op(acc, x, AVOC_ARRAY_ADD);
+  case AVOC_ARRAY_MIN:
+    return x < acc ? x : acc;
+  default:
+    return x > acc ? x : acc;
+  }
+}
+
+static unsigned long uint_reduce(unsigned long acc, unsigned long x,
+                                 avoc_array_reduction op) {
+  switch (op) {
+  case AVOC_ARRAY_SUM:
+    return acc + x;
+  case AVOC_ARRAY_MIN:
+    return x < acc ? x : acc;
+  default:
+    return x > acc ? x : acc;
+  }
+}
+
+static double float_reduce(double acc, double x, avoc_array_reduction op) {
+  switch (op) {
+  case AVOC_ARRAY_SUM:
+    return acc + x;
+  case AVOC_ARRAY_MIN:
+    return x < acc ? x : acc;
+  default:
+    return x > acc ? x : acc;
+  }
+}
+
+// The vector kernels handle the leading elements and return how many, the
+// rest is left to the scalar loops. Kernels return 0 for the kinds and
+// operations they lack instructions for. Reductions multiply a and b first
+// when b is not NULL and leave the partial result in acc, an element of the
+// array kind. Integer additions and subtractions wrap the same way signed or
+// not, the 32 bits sums modulo 2^32 as the scalar ones once converted back.
+#ifdef __SSE2__
+static size_t map_f64_sse2(double *dest, const double *a, const double *b,
+                           size_t count, avoc_array_op op) {
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128d x = _mm_loadu_pd(a + i);
+    __m128d y = _mm_loadu_pd(b + i);
+    switch (op) {
+    case AVOC_ARRAY_ADD:
+      x = _mm_add_pd(x, y);
+      break;
+    case AVOC_ARRAY_SUB:
+      x = _mm_sub_pd(x, y);
+      break;
+    case AVOC_ARRAY_MUL:
+      x = _mm_mul_pd(x, y);
+      break;
+    case AVOC_ARRAY_DIV:
+      x = _mm_div_pd(x, y);
+      break;
+    }
+    _mm_storeu_pd(dest + i, x);
+  }
+
+  return i;
+}
+
+static size_t map_f32_sse2(float *dest, const float *a, const float *b,
+                           size_t count, avoc_array_op op) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_loadu_ps(a + i);
+    __m128 y = _mm_loadu_ps(b + i);
+    switch (op) {
+    case AVOC_ARRAY_ADD:
+      x = _mm_add_ps(x, y);
+      break;
+    case AVOC_ARRAY_SUB:
+      x = _mm_sub_ps(x, y);
+      break;
+    case AVOC_ARRAY_MUL:
+      x = _mm_mul_ps(x, y);
+      break;
+    case AVOC_ARRAY_DIV:
+      x = _mm_div_ps(x, y);
+      break;
+    }
+    _mm_storeu_ps(dest + i, x);
+  }
+
+  return i;
+}
+
+// Additions and subtractions of integers of size bytes
+static size_t map_int_sse2(void *dest, const void *a, const void *b,
+                           size_t count, size_t size, avoc_array_op op) {
+  if (op != AVOC_ARRAY_ADD && op != AVOC_ARRAY_SUB) {
+    return 0L;
+  }
+
+  const size_t lanes = 16 / size;
+  size_t i = 0;
+  for (; i + lanes <= count; i += lanes) {
+    __m128i x = _mm_loadu_si128((const __m128i *)((const char *)a + i * size));
+    __m128i y = _mm_loadu_si128((const __m128i *)((const char *)b + i * size));
+    if (size == 4) {
+      x = op == AVOC_ARRAY_ADD ? _mm_add_epi32(x, y) : _mm_sub_epi32(x, y);
+    } else {
+      x = op == AVOC_ARRAY_ADD ? _mm_add_epi64(x, y) : _mm_sub_epi64(x, y);
+    }
+    _mm_storeu_si128((__m128i *)((char *)dest + i * size), x);
+  }
+
+  return i;
+}
+
+static size_t reduce_f64_sse2(const double *a, const double *b, size_t count,
+                              avoc_array_reduction op, double *acc) {
+  if (count < 2) {
+    return 0L;
+  }
+
+  __m128d lanes = _mm_loadu_pd(a);
+  if (b != NULL) {
+    lanes = _mm_mul_pd(lanes, _mm_loadu_pd(b));
+  }
+
+  size_t i = 2;
+  for (; i + 2 <= count; i += 2) {
+    __m128d x = _mm_loadu_pd(a + i);
+    if (b != NULL) {
+      x = _mm_mul_pd(x, _mm_loadu_pd(b + i));
+    }
+
+    switch (op) {
+    case AVOC_ARRAY_SUM:
+      lanes = _mm_add_pd(lanes, x);
+      break;
+    case AVOC_ARRAY_MIN:
+      lanes = _mm_min_pd(x, lanes);
+      break;
+    case AVOC_ARRAY_MAX:
+      lanes = _mm_max_pd(x, lanes);
+      break;
+    }
+  }
+
+  double partial[2];
+  _mm_storeu_pd(partial, lanes);
+  *acc = float_reduce(partial[0], partial[1], op);
+  return i;
+}
+
+static size_t reduce_f32_sse2(const float *a, const float *b, size_t count,
+                              avoc_array_reduction op, float *acc) {
+  if (count < 4) {
+    return 0L;
+  }
+
+  __m128 lanes = _mm_loadu_ps(a);
+  if (b != NULL) {
+    lanes = _mm_mul_ps(lanes, _mm_loadu_ps(b));
+  }
+
+  size_t i = 4;
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_loadu_ps(a + i);
+    if (b != NULL) {
+      x = _mm_mul_ps(x, _mm_loadu_ps(b + i));
+    }
+
+    switch (op) {
+    case AVOC_ARRAY_SUM:
+      lanes = _mm_add_ps(lanes, x);
+      break;
+    case AVOC_ARRAY_MIN:
+      lanes = _mm_min_ps(x, lanes);
+      break;
+    case AVOC_ARRAY_MAX:
+      lanes = _mm_max_ps(x, lanes);
+      break;
+    }
+  }
+
+  float partial[4];
+  _mm_storeu_ps(partial, lanes);
+  *acc = partial[0];
+  for (size_t j = 1; j < 4; j++) {
+    *acc = (float)float_reduce(*acc, partial[j], op);
+  }
+
+  return i;
+}
+
+// Sums of integers of size bytes
+static size_t sum_int_sse2(const void *a, size_t count, size_t size,
+                           void *acc) {
+  const size_t lanes = 16 / size;
+  if (count < lanes) {
+    return 0L;
+  }
+
+  __m128i sum = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + lanes <= count; i += lanes) {
+    __m128i x = _mm_loadu_si128((const __m128i *)((const char *)a + i * size));
+    sum = size == 4 ? _mm_add_epi32(sum, x) : _mm_add_epi64(sum, x);
+  }
+
+  unsigned long partial[2];
+  _mm_storeu_si128((__m128i *)partial, sum);
+  if (size == 4) {
+    // Each long holds two lanes
+    unsigned int low = 0;
+    for (size_t j = 0; j < 2; j++) {
+      low += (unsigned int)partial[j] + (unsigned int)(partial[j] >> 32);
+    }
+    memcpy(acc, &low, sizeof(low));
+  } else {
+    const unsigned long total = partial[0] + partial[1];
+    memcpy(acc, &total, sizeof(total));
+  }
+
+  return i;
+}
+#endif
+
+#ifdef AVOC_AVX2
+__attribute__((target("avx2"))) static size_t
+map_f64_avx2(double *dest, const double *a, const double *b, size_t count,
+             avoc_array_op op) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256d x = _mm256_loadu_pd(a + i);
+    __m256d y = _mm256_loadu_pd(b + i);
+    switch (op) {
+    case AVOC_ARRAY_ADD:
+      x = _mm256_add_pd(x, y);
+      break;
+    case AVOC_ARRAY_SUB:
+      x = _mm256_sub_pd(x, y);
+      break;
+    case AVOC_ARRAY_MUL:
+      x = _mm256_mul_pd(x, y);
+      break;
+    case AVOC_ARRAY_DIV:
+      x = _mm256_div_pd(x, y);
+      break;
+    }
+    _mm256_storeu_pd(dest + i, x);
+  }
+
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+map_f32_avx2(float *dest, const float *a, const float *b, size_t count,
+             avoc_array_op op) {
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 x = _mm256_loadu_ps(a + i);
+    __m256 y = _mm256_loadu_ps(b + i);
+    switch (op) {
+    case AVOC_ARRAY_ADD:
+      x = _mm256_add_ps(x, y);
+      break;
+    case AVOC_ARRAY_SUB:
+      x = _mm256_sub_ps(x, y);
+      break;
+    case AVOC_ARRAY_MUL:
+      x = _mm256_mul_ps(x, y);
+      break;
+    case AVOC_ARRAY_DIV:
+      x = _mm256_div_ps(x, y);
+      break;
+    }
+    _mm256_storeu_ps(dest + i, x);
+  }
+
+  return i;
+}
+
+// Additions and subtractions of integers of size bytes, and multiplications
+// of 32 bits ones, the low half of the product being the same signed or not
+__attribute__((target("avx2"))) static size_t
+map_int_avx2(void *dest, const void *a, const void *b, size_t count,
+             size_t size, avoc_array_op op) {
+  if (op == AVOC_ARRAY_DIV || (op == AVOC_ARRAY_MUL && size != 4)) {
+    return 0L;
+  }
+
+  const size_t lanes = 32 / size;
+  size_t i = 0;
+  for (; i + lanes <= count; i += lanes) {
+    __m256i x =
+        _mm256_loadu_si256((const __m256i *)((const char *)a + i * size));
+    __m256i y =
+        _mm256_loadu_si256((const __m256i *)((const char *)b + i * size));
+    if (op == AVOC_ARRAY_MUL) {
+      x = _mm256_mullo_epi32(x, y);
+    } else if (size == 4) {
+      x = op == AVOC_ARRAY_ADD ? _mm256_add_epi32(x, y)
+                               : _mm256_sub_epi32(x, y);
+    } else {
+      x = op == AVOC_ARRAY_ADD ? _mm256_add_epi64(x, y)
+                               : _mm256_sub_epi64(x, y);
+    }
+    _mm256_storeu_si256((__m256i *)((char *)dest + i * size), x);
+  }
+
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+reduce_f64_avx2(const double *a, const double *b, size_t count,
+                avoc_array_reduction op, double *acc) {
+  if (count < 4) {
+    return 0L;
+  }
+
+  __m256d lanes = _mm256_loadu_pd(a);
+  if (b != NULL) {
+    lanes = _mm256_mul_pd(lanes, _mm256_loadu_pd(b));
+  }
+
+  size_t i = 4;
+  for (; i + 4 <= count; i += 4) {
+    __m256d x = _mm256_loadu_pd(a + i);
+    if (b != NULL) {
+      x = _mm256_mul_pd(x, _mm256_loadu_pd(b + i));
+    }
+
+    switch (op) {
+    case AVOC_ARRAY_SUM:
+      lanes = _mm256_add_pd(lanes, x);
+      break;
+    case AVOC_ARRAY_MIN:
+      lanes = _mm256_min_pd(x, lanes);
+      break;
+    case AVOC_ARRAY_MAX:
+      lanes = _mm256_max_pd(x, lanes);
+      break;
+    }
+  }
+
+  double partial[4];
+  _mm256_storeu_pd(partial, lanes);
+  *acc = partial[0];
+  for (size_t j = 1; j < 4; j++) {
+    *acc = float_reduce(*acc, partial[j], op);
+  }
+
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+reduce_f32_avx2(const float *a, const float *b, size_t count,
+                avoc_array_reduction op, float *acc) {
+  if (count < 8) {
+    return 0L;
+  }
+
+  __m256 lanes = _mm256_loadu_ps(a);
+  if (b != NULL) {
+    lanes = _mm256_mul_ps(lanes, _mm256_loadu_ps(b));
+  }
+
+  size_t i = 8;
+  for (; i + 8 <= count; i += 8) {
+    __m256 x = _mm256_loadu_ps(a + i);
+    if (b != NULL) {
+      x = _mm256_mul_ps(x, _mm256_loadu_ps(b + i));
+    }
+
+    switch (op) {
+    case AVOC_ARRAY_SUM:
+      lanes = _mm256_add_ps(lanes, x);
+      break;
+    case AVOC_ARRAY_MIN:
+      lanes = _mm256_min_ps(x, lanes);
+      break;
+    case AVOC_ARRAY_MAX:
+      lanes = _mm256_max_ps(x, lanes);
+      break;
+    }
+  }
+
+  float partial[8];
+  _mm256_storeu_ps(partial, lanes);
+  *acc = partial[0];
+  for (size_t j = 1; j < 8; j++) {
+    *acc = (float)float_reduce(*acc, partial[j], op);
+  }
+
+  return i;
+}
+
+// Sums of integers of size bytes, minimums and maximums of 32 bits ones
+__attribute__((target("avx2"))) static size_t
+reduce_int_avx2(avoc_array_kind kind, const void *a, size_t count,
+                avoc_array_reduction op, void *acc) {
+  const size_t size = array_elem_size(kind);
+  const size_t lanes = 32 / size;
+  if (count < lanes || (op != AVOC_ARRAY_SUM && size != 4)) {
+    return 0L;
+  }
+
+  __m256i part = _mm256_loadu_si256((const __m256i *)a);
+  size_t i = lanes;
+  for (; i + lanes <= count; i += lanes) {
+    __m256i x =
+        _mm256_loadu_si256((const __m256i *)((const char *)a + i * size));
+    if (op == AVOC_ARRAY_SUM) {
+      part = size == 4 ? _mm256_add_epi32(part, x) : _mm256_add_epi64(part, x);
+    } else if (kind == AVOC_ARRAY_I32) {
+      part = op == AVOC_ARRAY_MIN ? _mm256_min_epi32(part, x)
+                                  : _mm256_max_epi32(part, x);
+    } else {
+      part = op == AVOC_ARRAY_MIN ? _mm256_min_epu32(part, x)
+                                  : _mm256_max_epu32(part, x);
+    }
+  }
+
+  if (size == 8) {
+    unsigned long partial[4];
+    _mm256_storeu_si256((__m256i *)partial, part);
+    const unsigned long total = partial[0] + partial[1] + partial[2] +
+                                partial[3];
+    memcpy(acc, &total, sizeof(total));
+  } else if (kind == AVOC_ARRAY_I32) {
+    int partial[8];
+    _mm256_storeu_si256((__m256i *)partial, part);
+    long total = partial[0];
+    for (size_t j = 1; j < 8; j++) {
+      total = int_reduce(total, partial[j], op);
+    }
+    const int low = wrap_i32((unsigned long)total);
+    memcpy(acc, &low, sizeof(low));
+  } else {
+    unsigned int partial[8];
+    _mm256_storeu_si256((__m256i *)partial, part);
+    unsigned int low = partial[0];
+    for (size_t j = 1; j < 8; j++) {
+      low = (unsigned int)uint_reduce(low, partial[j], op);
+    }
+    memcpy(acc, &low, sizeof(low));
+  }
+
+  return i;
+}
+#endif
+
+// Leading elements of dest computed by the vector kernels
+static size_t map_kernel(avoc_array_kind kind, void *dest, const void *a,
+                         const void *b, size_t count, avoc_array_op op) {
+  switch (simd_level()) {
+#ifdef AVOC_AVX2
+  case AVOC_SIMD_AVX2:
+    if (kind == AVOC_ARRAY_F64) {
+      return map_f64_avx2(dest, a, b, count, op);
+    } else if (kind == AVOC_ARRAY_F32) {
+      return map_f32_avx2(dest, a, b, count, op);
+    }
+    return map_int_avx2(dest, a, b, count, array_elem_size(kind), op);
+#endif
+#ifdef __SSE2__
+  case AVOC_SIMD_SSE2:
+    if (kind == AVOC_ARRAY_F64) {
+      return map_f64_sse2(dest, a, b, count, op);
+    } else if (kind == AVOC_ARRAY_F32) {
+      return map_f32_sse2(dest, a, b, count, op);
+    }
+    return map_int_sse2(dest, a, b, count, array_elem_size(kind), op);
+#endif
+  default:
+    return 0L;
+  }
+}
+
+// Leading elements of a reduced by the vector kernels into acc. Integer
+// products are left to the scalar loops, which compute them wider.
+static size_t reduce_kernel(avoc_array_kind kind, const void *a,
+                            const void *b, size_t count,
+                            avoc_array_reduction op, void *acc) {
+  switch (simd_level()) {
+#ifdef AVOC_AVX2
+  case AVOC_SIMD_AVX2:
+    if (kind == AVOC_ARRAY_F64) {
+      return reduce_f64_avx2(a, b, count, op, acc);
+    } else if (kind == AVOC_ARRAY_F32) {
+      return reduce_f32_avx2(a, b, count, op, acc);
+    }
+    return b == NULL ? reduce_int_avx2(kind, a, count, op, acc) : 0L;
+#endif
+#ifdef __SSE2__
+  case AVOC_SIMD_SSE2:
+    if (kind == AVOC_ARRAY_F64) {
+      return reduce_f64_sse2(a, b, count, op, acc);
+    } else if (kind == AVOC_ARRAY_F32) {
+      return reduce_f32_sse2(a, b, count, op, acc);
+    } else if (b == NULL && op == AVOC_ARRAY_SUM) {
+      return sum_int_sse2(a, count, array_elem_size(kind), acc);
+    }
+    return 0L;
+#endif
+  default:
+    return 0L;
+  }
+}
+
+// Whether count integers of the array kind at data hold a zero, which
+// avoc_array_map() cannot divide by.
+static int array_has_zero(avoc_array_kind kind, const void *data,
+                          size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    switch (kind) {
+    case AVOC_ARRAY_I32:
+    case AVOC_ARRAY_U32:
+      if (((const unsigned int *)data)[i] == 0) {
+        return 1;
+      }
+      break;
+    case AVOC_ARRAY_I64:
+    case AVOC_ARRAY_U64:
+      if (((const unsigned long *)data)[i] == 0) {
+        return 1;
+      }
+      break;
+    default:
+      return 0;
+    }
+  }
+
+  return 0;
+}
+
+// Applies op to count elements of the array kind at a and b into dest.
+static void array_map_data(avoc_array_kind kind, void *dest, const void *a,
+                           const void *b, size_t count, avoc_array_op op) {
+  size_t i = map_kernel(kind, dest, a, b, count, op);
+  switch (kind) {
+  case AVOC_ARRAY_U32: {
+    const unsigned int *x = a;
+    const unsigned int *y = b;
+    unsigned int *out = dest;
+    for (; i < count; i++) {
+      out[i] = (unsigned int)uint_op(x[i], y[i], op);
+    }
+    break;
+  }
+  case AVOC_ARRAY_U64: {
+    const unsigned long *x = a;
+    const unsigned long *y = b;
+    unsigned long *out = dest;
+    for (; i < count; i++) {
+      out[i] = uint_op(x[i], y[i], op);
+    }
+    break;
+  }
+  case AVOC_ARRAY_I32: {
+    // INT_MIN / -1 does not overflow as a long and wraps back to INT_MIN
+    const int *x = a;
+    const int *y = b;
+    int *out = dest;
+    for (; i < count; i++) {
+      out[i] = wrap_i32((unsigned long)int_op(x[i], y[i], op));
+    }
+    break;
+  }
+  case AVOC_ARRAY_I64: {
+    const long *x = a;
+    const long *y = b;
+    long *out = dest;
+    for (; i < count; i++) {
+      out[i] = int_op(x[i], y[i], op);
+    }
+    break;
+  }
+  case AVOC_ARRAY_F32: {
+    const float *x = a;
+    const float *y = b;
+    float *out = dest;
+    for (; i < count; i++) {
+      out[i] = (float)float_op(x[i], y[i], op);
+    }
+    break;
+  }
+  case AVOC_ARRAY_F64: {
+    const double *x = a;
+    const double *y = b;
+    double *out = dest;
+    for (; i < count; i++) {
+      out[i] = float_op(x[i], y[i], op);
+    }
+    break;
+  }
+  }
+}
+
+avoc_status avoc_array_map(const avoc_array *a, const avoc_array *b,
+                           avoc_array_op op, avoc_array *dest) {
+  assert(a != NULL);
+  assert(b != NULL);
+  assert(dest != NULL);
+  if (a->kind != b->kind || a->count != b->count ||
+      (op == AVOC_ARRAY_DIV && array_has_zero(b->kind, b->data, b->count))) {
+    return FAILED;
+  }
+
+  if (avoc_array_init(dest, a->kind, a->count) != OK) {
+    return FAILED;
+  }
+
+  array_map_data(a->kind, dest->data, a->data, b->data, a->count, op);
+  return OK;
+}
+
+// Reduces a, or the products of a and b when b is not NULL. The scalar loops
+// go on from the partial result of the vector kernels, if any.
+static avoc_status array_reduce(const avoc_array *a, const avoc_array *b,
+                                avoc_array_reduction op, avoc_item *result) {
+  if (a->count == 0 && op != AVOC_ARRAY_SUM) {
+    return FAILED;
+  }
+
+  avoc_item_init(result);
+  result->type = (int)a->kind;
+  const void *by = b != NULL ? b->data : NULL;
+  switch (a->kind) {
+  case AVOC_ARRAY_U32: {
+    const unsigned int *x = a->data;
+    const unsigned int *y = by;
+    unsigned int part;
+    size_t i = reduce_kernel(a->kind, x, y, a->count, op, &part);
+    unsigned long acc = i > 0 ? part
+                        : op == AVOC_ARRAY_SUM || a->count == 0 ? 0UL
+                                                                : x[0];
+    for (; i < a->count; i++) {
+      acc = uint_reduce(acc, y != NULL ? (unsigned long)x[i] * y[i] : x[i],
+                        op);
+    }
+    result->as_u32 = (unsigned int)acc;
+    break;
+  }
+  case AVOC_ARRAY_U64: {
+    const unsigned long *x = a->data;
+    const unsigned long *y = by;
+    unsigned long part;
+    size_t i = reduce_kernel(a->kind, x, y, a->count, op, &part);
+    unsigned long acc = i > 0 ? part
+                        : op == AVOC_ARRAY_SUM || a->count == 0 ? 0UL
+                                                                : x[0];
+    for (; i < a->count; i++) {
+      acc = uint_reduce(acc, y != NULL ? x[i] * y[i] : x[i], op);
+    }
+    result->as_u64 = acc;
+    break;
+  }
+  case AVOC_ARRAY_I32: {
+    // Wrapping sums of longs are the same modulo 2^32
+    const int *x = a->data;
+    const int *y = by;
+    int part;
+    size_t i = reduce_kernel(a->kind, x, y, a->count, op, &part);
+    long acc = i > 0 ? part
+               : op == AVOC_ARRAY_SUM || a->count == 0 ? 0L
+                                                       : x[0];
+    for (; i < a->count; i++) {
+      acc = int_reduce(acc, y != NULL ? (long)x[i] * y[i] : x[i], op);
+    }
+    result->as_i32 = wrap_i32((unsigned long)acc);
+    break;
+  }
+  case AVOC_ARRAY_I64: {
+    const long *x = a->data;
+    const long *y = by;
+    long part;
+    size_t i = reduce_kernel(a->kind, x, y, a->count, op, &part);
+    long acc = i > 0 ? part
+               : op == AVOC_ARRAY_SUM || a->count == 0 ? 0L
+                                                       : x[0];
+    for (; i < a->count; i++) {
+      long elem = y != NULL ? int_op(x[i], y[i], AVOC_ARRAY_MUL) : x[i];
+      acc = int_reduce(acc, elem, op);
+    }
+    result->as_i64 = acc;
+    break;
+  }
+  case AVOC_ARRAY_F32: {
+    const float *x = a->data;
+    const float *y = by;
+    float part;
+    size_t i = reduce_kernel(a->kind, x, y, a->count, op, &part);
+    float acc = i > 0 ? part
+                : op == AVOC_ARRAY_SUM || a->count == 0 ? 0.0f
+                                                        : x[0];
+    for (; i < a->count; i++) {
+      float elem = y != NULL ? x[i] * y[i] : x[i];
+      acc = (float)float_reduce(acc, elem, op);
+    }
+    result->as_f32 = acc;
+    break;
+  }
+  case AVOC_ARRAY_F64: {
+    const double *x = a->data;
+    const double *y = by;
+    double part;
+    size_t i = reduce_kernel(a->kind, x, y, a->count, op, &part);
+    double acc = i > 0 ? part
+                 : op == AVOC_ARRAY_SUM || a->count == 0 ? 0.0
+                                                         : x[0];
+    for (; i < a->count; i++) {
+      acc = float_reduce(acc, y != NULL ? x[i] * y[i] : x[i], op);
+    }
+    result->as_f64 = acc;
+    break;
+  }
+  }
+
+  result->hash = item_hash(result);
+  return OK;
+}
+
+avoc_status avoc_array_reduce(const avoc_array *array, avoc_array_reduction op,
+                              avoc_item *result) {
+  assert(array != NULL);
+  assert(result != NULL);
+  return array_reduce(array, NULL, op, result);
+}
+
+avoc_status avoc_array_dot(const avoc_array *a, const avoc_array *b,
+                           avoc_item *result) {
+  assert(a != NULL);
+  assert(b != NULL);
+  assert(result != NULL);
+  if (a->kind != b->kind || a->count != b->count) {
+    return FAILED;
+  }
+
+  return array_reduce(a, b, AVOC_ARRAY_SUM, result);
+}
+
+// Elements a task handles at least, smaller ones cost more to hand over
+// than they balance
+#define POOL_GRAIN 16384L
+
+// Capacity of the deque of a worker, halving tasks needs one per level
+#define POOL_TASKS 64
+
+// Range of elements, its start is a multiple of the grain of the job
+typedef struct {
+  size_t begin;
+  size_t end;
+} pool_task;
+
+// Worker of a pool. It pushes and pops the tasks at the back of its deque,
+// the other workers steal them from the front.
+typedef struct {
+  struct _avoc_pool *pool;
+  size_t index;
+  thrd_t thread; // Not started for the first worker, the calling thread
+  mtx_t lock;    // Guards the deque
+  pool_task tasks[POOL_TASKS];
+  size_t head;
+  size_t tail;
+} pool_worker;
+
+// Chunked loop over count elements, run handles [begin, end) on a worker
+typedef struct {
+  void (*run)(void *data, size_t worker, size_t begin, size_t end);
+  void *data;
+  size_t count;
+  size_t grain;
+} pool_job;
+
+struct _avoc_pool {
+  pool_worker *workers;
+  size_t count; // Number of workers
+  mtx_t lock;
+  cnd_t wake; // A job started or the pool stops
+  cnd_t idle; // The last thread left the job
+  size_t jobs; // Jobs started
+  size_t busy; // Threads still in the current job
+  int stop;
+  const pool_job *job;
+  atomic_size_t remaining; // Elements of the job not handled yet
+};
+
+static int pool_push(pool_worker *worker, pool_task task) {
+  mtx_lock(&worker->lock);
+  const int pushed = worker->tail < POOL_TASKS;
+  if (pushed) {
+    worker->tasks[worker->tail++] = task;
+  }
+
+  mtx_unlock(&worker->lock);
+  return pushed;
+}
+
+// Takes the last task of worker when own, otherwise the first one.
+static int pool_take(pool_worker *worker, int own, pool_task *task) {
+  mtx_lock(&worker->lock);
+  const int taken = worker->head < worker->tail;
+  if (taken) {
+    *task = own ? worker->tasks[--worker->tail]
+                : worker->tasks[worker->head++];
+  }
+
+  if (worker->head == worker->tail) {
+    worker->head = 0L;
+    worker->tail = 0L;
+  }
+
+  mtx_unlock(&worker->lock);
+  return taken;
+}
+
+// Runs tasks of the current job on worker until every element is handled.
+// Tasks are halved while they are larger than the grain, the halves left in
+// the deque being what idle workers steal.
+static void pool_work(avoc_pool *pool, size_t index) {
+  const pool_job *job = pool->job;
+  pool_worker *self = &pool->workers[index];
+  while (atomic_load(&pool->remaining) > 0) {
+    pool_task task;
+    int found = pool_take(self, 1, &task);
+    for (size_t i = 1; !found && i < pool->count; i++) {
+      found = pool_take(&pool->workers[(index + i) % pool->count], 0, &task);
+    }
+
+    if (!found) {
+      thrd_yield();
+      continue;
+    }
+
+    while (task.end - task.begin > job->grain) {
+      const size_t chunks = (task.end - task.begin - 1) / job->grain + 1;
+      const pool_task rest = {task.begin + chunks / 2 * job->grain,
+                              task.end};
+      if (!pool_push(self, rest)) {
+        break;
+      }
+
+      task.end = rest.begin;
+    }
+
+    job->run(job->data, index, task.begin, task.end);
+    atomic_fetch_sub(&pool->remaining, task.end - task.begin);
+  }
+}
+
+static int pool_thread(void *arg) {
+  pool_worker *self = arg;
+  avoc_pool *pool = self->pool;
+  size_t seen = 0L;
+  mtx_lock(&pool->lock);
+  for (;;) {
+    while (!pool->stop && pool->jobs == seen) {
+      cnd_wait(&pool->wake, &pool->lock);
+    }
+
+    if (pool->stop) {
+      break;
+    }
+
+    seen = pool->jobs;
+    mtx_unlock(&pool->lock);
+    pool_work(pool, self->index);
+    mtx_lock(&pool->lock);
+    if (--pool->busy == 0) {
+      cnd_signal(&pool->idle);
+    }
+  }
+
+  mtx_unlock(&pool->lock);
+  return 0;
+}
+
+// Runs job on every worker and returns once they all left it.
+static void pool_run(avoc_pool *pool, const pool_job *job) {
+  if (job->count == 0) {
+    return;
+  }
+
+  pool->job = job;
+  atomic_store(&pool->remaining, job->count);
+  pool_push(&pool->workers[0], (pool_task){0L, job->count});
+  mtx_lock(&pool->lock);
+  pool->jobs++;
+  pool->busy = pool->count - 1;
+  cnd_broadcast(&pool->wake);
+  mtx_unlock(&pool->lock);
+
+  pool_work(pool, 0L);
+  mtx_lock(&pool->lock);
+  while (pool->busy > 0) {
+    cnd_wait(&pool->idle, &pool->lock);
+  }
+
+  mtx_unlock(&pool->lock);
+}
+
+// Grain of a job over count elements, a few tasks per worker at least
+static size_t pool_grain(const avoc_pool *pool, size_t count) {
+  const size_t grain = count / (pool->count * 8);
+  return grain > POOL_GRAIN ? grain : POOL_GRAIN;
+}
+
+// Stops the threads started from worker 1 up to end.
+static void pool_stop(avoc_pool *pool, size_t end) {
+  mtx_lock(&pool->lock);
+  pool->stop = 1;
+  cnd_broadcast(&pool->wake);
+  mtx_unlock(&pool->lock);
+  for (size_t i = 1; i < end; i++) {
+    thrd_join(pool->workers[i].thread, NULL);
+  }
+
+  for (size_t i = 0; i < pool->count; i++) {
+    mtx_destroy(&pool->workers[i].lock);
+  }
+
+  cnd_destroy(&pool->idle);
+  cnd_destroy(&pool->wake);
+  mtx_destroy(&pool->lock);
+  avoc_free(pool->workers, pool->count * sizeof(pool_worker));
+  avoc_free(pool, sizeof(avoc_pool));
+}
+
+avoc_pool *avoc_pool_new(size_t threads) {
+  threads = threads > 0 ? threads : 1L;
+  avoc_pool *pool = avoc_malloc(sizeof(avoc_pool));
+  if (pool == NULL) {
+    return NULL;
+  }
+
+  pool->workers = avoc_malloc(threads * sizeof(pool_worker));
+  if (pool->workers == NULL) {
+    avoc_free(pool, sizeof(avoc_pool));
+    return NULL;
+  }
+
+  pool->count = threads;
+  mtx_init(&pool->lock, mtx_plain);
+  cnd_init(&pool->wake);
+  cnd_init(&pool->idle);
+  pool->jobs = 0L;
+  pool->busy = 0L;
+  pool->stop = 0;
+  pool->job = NULL;
+  atomic_init(&pool->remaining, 0L);
+  for (size_t i = 0; i < threads; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i;
+    pool->workers[i].head = 0L;
+    pool->workers[i].tail = 0L;
+    mtx_init(&pool->workers[i].lock, mtx_plain);
+  }
+
+  for (size_t i = 1; i < threads; i++) {
+    if (thrd_create(&pool->workers[i].thread, pool_thread,
+                    &pool->workers[i]) != thrd_success) {
+      pool_stop(pool, i);
+      return NULL;
+    }
+  }
+
+  return pool;
+}
+
+void avoc_pool_free(avoc_pool *pool) {
+  assert(pool != NULL);
+  pool_stop(pool, pool->count);
+}
+
+size_t avoc_pool_threads(const avoc_pool *pool) {
+  assert(pool != NULL);
+  return pool->count;
+}
+
+// Arrays of avoc_array_pmap()
+typedef struct {
+  const avoc_array *a;
+  const avoc_array *b;
+  avoc_array_op op;
+  avoc_array *dest;
+  atomic_int failed; // A chunk of b holds an integer zero to divide by
+} pool_map;
+
+static void pool_map_run(void *data, size_t worker, size_t begin,
+                         size_t end) {
+  pool_map *map = data;
+  const avoc_array_kind kind = map->a->kind;
+  const size_t size = array_elem_size(kind);
+  const char *b = (const char *)map->b->data + begin * size;
+  (void)worker;
+  if (map->op == AVOC_ARRAY_DIV && array_has_zero(kind, b, end - begin)) {
+    atomic_store(&map->failed, 1);
+    return;
+  }
+
+  array_map_data(kind, (char *)map->dest->data + begin * size,
+                 (const char *)map->a->data + begin * size, b, end - begin,
+                 map->op);
+}
+
+avoc_status avoc_array_pmap(avoc_pool *pool, const avoc_array *a,
+                            const avoc_array *b, avoc_array_op op,
+                            avoc_array *dest) {
+  assert(pool != NULL);
+  assert(a != NULL);
+  assert(b != NULL);
+  assert(dest != NULL);
+  if (a->kind != b->kind || a->count != b->count) {
+    return FAILED;
+  }
+
+  // The kernels are picked before any worker looks for them
+  simd_level();
+  if (avoc_array_init(dest, a->kind, a->count) != OK) {
+    return FAILED;
+  }
+
+  pool_map map = {a, b, op, dest, 0};
+  const pool_job job = {pool_map_run, &map, a->count,
+                        pool_grain(pool, a->count)};
+  pool_run(pool, &job);
+  if (atomic_load(&map.failed)) {
+    avoc_array_free(dest);
+    return FAILED;
+  }
+
+  return OK;
+}
+
+// Reduction of the chunks a worker handled
+typedef struct {
+  avoc_item item;
+  int used;
+} pool_partial;
+
+// Array and partial results of avoc_array_preduce()
+typedef struct {
+  const avoc_array *array;
+  avoc_array_reduction op;
+  pool_partial *partials; // One per worker
+} pool_reduce;
+
+// Reduces x into acc, literal items of the array kind.
+static void item_reduce(avoc_item *acc, const avoc_item *x,
+                        avoc_array_reduction op) {
+  switch ((avoc_array_kind)acc->type) {
+  case AVOC_ARRAY_U32:
+    acc->as_u32 = (unsigned int)uint_reduce(acc->as_u32, x->as_u32, op);
+    break;
+  case AVOC_ARRAY_U64:
+    acc->as_u64 = uint_reduce(acc->as_u64, x->as_u64, op);
+    break;
+  case AVOC_ARRAY_I32:
+    acc->as_i32 =
+        wrap_i32((unsigned long)int_reduce(acc->as_i32, x->as_i32, op));
+    break;
+  case AVOC_ARRAY_I64:
+    acc->as_i64 = int_reduce(acc->as_i64, x->as_i64, op);
+    break;
+  case AVOC_ARRAY_F32:
+    acc->as_f32 = (float)float_reduce(acc->as_f32, x->as_f32, op);
+    break;
+  case AVOC_ARRAY_F64:
+    acc->as_f64 = float_reduce(acc->as_f64, x->as_f64, op);
+    break;
+  }
+}
+
+static void pool_reduce_run(void *data, size_t worker, size_t begin,
+                            size_t end) {
+  pool_reduce *reduce = data;
+  const avoc_array *array = reduce->array;
+  const avoc_array chunk = {
+      array->kind, end - begin,
+      (char *)array->data + begin * array_elem_size(array->kind)};
+  pool_partial *partial = &reduce->partials[worker];
+  if (!partial->used) {
+    array_reduce(&chunk, NULL, reduce->op, &partial->item);
+    partial->used = 1;
+    return;
+  }
+
+  avoc_item item;
+  array_reduce(&chunk, NULL, reduce->op, &item);
+  item_reduce(&partial->item, &item, reduce->op);
+}
+
+avoc_status avoc_array_preduce(avoc_pool *pool, const avoc_array *array,
+                               avoc_array_reduction op, avoc_item *result) {
+  assert(pool != NULL);
+  assert(array != NULL);
+  assert(result != NULL);
+  if (array->count == 0) {
+    return array_reduce(array, NULL, op, result);
+  }
+
+  pool_partial *partials = avoc_malloc(pool->count * sizeof(pool_partial));
+  if (partials == NULL) {
+    return FAILED;
+  }
+
+  for (size_t i = 0; i < pool->count; i++) {
+    partials[i].used = 0;
+  }
+
+  simd_level();
+  pool_reduce reduce = {array, op, partials};
+  const pool_job job = {pool_reduce_run, &reduce, array->count,
+                        pool_grain(pool, array->count)};
+  pool_run(pool, &job);
+
+  int found = 0;
+  for (size_t i = 0; i < pool->count; i++) {
+    if (!partials[i].used) {
+      continue;
+    } else if (!found) {
+      *result = partials[i].item;
+      found = 1;
+    } else {
+      item_reduce(result, &partials[i].item, op);
+    }
+  }
+
+  avoc_free(partials, pool->count * sizeof(pool_partial));
+  result->hash = item_hash(result);
+  return OK;
+}
+
+// State of avoc_array_pfilter(), which runs two jobs over the same chunks
+typedef struct {
+  const avoc_array *array;
+  avoc_array_pred keep;
+  void *ctx;
+  size_t grain;
+  unsigned char *kept; // Whether keep is true for each element
+  size_t *offsets;     // Kept elements per chunk, then where they go in dest
+  avoc_array *dest;
+} pool_filter;
+
+static void pool_filter_test(void *data, size_t worker, size_t begin,
+                             size_t end) {
+  pool_filter *filter = data;
+  const size_t size = array_elem_size(filter->array->kind);
+  const char *elems = filter->array->data;
+  (void)worker;
+  for (size_t chunk = begin; chunk < end; chunk += filter->grain) {
+    const size_t chunk_end =
+        chunk + filter->grain < end ? chunk + filter->grain : end;
+    size_t count = 0L;
+    for (size_t i = chunk; i < chunk_end; i++) {
+      filter->kept[i] = filter->keep(filter->ctx, elems + i * size) != 0;
+      count += filter->kept[i];
+    }
+
+    filter->offsets[chunk / filter->grain] = count;
+  }
+}
+
+static void pool_filter_copy(void *data, size_t worker, size_t begin,
+                             size_t end) {
+  pool_filter *filter = data;
+  const size_t size = array_elem_size(filter->array->kind);
+  const char *elems = filter->array->data;
+  char *out = filter->dest->data;
+  (void)worker;
+  for (size_t chunk = begin; chunk < end; chunk += filter->grain) {
+    const size_t chunk_end =
+        chunk + filter->grain < end ? chunk + filter->grain : end;
+    size_t pos = filter->offsets[chunk / filter->grain];
+    for (size_t i = chunk; i < chunk_end; i++) {
+      if (filter->kept[i]) {
+        memcpy(out + pos++ * size, elems + i * size, size);
+      }
+    }
+  }
+}
+
+avoc_status avoc_array_pfilter(avoc_pool *pool, const avoc_array *array,
+                               avoc_array_pred keep, void *ctx,
+                               avoc_array *dest) {
+  assert(pool != NULL);
+  assert(array != NULL);
+  assert(keep != NULL);
+  assert(dest != NULL);
+  const size_t grain = pool_grain(pool, array->count);
+  const size_t chunks = array->count / grain + 1;
+  pool_filter filter = {array,
+                        keep,
+                        ctx,
+                        grain,
+                        avoc_malloc(array->count + 1),
+                        avoc_malloc(chunks * sizeof(size_t)),
+                        dest};
+  avoc_status status = FAILED;
+  if (filter.kept != NULL && filter.offsets != NULL) {
+    pool_job job = {pool_filter_test, &filter, array->count, grain};
+    pool_run(pool, &job);
+
+    // Chunks copy their elements after those of the chunks before them
+    size_t total = 0L;
+    for (size_t i = 0; i * grain < array->count; i++) {
+      const size_t count = filter.offsets[i];
+      filter.offsets[i] = total;
+      total += count;
+    }
+
+    status = avoc_array_init(dest, array->kind, total);
+    if (status == OK) {
+      job.run = pool_filter_copy;
+      pool_run(pool, &job);
+    }
+  }
+
+  avoc_free(filter.offsets, chunks * sizeof(size_t));
+  avoc_free(filter.kept, array->count + 1);
+  return status;
+}
+
+// Ids of the transients owning the nodes they create, never reused so the
+// nodes of an ended transient are copied like any other shared node
+static size_t transient_last_edit = 0L;
+
+#define AVOC_PVEC_MASK (AVOC_PVEC_WIDTH - 1)
+
+// Node of a persistent vector, leaves hold values and the others children
+typedef struct _avoc_pvec_node {
+  size_t refs; // Vectors and nodes holding it
+  size_t edit; // Transient which may change it in place, see avoc_pvec.edit
+  union {
+    struct _avoc_pvec_node *children[AVOC_PVEC_WIDTH];
+    avoc_value values[AVOC_PVEC_WIDTH];
+  };
+} avoc_pvec_node;
+
+static avoc_pvec_node *pvec_node_new(size_t edit) {
+  avoc_pvec_node *node = avoc_malloc(sizeof(avoc_pvec_node));
+  if (node != NULL) {
+    memset(node, 0, sizeof(avoc_pvec_node));
+    node->refs = 1L;
+    node->edit = edit;
+  }
+
+  return node;
+}
+
+// Drops a reference to the node at level, 0 for leaves, freeing it with the
+// last one. The recursion is as deep as the trie, 13 levels at most.
+static void pvec_node_release(avoc_pvec_node *node, size_t level) {
+  if (node == NULL || --node->refs > 0) {
+    return;
+  }
+
+  if (level > 0) {
+    for (size_t i = 0; i < AVOC_PVEC_WIDTH; i++) {
+      pvec_node_release(node->children[i], level - AVOC_PVEC_BITS);
+    }
+  }
+
+  avoc_free(node, sizeof(avoc_pvec_node));
+}
+
+// Node in slot the transient edit may change, a copy replacing it unless it
+// already owns it, an empty node when slot is empty. NULL when out of memory
+// with slot untouched.
+static avoc_pvec_node *pvec_own(avoc_pvec_node **slot, size_t level,
+                                size_t edit) {
+  avoc_pvec_node *node = *slot;
+  if (node != NULL && node->edit == edit) {
+    return node;
+  }
+
+  avoc_pvec_node *copy = pvec_node_new(edit);
+  if (copy == NULL || node == NULL) {
+    *slot = copy != NULL ? copy : *slot;
+    return copy;
+  }
+
+  memcpy(copy->children, node->children, sizeof(copy->children));
+  if (level > 0) {
+    for (size_t i = 0; i < AVOC_PVEC_WIDTH; i++) {
+      if (copy->children[i] != NULL) {
+        copy->children[i]->refs++;
+      }
+    }
+  }
+
+  pvec_node_release(node, level);
+  *slot = copy;
+  return copy;
+}
+
+// Owns the nodes from the root down to the one at stop on the path to index.
+// Replacing a node by its copy keeps the elements of vec, so failing halfway
+// leaves them untouched.
+static avoc_pvec_node *pvec_own_path(avoc_pvec *vec, size_t index,
+                                     size_t stop) {
+  avoc_pvec_node **slot = &vec->root;
+  for (size_t level = vec->shift;; level -= AVOC_PVEC_BITS) {
+    avoc_pvec_node *node = pvec_own(slot, level, vec->edit);
+    if (node == NULL || level == stop) {
+      return node;
+    }
+
+    slot = &node->children[(index >> level) & AVOC_PVEC_MASK];
+  }
+}
+
+// Index of the first element of the tail
+static size_t pvec_tail_offset(const avoc_pvec *vec) {
+  return vec->count == 0
+             ? 0L
+             : (vec->count - 1) >> AVOC_PVEC_BITS << AVOC_PVEC_BITS;
+}
+
+void avoc_pvec_init(avoc_pvec *vec) {
+  assert(vec != NULL);
+  vec->root = NULL;
+  vec->tail = NULL;
+  vec->count = 0L;
+  vec->shift = AVOC_PVEC_BITS;
+  vec->edit = 0L;
+}
+
+void avoc_pvec_free(avoc_pvec *vec) {
+  assert(vec != NULL);
+  pvec_node_release(vec->root, vec->shift);
+  pvec_node_release(vec->tail, 0L);
+  avoc_pvec_init(vec);
+}
+
+void avoc_pvec_copy(const avoc_pvec *vec, avoc_pvec *copy) {
+  assert(vec != NULL);
+  assert(copy != NULL);
+  assert(vec->edit == 0);
+  *copy = *vec;
+  if (copy->root != NULL) {
+    copy->root->refs++;
+  }
+
+  if (copy->tail != NULL) {
+    copy->tail->refs++;
+  }
+}
+
+avoc_value avoc_pvec_get(const avoc_pvec *vec, size_t index) {
+  assert(vec != NULL);
+  assert(index < vec->count);
+  const avoc_pvec_node *node = vec->tail;
+  if (index < pvec_tail_offset(vec)) {
+    node = vec->root;
+    for (size_t level = vec->shift; level > 0; level -= AVOC_PVEC_BITS) {
+      node = node->children[(index >> level) & AVOC_PVEC_MASK];
+    }
+  }
+
+  return node->values[index & AVOC_PVEC_MASK];
+}
+
+void avoc_pvec_transient(const avoc_pvec *vec, avoc_pvec *builder) {
+  avoc_pvec_copy(vec, builder);
+  builder->edit = ++transient_last_edit;
+}
+
+void avoc_pvec_persistent(avoc_pvec *builder) {
+  assert(builder != NULL);
+  builder->edit = 0L;
+}
+
+avoc_status avoc_pvec_transient_set(avoc_pvec *builder, size_t index,
+                                    avoc_value value) {
+  assert(builder != NULL);
+  assert(builder->edit != 0);
+  assert(index < builder->count);
+  avoc_pvec_node *leaf = index >= pvec_tail_offset(builder)
+                             ? pvec_own(&builder->tail, 0L, builder->edit)
+                             : pvec_own_path(builder, index, 0L);
+  if (leaf == NULL) {
+    return FAILED;
+  }
+
+  leaf->values[index & AVOC_PVEC_MASK] = value;
+  return OK;
+}
+
+avoc_status avoc_pvec_transient_push(avoc_pvec *builder, avoc_value value) {
+  assert(builder != NULL);
+  assert(builder->edit != 0);
+  const size_t tail_offset = pvec_tail_offset(builder);
+  const size_t tail_len = builder->count - tail_offset;
+  if (tail_len < AVOC_PVEC_WIDTH) {
+    avoc_pvec_node *tail = pvec_own(&builder->tail, 0L, builder->edit);
+    if (tail == NULL) {
+      return FAILED;
+    }
+
+    tail->values[tail_len] = value;
+    builder->count++;
+    return OK;
+  }
+
+  // The full tail moves into the trie, under a new root when it is full
+  avoc_pvec_node *tail = pvec_node_new(builder->edit);
+  if (tail == NULL) {
+    return FAILED;
+  }
+
+  if ((builder->count >> AVOC_PVEC_BITS) > (1UL << builder->shift)) {
+    avoc_pvec_node *root = pvec_node_new(builder->edit);
+    if (root == NULL) {
+      avoc_free(tail, sizeof(avoc_pvec_node));
+      return FAILED;
+    }
+
+    root->children[0] = builder->root;
+    builder->root = root;
+    builder->shift += AVOC_PVEC_BITS;
+  }
+
+  avoc_pvec_node *parent = pvec_own_path(builder, tail_offset, AVOC_PVEC_BITS);
+  if (parent == NULL) {
+    avoc_free(tail, sizeof(avoc_pvec_node));
+    return FAILED;
+  }
+
+  parent->children[(tail_offset >> AVOC_PVEC_BITS) & AVOC_PVEC_MASK] =
+      builder->tail;
+  builder->tail = tail;
+  tail->values[0] = value;
+  builder->count++;
+  return OK;
+}
+
+avoc_status avoc_pvec_set(const avoc_pvec *vec, size_t index, avoc_value value,
+                          avoc_pvec *result) {
+  assert(vec != result);
+  // A transient owning no node copies exactly the path to the element
+  avoc_pvec_transient(vec, result);
+  avoc_status status = avoc_pvec_transient_set(result, index, value);
+  avoc_pvec_persistent(result);
+  if (status != OK) {
+    avoc_pvec_free(result);
+  }
+
+  return status;
+}
+
+avoc_status avoc_pvec_push(const avoc_pvec *vec, avoc_value value,
+                           avoc_pvec *result) {
+  assert(vec != result);
+  avoc_pvec_transient(vec, result);
+  avoc_status status = avoc_pvec_transient_push(result, value);
+  avoc_pvec_persistent(result);
+  if (status != OK) {
+    avoc_pvec_free(result);
+  }
+
+  return status;
+}
+
+avoc_status avoc_pvec_from_list(const avoc_list *list, avoc_pvec *vec) {
+  assert(list != NULL);
+  assert(vec != NULL);
+  avoc_pvec empty;
+  avoc_pvec_init(&empty);
+  avoc_pvec_transient(&empty, vec);
+  for (const avoc_item *item = list->head; item != NULL;
+       item = item->next_sibling) {
+    avoc_value value;
+    if (avoc_value_from_item(item, &value) != OK ||
+        avoc_pvec_transient_push(vec, value) != OK) {
+      avoc_pvec_free(vec);
+      return FAILED;
+    }
+  }
+
+  avoc_pvec_persistent(vec);
+  return OK;
+}
+
+// Cell of a persistent list
+typedef struct _avoc_plist_cell {
+  size_t refs; // Lists and cells holding it
+  avoc_value value;
+  struct _avoc_plist_cell *next;
+} avoc_plist_cell;
+
+// Conses value onto list, the new cell takes over the reference list had.
+static avoc_status plist_push(avoc_plist *list, avoc_value value) {
+  avoc_plist_cell *cell = avoc_malloc(sizeof(avoc_plist_cell));
+  if (cell == NULL) {
+    return FAILED;
+  }
+
+  cell->refs = 1L;
+  cell->value = value;
+  cell->next = list->head;
+  list->head = cell;
+  list->count++;
+  return OK;
+}
+
+void avoc_plist_init(avoc_plist *list) {
+  assert(list != NULL);
+  list->head = NULL;
+  list->count = 0L;
+}
+
+void avoc_plist_free(avoc_plist *list) {
+  assert(list != NULL);
+  avoc_plist_cell *cell = list->head;
+  while (cell != NULL && --cell->refs == 0) {
+    avoc_plist_cell *next = cell->next;
+    avoc_free(cell, sizeof(avoc_plist_cell));
+    cell = next;
+  }
+
+  avoc_plist_init(list);
+}
+
+void avoc_plist_copy(const avoc_plist *list, avoc_plist *copy) {
+  assert(list != NULL);
+  assert(copy != NULL);
+  *copy = *list;
+  if (copy->head != NULL) {
+    copy->head->refs++;
+  }
+}
+
+avoc_status avoc_plist_cons(const avoc_plist *list, avoc_value value,
+                            avoc_plist *result) {
+  assert(list != result);
+  avoc_plist_copy(list, result);
+  if (plist_push(result, value) != OK) {
+    avoc_plist_free(result);
+    return FAILED;
+  }
+
+  return OK;
+}
+
+avoc_value avoc_plist_first(const avoc_plist *list) {
+  assert(list != NULL);
+  assert(list->head != NULL);
+  return list->head->value;
+}
+
+void avoc_plist_rest(const avoc_plist *list, avoc_plist *rest) {
+  assert(list != NULL);
+  assert(rest != NULL);
+  assert(list->head != NULL);
+  rest->head = list->head->next;
+  rest->count = list->count - 1;
+  if (rest->head != NULL) {
+    rest->head->refs++;
+  }
+}
+
+avoc_status avoc_plist_from_list(const avoc_list *list, avoc_plist *result) {
+  assert(list != NULL);
+  assert(result != NULL);
+  avoc_plist_init(result);
+  for (const avoc_item *item = list->tail; item != NULL;
+       item = item->prev_sibling) {
+    avoc_value value;
+    if (avoc_value_from_item(item, &value) != OK ||
+        plist_push(result, value) != OK) {
+      avoc_plist_free(result);
+      return FAILED;
+    }
+  }
+
+  return OK;
+}
+
+// Key and value of a map node, or the subtrie of the keys sharing its slot
+typedef struct {
+  avoc_value key;
+  avoc_value value;
+  struct _avoc_pmap_node *child; // NULL for a key and value
+} pmap_entry;
+
+// Node of a persistent map. Entries are in the order of the slots, which
+// take 5 bits of the key hash per level. The hash is a bijection, so keys
+// sharing every bit are the same and there is no collision to handle.
+typedef struct _avoc_pmap_node {
+  size_t refs;     // Maps and nodes holding it
+  size_t edit;     // Transient which may change it in place
+  uint32_t bitmap; // Slots holding an entry
+  uint32_t count;  // Number of entries
+  uint32_t cap;    // Capacity of entries
+  pmap_entry entries[];
+} avoc_pmap_node;
+
+#define PMAP_BITS 5
+#define PMAP_WIDTH (1U << PMAP_BITS)
+
+static uint64_t pmap_hash(avoc_value key) { return hash_mix(key); }
+
+static uint32_t pmap_slot(uint64_t hash, size_t shift) {
+  return 1U << ((hash >> shift) & (PMAP_WIDTH - 1));
+}
+
+// Entries of node before the one of slot
+static uint32_t pmap_index(const avoc_pmap_node *node, uint32_t slot) {
+#ifdef __GNUC__
+  return (uint32_t)__builtin_popcount(node->bitmap & (slot - 1));
+#else
+  uint32_t bits = node->bitmap & (slot - 1);
+  uint32_t count = 0;
+  for (; bits != 0; bits &= bits - 1) {
+    count++;
+  }
+
+  return count;
+#endif
+}
+
+static size_t pmap_node_size(uint32_t cap) {
+  return sizeof(avoc_pmap_node) + cap * sizeof(pmap_entry);
+}
+
+static avoc_pmap_node *pmap_node_new(size_t edit, uint32_t cap) {
+  avoc_pmap_node *node = avoc_malloc(pmap_node_size(cap));
+  if (node != NULL) {
+    node->refs = 1L;
+    node->edit = edit;
+    node->bitmap = 0;
+    node->count = 0;
+    node->cap = cap;
+  }
+
+  return node;
+}
+
+// Drops a reference to node as pvec_node_release(), the trie is 13 levels
+// deep at most.
+static void pmap_node_release(avoc_pmap_node *node) {
+  if (node == NULL || --node->refs > 0) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < node->count; i++) {
+    pmap_node_release(node->entries[i].child);
+  }
+
+  avoc_free(node, pmap_node_size(node->cap));
+}
+
+// Node in slot the transient edit may change with room for extra entries,
+// as pvec_own(). Owned nodes double their capacity when they grow.
+static avoc_pmap_node *pmap_own(avoc_pmap_node **slot, size_t edit,
+                                uint32_t extra) {
+  avoc_pmap_node *node = *slot;
+  const int owned = node != NULL && node->edit == edit;
+  if (owned && node->count + extra <= node->cap) {
+    return node;
+  }
+
+  const uint32_t count = node != NULL ? node->count : 0;
+  uint32_t cap = count + extra;
+  if (owned && cap < node->cap * 2) {
+    cap = node->cap * 2 < PMAP_WIDTH ? node->cap * 2 : PMAP_WIDTH;
+  }
+
+  avoc_pmap_node *copy = pmap_node_new(edit, cap);
+  if (copy == NULL || node == NULL) {
+    *slot = copy != NULL ? copy : *slot;
+    return copy;
+  }
+
+  copy->bitmap = node->bitmap;
+  copy->count = count;
+  memcpy(copy->entries, node->entries, count * sizeof(pmap_entry));
+  if (owned) {
+    // Only the transient holds it, the children move to the copy
+    avoc_free(node, pmap_node_size(node->cap));
+  } else {
+    for (uint32_t i = 0; i < count; i++) {
+      if (copy->entries[i].child != NULL) {
+        copy->entries[i].child->refs++;
+      }
+    }
+
+    pmap_node_release(node);
+  }
+
+  *slot = copy;
+  return copy;
+}
+
+void avoc_pmap_init(avoc_pmap *map) {
+  assert(map != NULL);
+  map->root = NULL;
+  map->count = 0L;
+  map->edit = 0L;
+}
+
+void avoc_pmap_free(avoc_pmap *map) {
+  assert(map != NULL);
+  pmap_node_release(map->root);
+  avoc_pmap_init(map);
+}
+
+void avoc_pmap_copy(const avoc_pmap *map, avoc_pmap *copy) {
+  assert(map != NULL);
+  assert(copy != NULL);
+  assert(map->edit == 0);
+  *copy = *map;
+  if (copy->root != NULL) {
+    copy->root->refs++;
+  }
+}
+
+avoc_status avoc_pmap_get(const avoc_pmap *map, avoc_value key,
+                          avoc_value *value) {
+  assert(map != NULL);
+  assert(value != NULL);
+  const uint64_t hash = pmap_hash(key);
+  const avoc_pmap_node *node = map->root;
+  for (size_t shift = 0; node != NULL; shift += PMAP_BITS) {
+    const uint32_t slot = pmap_slot(hash, shift);
+    if ((node->bitmap & slot) == 0) {
+      break;
+    }
+
+    const pmap_entry *entry = &node->entries[pmap_index(node, slot)];
+    if (entry->child != NULL) {
+      node = entry->child;
+    } else if (entry->key == key) {
+      *value = entry->value;
+      return OK;
+    } else {
+      break;
+    }
+  }
+
+  return FAILED;
+}
+
+void avoc_pmap_transient(const avoc_pmap *map, avoc_pmap *builder) {
+  avoc_pmap_copy(map, builder);
+  builder->edit = ++transient_last_edit;
+}
+
+void avoc_pmap_persistent(avoc_pmap *builder) {
+  assert(builder != NULL);
+  builder->edit = 0L;
+}
+
+// Nodes are owned on the way down as in pvec_own_path(), and the key of an
+// entry in the way moves into a new child first: neither changes the keys
+// of the map, so only the last step does.
+avoc_status avoc_pmap_transient_put(avoc_pmap *builder, avoc_value key,
+                                    avoc_value value) {
+  assert(builder != NULL);
+  assert(builder->edit != 0);
+  const uint64_t hash = pmap_hash(key);
+  avoc_pmap_node **parent = &builder->root;
+  for (size_t shift = 0;; shift += PMAP_BITS) {
+    assert(shift < 64);
+    const uint32_t slot = pmap_slot(hash, shift);
+    avoc_pmap_node *node = *parent;
+    const int found = node != NULL && (node->bitmap & slot) != 0;
+    node = pmap_own(parent, builder->edit, found ? 0 : 1);
+    if (node == NULL) {
+      return FAILED;
+    }
+
+    pmap_entry *entry = &node->entries[pmap_index(node, slot)];
+    if (!found) {
+      memmove(entry + 1, entry,
+              (node->count - (size_t)(entry - node->entries)) *
+                  sizeof(pmap_entry));
+      entry->key = key;
+      entry->value = value;
+      entry->child = NULL;
+      node->bitmap |= slot;
+      node->count++;
+      builder->count++;
+      return OK;
+    } else if (entry->child == NULL && entry->key == key) {
+      entry->value = value;
+      return OK;
+    } else if (entry->child == NULL) {
+      avoc_pmap_node *child = pmap_node_new(builder->edit, 2);
+      if (child == NULL) {
+        return FAILED;
+      }
+
+      child->bitmap = pmap_slot(pmap_hash(entry->key), shift + PMAP_BITS);
+      child->count = 1;
+      child->entries[0] = *entry;
+      entry->child = child;
+    }
+
+    parent = &entry->child;
+  }
+}
+
+avoc_status avoc_pmap_put(const avoc_pmap *map, avoc_value key,
+                          avoc_value value, avoc_pmap *result) {
+  assert(map != result);
+  avoc_pmap_transient(map, result);
+  avoc_status status = avoc_pmap_transient_put(result, key, value);
+  avoc_pmap_persistent(result);
+  if (status != OK) {
+    avoc_pmap_free(result);
+  }
+
+  return status;
+}
+
+void avoc_module_graph_init(avoc_module_graph *graph) {
+  assert(graph != NULL);
+  graph->modules = NULL;
+  graph->count = 0L;
+  graph->cap = 0L;
+  graph->order = NULL;
+}
+
+avoc_status avoc_module_graph_add(avoc_module_graph *graph, const char *name,
+                                  const char *buf_data, size_t buf_len) {
+  assert(graph != NULL);
+  assert(name != NULL);
+  if (graph->count == graph->cap) {
+    size_t cap = graph->cap == 0 ? 8 : graph->cap * 2;
+    avoc_module *grown =
+        avoc_realloc(graph->modules, graph->cap * sizeof(avoc_module),
+                     cap * sizeof(avoc_module));
+    if (grown == NULL) {
+      return FAILED;
+    }
+
+    graph->modules = grown;
+    graph->cap = cap;
+  }
+
+  avoc_module *module = &graph->modules[graph->count];
+  if (avoc_source_init(&module->src, name, buf_data, buf_len) != OK) {
+    avoc_source_free(&module->src);
+    return FAILED;
+  }
+
+  graph->count++;
+  avoc_list_init(&module->tree);
+  module->source_hash = hash_mix(hash_bytes(0UL, buf_data, buf_len));
+  module->interface_hash = 0UL;
+  module->deps = NULL;
+  module->dep_count = 0L;
+  module->level = 0L;
+  module->dirty = 1;
+  module->reused = 0;
+  return OK;
+}
+
+static avoc_module *module_find(const avoc_module_graph *graph,
+                                const char *name, size_t len) {
+  for (size_t i = 0; i < graph->count; i++) {
+    const char *cur = graph->modules[i].src.name;
+    if (view_equal(cur, strlen(cur), name, len)) {
+      return &graph->modules[i];
+    }
+  }
+
+  return NULL;
+}
+
+// Finds the module name of a top level (import name) form, name is left
+// NULL for any other item.
+static avoc_status import_name(avoc_source *src, const avoc_item *item,
+                               const avoc_item **name) {
+  *name = NULL;
+  if (item->type != ITEM_CALL || item->as_list->head == NULL) {
+    return OK;
+  }
+
+  const avoc_item *head = item->as_list->head;
+  if (head->type != ITEM_SYM ||
+      !view_equal(head->as_sym, head->str_len, "import", 6)) {
+    return OK;
+  }
+
+  const avoc_item *arg = head->next_sibling;
+  if (arg == NULL || arg->next_sibling != NULL ||
+      (arg->type != ITEM_SYM && arg->type != ITEM_LIT_STR)) {
+    source_seek(src, (unsigned char *)head->as_sym - src->buf_data);
+    PRINT_ERROR(src, "import expects a module name");
+    return FAILED;
+  }
+
+  *name = arg;
+  return OK;
+}
+
+// Hash of what importers see of a module, the name and type of each top
+// level definition. Definitions without a type are hashed whole, as their
+// type comes from their value, and so are the interfaces of the imports,
+// as that value may use them. Those are hashed first in the build order.
+static uint64_t module_interface_hash(const avoc_module_graph *graph,
+                                      const avoc_module *module) {
+  uint64_t h = 0UL;
+  int untyped = 0;
+  for (const avoc_item *item = module->tree.head; item != NULL;
+       item = item->next_sibling) {
+    const avoc_item *head =
+        item->type == ITEM_CALL ? item->as_list->head : NULL;
+    if (head == NULL || head->type != ITEM_SYM ||
+        avoc_keyword_lookup(head->as_sym, head->str_len) != KEYWORD_DEF ||
+        head->next_sibling == NULL || head->next_sibling->type != ITEM_SYM) {
+      continue;
+    }
+
+    const avoc_item *name = head->next_sibling;
+    if (name->sym_ordinary_type != NULL || name->sym_composed_type != NULL) {
+      h = hash_mix(h + name->hash);
+    } else {
+      h = hash_mix(h + item->hash);
+      untyped = 1;
+    }
+  }
+
+  for (size_t d = 0; d < module->dep_count && untyped; d++) {
+    h = hash_mix(h + graph->modules[module->deps[d]].interface_hash);
+  }
+
+  return h;
+}
+
+// Takes the source and tree of the same module in the previous build when
+// its text did not change.
+static void module_reuse(avoc_module *module, avoc_module_graph *previous) {
+  if (previous == NULL || previous->order == NULL) {
+    return;
+  }
+
+  const char *name = module->src.name;
+  avoc_module *prev = module_find(previous, name, strlen(name));
+  if (prev == NULL || prev->source_hash != module->source_hash ||
+      !view_equal((char *)prev->src.buf_data, prev->src.buf_len,
+                  (char *)module->src.buf_data, module->src.buf_len)) {
+    return;
+  }
+
+  avoc_source src = module->src;
+  avoc_list tree = module->tree;
+  module->src = prev->src;
+  module->tree = prev->tree;
+  prev->src = src;
+  prev->tree = tree;
+  module->reused = 1;
+}
+
+// Parses a module and resolves its imports into indices of the graph.
+static avoc_status module_parse(avoc_module_graph *graph,
+                                avoc_module *module) {
+  avoc_status status =
+      module->reused ? OK : avoc_parse_source(&module->src, &module->tree);
+  if (status != OK) {
+    return status;
+  }
+
+  const avoc_item *name = NULL;
+  size_t count = 0L;
+  for (const avoc_item *item = module->tree.head; item != NULL;
+       item = item->next_sibling) {
+    if (import_name(&module->src, item, &name) != OK) {
+      return FAILED;
+    }
+
+    count += name != NULL;
+  }
+
+  if (count > 0) {
+    module->deps = avoc_calloc(count, sizeof(size_t));
+    if (module->deps == NULL) {
+      return FAILED;
+    }
+  }
+
+  for (const avoc_item *item = module->tree.head; item != NULL;
+       item = item->next_sibling) {
+    import_name(&module->src, item, &name);
+    if (name == NULL) {
+      continue;
+    }
+
+    const avoc_module *dep = module_find(graph, name->as_str, name->str_len);
+    if (dep == NULL) {
+      if (!name->str_owned) {
+        source_seek(&module->src,
+                    (unsigned char *)name->as_str - module->src.buf_data);
+      }
+
+      PRINT_ERRORF(&module->src, "unknown module: %.*s", (int)name->str_len,
+                   name->as_str);
+      avoc_free(module->deps, count * sizeof(size_t));
+      module->deps = NULL;
+      module->dep_count = 0L;
+      return FAILED;
+    }
+
+    module->deps[module->dep_count++] = dep - graph->modules;
+  }
+
+  return OK;
+}
+
+avoc_status avoc_module_graph_build(avoc_module_graph *graph,
+                                    avoc_module_graph *previous) {
+  assert(graph != NULL);
+  assert(graph->order == NULL);
+  const size_t count = graph->count;
+
+  for (size_t i = 0; i < count; i++) {
+    module_reuse(&graph->modules[i], previous);
+  }
+
+  if (previous != NULL) {
+    avoc_free(previous->order, (previous->count + 1) * sizeof(size_t));
+    previous->order = NULL;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (module_parse(graph, &graph->modules[i]) != OK) {
+      return FAILED;
+    }
+  }
+
+  size_t edges = 0L;
+  for (size_t i = 0; i < count; i++) {
+    edges += graph->modules[i].dep_count;
+  }
+
+  // Kahn's algorithm, importers of each module are stored contiguously
+  // from firsts[module] and pending counts the imports not sorted yet
+  size_t *firsts = avoc_calloc(count + 1, sizeof(size_t));
+  size_t *pending = avoc_calloc(count, sizeof(size_t));
+  size_t *importers = avoc_calloc(edges + 1, sizeof(size_t));
+  size_t *fill = avoc_calloc(count + 1, sizeof(size_t));
+  graph->order = avoc_calloc(count + 1, sizeof(size_t));
+  if (firsts == NULL || pending == NULL || importers == NULL || fill == NULL ||
+      graph->order == NULL) {
+    avoc_free(firsts, (count + 1) * sizeof(size_t));
+    avoc_free(pending, count * sizeof(size_t));
+    avoc_free(importers, (edges + 1) * sizeof(size_t));
+    avoc_free(fill, (count + 1) * sizeof(size_t));
+    avoc_free(graph->order, (count + 1) * sizeof(size_t));
+    graph->order = NULL;
+    return FAILED;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    const avoc_module *module = &graph->modules[i];
+    pending[i] = module->dep_count;
+    for (size_t d = 0; d < module->dep_count; d++) {
+      firsts[module->deps[d] + 1]++;
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    firsts[i + 1] += firsts[i];
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    const avoc_module *module = &graph->modules[i];
+    for (size_t d = 0; d < module->dep_count; d++) {
+      size_t dep = module->deps[d];
+      importers[firsts[dep] + fill[dep]++] = i;
+    }
+  }
+
+  size_t sorted = 0L;
+  for (size_t i = 0; i < count; i++) {
+    if (pending[i] == 0) {
+      graph->order[sorted++] = i;
+    }
+  }
+
+  for (size_t next = 0; next < sorted; next++) {
+    const avoc_module *module = &graph->modules[graph->order[next]];
+    size_t from = firsts[graph->order[next]];
+    size_t to = firsts[graph->order[next] + 1];
+    for (size_t e = from; e < to; e++) {
+      avoc_module *importer = &graph->modules[importers[e]];
+      if (importer->level < module->level + 1) {
+        importer->level = module->level + 1;
+      }
+
+      if (--pending[importers[e]] == 0) {
+        graph->order[sorted++] = importers[e];
+      }
+    }
+  }
+
+  // Unsorted modules have an unsorted import, following them long enough
+  // ends inside a cycle
+  avoc_status status = OK;
+  for (size_t i = 0; i < count && sorted < count; i++) {
+    if (pending[i] == 0) {
+      continue;
+    }
+
+    size_t cur = i;
+    for (size_t step = 0; step < count; step++) {
+      const avoc_module *module = &graph->modules[cur];
+      for (size_t d = 0; d < module->dep_count; d++) {
+        if (pending[module->deps[d]] > 0) {
+          cur = module->deps[d];
+          break;
+        }
+      }
+    }
+
+    PRINT_ERRORF(&graph->modules[cur].src, "import cycle through %s",
+                 graph->modules[cur].src.name);
+    status = FAILED;
+    break;
+  }
+
+  avoc_free(firsts, (count + 1) * sizeof(size_t));
+  avoc_free(pending, count * sizeof(size_t));
+  avoc_free(importers, (edges + 1) * sizeof(size_t));
+  avoc_free(fill, (count + 1) * sizeof(size_t));
+  if (status != OK) {
+    return status;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    avoc_module *module = &graph->modules[graph->order[i]];
+    module->interface_hash = module_interface_hash(graph, module);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    avoc_module *module = &graph->modules[i];
+    const char *name = module->src.name;
+    const avoc_module *prev =
+        previous != NULL ? module_find(previous, name, strlen(name)) : NULL;
+
+    module->dirty = prev == NULL || prev->source_hash != module->source_hash;
+    for (size_t d = 0; d < module->dep_count && !module->dirty; d++) {
+      const avoc_module *dep = &graph->modules[module->deps[d]];
+      const avoc_module *prev_dep =
+          module_find(previous, dep->src.name, strlen(dep->src.name));
+      module->dirty =
+          prev_dep == NULL || prev_dep->interface_hash != dep->interface_hash;
+    }
+  }
+
+  return OK;
+}
+
+void avoc_module_graph_free(avoc_module_graph *graph) {
+  assert(graph != NULL);
+  for (size_t i = 0; i < graph->count; i++) {
+    avoc_module *module = &graph->modules[i];
+    avoc_list_free(&module->tree);
+    avoc_source_free(&module->src);
+    avoc_free(module->deps, module->dep_count * sizeof(size_t));
+  }
+
+  avoc_free(graph->order, (graph->count + 1) * sizeof(size_t));
+  avoc_free(graph->modules, graph->cap * sizeof(avoc_module));
+  avoc_module_graph_init(graph);
+}
+
+#ifdef AVOCC_TRACE
+static avoc_trace_stats trace_stats;
+static avoc_phase trace_phase = AVOC_PHASES; // AVOC_PHASES: outside phases
+static uint64_t trace_last = 0L;
+static FILE *trace_out = NULL;
+static int trace_events = 0;
+
+// Cycles on x86, nanoseconds elsewhere.
+static uint64_t trace_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static uint64_t trace_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000UL + (uint64_t)ts.tv_nsec / 1000UL;
+}
+
+// Charges the time since the last switch to the running phase and makes
+// phase the running one, returns the phase that was running.
+static avoc_phase trace_switch(avoc_phase phase) {
+  uint64_t now = trace_ticks();
+  avoc_phase prev = trace_phase;
+  if (prev != AVOC_PHASES) {
+    trace_stats.phase_ticks[prev] += now - trace_last;
+  }
+
+  trace_phase = phase;
+  trace_last = now;
+  return prev;
+}
+
+static void trace_span(const char *name, const avoc_source *src,
+                       uint64_t start) {
+  if (trace_out == NULL) {
+    return;
+  }
+
+  uint64_t end = trace_now_us();
+  fprintf(trace_out,
+          "%s{\"name\":\"%s\",\"cat\":\"avocc\",\"ph\":\"X\",\"ts\":%lu,"
+          "\"dur\":%lu,\"pid\":1,\"tid\":1,\"args\":{\"file\":\"",
+          trace_events++ > 0 ? ",\n" : "", name, (unsigned long)start,
+          (unsigned long)(end - start));
+
+  for (const char *c = src->name != NULL ? src->name : ""; *c != 0; c++) {
+    if (*c == '"' || *c == '\\') {
+      fputc('\\', trace_out);
+      fputc(*c, trace_out);
+    } else if ((unsigned char)*c < 0x20) {
+      fprintf(trace_out, "\\u%04x", *c);
+    } else {
+      fputc(*c, trace_out);
+    }
+  }
+
+  fputs("\"}}", trace_out);
+}
+
+void avoc_trace_open(FILE *out) {
+  assert(out != NULL);
+  trace_out = out;
+  trace_events = 0;
+  fputs("[\n", out);
+}
+
+void avoc_trace_close(void) {
+  if (trace_out != NULL) {
+    fputs("\n]\n", trace_out);
+    trace_out = NULL;
+  }
+}
+
+void avoc_get_trace_stats(avoc_trace_stats *stats) {
+  assert(stats != NULL);
+  *stats = trace_stats;
+}
+
+void avoc_reset_trace_stats(void) {
+  memset(&trace_stats, 0L, sizeof(trace_stats));
+}
+
+avoc_status avoc_next_token_untraced(avoc_source *src, avoc_token *token);
+avoc_status avoc_parse_lit_untraced(avoc_source *src, avoc_token *token,
+                                    avoc_item *item);
+avoc_status avoc_parse_sym_untraced(avoc_source *src, avoc_token *token,
+                                    avoc_item *item);
+avoc_status avoc_parse_list_untraced(avoc_source *src, avoc_token *token,
+                                     avoc_list *list, avoc_token_type term);
+
+avoc_status avoc_next_token(avoc_source *src, avoc_token *token) {
+  avoc_phase prev = trace_switch(AVOC_PHASE_LEX);
+  avoc_status status = avoc_next_token_untraced(src, token);
+  trace_stats.phase_calls[AVOC_PHASE_LEX]++;
+  trace_stats.token_counts[token->type]++;
+  trace_switch(prev);
+  return status;
+}
+
+avoc_status avoc_parse_lit(avoc_source *src, avoc_token *token,
+                           avoc_item *item) {
+  avoc_phase prev = trace_switch(AVOC_PHASE_LIT);
+  avoc_status status = avoc_parse_lit_untraced(src, token, item);
+  trace_stats.phase_calls[AVOC_PHASE_LIT]++;
+  trace_switch(prev);
+  return status;
+}
+
+avoc_status avoc_parse_sym(avoc_source *src, avoc_token *token,
+                           avoc_item *item) {
+  avoc_phase prev = trace_switch(AVOC_PHASE_SYM);
+  avoc_status status = avoc_parse_sym_untraced(src, token, item);
+  trace_stats.phase_calls[AVOC_PHASE_SYM]++;
+  trace_switch(prev);
+  return status;
+}
+
+avoc_status avoc_parse_list(avoc_source *src, avoc_token *token,
+                            avoc_list *list, avoc_token_type term) {
+  avoc_phase prev = trace_switch(AVOC_PHASE_LIST);
+  avoc_status status = avoc_parse_list_untraced(src, token, list, term);
+  trace_stats.phase_calls[AVOC_PHASE_LIST]++;
+  trace_switch(prev);
+  return status;
+}
+#endif
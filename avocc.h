@@ -2,14 +2,17 @@
 #define AVOCC_H
 
 #include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
 #include <stdio.h>  // fprintf()
+#include <string.h> // memcpy()
 
 // Contains the state of a source code buffer
 typedef struct _avoc_source {
   unsigned char *buf_data;
-  size_t buf_len; // Buffer total length
-  size_t buf_pos; // Cursor position (two by two code points)
-  size_t cur_pos; // Current code point position
+  size_t buf_len;  // Buffer total length
+  short buf_owned; // buf_data is a copy released by avoc_source_free
+  size_t buf_pos;  // Cursor position (two by two code points)
+  size_t cur_pos;  // Current code point position
 
   int cur_cp; // Current code point value
   int nxt_cp; // Next code point value
@@ -17,9 +20,18 @@ typedef struct _avoc_source {
   long cur_cp_pos; // Current codepoint position
   long nxt_cp_pos; // Next codepoint position
 
-  size_t row;
-  size_t col;
   char *name;
+
+  size_t *line_starts; // Offset of each line, built on the first lookup
+  size_t line_count;   // Number of lines in line_starts
+  size_t line_cap;     // Capacity of line_starts
+
+  char *str_buf;  // Unescaped contents of the last string token with escapes
+  size_t str_cap; // Capacity of str_buf
+
+  struct _avoc_cons_table *cons; // Shared lists, see avoc_parse_source_shared
+  size_t depth;                  // Nesting of the lists being parsed
+  size_t tok_end;                // End of the token before the current one
 } avoc_source;
 
 // Function result status
@@ -42,6 +54,21 @@ typedef enum {
   TOKEN_COMMENT,
 } avoc_token_type;
 
+// Reserved identifiers, the literals and the special forms
+typedef enum {
+  KEYWORD_NONE,
+  KEYWORD_TRUE,
+  KEYWORD_FALSE,
+  KEYWORD_NIL,
+  KEYWORD_DEF,
+  KEYWORD_FN,
+  KEYWORD_IF,
+  KEYWORD_LET,
+  KEYWORD_DO,
+  KEYWORD_QUOTE,
+  KEYWORD_MACRO,
+} avoc_keyword;
+
 // Token reference
 typedef struct _avoc_token {
   avoc_token_type type; // Type of this token
@@ -67,6 +94,7 @@ typedef struct _avoc_item {
     ITEM_SYM,
     ITEM_CALL,
     ITEM_COMMENT,
+    ITEM_LAZY, // Unparsed top level form, as_str is a view of its text
   } type;
 
   union {
@@ -83,22 +111,257 @@ typedef struct _avoc_item {
     struct _avoc_list *as_call;
   };
 
+  // Symbols, comments and strings without escape sequences are views into
+  // the source buffer, so they are not NUL terminated and the source must
+  // outlive the item. Unescaped strings and materialized items own a NUL
+  // terminated copy instead.
+  size_t str_len;  // Length of as_str/as_sym
+  short str_owned; // as_str/as_sym and sym_ordinary_type are heap copies
+
   struct _avoc_list
       *sym_composed_type;  // Composed type definition. i.e. a::(T ...)
   char *sym_ordinary_type; // Ordinary type definition i.e. a::T
+  size_t sym_ordinary_type_len;
 
   struct _avoc_item
       *next_sibling; // when used as item, this is the next element
   struct _avoc_item
       *prev_sibling; // when used as item, this is the next element
+
+  uint64_t hash; // Structural hash of the item and its children
+
+  size_t offset; // First byte of the item in its source
+  size_t length; // Bytes of source the item spans, children included
 } avoc_item;
 
 typedef struct _avoc_list {
   struct _avoc_item *head;
   struct _avoc_item *tail;
   size_t item_count;
+  uint64_t hash; // Structural hash of the items, updated on each push
+  size_t refs;   // Items pointing to this list, see avoc_parse_source_shared
+  int item_type; // Type shared by all the items, -1 when mixed or empty
 } avoc_list;
 
+#define AVOC_ITEM_KINDS (ITEM_LAZY + 1)
+
+// Memory hooks used for every allocation of sources and trees. The size of
+// a block is passed back when it is resized or released, so arenas and
+// pools do not need to keep headers.
+typedef struct _avoc_allocator {
+  void *(*alloc_fn)(void *ctx, size_t size);
+  void *(*realloc_fn)(void *ctx, void *ptr, size_t old_size, size_t new_size);
+  void (*free_fn)(void *ctx, void *ptr, size_t size);
+  void *ctx;
+} avoc_allocator;
+
+// Counters of the allocations made through the hooks
+typedef struct _avoc_alloc_stats {
+  size_t alloc_count;  // Allocations, resizes included
+  size_t free_count;   // Releases
+  size_t bytes_in_use; // Bytes currently allocated
+  size_t peak_bytes;   // Highest bytes_in_use since the last reset
+} avoc_alloc_stats;
+
+// Memory used by a parse tree, see avoc_list_stats()
+typedef struct _avoc_tree_stats {
+  size_t item_kinds[AVOC_ITEM_KINDS]; // Items per ITEM_* kind
+  size_t item_count;                  // Items
+  size_t list_count;                  // Child lists, the root is not counted
+  size_t item_bytes;                  // Bytes of the items
+  size_t list_bytes;                  // Bytes of the child lists
+  size_t str_bytes;                   // Owned strings and comments
+  size_t sym_bytes;                   // Owned symbols and type names
+  size_t view_bytes;                  // Bytes referenced in the source buffer
+} avoc_tree_stats;
+
+// What a traversal does after visiting an item, see avoc_list_visit()
+typedef enum {
+  AVOC_VISIT_NEXT, // Go on into the children of the item
+  AVOC_VISIT_SKIP, // Go on without the children of the item
+  AVOC_VISIT_STOP, // End the traversal
+} avoc_visit;
+
+// Visitor callback, depth is 0 for the items of the visited list.
+typedef avoc_visit (*avoc_visit_fn)(void *ctx, const avoc_item *item,
+                                    size_t depth);
+
+// Most ?name symbols a query pattern can have
+#define AVOC_QUERY_MAX_CAPTURES 16
+
+// A tree pattern, see avoc_query_init()
+typedef struct _avoc_query {
+  avoc_source src;      // Pattern text
+  avoc_item pattern;    // Parsed pattern
+  size_t depth;         // Nesting of the lists of the pattern
+  size_t capture_count; // ?name symbols of the pattern
+} avoc_query;
+
+// An item matching a query, see avoc_query_run()
+typedef struct _avoc_match {
+  size_t query;          // Index of the query
+  const avoc_item *item; // Matching item
+  size_t depth;          // Depth of the item in the tree
+  const avoc_item *captures[AVOC_QUERY_MAX_CAPTURES]; // In pattern order
+} avoc_match;
+
+// Match callback, SKIP leaves out the children of the item for every query.
+typedef avoc_visit (*avoc_match_fn)(void *ctx, const avoc_match *match);
+
+// Deepest nesting of macro calls expanding into macro calls
+#define AVOC_MAX_EXPANSION 256
+
+// Counters of the expansions done by an expander
+typedef struct _avoc_expand_stats {
+  size_t macros;       // Macros defined
+  size_t expansions;   // Macro calls replaced by their expansion
+  size_t cache_hits;   // Expansions taken from the cache
+  size_t output_items; // Items built by the expansions missing the cache
+} avoc_expand_stats;
+
+// Macros and the expansions they produced, see avoc_expand()
+typedef struct _avoc_expander {
+  struct _avoc_symbol *symbols;  // Interned names and strings
+  size_t symbol_count;           // Used slots of symbols
+  size_t symbol_cap;             // Power of two
+  struct _avoc_macro *macros;    // Defined macros
+  size_t macro_count;            // Number of macros
+  size_t macro_cap;              // Capacity of macros
+  struct _avoc_expansion *cache; // Expansions by hash of their call
+  size_t cache_count;            // Used slots of cache
+  size_t cache_cap;              // Power of two
+  size_t gensym;                 // Numbers the renamed symbols
+  avoc_expand_stats stats;
+} avoc_expander;
+
+// Element types of an avoc_array, named after the item types they pack
+typedef enum {
+  AVOC_ARRAY_U32 = ITEM_LIT_U32,
+  AVOC_ARRAY_U64 = ITEM_LIT_U64,
+  AVOC_ARRAY_I32 = ITEM_LIT_I32,
+  AVOC_ARRAY_I64 = ITEM_LIT_I64,
+  AVOC_ARRAY_F32 = ITEM_LIT_F32,
+  AVOC_ARRAY_F64 = ITEM_LIT_F64,
+} avoc_array_kind;
+
+// Packed elements of a list of numbers of a single type, see
+// avoc_array_from_list()
+typedef struct _avoc_array {
+  avoc_array_kind kind; // Type of every element
+  size_t count;         // Number of elements
+  void *data;           // unsigned, unsigned long, int, long, float or double
+} avoc_array;
+
+// Element-wise operations, see avoc_array_map()
+typedef enum {
+  AVOC_ARRAY_ADD,
+  AVOC_ARRAY_SUB,
+  AVOC_ARRAY_MUL,
+  AVOC_ARRAY_DIV,
+} avoc_array_op;
+
+// Reductions, see avoc_array_reduce()
+typedef enum {
+  AVOC_ARRAY_SUM,
+  AVOC_ARRAY_MIN,
+  AVOC_ARRAY_MAX,
+} avoc_array_reduction;
+
+// Vector instructions used by the array kernels
+typedef enum {
+  AVOC_SIMD_NONE,
+  AVOC_SIMD_SSE2,
+  AVOC_SIMD_AVX2,
+} avoc_simd;
+
+// Predicate of avoc_array_pfilter(), elem points to an element of the array
+// kind. It is called from every thread of the pool at once.
+typedef int (*avoc_array_pred)(void *ctx, const void *elem);
+
+// Threads running the parallel array kernels, see avoc_pool_new()
+typedef struct _avoc_pool avoc_pool;
+
+// Output sink of the formatter, returns the number of bytes written.
+typedef size_t (*avoc_write_fn)(void *ctx, const char *data, size_t len);
+
+// Layout of the formatted source, see avoc_format_options_init()
+typedef struct _avoc_format_options {
+  size_t width;  // Preferred maximum line width, in codepoints
+  size_t indent; // Spaces per nesting level
+} avoc_format_options;
+
+// A source file of a module graph, named after the module. Top level
+// (import name) forms refer to other modules of the same graph.
+typedef struct _avoc_module {
+  avoc_source src;         // Source text, the name is the module name
+  avoc_list tree;          // Parse tree
+  uint64_t source_hash;    // Hash of the source text
+  uint64_t interface_hash; // Hash of the top level definitions
+  size_t *deps;            // Indices of the imported modules
+  size_t dep_count;        // Number of imported modules
+  size_t level;            // 0 without imports, otherwise 1 + deepest import
+  short dirty;             // Needs rebuilding since the previous build
+  short reused;            // Tree taken from the previous build, not parsed
+} avoc_module;
+
+// Modules and the order they build in, see avoc_module_graph_build()
+typedef struct _avoc_module_graph {
+  avoc_module *modules;
+  size_t count;
+  size_t cap;
+  size_t *order; // Indices of the modules, dependencies first
+} avoc_module_graph;
+
+// One word runtime value. Doubles are stored as they are, every other kind
+// lives in the payload of a quiet NaN:
+//
+//   f64      any double, NaNs are canonicalized to 0x7FF8000000000000
+//   i32      0x7FFD 0000 XXXX XXXX
+//   nil      0x7FFE 0000 0000 0000
+//   bool     0x7FFF 0000 0000 000X
+//   pointer  0xFFFC XXXX XXXX XXXX (48 bits address)
+typedef uint64_t avoc_value;
+
+#define AVOC_VALUE_QNAN 0x7FFC000000000000UL
+#define AVOC_VALUE_SIGN 0x8000000000000000UL
+#define AVOC_VALUE_TAG_MASK 0xFFFF000000000000UL
+#define AVOC_VALUE_TAG_I32 0x7FFD000000000000UL
+#define AVOC_VALUE_TAG_NIL 0x7FFE000000000000UL
+#define AVOC_VALUE_TAG_BOL 0x7FFF000000000000UL
+#define AVOC_VALUE_TAG_PTR (AVOC_VALUE_SIGN | AVOC_VALUE_QNAN)
+#define AVOC_VALUE_NAN 0x7FF8000000000000UL
+
+// Branching of the persistent vector trie, bits of the index per level
+#define AVOC_PVEC_BITS 5
+#define AVOC_PVEC_WIDTH (1 << AVOC_PVEC_BITS)
+
+// Persistent vector of values, a trie of AVOC_PVEC_WIDTH wide nodes and a
+// tail leaf with the last elements, see avoc_pvec_push(). Updates copy the
+// nodes on the path to the element and share the others with the vector
+// they come from. Nodes are reference counted, every vector is freed apart.
+typedef struct _avoc_pvec {
+  struct _avoc_pvec_node *root; // NULL while the tail holds every element
+  struct _avoc_pvec_node *tail; // Last 1 to AVOC_PVEC_WIDTH elements
+  size_t count;                 // Number of elements
+  size_t shift;                 // Index bits below the root level
+  size_t edit; // Transient owning the nodes it changes in place, 0 if none
+} avoc_pvec;
+
+// Persistent singly linked list of values, lists consing onto another share
+// its cells, see avoc_plist_cons().
+typedef struct _avoc_plist {
+  struct _avoc_plist_cell *head; // NULL when empty
+  size_t count;                  // Number of elements
+} avoc_plist;
+
+// Persistent hash map between values, a hash array mapped trie of 32 wide
+// nodes sharing them as avoc_pvec does, see avoc_pmap_put().
+typedef struct _avoc_pmap {
+  struct _avoc_pmap_node *root; // NULL when empty
+  size_t count;                 // Number of keys
+  size_t edit; // Transient owning the nodes it changes in place, 0 if none
+} avoc_pmap;
+
 __attribute__((unused)) static const char *token_type_names[] = {
     "EOF",          "EOL",          "COLON",   "TOKEN_LIST_S", "TOKEN_LIST_E",
     "TOKEN_CALL_S", "TOKEN_CALL_E", "NIL",     "LIT_NUM",      "LIT_STR",
@@ -107,27 +370,69 @@ __attribute__((unused)) static const char *token_type_names[] = {
 
 #define UTF8_END (-1)
 #define UTF8_ERROR (-2)
-#define PRINT_ERROR(src, msg)                                                  \
-  fprintf(stderr, "%s:%ld:%ld: " msg "\n", (src)->name, (src)->row, (src)->col)
+#define PRINT_ERROR(src, msg) PRINT_ERRORF(src, msg "%s", "")
+
+// Deepest list nesting accepted by the parser, which recurses on each level
+#define AVOC_MAX_DEPTH 2048
 
+// Building with AVOCC_QUIET drops the error messages, i.e. for fuzzing
+#ifdef AVOCC_QUIET
 #define PRINT_ERRORF(src, msg, ...)                                            \
-  fprintf(stderr, "%s:%ld:%ld: " msg "\n", (src)->name, (src)->row,            \
-          (src)->col, __VA_ARGS__)
+  do {                                                                         \
+    (void)(src);                                                               \
+  } while (0)
+#else
+#define PRINT_ERRORF(src, msg, ...)                                            \
+  do {                                                                         \
+    size_t err_row, err_col;                                                   \
+    avoc_source_position((src), (size_t)(src)->cur_cp_pos, &err_row,           \
+                         &err_col);                                            \
+    fprintf(stderr, "%s:%zu:%zu: " msg "\n", (src)->name, err_row, err_col,    \
+            __VA_ARGS__);                                                      \
+  } while (0)
+#endif
 
 #define PRINT_UNEXPECTED_CHAR_ERROR(src, expected, given)                      \
-  fprintf(stderr,                                                              \
-          "%s:%ld:%ld: unexpected character, expected: %c, given: %c\n",       \
-          (src)->name, (src)->row, (src)->col, token_type_names[(expected)],   \
-          token_type_names[(given)])
+  PRINT_ERRORF(src, "unexpected character, expected: %c, given: %c",           \
+               (expected), (given))
 
 #define PRINT_UNEXPECTED_TOKEN_ERROR(src, expected, given)                     \
-  fprintf(stderr, "%s:%ld:%ld: unexpected token, expected: %s, given: %s\n",   \
-          (src)->name, (src)->row, (src)->col, token_type_names[(expected)],   \
-          token_type_names[(given)])
+  PRINT_ERRORF(src, "unexpected token, expected: %s, given: %s",               \
+               token_type_names[(expected)], token_type_names[(given)])
+
+// Replaces the memory hooks, NULL restores malloc(), realloc() and free().
+// Whatever is allocated must be released with the same hooks.
+void avoc_set_allocator(const avoc_allocator *alloc);
+
+// Copies the allocation counters into stats.
+void avoc_get_alloc_stats(avoc_alloc_stats *stats);
+
+// Clears the allocation counters, the peak starts from the bytes in use.
+void avoc_reset_alloc_stats(void);
+
+// Allocates memory through the hooks, items and lists built by hand must be
+// allocated with it to be released by avoc_list_free().
+void *avoc_malloc(size_t size);
 
-// Initializes a source copying the values into memory.
-void avoc_source_init(avoc_source *src, const char *name, const char *buf_data,
-                      size_t buf_len);
+// Releases memory allocated through the hooks, size is the allocated size.
+void avoc_free(void *ptr, size_t size);
+
+// Initializes a source copying the values into memory. Fails when out of
+// memory, leaving a source avoc_source_free() accepts.
+avoc_status avoc_source_init(avoc_source *src, const char *name,
+                             const char *buf_data, size_t buf_len);
+
+// Initializes a source over buf_data without copying it, the buffer must
+// outlive the source and is not released by avoc_source_free. Fails when
+// the name cannot be copied.
+avoc_status avoc_source_init_view(avoc_source *src, const char *name,
+                                  const char *buf_data, size_t buf_len);
+
+// Computes the 1-based row and column (in codepoints) of a byte offset. The
+// line index is built on the first call, lookups are O(log lines) plus the
+// length of the line up to offset.
+void avoc_source_position(avoc_source *src, size_t offset, size_t *row,
+                          size_t *col);
 
 // Initializes a token setting its value to zero.
 void avoc_token_init(avoc_token *token);
@@ -138,23 +443,36 @@ void avoc_item_init(avoc_item *item);
 // Initializes a list
 void avoc_list_init(avoc_list *list);
 
+// Replaces the string, symbol or ordinary type views of this item by owned
+// NUL terminated copies. The copy is shallow: child lists, composed types and
+// lazy items keep their views, so only this item's own strings stop depending
+// on the source buffer. Fails leaving the item untouched when out of memory.
+avoc_status avoc_item_materialize(avoc_item *item);
+
 // Frees the resources of a src without freeing the src itself.
 void avoc_source_free(avoc_source *src);
 
 // Frees the resources of an item without freeing the item itself.
 void avoc_item_free(avoc_item *item);
 
-// Frees the resources of an list without freeing the list itself.
+// Frees the resources of an list without freeing the list itself, nested
+// lists are released using constant stack space. Shared nested lists are
+// only released with their last reference.
 void avoc_list_free(avoc_list *list);
 
 // Moves forward into the buffer, storing cur_cp and nxt_cp.
 int avoc_source_fwd(avoc_source *src);
 
+// Classifies an identifier, KEYWORD_NONE if it is not a keyword. Uses a
+// perfect hash, so it costs one hash and one comparison.
+avoc_keyword avoc_keyword_lookup(const char *str, size_t len);
+
 // Get a token from the current position of the buffer (in src, out token)
 avoc_status avoc_next_token(avoc_source *src, avoc_token *token);
 
 // Pushes an item into the dest list, the item must be an initialized valid
-// memory address.
+// memory address. The hash of the list is updated with the one of the item,
+// so the item must be complete when pushed.
 void avoc_list_push(avoc_list *dest, avoc_item *item);
 
 // Merges the right list into the left keeping its order as argumented.
@@ -183,4 +501,422 @@ avoc_status avoc_parse_list(avoc_source *src, avoc_token *token,
 // Parse a source.
 avoc_status avoc_parse_source(avoc_source *src, avoc_list *list);
 
+// Computes the node counts and memory used by the tree under list. Shared
+// lists are counted once per reference. Fails when out of memory.
+avoc_status avoc_list_stats(const avoc_list *list, avoc_tree_stats *stats);
+
+// Parse a source lazily, top level forms are only lexed to find their
+// matching bracket and stored as ITEM_LAZY items, see avoc_item_force.
+avoc_status avoc_parse_source_lazy(avoc_source *src, avoc_list *list);
+
+// Parse a source sharing identical subtrees. Child lists with the same
+// structure are parsed once and referenced by every item containing them,
+// so the tree must be treated as immutable. Items are hashed bottom-up and
+// compared shallowly, as their children are already shared.
+avoc_status avoc_parse_source_shared(avoc_source *src, avoc_list *list);
+
+// Parses a lazy item in place turning it into an ITEM_CALL, other items are
+// left untouched. The source must be the one the item was parsed from. The
+// hash of the item is recomputed, the hash and item type of the list holding
+// it are not.
+avoc_status avoc_item_force(avoc_source *src, avoc_item *item);
+
+// Innermost item of the tree under list whose span contains offset, NULL if
+// there is none.
+const avoc_item *avoc_item_at(const avoc_list *list, size_t offset);
+
+// Replaces removed bytes at offset by len bytes of text and parses again
+// only the top level forms the edit touches. The items of the other forms
+// are kept, moved to the new buffer, which is owned by src from then on.
+// list must be the tree parsed from src and not shared. When the touched
+// forms no longer parse the text is still applied, they are replaced by one
+// ITEM_LAZY item spanning them, whose avoc_item_force() reports the error,
+// and FAILED is returned. A later edit touching that item parses it again.
+// Only when out of memory are src and list left as they were.
+avoc_status avoc_source_edit(avoc_source *src, avoc_list *list, size_t offset,
+                             size_t removed, const char *text, size_t len);
+
+// Walks the tree under list in depth first order without recursion. pre is
+// called before the children of an item and post after them, or right after
+// pre when they are skipped. Either one can be NULL. The next sibling is
+// prefetched while the children of an item are visited. Lazy items have no
+// children. Returns AVOC_VISIT_STOP if a callback stopped the traversal or
+// the stack of pending lists ran out of memory, AVOC_VISIT_NEXT otherwise.
+avoc_visit avoc_list_visit(const avoc_list *list, avoc_visit_fn pre,
+                           avoc_visit_fn post, void *ctx);
+
+// Compiles a pattern, a single item written in the language. Items of the
+// pattern match items of the same kind and value, lists item by item, but
+// for these symbols:
+//
+//   _       any item
+//   ?name   any item, captured in the order it appears in the pattern
+//   ...     the rest of a list, zero or more items
+//
+// A pattern symbol without type matches the symbols of the same name with
+// any type or none. name:T requires the type T, name:_ any type, name:?t
+// captures the typed symbol and name:(T ...) matches composed types, i.e.
+// (def ?name:_ ...) finds the typed definitions. Comments are ignored on
+// both sides. Fails if the pattern does not parse.
+avoc_status avoc_query_init(avoc_query *query, const char *pattern,
+                            size_t len);
+
+// Frees the resources of a query without freeing the query itself.
+void avoc_query_free(avoc_query *query);
+
+// Matches count queries against every item of the tree under list in a
+// single traversal, calling match_fn in depth first order for each item and
+// query that match. The traversal stops when match_fn returns
+// AVOC_VISIT_STOP, which is then returned, as when out of memory.
+avoc_visit avoc_query_run(const avoc_list *list, const avoc_query *queries,
+                          size_t count, avoc_match_fn match_fn, void *ctx);
+
+// Initializes an expander without macros.
+void avoc_expander_init(avoc_expander *exp);
+
+// Frees the macros, symbols and cached expansions of an expander without
+// freeing the expander itself.
+void avoc_expander_free(avoc_expander *exp);
+
+// Defines the macros of the top level (macro name [params] template) forms
+// of list, removing them, and replaces every call to a macro by its
+// expansion. The macros stay defined in exp for the next lists.
+//
+// Templates are copied as they are but for ,param symbols, replaced by the
+// argument, and ,@rest symbols, replaced by the arguments bound by a final
+// & rest parameter. Names bound by let and fn forms of a template are
+// renamed on each expansion, i.e. tmp becomes tmp#3, skipping numbers that
+// give a name spelled in the program, so they never capture the symbols of
+// the arguments. Expansions are expanded again, outside in.
+//
+// Expansions are cached by the structural hash of the call, so identical
+// calls share the lists of a single expansion, which must be treated as
+// immutable. The items inside a shared expansion keep the span of the first
+// call, only the expanded call item itself spans each call. Defining a macro
+// empties the cache. Expanded items reference the strings of exp, so it must
+// outlive the tree. The hashes of the lists holding expanded calls are
+// updated. list must not be shared nor lazy.
+avoc_status avoc_expand(avoc_expander *exp, avoc_source *src, avoc_list *list);
+
+// Sets the default formatting options, 80 columns and 2 spaces.
+void avoc_format_options_init(avoc_format_options *opts);
+
+// Writes the tree under list in canonical form, one top level form per line.
+// Lists are written in a single line when they fit, otherwise each element
+// after the first goes in its own line. This is a fit or break choice made
+// per list, greedily from the outside in, rather than the group and nest
+// document algebra of Wadler's printer: a broken list never tries to pack
+// several children in a line. Output is buffered and passed to write_fn in
+// large blocks, opts can be NULL to use the defaults. Fails when writing
+// fails or an item is an infinite or NaN float, which has no literal.
+avoc_status avoc_format_list(const avoc_list *list,
+                             const avoc_format_options *opts,
+                             avoc_write_fn write_fn, void *ctx);
+
+// avoc_write_fn writing to the FILE * in ctx.
+size_t avoc_file_write(void *ctx, const char *data, size_t len);
+
+// Writes the tree under list as a snapshot, a relocatable image holding no
+// pointers. Loading it skips lexing and parsing, i.e. for a large prelude.
+// Fails without writing anything when list holds ITEM_LAZY forms, as they
+// could not be forced once loaded: force them or parse eagerly first.
+avoc_status avoc_snapshot_write(const avoc_list *list, avoc_write_fn write_fn,
+                                void *ctx);
+
+// Rebuilds a tree from a snapshot image into the empty list. Strings,
+// symbols and comments are views into the image as they are into the source
+// when parsing, so the image must outlive the tree: it can be a read only
+// mapping of the snapshot file. Loading is not map-and-use though: every
+// item and list is still allocated and linked, only the lexer and parser are
+// skipped. Hashes are computed again and corrupt images fail without leaving
+// any item in list.
+avoc_status avoc_snapshot_load(const void *image, size_t len,
+                               avoc_list *list);
+
+// Packs the items of list into array, which must be released with
+// avoc_array_free(). Fails unless every item is a literal of the same integer
+// or floating point type, as tracked by avoc_list.item_type, so empty lists
+// fail too.
+avoc_status avoc_array_from_list(const avoc_list *list, avoc_array *array);
+
+// Initializes an array of count zeroed elements. Fails when out of memory,
+// leaving an empty array.
+avoc_status avoc_array_init(avoc_array *array, avoc_array_kind kind,
+                            size_t count);
+
+// Releases the elements of array.
+void avoc_array_free(avoc_array *array);
+
+// Applies op to each pair of elements of a and b into dest, a new array.
+// Both must have the same kind and count. Integers wrap around on overflow,
+// so the minimum signed integer divided by -1 gives itself. Integer division
+// fails without creating dest when any element of b is zero.
+avoc_status avoc_array_map(const avoc_array *a, const avoc_array *b,
+                           avoc_array_op op, avoc_array *dest);
+
+// Reduces array into result, a literal item of the array kind. The sum of an
+// empty array is zero, its minimum and maximum fail. Floating point sums are
+// added in a different order depending on the vector instructions in use,
+// integer ones wrap around in any order.
+avoc_status avoc_array_reduce(const avoc_array *array, avoc_array_reduction op,
+                              avoc_item *result);
+
+// Sum of the products of the elements of a and b into result, as the sum of
+// avoc_array_reduce().
+avoc_status avoc_array_dot(const avoc_array *a, const avoc_array *b,
+                           avoc_item *result);
+
+// Limits the array kernels to simd, by default they use the best supported by
+// the CPU. Returns the level in use, lower than simd when it is unsupported.
+avoc_simd avoc_array_set_simd(avoc_simd simd);
+
+// Starts a pool of threads workers, the thread calling the parallel kernels
+// being one of them, so 1 starts no thread. NULL when out of memory or when
+// a thread cannot be started. Workers split the arrays into chunks and take
+// them from each other when they run out, so uneven chunks balance out.
+// Only the calling thread allocates, with the allocator set at the time.
+avoc_pool *avoc_pool_new(size_t threads);
+
+// Stops the threads of pool and releases it.
+void avoc_pool_free(avoc_pool *pool);
+
+// Number of workers of pool, including the calling thread.
+size_t avoc_pool_threads(const avoc_pool *pool);
+
+// avoc_array_map() run by the workers of pool over chunks of a and b. Only
+// one kernel runs on a pool at a time.
+avoc_status avoc_array_pmap(avoc_pool *pool, const avoc_array *a,
+                            const avoc_array *b, avoc_array_op op,
+                            avoc_array *dest);
+
+// avoc_array_reduce() run by the workers of pool, each chunk being reduced
+// first. Floating point sums then depend on how the chunks were spread.
+avoc_status avoc_array_preduce(avoc_pool *pool, const avoc_array *array,
+                               avoc_array_reduction op, avoc_item *result);
+
+// Makes dest a new array of the elements of array for which keep is true, in
+// the same order. The workers of pool test chunks of array then copy the
+// kept elements of each chunk to where the previous chunks end.
+avoc_status avoc_array_pfilter(avoc_pool *pool, const avoc_array *array,
+                               avoc_array_pred keep, void *ctx,
+                               avoc_array *dest);
+
+// Initializes an empty persistent vector.
+void avoc_pvec_init(avoc_pvec *vec);
+
+// Releases the nodes of vec no other vector shares and empties it.
+void avoc_pvec_free(avoc_pvec *vec);
+
+// Makes copy a vector sharing every node of vec, which must not be transient.
+void avoc_pvec_copy(const avoc_pvec *vec, avoc_pvec *copy);
+
+// Element at index, which must be lower than the count of vec.
+avoc_value avoc_pvec_get(const avoc_pvec *vec, size_t index);
+
+// Makes result a new vector equal to vec but for the element at index,
+// which must be lower than the count. vec is left untouched and must not be
+// transient nor result. On failure result is left empty.
+avoc_status avoc_pvec_set(const avoc_pvec *vec, size_t index, avoc_value value,
+                          avoc_pvec *result);
+
+// Makes result a new vector of the elements of vec followed by value, as
+// avoc_pvec_set().
+avoc_status avoc_pvec_push(const avoc_pvec *vec, avoc_value value,
+                           avoc_pvec *result);
+
+// Makes builder a transient copy of vec, changed in place by
+// avoc_pvec_transient_set() and avoc_pvec_transient_push(), which copy the
+// nodes shared with vec once and then reuse them. vec is left untouched.
+void avoc_pvec_transient(const avoc_pvec *vec, avoc_pvec *builder);
+
+// Sets the element at index of the transient builder. On failure builder
+// keeps its elements.
+avoc_status avoc_pvec_transient_set(avoc_pvec *builder, size_t index,
+                                    avoc_value value);
+
+// Appends value to the transient builder. On failure builder keeps its
+// elements.
+avoc_status avoc_pvec_transient_push(avoc_pvec *builder, avoc_value value);
+
+// Ends the transient builder, which becomes a persistent vector.
+void avoc_pvec_persistent(avoc_pvec *builder);
+
+// Makes vec a persistent vector of the items of list, converted with
+// avoc_value_from_item() so nested lists are boxed pointers to their items.
+// On failure vec is left empty.
+avoc_status avoc_pvec_from_list(const avoc_list *list, avoc_pvec *vec);
+
+// Initializes an empty persistent list.
+void avoc_plist_init(avoc_plist *list);
+
+// Releases the cells of list no other list shares and empties it.
+void avoc_plist_free(avoc_plist *list);
+
+// Makes copy a list sharing every cell of list.
+void avoc_plist_copy(const avoc_plist *list, avoc_plist *copy);
+
+// Makes result a new list of value followed by the elements of list, which
+// is left untouched and must not be result. On failure result is left empty.
+avoc_status avoc_plist_cons(const avoc_plist *list, avoc_value value,
+                            avoc_plist *result);
+
+// First element of list, which must not be empty.
+avoc_value avoc_plist_first(const avoc_plist *list);
+
+// Makes rest a list sharing the cells of list but its first, which must not
+// be empty. It allocates nothing.
+void avoc_plist_rest(const avoc_plist *list, avoc_plist *rest);
+
+// Makes result a persistent list of the items of list, as
+// avoc_pvec_from_list().
+avoc_status avoc_plist_from_list(const avoc_list *list, avoc_plist *result);
+
+// Initializes an empty persistent map.
+void avoc_pmap_init(avoc_pmap *map);
+
+// Releases the nodes of map no other map shares and empties it.
+void avoc_pmap_free(avoc_pmap *map);
+
+// Makes copy a map sharing every node of map, which must not be transient.
+void avoc_pmap_copy(const avoc_pmap *map, avoc_pmap *copy);
+
+// Looks up the value of key, fails when map does not hold it. Keys compare
+// as avoc_value words: boxed pointers by address, 0.0 apart from -0.0.
+avoc_status avoc_pmap_get(const avoc_pmap *map, avoc_value key,
+                          avoc_value *value);
+
+// Makes result a new map equal to map but for key, which maps to value. map
+// is left untouched and must not be transient nor result. On failure result
+// is left empty.
+avoc_status avoc_pmap_put(const avoc_pmap *map, avoc_value key,
+                          avoc_value value, avoc_pmap *result);
+
+// Makes builder a transient copy of map, as avoc_pvec_transient().
+void avoc_pmap_transient(const avoc_pmap *map, avoc_pmap *builder);
+
+// Maps key to value in the transient builder. On failure builder keeps its
+// keys.
+avoc_status avoc_pmap_transient_put(avoc_pmap *builder, avoc_value key,
+                                    avoc_value value);
+
+// Ends the transient builder, which becomes a persistent map.
+void avoc_pmap_persistent(avoc_pmap *builder);
+
+// Initializes an empty module graph.
+void avoc_module_graph_init(avoc_module_graph *graph);
+
+// Adds a module copying its name and source text. Fails when out of memory,
+// leaving the graph as it was.
+avoc_status avoc_module_graph_add(avoc_module_graph *graph, const char *name,
+                                  const char *buf_data, size_t buf_len);
+
+// Parses every module, resolves their imports and sorts them so each one
+// comes after its dependencies. Modules of the same level do not depend on
+// each other. A module is dirty when it is new or its source changed since
+// previous, or the interface of one of its imports did, so editing the body
+// of a definition does not dirty the importers. The interface of a module
+// with definitions without a type covers those of its imports, as their
+// values may use them. previous can be NULL.
+// Unknown modules, import cycles and running out of memory fail.
+//
+// Modules whose text did not change take the source and tree of previous
+// instead of being parsed again. That consumes previous: its hashes are kept
+// but its order is released, so it is not reused again. A long running
+// driver keeps the last built graph around to make the next build warm.
+avoc_status avoc_module_graph_build(avoc_module_graph *graph,
+                                    avoc_module_graph *previous);
+
+// Frees the modules of a graph without freeing the graph itself.
+void avoc_module_graph_free(avoc_module_graph *graph);
+
+#ifdef AVOCC_TRACE
+// Instrumented phases, each one is the time spent in the function itself
+// without the time of the traced functions it calls.
+typedef enum {
+  AVOC_PHASE_LEX,  // avoc_next_token()
+  AVOC_PHASE_LIST, // avoc_parse_list()
+  AVOC_PHASE_LIT,  // avoc_parse_lit()
+  AVOC_PHASE_SYM,  // avoc_parse_sym()
+  AVOC_PHASES,
+} avoc_phase;
+
+typedef struct _avoc_trace_stats {
+  size_t token_counts[TOKEN_COMMENT + 1]; // Tokens lexed per TOKEN_* type
+  size_t phase_calls[AVOC_PHASES];        // Calls per phase
+  uint64_t phase_ticks[AVOC_PHASES]; // Cycles on x86, nanoseconds elsewhere
+} avoc_trace_stats;
+
+// Starts writing a Chrome trace (chrome://tracing, Perfetto) to out, with a
+// span per parsed source. Only available when built with AVOCC_TRACE.
+void avoc_trace_open(FILE *out);
+
+// Terminates the Chrome trace, the stream is not closed.
+void avoc_trace_close(void);
+
+// Copies the counters gathered since the last reset into stats.
+void avoc_get_trace_stats(avoc_trace_stats *stats);
+
+// Clears the trace counters.
+void avoc_reset_trace_stats(void);
+#endif
+
+// Converts a parsed item into a value, scalar literals are unboxed and
+// non-scalar items (strings, symbols, lists...) are boxed as a pointer to the
+// item. Fails for 64 bits integers that do not fit in an i32 nor a double.
+avoc_status avoc_value_from_item(const avoc_item *item, avoc_value *value);
+
+static inline avoc_value avoc_value_nil(void) { return AVOC_VALUE_TAG_NIL; }
+
+static inline avoc_value avoc_value_bol(int b) {
+  return AVOC_VALUE_TAG_BOL | (b != 0);
+}
+
+static inline avoc_value avoc_value_i32(int i) {
+  return AVOC_VALUE_TAG_I32 | (uint32_t)i;
+}
+
+static inline avoc_value avoc_value_f64(double f) {
+  avoc_value v;
+  memcpy(&v, &f, sizeof(v));
+  return f != f ? AVOC_VALUE_NAN : v;
+}
+
+static inline avoc_value avoc_value_ptr(const void *ptr) {
+  return AVOC_VALUE_TAG_PTR | (uintptr_t)ptr;
+}
+
+static inline int avoc_value_is_f64(avoc_value v) {
+  return (v & AVOC_VALUE_QNAN) != AVOC_VALUE_QNAN;
+}
+
+static inline int avoc_value_is_i32(avoc_value v) {
+  return (v & AVOC_VALUE_TAG_MASK) == AVOC_VALUE_TAG_I32;
+}
+
+static inline int avoc_value_is_nil(avoc_value v) {
+  return v == AVOC_VALUE_TAG_NIL;
+}
+
+static inline int avoc_value_is_bol(avoc_value v) {
+  return (v & ~1UL) == AVOC_VALUE_TAG_BOL;
+}
+
+static inline int avoc_value_is_ptr(avoc_value v) {
+  return (v & AVOC_VALUE_TAG_PTR) == AVOC_VALUE_TAG_PTR;
+}
+
+static inline double avoc_value_as_f64(avoc_value v) {
+  double f;
+  memcpy(&f, &v, sizeof(f));
+  return f;
+}
+
+static inline int avoc_value_as_i32(avoc_value v) { return (int)(uint32_t)v; }
+
+static inline int avoc_value_as_bol(avoc_value v) { return (int)(v & 1UL); }
+
+static inline void *avoc_value_as_ptr(avoc_value v) {
+  return (void *)(uintptr_t)(v & ~AVOC_VALUE_TAG_PTR);
+}
+
 #endif /* AVOCC_H */
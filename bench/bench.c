@@ -0,0 +1,322 @@
+// Benchmarks of the runtime values against the parse tree they come from.
+//
+// Persistent vectors are compared with avoc_list, the list a [...] literal
+// parses into: indexing walks it and keeping the previous version around
+// while updating or appending means copying it first. Each row gives the
+// nanoseconds per operation for lists of the literal size. See the bench
+// target of the Makefile.
+//
+// The parallel array kernels are then compared with the serial ones on the
+// same arrays, for pools of growing sizes up to at least the online cores.
+// Speedups need as many cores, with fewer the rows show what the pool costs.
+#define _POSIX_C_SOURCE 199309L // clock_gettime()
+
+#include "../avocc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// xorshift64, the indices only need to defeat the prefetcher
+static size_t next_index(uint64_t *state, size_t count) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return (size_t)(*state % count);
+}
+
+// Parses (v [0 1 ... count-1]) into tree, the literal is the first list.
+static avoc_list *parse_literal(avoc_source *src, avoc_list *tree,
+                                size_t count) {
+  size_t cap = 8 + count * 12;
+  char *text = malloc(cap);
+  size_t len = (size_t)snprintf(text, cap, "(v [");
+  for (size_t i = 0; i < count; i++) {
+    len += (size_t)snprintf(text + len, cap - len, "%zu ", i);
+  }
+
+  len += (size_t)snprintf(text + len, cap - len, "])");
+  avoc_source_init(src, NULL, text, len);
+  free(text);
+  avoc_list_init(tree);
+  if (avoc_parse_source(src, tree) != OK) {
+    exit(1);
+  }
+
+  return tree->head->as_list->tail->as_list;
+}
+
+// What changing an avoc_list costs when the previous version must remain.
+static void list_copy(const avoc_list *list, avoc_list *copy) {
+  avoc_list_init(copy);
+  for (const avoc_item *item = list->head; item != NULL;
+       item = item->next_sibling) {
+    avoc_item *dup = avoc_malloc(sizeof(avoc_item));
+    *dup = *item;
+    dup->prev_sibling = NULL;
+    dup->next_sibling = NULL;
+    avoc_list_push(copy, dup);
+  }
+}
+
+static avoc_item *list_at(const avoc_list *list, size_t index) {
+  avoc_item *item = list->head;
+  while (index-- > 0) {
+    item = item->next_sibling;
+  }
+
+  return item;
+}
+
+// Keeps the compiler from dropping the lookups
+static volatile long lookups;
+
+// Operations on lists are O(n), fewer of them keep each size under a second
+static size_t list_ops(size_t count) {
+  return count >= 100000 ? 100L : count >= 10000 ? 1000L : 10000L;
+}
+
+static void bench_index(const avoc_list *list, const avoc_pvec *vec) {
+  const size_t ops = list_ops(list->item_count);
+  uint64_t state = 88172645463325252UL;
+  long sink = 0;
+  double start = now_ns();
+  for (size_t i = 0; i < ops; i++) {
+    sink += list_at(list, next_index(&state, list->item_count))->as_i32;
+  }
+
+  const double list_ns = (now_ns() - start) / (double)ops;
+  const size_t vec_ops = 1000000L;
+  start = now_ns();
+  for (size_t i = 0; i < vec_ops; i++) {
+    sink += avoc_value_as_i32(
+        avoc_pvec_get(vec, next_index(&state, vec->count)));
+  }
+
+  const double vec_ns = (now_ns() - start) / (double)vec_ops;
+  lookups = sink;
+  printf("%9zu  index   %12.1f %12.1f %12s\n", list->item_count, list_ns,
+         vec_ns, "-");
+}
+
+static void bench_update(const avoc_list *list, const avoc_pvec *vec) {
+  const size_t ops = list_ops(list->item_count);
+  uint64_t state = 88172645463325252UL;
+  avoc_list copy;
+  list_copy(list, &copy);
+  double start = now_ns();
+  for (size_t i = 0; i < ops; i++) {
+    avoc_list next;
+    list_copy(&copy, &next);
+    list_at(&next, next_index(&state, next.item_count))->as_i32 = (int)i;
+    avoc_list_free(&copy);
+    copy = next;
+  }
+
+  const double list_ns = (now_ns() - start) / (double)ops;
+  avoc_list_free(&copy);
+
+  const size_t vec_ops = 1000000L;
+  avoc_pvec current;
+  avoc_pvec_copy(vec, &current);
+  start = now_ns();
+  for (size_t i = 0; i < vec_ops; i++) {
+    avoc_pvec next;
+    avoc_pvec_set(&current, next_index(&state, current.count),
+                  avoc_value_i32((int)i), &next);
+    avoc_pvec_free(&current);
+    current = next;
+  }
+
+  const double vec_ns = (now_ns() - start) / (double)vec_ops;
+  avoc_pvec_free(&current);
+
+  avoc_pvec builder;
+  avoc_pvec_transient(vec, &builder);
+  start = now_ns();
+  for (size_t i = 0; i < vec_ops; i++) {
+    avoc_pvec_transient_set(&builder, next_index(&state, builder.count),
+                            avoc_value_i32((int)i));
+  }
+
+  const double transient_ns = (now_ns() - start) / (double)vec_ops;
+  avoc_pvec_free(&builder);
+  printf("%9zu  update  %12.1f %12.1f %12.1f\n", list->item_count, list_ns,
+         vec_ns, transient_ns);
+}
+
+// Every append starts from the literal, so the sizes stay the same
+static void bench_append(const avoc_list *list, const avoc_pvec *vec) {
+  const size_t ops = list_ops(list->item_count);
+  double start = now_ns();
+  for (size_t i = 0; i < ops; i++) {
+    avoc_list next;
+    list_copy(list, &next);
+    avoc_item *item = avoc_malloc(sizeof(avoc_item));
+    *item = *list->head;
+    item->prev_sibling = NULL;
+    item->next_sibling = NULL;
+    avoc_list_push(&next, item);
+    avoc_list_free(&next);
+  }
+
+  const double list_ns = (now_ns() - start) / (double)ops;
+  const size_t vec_ops = 1000000L;
+  start = now_ns();
+  for (size_t i = 0; i < vec_ops; i++) {
+    avoc_pvec next;
+    avoc_pvec_push(vec, avoc_value_i32((int)i), &next);
+    avoc_pvec_free(&next);
+  }
+
+  const double vec_ns = (now_ns() - start) / (double)vec_ops;
+
+  // A builder appending the elements of another literal of the same size
+  avoc_pvec builder;
+  avoc_pvec_transient(vec, &builder);
+  start = now_ns();
+  for (size_t i = 0; i < vec->count; i++) {
+    avoc_pvec_transient_push(&builder, avoc_value_i32((int)i));
+  }
+
+  const double transient_ns = (now_ns() - start) / (double)vec->count;
+  avoc_pvec_free(&builder);
+  printf("%9zu  append  %12.1f %12.1f %12.1f\n", list->item_count, list_ns,
+         vec_ns, transient_ns);
+}
+
+static void bench_pvec(void) {
+  printf("ns/op         size  op      %12s %12s %12s\n", "avoc_list",
+         "avoc_pvec", "transient");
+  const size_t sizes[] = {1000L, 10000L, 100000L};
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    avoc_source src;
+    avoc_list tree;
+    const avoc_list *list = parse_literal(&src, &tree, sizes[s]);
+    avoc_pvec vec;
+    double start = now_ns();
+    if (avoc_pvec_from_list(list, &vec) != OK) {
+      exit(1);
+    }
+
+    const double convert_ns = (now_ns() - start) / (double)sizes[s];
+    printf("%9zu  convert %12s %12.1f %12s\n", sizes[s], "-", convert_ns,
+           "-");
+    bench_index(list, &vec);
+    bench_update(list, &vec);
+    bench_append(list, &vec);
+    avoc_pvec_free(&vec);
+    avoc_list_free(&tree);
+    avoc_source_free(&src);
+  }
+}
+
+static int keep_positive(void *ctx, const void *elem) {
+  (void)ctx;
+  return *(const double *)elem > 0.0;
+}
+
+// Serial counterpart of avoc_array_pfilter() for keep_positive()
+static void filter_positive(const avoc_array *array, avoc_array *dest) {
+  const double *x = array->data;
+  size_t count = 0L;
+  for (size_t i = 0; i < array->count; i++) {
+    count += x[i] > 0.0;
+  }
+
+  if (avoc_array_init(dest, array->kind, count) != OK) {
+    exit(1);
+  }
+
+  double *out = dest->data;
+  for (size_t i = 0; i < array->count; i++) {
+    if (x[i] > 0.0) {
+      *out++ = x[i];
+    }
+  }
+}
+
+static void bench_parallel(void) {
+  const size_t count = 1L << 22;
+  const int rounds = 10;
+  avoc_array a, b, c;
+  if (avoc_array_init(&a, AVOC_ARRAY_F64, count) != OK ||
+      avoc_array_init(&b, AVOC_ARRAY_F64, count) != OK) {
+    exit(1);
+  }
+
+  uint64_t state = 88172645463325252UL;
+  for (size_t i = 0; i < count; i++) {
+    ((double *)a.data)[i] = (double)next_index(&state, 2001L) - 1000.0;
+    ((double *)b.data)[i] = (double)next_index(&state, 1000L) + 1.0;
+  }
+
+  avoc_item result;
+  double start = now_ns();
+  for (int r = 0; r < rounds; r++) {
+    avoc_array_map(&a, &b, AVOC_ARRAY_MUL, &c);
+    avoc_array_free(&c);
+  }
+  const double map_ns = (now_ns() - start) / rounds;
+  start = now_ns();
+  for (int r = 0; r < rounds; r++) {
+    avoc_array_reduce(&a, AVOC_ARRAY_SUM, &result);
+  }
+  const double reduce_ns = (now_ns() - start) / rounds;
+  start = now_ns();
+  for (int r = 0; r < rounds; r++) {
+    filter_positive(&a, &c);
+    avoc_array_free(&c);
+  }
+  const double filter_ns = (now_ns() - start) / rounds;
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  const size_t max_threads = cores > 4 ? (size_t)cores : 4L;
+  printf("\nms/op, %zu f64    threads %9s %9s %9s\n", count, "map",
+         "reduce", "filter");
+  printf("serial                   - %9.2f %9.2f %9.2f\n", map_ns / 1e6,
+         reduce_ns / 1e6, filter_ns / 1e6);
+  for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+    avoc_pool *pool = avoc_pool_new(threads);
+    if (pool == NULL) {
+      exit(1);
+    }
+
+    start = now_ns();
+    for (int r = 0; r < rounds; r++) {
+      avoc_array_pmap(pool, &a, &b, AVOC_ARRAY_MUL, &c);
+      avoc_array_free(&c);
+    }
+    const double pmap_ns = (now_ns() - start) / rounds;
+    start = now_ns();
+    for (int r = 0; r < rounds; r++) {
+      avoc_array_preduce(pool, &a, AVOC_ARRAY_SUM, &result);
+    }
+    const double preduce_ns = (now_ns() - start) / rounds;
+    start = now_ns();
+    for (int r = 0; r < rounds; r++) {
+      avoc_array_pfilter(pool, &a, keep_positive, NULL, &c);
+      avoc_array_free(&c);
+    }
+    const double pfilter_ns = (now_ns() - start) / rounds;
+    printf("parallel         %9zu %9.2f %9.2f %9.2f\n", threads,
+           pmap_ns / 1e6, preduce_ns / 1e6, pfilter_ns / 1e6);
+    avoc_pool_free(pool);
+  }
+
+  avoc_array_free(&b);
+  avoc_array_free(&a);
+}
+
+int main(void) {
+  bench_pvec();
+  bench_parallel();
+  return 0;
+}
@@ -0,0 +1,465 @@
+// Fuzzing harness of the lexer, the parser and the snapshot loader.
+//
+// Built with AVOCC_LIBFUZZER it only defines LLVMFuzzerTestOneInput(), for
+// the parser or, with AVOCC_FUZZ_LEXER, for the lexer. See the fuzz-libfuzzer
+// target of the Makefile. Adding AVOCC_FUZZ_REPLAY gives it a main() running
+// the entry point over the files given, as libFuzzer does, so the fuzz target
+// builds and runs it without a compiler supporting -fsanitize=fuzzer.
+//
+// Otherwise it is a standalone driver which runs both targets in process
+// over a corpus, over the corpus repeated up to SCALED_LEN bytes, and over
+// random mutations of it. Every run has a timeout, so the scaled inputs
+// catch quadratic behaviour as well as crashes. The input being run when
+// something goes wrong is saved to fuzz-crash or fuzz-timeout.
+//
+// Sources are views of the input, so runs do not copy it.
+#define _POSIX_C_SOURCE 200809L
+
+#include "../avocc.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+int avoc_fuzz_lexer(const uint8_t *data, size_t size) {
+  avoc_source src;
+  avoc_token token;
+
+  avoc_source_init_view(&src, NULL, (const char *)data, size);
+  avoc_token_init(&token);
+  while (avoc_next_token(&src, &token) == OK && token.type != TOKEN_EOF) {
+  }
+
+  avoc_source_free(&src);
+  return 0;
+}
+
+static size_t null_write(void *ctx, const char *data, size_t len) {
+  (void)ctx;
+  (void)data;
+  return len;
+}
+
+// Growing buffer written by the snapshots
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} mem_buffer;
+
+static size_t mem_write(void *ctx, const char *data, size_t len) {
+  mem_buffer *buf = ctx;
+  if (buf->len + len > buf->cap) {
+    buf->cap = (buf->len + len) * 2;
+    buf->data = realloc(buf->data, buf->cap);
+  }
+
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  return len;
+}
+
+// Loads back a snapshot of the tree under list.
+static void fuzz_snapshot(const avoc_list *list) {
+  mem_buffer buf = {NULL, 0L, 0L};
+  avoc_list loaded;
+  avoc_snapshot_write(list, mem_write, &buf);
+  avoc_list_init(&loaded);
+  avoc_snapshot_load(buf.data, buf.len, &loaded);
+  avoc_list_free(&loaded);
+  free(buf.data);
+}
+
+int avoc_fuzz_parser(const uint8_t *data, size_t size) {
+  avoc_source src;
+  avoc_list list;
+  avoc_expander exp;
+
+  avoc_source_init_view(&src, NULL, (const char *)data, size);
+  avoc_list_init(&list);
+  avoc_expander_init(&exp);
+  if (avoc_parse_source(&src, &list) == OK) {
+    avoc_format_list(&list, NULL, null_write, NULL);
+    fuzz_snapshot(&list);
+    if (avoc_expand(&exp, &src, &list) == OK) {
+      avoc_format_list(&list, NULL, null_write, NULL);
+    }
+  }
+
+  avoc_list_free(&list);
+  avoc_expander_free(&exp);
+  avoc_source_free(&src);
+
+  avoc_source_init_view(&src, NULL, (const char *)data, size);
+  avoc_list_init(&list);
+  if (avoc_parse_source_lazy(&src, &list) == OK) {
+    for (avoc_item *item = list.head; item != NULL; item = item->next_sibling) {
+      avoc_item_force(&src, item);
+    }
+  }
+
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+
+  avoc_source_init_view(&src, NULL, (const char *)data, size);
+  avoc_list_init(&list);
+  avoc_parse_source_shared(&src, &list);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+
+  // Inputs are snapshots too
+  avoc_list_init(&list);
+  avoc_snapshot_load(data, size, &list);
+  avoc_list_free(&list);
+  return 0;
+}
+
+#ifdef AVOCC_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+#ifdef AVOCC_FUZZ_LEXER
+  return avoc_fuzz_lexer(data, size);
+#else
+  return avoc_fuzz_parser(data, size);
+#endif
+}
+
+#ifdef AVOCC_FUZZ_REPLAY
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    FILE *file = fopen(argv[i], "rb");
+    if (file == NULL) {
+      fprintf(stderr, "fuzz: cannot read %s\n", argv[i]);
+      return 2;
+    }
+
+    fseek(file, 0L, SEEK_END);
+    long len = ftell(file);
+    fseek(file, 0L, SEEK_SET);
+    uint8_t *data = malloc(len > 0 ? (size_t)len : 1L);
+    size_t read = len > 0 ? fread(data, 1, (size_t)len, file) : 0L;
+    fclose(file);
+
+    LLVMFuzzerTestOneInput(data, read);
+    free(data);
+  }
+
+  printf("fuzz: replayed %d inputs\n", argc - 1);
+  return 0;
+}
+#endif
+#else
+
+// Inputs repeated up to this length must still run within the timeout
+#define SCALED_LEN (1L << 18)
+
+typedef struct {
+  uint8_t *data;
+  size_t len;
+} fuzz_input;
+
+// Input being run, saved by the signal handlers
+static const uint8_t *cur_data = NULL;
+static size_t cur_len = 0L;
+
+static void save_input(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0) {
+    ssize_t written = write(fd, cur_data, cur_len);
+    (void)written; // Nothing else to do from a signal handler
+    close(fd);
+  }
+}
+
+static void report(const char *msg) {
+  ssize_t written = write(STDERR_FILENO, msg, strlen(msg));
+  (void)written;
+}
+
+static void on_timeout(int sig) {
+  (void)sig;
+  save_input("fuzz-timeout");
+  report("fuzz: timeout, input saved to fuzz-timeout\n");
+  signal(SIGABRT, SIG_DFL);
+  abort();
+}
+
+static void on_crash(void) {
+  save_input("fuzz-crash");
+  report("fuzz: crash, input saved to fuzz-crash\n");
+}
+
+static void on_crash_signal(int sig) {
+  on_crash();
+  raise(sig); // The handler was reset, so this one is not caught
+}
+
+#ifdef __SANITIZE_ADDRESS__
+void __sanitizer_set_death_callback(void (*callback)(void));
+#endif
+
+static void install_handlers(void) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = on_timeout;
+  sigaction(SIGALRM, &action, NULL);
+
+  action.sa_handler = on_crash_signal;
+  action.sa_flags = SA_RESETHAND;
+  sigaction(SIGSEGV, &action, NULL);
+  sigaction(SIGBUS, &action, NULL);
+  sigaction(SIGILL, &action, NULL);
+  sigaction(SIGFPE, &action, NULL);
+  sigaction(SIGABRT, &action, NULL);
+#ifdef __SANITIZE_ADDRESS__
+  __sanitizer_set_death_callback(on_crash);
+#endif
+}
+
+// Runs both targets over a copy of exactly len bytes, so reads past the end
+// are caught by the sanitizers.
+static void run_input(const uint8_t *data, size_t len, unsigned timeout) {
+  uint8_t *copy = malloc(len > 0 ? len : 1);
+  memcpy(copy, data, len);
+  cur_data = copy;
+  cur_len = len;
+
+  alarm(timeout);
+  avoc_fuzz_lexer(copy, len);
+  avoc_fuzz_parser(copy, len);
+  alarm(0);
+  free(copy);
+}
+
+static void corpus_push(fuzz_input **corpus, size_t *count, size_t *cap,
+                        uint8_t *data, size_t len) {
+  if (*count == *cap) {
+    *cap = *cap == 0 ? 64 : *cap * 2;
+    *corpus = realloc(*corpus, *cap * sizeof(fuzz_input));
+  }
+
+  (*corpus)[*count].data = data;
+  (*corpus)[*count].len = len;
+  (*count)++;
+}
+
+static int load_file(const char *path, fuzz_input **corpus, size_t *count,
+                     size_t *cap) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return 0;
+  }
+
+  fseek(file, 0L, SEEK_END);
+  long len = ftell(file);
+  fseek(file, 0L, SEEK_SET);
+  if (len < 0) {
+    fclose(file);
+    return 0;
+  }
+
+  uint8_t *data = malloc(len > 0 ? (size_t)len : 1);
+  size_t read = fread(data, 1, (size_t)len, file);
+  fclose(file);
+  corpus_push(corpus, count, cap, data, read);
+  return 1;
+}
+
+static int load_path(const char *path, fuzz_input **corpus, size_t *count,
+                     size_t *cap) {
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return load_file(path, corpus, count, cap);
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+
+    size_t len = strlen(path) + strlen(entry->d_name) + 2;
+    char *file = malloc(len);
+    snprintf(file, len, "%s/%s", path, entry->d_name);
+    load_file(file, corpus, count, cap);
+    free(file);
+  }
+
+  closedir(dir);
+  return 1;
+}
+
+static uint64_t rng_state = 1UL;
+
+// xorshift64*, deterministic for a given -seed
+static uint64_t rng_next(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545F4914F6CDD1DUL;
+}
+
+static size_t rng_below(size_t n) { return n > 0 ? rng_next() % n : 0L; }
+
+// Applies a few random edits to buf, biased towards the bytes the lexer
+// cares about. Returns the new length, at most cap.
+static size_t mutate(uint8_t *buf, size_t len, size_t cap,
+                     const fuzz_input *corpus, size_t count) {
+  static const char special[] = "()[]<>:;#|'\"`\\ \n\t0123456789.-+exfiu";
+  size_t edits = 1 + rng_below(4);
+
+  for (size_t e = 0; e < edits; e++) {
+    size_t pos = rng_below(len + 1);
+    switch (rng_below(6)) {
+    case 0: // Flip a bit
+      if (len > 0) {
+        buf[rng_below(len)] ^= (uint8_t)(1u << rng_below(8));
+      }
+      break;
+    case 1: // Overwrite a byte
+      if (len > 0) {
+        buf[rng_below(len)] = (uint8_t)special[rng_below(sizeof(special) - 1)];
+      }
+      break;
+    case 2: // Insert a byte
+      if (len < cap) {
+        memmove(buf + pos + 1, buf + pos, len - pos);
+        buf[pos] = rng_below(4) == 0
+                       ? (uint8_t)rng_below(256)
+                       : (uint8_t)special[rng_below(sizeof(special) - 1)];
+        len++;
+      }
+      break;
+    case 3: { // Erase a range
+      size_t n = rng_below(len - pos + 1);
+      memmove(buf + pos, buf + pos + n, len - pos - n);
+      len -= n;
+      break;
+    }
+    case 4: { // Duplicate a range
+      size_t from = rng_below(len + 1);
+      size_t n = rng_below(len - from + 1);
+      n = n < cap - len ? n : cap - len;
+      if (from < pos && from + n > pos) {
+        n = pos - from; // Keep the range on one side of pos
+      }
+
+      memmove(buf + pos + n, buf + pos, len - pos);
+      memmove(buf + pos, buf + (from < pos ? from : from + n), n);
+      len += n;
+      break;
+    }
+    default: { // Splice part of another input
+      const fuzz_input *other = &corpus[rng_below(count)];
+      size_t from = rng_below(other->len + 1);
+      size_t n = rng_below(other->len - from + 1);
+      n = n < cap - len ? n : cap - len;
+      memmove(buf + pos + n, buf + pos, len - pos);
+      memcpy(buf + pos, other->data + from, n);
+      len += n;
+      break;
+    }
+    }
+  }
+
+  return len;
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-runs N] [-seed N] [-timeout SECONDS] [-max_len N] "
+          "[FILE|DIR]...\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  size_t runs = 100000L;
+  size_t max_len = 4096L;
+  unsigned timeout = 5;
+  fuzz_input *corpus = NULL;
+  size_t count = 0L;
+  size_t cap = 0L;
+
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 < argc && strcmp(argv[i], "-runs") == 0) {
+      runs = strtoul(argv[++i], NULL, 10);
+    } else if (i + 1 < argc && strcmp(argv[i], "-seed") == 0) {
+      rng_state = strtoull(argv[++i], NULL, 10) | 1UL;
+    } else if (i + 1 < argc && strcmp(argv[i], "-timeout") == 0) {
+      timeout = (unsigned)strtoul(argv[++i], NULL, 10);
+    } else if (i + 1 < argc && strcmp(argv[i], "-max_len") == 0) {
+      max_len = strtoul(argv[++i], NULL, 10);
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 2;
+    } else if (!load_path(argv[i], &corpus, &count, &cap)) {
+      fprintf(stderr, "fuzz: cannot read %s\n", argv[i]);
+      return 2;
+    }
+  }
+
+  if (count == 0) {
+    corpus_push(&corpus, &count, &cap, malloc(1), 0L);
+  }
+
+  install_handlers();
+  double start = now_seconds();
+
+  for (size_t i = 0; i < count; i++) {
+    run_input(corpus[i].data, corpus[i].len, timeout);
+  }
+
+  // Inputs which take more than linear time blow the timeout once scaled
+  uint8_t *scaled = malloc(SCALED_LEN);
+  for (size_t i = 0; i < count; i++) {
+    if (corpus[i].len == 0) {
+      continue;
+    }
+
+    size_t len = 0L;
+    while (len + corpus[i].len <= SCALED_LEN) {
+      memcpy(scaled + len, corpus[i].data, corpus[i].len);
+      len += corpus[i].len;
+    }
+
+    run_input(scaled, len, timeout);
+  }
+
+  free(scaled);
+  double scaled_end = now_seconds();
+
+  uint8_t *buf = malloc(max_len > 0 ? max_len : 1);
+  for (size_t r = 0; r < runs; r++) {
+    const fuzz_input *base = &corpus[rng_below(count)];
+    size_t len = base->len < max_len ? base->len : max_len;
+    memcpy(buf, base->data, len);
+    len = mutate(buf, len, max_len, corpus, count);
+    run_input(buf, len, timeout);
+  }
+
+  double end = now_seconds();
+  printf("fuzz: %zu inputs, %zu scaled to %ld bytes in %.2fs, %zu mutations "
+         "in %.2fs (%.0f/s)\n",
+         count, count, SCALED_LEN, scaled_end - start, runs, end - scaled_end,
+         runs / (end - scaled_end > 0 ? end - scaled_end : 1));
+
+  free(buf);
+  for (size_t i = 0; i < count; i++) {
+    free(corpus[i].data);
+  }
+
+  free(corpus);
+  return 0;
+}
+#endif
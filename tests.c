@@ -1,6 +1,8 @@
 #include "tests.h"
 #include "avocc.h"
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 void test_source_init_free() {
@@ -13,8 +15,8 @@ void test_source_init_free() {
   assert_eq(src0.nxt_cp, 0);
   assert_eql(src0.cur_cp_pos, 0L);
   assert_eql(src0.nxt_cp_pos, 0L);
-  assert_eql(src0.col, 1L);
-  assert_eql(src0.row, 1L);
+  assert_okb(src0.line_starts == NULL);
+  assert_eql(src0.line_count, 0L);
   assert_okb(src0.name == NULL);
 
   avoc_source src1;
@@ -29,8 +31,7 @@ void test_source_init_free() {
   assert_eq(src1.nxt_cp, 0);
   assert_eql(src1.cur_cp_pos, 0L);
   assert_eql(src1.nxt_cp_pos, 0L);
-  assert_eql(src1.col, 1L);
-  assert_eql(src1.row, 1L);
+  assert_okb(src1.line_starts == NULL);
 
   avoc_source_free(&src1);
   assert_okb(src0.buf_data == NULL);
@@ -41,6 +42,27 @@ void test_source_init_free() {
   assert_okb(src2.name != NULL);
   assert_eqs(src2.name, "filename");
   avoc_source_free(&src2);
+
+  // views use the buffer as it is and leave it to the caller
+  const char *text = "(avocado)";
+  avoc_alloc_stats before, after;
+  avoc_get_alloc_stats(&before);
+  avoc_source src3;
+  avoc_source_init_view(&src3, NULL, text, strlen(text));
+  avoc_get_alloc_stats(&after);
+  assert_okb((const char *)src3.buf_data == text);
+  assert_eql(src3.buf_len, 9L);
+  assert_eq(src3.buf_owned, 0);
+  assert_eql(after.alloc_count, before.alloc_count);
+
+  avoc_list list;
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src3, &list) == OK);
+  assert_eql(list.item_count, 1L);
+  avoc_list_free(&list);
+  avoc_source_free(&src3);
+  assert_okb(src3.buf_data == NULL);
+  assert_eqs(text, "(avocado)");
 }
 
 void test_source_move_fwd_ascii() {
@@ -181,20 +203,60 @@ void test_source_move_fwd_utf8() {
   avoc_source_free(&src);
 }
 
-void test_source_move_fwd_newl() {
+void test_source_position() {
   avoc_source src;
+  size_t row, col;
+
+  avoc_source_init(&src, NULL, NULL, 0L);
+  avoc_source_position(&src, 0L, &row, &col);
+  assert_eql(row, 1L);
+  assert_eql(col, 1L);
+  avoc_source_free(&src);
 
   load_string(&src, "A\nB");
-  assert_eql(src.row, 1L);
-  assert_eql(src.col, 1L);
+  avoc_source_position(&src, 0L, &row, &col);
+  assert_eql(row, 1L);
+  assert_eql(col, 1L);
+  assert_eql(src.line_count, 2L);
+
+  avoc_source_position(&src, 1L, &row, &col);
+  assert_eql(row, 1L);
+  assert_eql(col, 2L);
+
+  avoc_source_position(&src, 2L, &row, &col);
+  assert_eql(row, 2L);
+  assert_eql(col, 1L);
+
+  avoc_source_position(&src, 100L, &row, &col);
+  assert_eql(row, 2L);
+  assert_eql(col, 2L);
+  avoc_source_free(&src);
 
-  avoc_source_fwd(&src);
-  assert_eql(src.row, 1L);
-  assert_eql(src.col, 2L);
+  // U+1F951 'x' '\n' '\n' 'y' U+00A1 'z'
+  load_string(&src, "\xF0\x9F\xA5\x91x\n\ny\xC2\xA1z");
+  avoc_source_position(&src, 4L, &row, &col);
+  assert_eql(row, 1L);
+  assert_eql(col, 2L);
 
-  avoc_source_fwd(&src);
-  assert_eql(src.row, 2L);
-  assert_eql(src.col, 1L);
+  avoc_source_position(&src, 6L, &row, &col);
+  assert_eql(row, 2L);
+  assert_eql(col, 1L);
+
+  avoc_source_position(&src, 10L, &row, &col);
+  assert_eql(row, 3L);
+  assert_eql(col, 3L);
+  avoc_source_free(&src);
+
+  // Lines past the vectorized chunks
+  load_string(&src, "0123456789\n0123456789\n0123456789\n0123456789\n");
+  assert_eql(src.buf_len, 44L);
+  avoc_source_position(&src, 35L, &row, &col);
+  assert_eql(row, 4L);
+  assert_eql(col, 3L);
+  assert_eql(src.line_count, 5L);
+  avoc_source_position(&src, 44L, &row, &col);
+  assert_eql(row, 5L);
+  assert_eql(col, 1L);
   avoc_source_free(&src);
 }
 
@@ -378,7 +440,7 @@ void test_token_next_str_lit() {
   assert_eq(token.type, TOKEN_LIT_STR);
   assert_eql(token.offset, 0L);
   assert_eql(token.length, 6L);
-  assert_eql(token.auxlen, 1L);
+  assert_eql(token.auxlen, 2L);
   avoc_source_free(&src);
 
   load_string(&src, "\"\\u00A1\"");
@@ -685,6 +747,31 @@ void test_token_edge_cases() {
   avoc_source_free(&src);
 }
 
+void test_keywords() {
+  const char *names[] = {"true", "false", "nil",   "def",  "fn",
+                         "if",   "let",   "do",    "quote", "macro"};
+  const avoc_keyword keywords[] = {
+      KEYWORD_TRUE, KEYWORD_FALSE, KEYWORD_NIL, KEYWORD_DEF,   KEYWORD_FN,
+      KEYWORD_IF,   KEYWORD_LET,   KEYWORD_DO,  KEYWORD_QUOTE, KEYWORD_MACRO};
+
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    assert_eq(avoc_keyword_lookup(names[i], strlen(names[i])), keywords[i]);
+  }
+
+  assert_eq(avoc_keyword_lookup("", 0), KEYWORD_NONE);
+  assert_eq(avoc_keyword_lookup("t", 1), KEYWORD_NONE);
+  assert_eq(avoc_keyword_lookup("tru", 3), KEYWORD_NONE);
+  assert_eq(avoc_keyword_lookup("trues", 5), KEYWORD_NONE);
+  assert_eq(avoc_keyword_lookup("truth", 5), KEYWORD_NONE);
+  assert_eq(avoc_keyword_lookup("define", 6), KEYWORD_NONE);
+  assert_eq(avoc_keyword_lookup("fi", 2), KEYWORD_NONE);
+  assert_eq(avoc_keyword_lookup("\xF0\x9F\xA5\x91", 4), KEYWORD_NONE);
+
+  // only a prefix of the slice is a keyword
+  assert_eq(avoc_keyword_lookup("nil)", 3), KEYWORD_NIL);
+  assert_eq(avoc_keyword_lookup("nil)", 4), KEYWORD_NONE);
+}
+
 void test_lists() {
   avoc_item item1, item2, item3, item4;
   avoc_list list1, list2;
@@ -728,6 +815,69 @@ void test_lists() {
   assert_okb(item3.prev_sibling == &item2);
 }
 
+// Owned copy of str as avoc_list_free() releases it, str_len + 1 bytes
+static char *copy_string(const char *str, size_t *str_len) {
+  *str_len = strlen(str);
+  char *cpy = avoc_malloc(*str_len + 1);
+  memcpy(cpy, str, *str_len + 1);
+  return cpy;
+}
+
+void test_lists_free_deep() {
+  // [[[ ... [1 "a" sym:(T)] ... ]]] a million levels deep
+  const size_t depth = 1000000L;
+  avoc_alloc_stats before, after;
+  avoc_get_alloc_stats(&before);
+  avoc_list root;
+  avoc_list_init(&root);
+
+  avoc_list *cur = &root;
+  for (size_t i = 0; i < depth; i++) {
+    avoc_item *item = avoc_malloc(sizeof(avoc_item));
+    avoc_item_init(item);
+    item->type = ITEM_LIT_LST;
+    item->as_list = avoc_malloc(sizeof(avoc_list));
+    avoc_list_init(item->as_list);
+    avoc_list_push(cur, item);
+    cur = item->as_list;
+  }
+
+  avoc_item *num = avoc_malloc(sizeof(avoc_item));
+  avoc_item_init(num);
+  num->type = ITEM_LIT_I32;
+  num->as_i32 = 1;
+  avoc_list_push(cur, num);
+
+  avoc_item *str = avoc_malloc(sizeof(avoc_item));
+  avoc_item_init(str);
+  str->type = ITEM_LIT_STR;
+  str->as_str = copy_string("a", &str->str_len);
+  str->str_owned = 1;
+  avoc_list_push(cur, str);
+
+  avoc_item *sym = avoc_malloc(sizeof(avoc_item));
+  avoc_item_init(sym);
+  sym->type = ITEM_SYM;
+  sym->as_sym = copy_string("sym", &sym->str_len);
+  sym->sym_composed_type = avoc_malloc(sizeof(avoc_list));
+  avoc_list_init(sym->sym_composed_type);
+  avoc_item *typ = avoc_malloc(sizeof(avoc_item));
+  avoc_item_init(typ);
+  typ->type = ITEM_SYM;
+  typ->as_sym = copy_string("T", &typ->str_len);
+  typ->str_owned = 1;
+  avoc_list_push(sym->sym_composed_type, typ);
+  sym->str_owned = 1;
+  avoc_list_push(cur, sym);
+
+  assert_eql(root.item_count, 1L);
+  avoc_list_free(&root);
+  avoc_get_alloc_stats(&after);
+  assert_eql(after.bytes_in_use, before.bytes_in_use);
+  assert_eql(after.free_count - before.free_count,
+             after.alloc_count - before.alloc_count);
+}
+
 void test_parse_bol_lit() {
   avoc_source src;
   avoc_token token;
@@ -906,6 +1056,7 @@ void test_parse_str_lit() {
   avoc_token token;
   avoc_item item;
   avoc_status status;
+  size_t row, col;
 
   load_string(&src, "'str1' \"str2\" `str3`");
   avoc_item_init(&item);
@@ -914,19 +1065,21 @@ void test_parse_str_lit() {
   status = avoc_parse_lit(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_LIT_STR);
-  assert_eqs(item.as_str, "str1");
+  assert_eqsn(item.as_str, item.str_len, "str1");
+  assert_eq(item.str_owned, 0);
+  assert_ok(item.as_str == (char *)src.buf_data + 1);
   avoc_item_free(&item);
 
   status = avoc_parse_lit(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_LIT_STR);
-  assert_eqs(item.as_str, "str2");
+  assert_eqsn(item.as_str, item.str_len, "str2");
   avoc_item_free(&item);
 
   status = avoc_parse_lit(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_LIT_STR);
-  assert_eqs(item.as_str, "str3");
+  assert_eqsn(item.as_str, item.str_len, "str3");
   avoc_source_free(&src);
   avoc_item_free(&item);
 
@@ -937,6 +1090,8 @@ void test_parse_str_lit() {
   status = avoc_parse_lit(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_LIT_STR);
+  assert_eqsn(item.as_str, item.str_len, "c\\c");
+  assert_eq(item.str_owned, 1);
   assert_eqs(item.as_str, "c\\c");
   avoc_item_free(&item);
   avoc_source_free(&src);
@@ -948,7 +1103,7 @@ void test_parse_str_lit() {
   status = avoc_parse_lit(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_LIT_STR);
-  assert_eqs(item.as_str, "c\nc");
+  assert_eqsn(item.as_str, item.str_len, "c\nc");
   avoc_item_free(&item);
   avoc_source_free(&src);
 
@@ -959,7 +1114,7 @@ void test_parse_str_lit() {
   status = avoc_parse_lit(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_LIT_STR);
-  assert_eqs(item.as_str, "x \xC2\xA1 x");
+  assert_eqsn(item.as_str, item.str_len, "x \xC2\xA1 x");
   avoc_item_free(&item);
   avoc_source_free(&src);
 
@@ -970,9 +1125,89 @@ void test_parse_str_lit() {
   status = avoc_parse_lit(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_LIT_STR);
-  assert_eqs(item.as_str, "x \xF0\x9F\x98\x8A x");
+  assert_eqsn(item.as_str, item.str_len, "x \xF0\x9F\x98\x8A x");
+  avoc_item_free(&item);
+  avoc_source_free(&src);
+
+  load_string(&src, "'\xC2\xA1\\t\xF0\x9F\xA5\x91'");
+  avoc_item_init(&item);
+  status = avoc_next_token(&src, &token);
+  assert_okb(status == OK);
+  status = avoc_parse_lit(&src, &token, &item);
+  assert_okb(status == OK);
+  assert_eq(item.str_owned, 1);
+  assert_eqsn(item.as_str, item.str_len, "\xC2\xA1\t\xF0\x9F\xA5\x91");
+  avoc_item_free(&item);
+  avoc_source_free(&src);
+
+  load_string(&src,
+              "'a long run of plain text before\\n the escape and after'");
+  avoc_item_init(&item);
+  status = avoc_next_token(&src, &token);
+  assert_okb(status == OK);
+  assert_eql(token.length, 56L);
+  assert_eql(token.auxlen, 53L);
+  status = avoc_parse_lit(&src, &token, &item);
+  assert_okb(status == OK);
+  assert_eqsn(item.as_str, item.str_len,
+              "a long run of plain text before\n the escape and after");
+  avoc_item_free(&item);
+  avoc_source_free(&src);
+
+  load_string(&src, "`raw \\n \\` and\nnew line` 1");
+  avoc_item_init(&item);
+  status = avoc_next_token(&src, &token);
+  assert_okb(status == OK);
+  avoc_source_position(&src, token.offset + token.length, &row, &col);
+  assert_eql(row, 2L);
+  assert_eql(col, 10L);
+  status = avoc_parse_lit(&src, &token, &item);
+  assert_okb(status == OK);
+  assert_eq(item.str_owned, 0);
+  assert_eqsn(item.as_str, item.str_len, "raw \\n \\` and\nnew line");
+  assert_eq(token.type, TOKEN_LIT_NUM);
+  avoc_item_free(&item);
+  avoc_source_free(&src);
+
+  load_string(&src, "'\\e\\?\\\"\\x41'");
+  avoc_item_init(&item);
+  status = avoc_next_token(&src, &token);
+  assert_okb(status == OK);
+  status = avoc_parse_lit(&src, &token, &item);
+  assert_okb(status == OK);
+  assert_eqsn(item.as_str, item.str_len, "\x1B?\"A");
   avoc_item_free(&item);
   avoc_source_free(&src);
+
+  load_string(&src, "'\\xZZ'");
+  status = avoc_next_token(&src, &token);
+  assert_ok(status == FAILED);
+  avoc_source_free(&src);
+
+  load_string(&src, "'\\q'");
+  status = avoc_next_token(&src, &token);
+  assert_ok(status == FAILED);
+  avoc_source_free(&src);
+
+  load_string(&src, "'\\u00'");
+  status = avoc_next_token(&src, &token);
+  assert_ok(status == FAILED);
+  avoc_source_free(&src);
+
+  // surrogates cannot be encoded, the code points around them can
+  const char *surrogates[] = {"'\\uD800'", "'\\uDFFF'", "'\\U0000DC00'"};
+  for (size_t i = 0; i < sizeof(surrogates) / sizeof(surrogates[0]); i++) {
+    load_string(&src, surrogates[i]);
+    status = avoc_next_token(&src, &token);
+    assert_ok(status == FAILED);
+    avoc_source_free(&src);
+  }
+
+  load_string(&src, "'\\uD7FF\\uE000'");
+  status = avoc_next_token(&src, &token);
+  assert_okb(status == OK);
+  assert_eql(token.auxlen, 6L);
+  avoc_source_free(&src);
 }
 
 void test_parse_lst_lit() {
@@ -993,11 +1228,12 @@ void test_parse_lst_lit() {
   list = item.as_list;
 
   assert_eq(list->head->type, ITEM_SYM);
-  assert_eqs(list->head->as_str, "first");
+  assert_eqsn(list->head->as_str, list->head->str_len, "first");
 
   assert_okb(list->head->next_sibling != NULL);
   assert_eq(list->head->next_sibling->type, ITEM_SYM);
-  assert_eqs(list->head->next_sibling->as_str, "second");
+  assert_eqsn(list->head->next_sibling->as_str,
+              list->head->next_sibling->str_len, "second");
 
   assert_eq(list->tail->type, ITEM_LIT_I32);
   assert_eq(list->tail->as_i32, 3);
@@ -1016,12 +1252,12 @@ void test_parse_lst_lit() {
   list = item.as_list;
 
   assert_eq(list->head->type, ITEM_SYM);
-  assert_eqs(list->head->as_str, "first");
+  assert_eqsn(list->head->as_str, list->head->str_len, "first");
 
   assert_okb(list->tail->type == ITEM_LIT_LST);
   avoc_item *nested_head = list->tail->as_list->head;
   assert_eq(nested_head->type, ITEM_SYM);
-  assert_eqs(nested_head->as_str, "second");
+  assert_eqsn(nested_head->as_str, nested_head->str_len, "second");
 
   avoc_item_free(&item);
   avoc_source_free(&src);
@@ -1040,28 +1276,28 @@ void test_parse_sym_no_type() {
   status = avoc_parse_sym(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_SYM);
-  assert_eqs(item.as_str, "sym1");
+  assert_eqsn(item.as_str, item.str_len, "sym1");
   avoc_item_free(&item);
 
   avoc_item_init(&item);
   status = avoc_parse_sym(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_SYM);
-  assert_eqs(item.as_str, "SYM2");
+  assert_eqsn(item.as_str, item.str_len, "SYM2");
   avoc_item_free(&item);
 
   avoc_item_init(&item);
   status = avoc_parse_sym(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_SYM);
-  assert_eqs(item.as_str, "$sym3");
+  assert_eqsn(item.as_str, item.str_len, "$sym3");
   avoc_item_free(&item);
 
   avoc_item_init(&item);
   status = avoc_parse_sym(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_SYM);
-  assert_eqs(item.as_str, "\xF0\x9F\xA5\x91");
+  assert_eqsn(item.as_str, item.str_len, "\xF0\x9F\xA5\x91");
   avoc_item_free(&item);
   avoc_source_free(&src);
 }
@@ -1081,32 +1317,33 @@ void test_parse_sym_with_ord_type() {
   status = avoc_parse_sym(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_SYM);
-  assert_eqs(item.as_str, "sym1");
-  assert_eqs(item.sym_ordinary_type, "type1");
+  assert_eqsn(item.as_str, item.str_len, "sym1");
+  assert_eqsn(item.sym_ordinary_type, item.sym_ordinary_type_len, "type1");
   avoc_item_free(&item);
 
   avoc_item_init(&item);
   status = avoc_parse_sym(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_SYM);
-  assert_eqs(item.as_str, "SYM2");
-  assert_eqs(item.sym_ordinary_type, "TYPE2");
+  assert_eqsn(item.as_str, item.str_len, "SYM2");
+  assert_eqsn(item.sym_ordinary_type, item.sym_ordinary_type_len, "TYPE2");
   avoc_item_free(&item);
 
   avoc_item_init(&item);
   status = avoc_parse_sym(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_SYM);
-  assert_eqs(item.as_str, "$sym3");
-  assert_eqs(item.sym_ordinary_type, "$type3");
+  assert_eqsn(item.as_str, item.str_len, "$sym3");
+  assert_eqsn(item.sym_ordinary_type, item.sym_ordinary_type_len, "$type3");
   avoc_item_free(&item);
 
   avoc_item_init(&item);
   status = avoc_parse_sym(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_SYM);
-  assert_eqs(item.as_str, "\xF0\x9F\xA5\x91");
-  assert_eqs(item.sym_ordinary_type, "\xF0\x9F\xA5\x91");
+  assert_eqsn(item.as_str, item.str_len, "\xF0\x9F\xA5\x91");
+  assert_eqsn(item.sym_ordinary_type, item.sym_ordinary_type_len,
+              "\xF0\x9F\xA5\x91");
   avoc_item_free(&item);
   avoc_source_free(&src);
 }
@@ -1124,7 +1361,7 @@ void test_parse_comment() {
   status = avoc_parse_comment(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_COMMENT);
-  assert_eqs(item.as_str, ";; this is a comment ;;");
+  assert_eqsn(item.as_str, item.str_len, ";; this is a comment ;;");
 
   avoc_item_init(&item);
   status = avoc_next_token(&src, &token);
@@ -1132,8 +1369,26 @@ void test_parse_comment() {
   status = avoc_parse_comment(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_COMMENT);
+  assert_eqsn(item.as_str, item.str_len, ";; another comment ;;");
+  assert_eq(item.str_owned, 0);
+
+  avoc_item_materialize(&item);
+  assert_eq(item.str_owned, 1);
   assert_eqs(item.as_str, ";; another comment ;;");
+  avoc_item_free(&item);
+  avoc_source_free(&src);
+
+  load_string(&src, "sym:type");
+  avoc_item_init(&item);
+  status = avoc_next_token(&src, &token);
+  assert_okb(status == OK);
+  status = avoc_parse_sym(&src, &token, &item);
+  assert_okb(status == OK);
+  avoc_item_materialize(&item);
   avoc_source_free(&src);
+  assert_eqs(item.as_sym, "sym");
+  assert_eqs(item.sym_ordinary_type, "type");
+  avoc_item_free(&item);
 }
 
 void test_parse_item_no_lists() {
@@ -1149,14 +1404,14 @@ void test_parse_item_no_lists() {
   status = avoc_parse_item(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_SYM);
-  assert_eqs(item.as_sym, "a");
+  assert_eqsn(item.as_sym, item.str_len, "a");
   avoc_item_free(&item);
 
   avoc_item_init(&item);
   status = avoc_parse_item(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_LIT_STR);
-  assert_eqs(item.as_str, "1");
+  assert_eqsn(item.as_str, item.str_len, "1");
   avoc_item_free(&item);
 
   avoc_item_init(&item);
@@ -1177,15 +1432,15 @@ void test_parse_item_no_lists() {
   status = avoc_parse_item(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_COMMENT);
-  assert_eqs(item.as_str, ";; 4 ;;");
+  assert_eqsn(item.as_str, item.str_len, ";; 4 ;;");
   avoc_item_free(&item);
 
   avoc_item_init(&item);
   status = avoc_parse_item(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_SYM);
-  assert_eqs(item.as_sym, "%5");
-  assert_eqs(item.sym_ordinary_type, "%6");
+  assert_eqsn(item.as_sym, item.str_len, "%5");
+  assert_eqsn(item.sym_ordinary_type, item.sym_ordinary_type_len, "%6");
   avoc_item_free(&item);
 
   avoc_item_init(&item);
@@ -1222,11 +1477,11 @@ void test_parse_calls() {
   assert_okb(status == OK);
   assert_okb(list.head != NULL);
   assert_eq(list.head->type, ITEM_SYM);
-  assert_eqs(list.head->as_sym, "first");
+  assert_eqsn(list.head->as_sym, list.head->str_len, "first");
 
   assert_okb(list.tail != NULL);
   assert_eq(list.tail->type, ITEM_SYM);
-  assert_eqs(list.tail->as_sym, "second");
+  assert_eqsn(list.tail->as_sym, list.tail->str_len, "second");
   avoc_list_free(&list);
   avoc_source_free(&src);
 
@@ -1238,11 +1493,11 @@ void test_parse_calls() {
   assert_okb(status == OK);
   assert_okb(list.head != NULL);
   assert_eq(list.head->type, ITEM_SYM);
-  assert_eqs(list.head->as_sym, "first");
+  assert_eqsn(list.head->as_sym, list.head->str_len, "first");
 
   assert_okb(list.tail != NULL);
   assert_eq(list.tail->type, ITEM_SYM);
-  assert_eqs(list.tail->as_sym, "second");
+  assert_eqsn(list.tail->as_sym, list.tail->str_len, "second");
   avoc_list_free(&list);
   avoc_source_free(&src);
 
@@ -1254,11 +1509,11 @@ void test_parse_calls() {
   assert_okb(status == OK);
   assert_okb(list.head != NULL);
   assert_eq(list.head->type, ITEM_SYM);
-  assert_eqs(list.head->as_sym, "first");
+  assert_eqsn(list.head->as_sym, list.head->str_len, "first");
 
   assert_okb(list.tail != NULL);
   assert_eq(list.tail->type, ITEM_SYM);
-  assert_eqs(list.tail->as_sym, "second");
+  assert_eqsn(list.tail->as_sym, list.tail->str_len, "second");
   avoc_list_free(&list);
   avoc_source_free(&src);
 
@@ -1270,13 +1525,14 @@ void test_parse_calls() {
   assert_okb(status == OK);
   assert_okb(list.head != NULL);
   assert_eq(list.head->type, ITEM_SYM);
-  assert_eqs(list.head->as_sym, "first");
+  assert_eqsn(list.head->as_sym, list.head->str_len, "first");
 
   assert_okb(list.tail != NULL);
   assert_eq(list.tail->type, ITEM_SYM);
-  assert_eqs(list.tail->as_sym, "second");
+  assert_eqsn(list.tail->as_sym, list.tail->str_len, "second");
   assert_okb(list.tail->sym_ordinary_type != NULL);
-  assert_eqs(list.tail->sym_ordinary_type, "third");
+  assert_eqsn(list.tail->sym_ordinary_type, list.tail->sym_ordinary_type_len,
+              "third");
   avoc_list_free(&list);
   avoc_source_free(&src);
 
@@ -1288,7 +1544,7 @@ void test_parse_calls() {
   assert_okb(status == OK);
   assert_okb(list.head != NULL);
   assert_eq(list.head->type, ITEM_SYM);
-  assert_eqs(list.head->as_sym, "num");
+  assert_eqsn(list.head->as_sym, list.head->str_len, "num");
 
   assert_okb(list.tail != NULL);
   assert_eq(list.tail->type, ITEM_LIT_I32);
@@ -1304,11 +1560,11 @@ void test_parse_calls() {
   assert_okb(status == OK);
   assert_okb(list.head != NULL);
   assert_eq(list.head->type, ITEM_SYM);
-  assert_eqs(list.head->as_sym, "str");
+  assert_eqsn(list.head->as_sym, list.head->str_len, "str");
 
   assert_okb(list.tail != NULL);
   assert_eq(list.tail->type, ITEM_LIT_STR);
-  assert_eqs(list.tail->as_str, "string");
+  assert_eqsn(list.tail->as_str, list.tail->str_len, "string");
   avoc_list_free(&list);
   avoc_source_free(&src);
 
@@ -1320,12 +1576,13 @@ void test_parse_calls() {
   assert_okb(status == OK);
   assert_okb(list.head != NULL);
   assert_eq(list.head->type, ITEM_SYM);
-  assert_eqs(list.head->as_sym, "parent");
+  assert_eqsn(list.head->as_sym, list.head->str_len, "parent");
 
   assert_okb(list.tail != NULL);
   assert_okb(list.tail->type == ITEM_CALL);
   assert_okb(list.tail->as_list->head->type == ITEM_SYM);
-  assert_eqs(list.tail->as_list->head->as_sym, "child");
+  assert_eqsn(list.tail->as_list->head->as_sym,
+              list.tail->as_list->head->str_len, "child");
   avoc_list_free(&list);
   avoc_source_free(&src);
 }
@@ -1344,18 +1601,18 @@ void test_parse_sym_with_composed_type() {
   status = avoc_parse_item(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_SYM);
-  assert_eqs(item.as_sym, "sym");
+  assert_eqsn(item.as_sym, item.str_len, "sym");
 
   assert_okb(item.sym_composed_type != NULL);
   type = item.sym_composed_type;
 
   assert_okb(type->head != NULL);
   assert_eq(type->head->type, ITEM_SYM);
-  assert_eqs(type->head->as_sym, "composed");
+  assert_eqsn(type->head->as_sym, type->head->str_len, "composed");
 
   assert_okb(type->tail != NULL);
   assert_eq(type->tail->type, ITEM_SYM);
-  assert_eqs(type->tail->as_sym, "type");
+  assert_eqsn(type->tail->as_sym, type->tail->str_len, "type");
   avoc_item_free(&item);
   avoc_source_free(&src);
 
@@ -1366,19 +1623,20 @@ void test_parse_sym_with_composed_type() {
   status = avoc_parse_item(&src, &token, &item);
   assert_okb(status == OK);
   assert_eq(item.type, ITEM_SYM);
-  assert_eqs(item.as_sym, "sym");
+  assert_eqsn(item.as_sym, item.str_len, "sym");
 
   assert_okb(item.sym_composed_type != NULL);
   type = item.sym_composed_type;
 
   assert_okb(type->head != NULL);
   assert_eq(type->head->type, ITEM_SYM);
-  assert_eqs(type->head->as_sym, "composed");
+  assert_eqsn(type->head->as_sym, type->head->str_len, "composed");
 
   assert_okb(type->tail != NULL);
   assert_eq(type->tail->type, ITEM_CALL);
   assert_okb(type->tail->as_list->head->type == ITEM_SYM);
-  assert_eqs(type->tail->as_list->head->as_sym, "type");
+  assert_eqsn(type->tail->as_list->head->as_sym,
+              type->tail->as_list->head->str_len, "type");
   avoc_item_free(&item);
   avoc_source_free(&src);
 }
@@ -1416,13 +1674,2451 @@ void test_parse_source() {
   assert_eq(list.head->as_list->head->as_i32, 1);
   avoc_list_free(&list);
   avoc_source_free(&src);
+
+  // nesting is limited instead of exhausting the stack
+  char *deep = malloc(AVOC_MAX_DEPTH * 2 + 3);
+  memset(deep, '(', AVOC_MAX_DEPTH);
+  memset(deep + AVOC_MAX_DEPTH, ')', AVOC_MAX_DEPTH);
+  deep[AVOC_MAX_DEPTH * 2] = 0;
+  load_string(&src, deep);
+  avoc_list_init(&list);
+  status = avoc_parse_source(&src, &list);
+  assert_okb(status == OK);
+  assert_eql(src.depth, 0L);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+
+  memmove(deep + 1, deep, AVOC_MAX_DEPTH * 2 + 1);
+  deep[0] = '(';
+  strcat(deep, ")");
+  load_string(&src, deep);
+  avoc_list_init(&list);
+  status = avoc_parse_source(&src, &list);
+  assert_ok(status == FAILED);
+  assert_eql(src.depth, 0L);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+  free(deep);
+}
+
+void test_parse_source_lazy() {
+  avoc_source src;
+  avoc_list list;
+  avoc_status status;
+
+  load_string(&src, "(def a 1)\n(def b:(T) [2 (3 ')')])\n(c)");
+  avoc_list_init(&list);
+  status = avoc_parse_source_lazy(&src, &list);
+  assert_okb(status == OK);
+  assert_eql(list.item_count, 3L);
+  assert_eq(list.head->type, ITEM_LAZY);
+  assert_eqsn(list.head->as_str, list.head->str_len, "(def a 1)");
+
+  avoc_item *item = list.head->next_sibling;
+  assert_eq(item->type, ITEM_LAZY);
+  assert_eqsn(item->as_str, item->str_len, "(def b:(T) [2 (3 ')')])");
+  assert_eq(list.tail->type, ITEM_LAZY);
+
+  status = avoc_item_force(&src, item);
+  assert_okb(status == OK);
+  assert_eq(item->type, ITEM_CALL);
+  assert_eql(item->as_list->item_count, 3L);
+  assert_eqsn(item->as_list->head->as_sym, item->as_list->head->str_len,
+              "def");
+  assert_okb(item->as_list->tail->type == ITEM_LIT_LST);
+  assert_eql(item->as_list->tail->as_list->item_count, 2L);
+
+  // forcing twice is a no-op
+  status = avoc_item_force(&src, item);
+  assert_okb(status == OK);
+  assert_eq(item->type, ITEM_CALL);
+
+  status = avoc_item_force(&src, list.tail);
+  assert_okb(status == OK);
+  assert_eq(list.tail->type, ITEM_CALL);
+  assert_eql(list.tail->as_list->item_count, 1L);
+  assert_eq(list.head->type, ITEM_LAZY);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+
+  load_string(&src, "(def a (1)");
+  avoc_list_init(&list);
+  status = avoc_parse_source_lazy(&src, &list);
+  assert_ok(status == FAILED);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+
+  load_string(&src, "(a [)]");
+  avoc_list_init(&list);
+  status = avoc_parse_source_lazy(&src, &list);
+  assert_okb(status == OK);
+  status = avoc_item_force(&src, list.head);
+  assert_ok(status == FAILED);
+  assert_eq(list.head->type, ITEM_LAZY);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+}
+
+typedef struct {
+  size_t allocs;
+  size_t frees;
+} counting_ctx;
+
+static void *counting_malloc(void *ctx, size_t size) {
+  ((counting_ctx *)ctx)->allocs++;
+  return malloc(size);
+}
+
+static void *counting_realloc(void *ctx, void *ptr, size_t old_size,
+                              size_t new_size) {
+  (void)old_size;
+  ((counting_ctx *)ctx)->allocs++;
+  return realloc(ptr, new_size);
+}
+
+static void counting_free(void *ctx, void *ptr, size_t size) {
+  (void)size;
+  ((counting_ctx *)ctx)->frees++;
+  free(ptr);
+}
+
+void test_alloc_stats() {
+  counting_ctx ctx = {0L, 0L};
+  avoc_allocator alloc = {counting_malloc, counting_realloc, counting_free,
+                          &ctx};
+  avoc_alloc_stats before, after;
+  avoc_tree_stats tree;
+  avoc_source src;
+  avoc_list list;
+  avoc_status status;
+
+  avoc_set_allocator(&alloc);
+  avoc_get_alloc_stats(&before);
+  avoc_reset_alloc_stats();
+
+  load_string(&src, "(def a:T 'str\\n' [1 2.0 `raw`] ; comment\n) (b)");
+  avoc_list_init(&list);
+  status = avoc_parse_source(&src, &list);
+  assert_okb(status == OK);
+
+  assert_okb(avoc_list_stats(&list, &tree) == OK);
+  assert_eql(tree.item_count, 11L);
+  assert_eql(tree.list_count, 3L);
+  assert_eql(tree.item_kinds[ITEM_CALL], 2L);
+  assert_eql(tree.item_kinds[ITEM_SYM], 3L);
+  assert_eql(tree.item_kinds[ITEM_LIT_STR], 2L);
+  assert_eql(tree.item_kinds[ITEM_LIT_LST], 1L);
+  assert_eql(tree.item_kinds[ITEM_LIT_I32], 1L);
+  assert_eql(tree.item_kinds[ITEM_LIT_F32], 1L);
+  assert_eql(tree.item_kinds[ITEM_COMMENT], 1L);
+  assert_eql(tree.item_bytes, 11L * sizeof(avoc_item));
+  assert_eql(tree.list_bytes, 3L * sizeof(avoc_list));
+  assert_eql(tree.str_bytes, 5L);
+  assert_eql(tree.sym_bytes, 0L);
+  assert_eql(tree.view_bytes, 19L);
+
+  avoc_alloc_stats stats;
+  avoc_get_alloc_stats(&stats);
+  assert_eql(stats.alloc_count, ctx.allocs);
+  assert_ok(stats.bytes_in_use - before.bytes_in_use >=
+            tree.item_bytes + tree.list_bytes + tree.str_bytes);
+  assert_ok(stats.peak_bytes >= stats.bytes_in_use);
+
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+  avoc_get_alloc_stats(&after);
+  assert_eql(after.bytes_in_use, before.bytes_in_use);
+  assert_eql(after.free_count, ctx.frees);
+  assert_eql(ctx.allocs, ctx.frees);
+  avoc_set_allocator(NULL);
+}
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+  size_t writes;
+} string_sink;
+
+static size_t sink_write(void *ctx, const char *data, size_t len) {
+  string_sink *sink = ctx;
+  if (sink->len + len + 1 > sink->cap) {
+    sink->cap = (sink->len + len + 1) * 2;
+    sink->data = realloc(sink->data, sink->cap);
+  }
+
+  memcpy(sink->data + sink->len, data, len);
+  sink->len += len;
+  sink->data[sink->len] = 0;
+  sink->writes++;
+  return len;
+}
+
+static size_t failing_write(void *ctx, const char *data, size_t len) {
+  (void)ctx;
+  (void)data;
+  return len / 2;
+}
+
+// Parses str and formats it with the given width, NULL if parsing fails.
+static char *format_string(const char *str, size_t width) {
+  avoc_source src;
+  avoc_list list;
+  avoc_format_options opts;
+  string_sink sink = {NULL, 0L, 0L, 0L};
+
+  load_string(&src, str);
+  avoc_list_init(&list);
+  avoc_format_options_init(&opts);
+  opts.width = width;
+  if (avoc_parse_source(&src, &list) == OK &&
+      avoc_format_list(&list, &opts, sink_write, &sink) != OK) {
+    free(sink.data);
+    sink.data = NULL;
+  }
+
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+  return sink.data;
+}
+
+// Formats str and checks the output against expected and that formatting
+// the output again does not change it.
+static void assert_format(const char *str, size_t width, const char *expected) {
+  char *first = format_string(str, width);
+  assert_ok(first != NULL);
+  if (first == NULL) {
+    return;
+  }
+
+  assert_eqs(first, expected);
+  char *second = format_string(first, width);
+  assert_ok(second != NULL);
+  if (second != NULL) {
+    assert_eqs(second, first);
+  }
+
+  free(first);
+  free(second);
+}
+
+void test_format() {
+  avoc_format_options opts;
+  avoc_format_options_init(&opts);
+  assert_eql(opts.width, 80L);
+  assert_eql(opts.indent, 2L);
+
+  assert_format("(def   a 1)", 80, "(def a 1)\n");
+  assert_format("(a)\n\n\n(b)", 80, "(a)\n(b)\n");
+  assert_format("(f true false nil)", 80, "(f true false nil)\n");
+  assert_format("(f -5 7i64 0x10u32 0b11u64)", 80, "(f -5 7i64 16u32 3u64)\n");
+  assert_format("(f 1.5 2.0f64 1.0e3 0.1 1.5e-7f64)", 80,
+                "(f 1.5 2.0f64 1000.0 0.1 1.5e-07f64)\n");
+  assert_format("(f \"a\\x41\\\"\\\\\\n\\t\\r\\a\")", 80,
+                "(f \"aA\\\"\\\\\\n\\t\\r\\x07\")\n");
+  assert_format("(f `raw\\n`)", 80, "(f \"raw\\\\n\")\n");
+
+  // \x above 0x7F is a code point, so the output reparses to the same text
+  int same = 1;
+  for (int byte = 0x80; byte <= 0xFF; byte++) {
+    char str[16];
+    char expected[16];
+    snprintf(str, sizeof(str), "(f \"\\x%02X\")", byte);
+    snprintf(expected, sizeof(expected), "(f \"%c%c\")\n", 0xC0 | byte >> 6,
+             0x80 | (byte & 0x3F));
+    char *first = format_string(str, 80);
+    char *second = first != NULL ? format_string(first, 80) : NULL;
+    same &= second != NULL && strcmp(first, expected) == 0 &&
+            strcmp(second, first) == 0;
+    free(second);
+    free(first);
+  }
+
+  assert_okb(same);
+  assert_format("(f \"\xc3\xa1\")", 80, "(f \"\xc3\xa1\")\n");
+  assert_format("(def a:i32 b:(fn i32))", 80, "(def a:i32 b:(fn i32))\n");
+  assert_format("(f [1 [2 3]] ())", 80, "(f [1 [2 3]] ())\n");
+
+  // lists that do not fit put each element after the first in its own line
+  assert_format("(defn add [a b] (+ a b))", 12,
+                "(defn\n  add\n  [a b]\n  (+ a b))\n");
+  assert_format("(defn add [a b] (let [c (+ a b)] (* c c)))", 24,
+                "(defn\n  add\n  [a b]\n  (let\n    [c (+ a b)]\n"
+                "    (* c c)))\n");
+  assert_format("(f [1 2 3 4 5 6 7 8])", 10,
+                "(f\n  [1\n    2\n    3\n    4\n    5\n    6\n    7\n"
+                "    8])\n");
+  assert_format("(f \"\xc3\xa1\xc3\xa1\xc3\xa1\" x)", 11,
+                "(f \"\xc3\xa1\xc3\xa1\xc3\xa1\" x)\n");
+  assert_format("(f \"\xc3\xa1\xc3\xa1\xc3\xa1\" x)", 10,
+                "(f\n  \"\xc3\xa1\xc3\xa1\xc3\xa1\"\n  x)\n");
+
+  // line comments always end their line
+  assert_format("(f ; one\n a b)", 80, "(f\n  ; one\n  a\n  b)\n");
+  assert_format("(f a ; one\n)", 80, "(f\n  a\n  ; one\n)\n");
+  assert_format("(f a #| two |# b)", 80, "(f a #| two |# b)\n");
+
+  // a wider indentation step
+  avoc_source src;
+  avoc_list list;
+  string_sink sink = {NULL, 0L, 0L, 0L};
+  load_string(&src, "(defn f [a] a)");
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+  opts.width = 8;
+  opts.indent = 4;
+  assert_okb(avoc_format_list(&list, &opts, sink_write, &sink) == OK);
+  assert_eqs(sink.data, "(defn\n    f\n    [a]\n    a)\n");
+  assert_ok(avoc_format_list(&list, NULL, failing_write, NULL) == FAILED);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+  free(sink.data);
+
+  // deep nesting and long output are handled without recursion and with
+  // a bounded number of writes
+  const size_t depth = 100000L;
+  avoc_list_init(&list);
+  avoc_list *cur = &list;
+  for (size_t i = 0; i < depth; i++) {
+    avoc_item *item = avoc_malloc(sizeof(avoc_item));
+    avoc_item_init(item);
+    item->type = ITEM_LIT_LST;
+    item->as_list = avoc_malloc(sizeof(avoc_list));
+    avoc_list_init(item->as_list);
+    avoc_list_push(cur, item);
+    cur = item->as_list;
+  }
+
+  avoc_item *num = avoc_malloc(sizeof(avoc_item));
+  avoc_item_init(num);
+  num->type = ITEM_LIT_I32;
+  num->as_i32 = 1;
+  avoc_list_push(cur, num);
+
+  sink = (string_sink){NULL, 0L, 0L, 0L};
+  assert_okb(avoc_format_list(&list, NULL, sink_write, &sink) == OK);
+  assert_eql(sink.len, depth * 2 + 2);
+  assert_okb(sink.data != NULL && strncmp(sink.data, "[[[[", 4) == 0);
+  assert_okb(sink.data != NULL && strncmp(sink.data + depth, "1]]]]", 5) == 0);
+  assert_okb(sink.writes < sink.len / 4096);
+  free(sink.data);
+
+  // measuring whether it fits a very wide line does not recurse either
+  opts.width = 1L << 22;
+  opts.indent = 2;
+  sink = (string_sink){NULL, 0L, 0L, 0L};
+  assert_okb(avoc_format_list(&list, &opts, sink_write, &sink) == OK);
+  assert_eql(sink.len, depth * 2 + 2);
+  avoc_list_free(&list);
+  free(sink.data);
+
+  // floats out of range have no literal, the largest ones round-trip
+  const char *overflows[] = {"(f 1e999f64)", "(f 1e40f32)", "(f -1e999f64)"};
+  for (size_t i = 0; i < sizeof(overflows) / sizeof(overflows[0]); i++) {
+    load_string(&src, overflows[i]);
+    avoc_list_init(&list);
+    assert_ok(avoc_parse_source(&src, &list) == FAILED);
+    avoc_list_free(&list);
+    avoc_source_free(&src);
+  }
+
+  load_string(&src, "(f 3.4028235e38f32 -1.7976931348623157e308f64 1e-45f32 "
+                    "5e-324f64 0.1)");
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+  sink = (string_sink){NULL, 0L, 0L, 0L};
+  assert_okb(avoc_format_list(&list, NULL, sink_write, &sink) == OK);
+  avoc_source reparsed_src;
+  avoc_list reparsed;
+  load_string(&reparsed_src, sink.data != NULL ? sink.data : "");
+  avoc_list_init(&reparsed);
+  assert_okb(avoc_parse_source(&reparsed_src, &reparsed) == OK);
+  assert_okb(reparsed.hash == list.hash);
+  avoc_list_free(&reparsed);
+  avoc_source_free(&reparsed_src);
+  free(sink.data);
+
+  // bytes that are not UTF-8 are escaped, the valid sequences around them
+  // are kept, and the output parses again
+  avoc_source bytes_src;
+  avoc_list bytes;
+  load_string(&bytes_src, "(f \"\")");
+  avoc_list_init(&bytes);
+  assert_okb(avoc_parse_source(&bytes_src, &bytes) == OK);
+  avoc_item *str = bytes.head->as_list->tail;
+  str->as_str = copy_string("a\xFF\xC3\xA1\xE2\x82\xC0\x80\xED\xA0\x80z",
+                            &str->str_len);
+  str->str_owned = 1;
+  sink = (string_sink){NULL, 0L, 0L, 0L};
+  assert_okb(avoc_format_list(&bytes, NULL, sink_write, &sink) == OK);
+  assert_eqs(sink.data != NULL ? sink.data : "",
+             "(f \"a\\xFF\xC3\xA1\\xE2\\x82\\xC0\\x80\\xED\\xA0\\x80z\")\n");
+  char *reformatted = format_string(sink.data != NULL ? sink.data : "", 80);
+  assert_okb(reformatted != NULL);
+  free(reformatted);
+  free(sink.data);
+  avoc_list_free(&bytes);
+  avoc_source_free(&bytes_src);
+
+  list.head->as_list->tail->as_f32 = (float)HUGE_VAL;
+  sink = (string_sink){NULL, 0L, 0L, 0L};
+  assert_ok(avoc_format_list(&list, NULL, sink_write, &sink) == FAILED);
+  free(sink.data);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+}
+
+void test_structural_hash() {
+  avoc_source src;
+  avoc_list list;
+  avoc_status status;
+
+  load_string(&src, "(f 1 'a' b:i32 [c]) (f 1 'a' b:i32 [c]) (f 1 'a' b [c])\n"
+                    "(f [1 2]) (f [2 1]) (f 1.0) (f 1)");
+  avoc_list_init(&list);
+  status = avoc_parse_source(&src, &list);
+  assert_okb(status == OK);
+  assert_eql(list.item_count, 7L);
+
+  avoc_item *item = list.head;
+  uint64_t hashes[7];
+  for (size_t i = 0; item != NULL; item = item->next_sibling, i++) {
+    hashes[i] = item->hash;
+    assert_ok(item->hash != 0UL);
+    assert_ok(item->as_list->hash != 0UL);
+  }
+
+  assert_okb(hashes[0] == hashes[1]);
+  assert_okb(hashes[0] != hashes[2]);
+  assert_okb(hashes[3] != hashes[4]);
+  assert_okb(hashes[5] != hashes[6]);
+  assert_okb(list.head->as_list->tail->hash ==
+             list.head->next_sibling->as_list->tail->hash);
+
+  // the hash of a list depends on its items and their order
+  avoc_list copy;
+  avoc_list_init(&copy);
+  for (item = list.head->as_list->head; item != NULL;
+       item = item->next_sibling) {
+    avoc_item *dup = avoc_malloc(sizeof(avoc_item));
+    *dup = *item;
+    dup->next_sibling = NULL;
+    dup->prev_sibling = NULL;
+    avoc_list_push(&copy, dup);
+  }
+
+  assert_okb(copy.hash == list.head->as_list->hash);
+  while (copy.head != NULL) {
+    avoc_item *nxt = copy.head->next_sibling;
+    avoc_free(copy.head, sizeof(avoc_item));
+    copy.head = nxt;
+  }
+
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+
+  // forcing a lazy item gives it the hash of the eagerly parsed form
+  load_string(&src, "(f [1 2] x:(T))");
+  avoc_list_init(&list);
+  status = avoc_parse_source(&src, &list);
+  assert_okb(status == OK);
+  uint64_t eager = list.head->hash;
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+
+  load_string(&src, "(f [1 2] x:(T))");
+  avoc_list_init(&list);
+  status = avoc_parse_source_lazy(&src, &list);
+  assert_okb(status == OK);
+  assert_okb(list.head->hash != eager);
+  status = avoc_item_force(&src, list.head);
+  assert_okb(status == OK);
+  assert_okb(list.head->hash == eager);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+}
+
+void test_parse_source_shared() {
+  const char *text = "(def a (+ (* x 2) [1 2]))\n"
+                     "(def b (+ (* x 2) [1 2]))\n"
+                     "(def c:(fn i32) (* x 2))\n"
+                     "(def a (+ (* x 2) [1 2]))";
+  avoc_alloc_stats base, plain, shared;
+  avoc_source src;
+  avoc_list list;
+  avoc_status status;
+
+  avoc_get_alloc_stats(&base);
+  load_string(&src, text);
+  avoc_list_init(&list);
+  status = avoc_parse_source(&src, &list);
+  assert_okb(status == OK);
+  avoc_get_alloc_stats(&plain);
+  char *expected = format_string(text, 80);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+
+  load_string(&src, text);
+  avoc_list_init(&list);
+  status = avoc_parse_source_shared(&src, &list);
+  assert_okb(status == OK);
+  assert_okb(src.cons == NULL);
+  avoc_get_alloc_stats(&shared);
+  assert_ok(shared.bytes_in_use < plain.bytes_in_use);
+
+  avoc_item *a = list.head;
+  avoc_item *b = a->next_sibling;
+  avoc_item *c = b->next_sibling;
+  avoc_item *a2 = list.tail;
+  assert_okb(a->as_list == a2->as_list);
+  assert_eql(a->as_list->refs, 2L);
+  assert_okb(a->as_list != b->as_list);
+
+  // (+ (* x 2) [1 2]) is shared by a and b, (* x 2) also by c
+  avoc_list *sum = a->as_list->tail->as_list;
+  assert_okb(sum == b->as_list->tail->as_list);
+  assert_okb(sum->head->next_sibling->as_list == c->as_list->tail->as_list);
+  assert_okb(sum->tail->as_list->item_count == 2L);
+
+  string_sink sink = {NULL, 0L, 0L, 0L};
+  assert_okb(avoc_format_list(&list, NULL, sink_write, &sink) == OK);
+  assert_okb(sink.data != NULL && expected != NULL &&
+             strcmp(sink.data, expected) == 0);
+  free(sink.data);
+  free(expected);
+
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+  avoc_get_alloc_stats(&shared);
+  assert_eql(shared.bytes_in_use, base.bytes_in_use);
+
+  // a failed parse releases the lists shared so far
+  load_string(&src, "(a (b 1) (b 1)) (a (b 1) (b 1)) (c (b 1)");
+  avoc_list_init(&list);
+  status = avoc_parse_source_shared(&src, &list);
+  assert_ok(status == FAILED);
+  assert_okb(src.cons == NULL);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+  avoc_get_alloc_stats(&shared);
+  assert_eql(shared.bytes_in_use, base.bytes_in_use);
+}
+
+static avoc_status add_module(avoc_module_graph *graph, const char *name,
+                              const char *text) {
+  return avoc_module_graph_add(graph, name, text, strlen(text));
+}
+
+void test_module_graph() {
+  avoc_module_graph first, second, third, bad;
+  avoc_alloc_stats before, cold, after_cold, warm;
+  avoc_status status;
+
+  avoc_module_graph_init(&first);
+  add_module(&first, "app", "(import math) (import 'base') (main)");
+  add_module(&first, "math", "(import base) (def area:(fn f64) (* pi 2.0))");
+  add_module(&first, "base", "(def pi:f64 3.14) (def e 2.71)");
+  add_module(&first, "util", "(def id:(fn T) (x))");
+  avoc_get_alloc_stats(&before);
+  status = avoc_module_graph_build(&first, NULL);
+  assert_okb(status == OK);
+  assert_eql(first.count, 4L);
+  avoc_get_alloc_stats(&cold);
+
+  const avoc_module *app = &first.modules[0];
+  const avoc_module *math = &first.modules[1];
+  const avoc_module *base = &first.modules[2];
+  assert_eql(app->dep_count, 2L);
+  assert_eql(app->deps[0], 1L);
+  assert_eql(app->deps[1], 2L);
+  assert_eql(math->dep_count, 1L);
+  assert_eql(base->dep_count, 0L);
+  assert_eql(base->level, 0L);
+  assert_eql(math->level, 1L);
+  assert_eql(app->level, 2L);
+  assert_eql(first.modules[3].level, 0L);
+  assert_eql(first.order[0], 2L);
+  assert_eql(first.order[1], 3L);
+  assert_eql(first.order[2], 1L);
+  assert_eql(first.order[3], 0L);
+  for (size_t i = 0; i < first.count; i++) {
+    assert_eq(first.modules[i].dirty, 1);
+  }
+
+  // a new value for a typed definition keeps the interface of base
+  avoc_module_graph_init(&second);
+  add_module(&second, "app", "(import math) (import 'base') (main)");
+  add_module(&second, "math", "(import base) (def area:(fn f64) (* pi 2.0))");
+  add_module(&second, "base", "(def pi:f64 3.1416) (def e 2.71)");
+  add_module(&second, "util", "(def id:(fn T) (x))");
+  avoc_get_alloc_stats(&after_cold);
+  status = avoc_module_graph_build(&second, &first);
+  assert_okb(status == OK);
+  avoc_get_alloc_stats(&warm);
+  assert_ok(warm.alloc_count - after_cold.alloc_count <
+            cold.alloc_count - before.alloc_count);
+
+  // unchanged modules take their trees from the previous build
+  assert_eq(second.modules[0].reused, 1);
+  assert_eq(second.modules[1].reused, 1);
+  assert_eq(second.modules[2].reused, 0);
+  assert_eq(second.modules[3].reused, 1);
+  assert_okb(second.modules[0].tree.item_count == 3L);
+  assert_okb(first.modules[0].tree.head == NULL);
+  assert_okb(first.order == NULL);
+  assert_eq(second.modules[0].dirty, 0);
+  assert_eq(second.modules[1].dirty, 0);
+  assert_eq(second.modules[2].dirty, 1);
+  assert_eq(second.modules[3].dirty, 0);
+  assert_okb(second.modules[2].source_hash != base->source_hash);
+  assert_okb(second.modules[2].interface_hash == base->interface_hash);
+
+  // untyped definitions are part of the interface with their value
+  avoc_module_graph_init(&third);
+  add_module(&third, "app", "(import math) (import 'base') (main)");
+  add_module(&third, "math", "(import base) (def area:(fn f64) (* pi 2.0))");
+  add_module(&third, "base", "(def pi:f64 3.1416) (def e 2.718)");
+  add_module(&third, "util", "(def id:(fn T) (x))");
+  status = avoc_module_graph_build(&third, &second);
+  assert_okb(status == OK);
+  assert_eq(third.modules[0].reused, 1);
+  assert_eq(third.modules[2].reused, 0);
+  assert_eq(third.modules[0].dirty, 1);
+  assert_eq(third.modules[1].dirty, 1);
+  assert_eq(third.modules[2].dirty, 1);
+  assert_eq(third.modules[3].dirty, 0);
+
+  avoc_module_graph_free(&first);
+  avoc_module_graph_free(&second);
+  avoc_module_graph_free(&third);
+  assert_okb(first.modules == NULL);
+  assert_eql(first.count, 0L);
+
+  // the type of an untyped definition changes with the imports it uses, so
+  // the change reaches the importers of its module
+  avoc_module_graph_init(&first);
+  add_module(&first, "a", "(def x 1)");
+  add_module(&first, "b", "(import a) (def y (x))");
+  add_module(&first, "c", "(import b)");
+  assert_okb(avoc_module_graph_build(&first, NULL) == OK);
+  avoc_module_graph_init(&second);
+  add_module(&second, "a", "(def x 1.0)");
+  add_module(&second, "b", "(import a) (def y (x))");
+  add_module(&second, "c", "(import b)");
+  assert_okb(avoc_module_graph_build(&second, &first) == OK);
+  assert_eq(second.modules[0].dirty, 1);
+  assert_eq(second.modules[1].dirty, 1);
+  assert_eq(second.modules[2].dirty, 1);
+  assert_okb(second.modules[1].interface_hash !=
+             first.modules[1].interface_hash);
+  avoc_module_graph_free(&first);
+  avoc_module_graph_free(&second);
+
+  avoc_module_graph_init(&bad);
+  add_module(&bad, "a", "(import b)");
+  add_module(&bad, "b", "(import c)");
+  add_module(&bad, "c", "(import b)");
+  status = avoc_module_graph_build(&bad, NULL);
+  assert_ok(status == FAILED);
+  avoc_module_graph_free(&bad);
+
+  avoc_module_graph_init(&bad);
+  add_module(&bad, "a", "(def x 1) (import missing)");
+  status = avoc_module_graph_build(&bad, NULL);
+  assert_ok(status == FAILED);
+  avoc_module_graph_free(&bad);
+
+  avoc_module_graph_init(&bad);
+  add_module(&bad, "a", "(import a b)");
+  status = avoc_module_graph_build(&bad, NULL);
+  assert_ok(status == FAILED);
+  avoc_module_graph_free(&bad);
+}
+
+void test_item_at() {
+  avoc_source src;
+  avoc_list list;
+  const char *text = "(def a:i32 1)\n(f [x 'str'] y:(T U))";
+
+  load_string(&src, text);
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+  assert_eql(list.head->offset, 0L);
+  assert_eql(list.head->length, 13L);
+  assert_eql(list.tail->offset, 14L);
+  assert_eql(list.tail->length, 21L);
+
+  const avoc_item *item = avoc_item_at(&list, 5);
+  assert_okb(item != NULL && item->type == ITEM_SYM);
+  assert_eql(item->offset, 5L);
+  assert_eql(item->length, 5L);
+  assert_okb(avoc_item_at(&list, 8) == item);
+
+  item = avoc_item_at(&list, 20);
+  assert_okb(item != NULL && item->type == ITEM_LIT_STR);
+  assert_eqsn(text + item->offset, item->length, "'str'");
+
+  item = avoc_item_at(&list, 17);
+  assert_okb(item != NULL && item->type == ITEM_LIT_LST);
+  assert_eqsn(text + item->offset, item->length, "[x 'str']");
+
+  item = avoc_item_at(&list, 32);
+  assert_okb(item != NULL && item->type == ITEM_SYM);
+  assert_eqsn(item->as_sym, item->str_len, "U");
+
+  item = avoc_item_at(&list, 12);
+  assert_okb(item == list.head);
+  assert_okb(avoc_item_at(&list, 13) == NULL);
+  assert_okb(avoc_item_at(&list, 100) == NULL);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+}
+
+// Formats the tree under list into a new string.
+static char *format_tree(const avoc_list *list) {
+  string_sink sink = {NULL, 0L, 0L, 0L};
+  avoc_format_list(list, NULL, sink_write, &sink);
+  return sink.data;
+}
+
+// Checks an edited tree against a fresh parse of the edited text.
+static void assert_edit_matches(const avoc_source *src, const avoc_list *list) {
+  avoc_source fresh_src;
+  avoc_list fresh;
+  avoc_source_init(&fresh_src, NULL, (const char *)src->buf_data,
+                   src->buf_len);
+  avoc_list_init(&fresh);
+  assert_okb(avoc_parse_source(&fresh_src, &fresh) == OK);
+  assert_eql(list->item_count, fresh.item_count);
+  assert_okb(list->hash == fresh.hash);
+
+  const avoc_item *a = list->head;
+  const avoc_item *b = fresh.head;
+  for (; a != NULL && b != NULL; a = a->next_sibling, b = b->next_sibling) {
+    assert_eql(a->offset, b->offset);
+    assert_eql(a->length, b->length);
+  }
+
+  char *edited = format_tree(list);
+  char *expected = format_tree(&fresh);
+  assert_okb(edited != NULL && expected != NULL &&
+             strcmp(edited, expected) == 0);
+  free(edited);
+  free(expected);
+  avoc_list_free(&fresh);
+  avoc_source_free(&fresh_src);
+}
+
+void test_source_edit() {
+  avoc_source src;
+  avoc_list list;
+  avoc_status status;
+
+  load_string(&src, "(def a 1)\n(def b 2)\n(def c 'three')");
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+  avoc_item *a = list.head;
+  avoc_item *c = list.tail;
+
+  // only the edited form is parsed again
+  status = avoc_source_edit(&src, &list, 17, 1, "(+ 1 1)", 7);
+  assert_okb(status == OK);
+  assert_eqsn((char *)src.buf_data, src.buf_len,
+              "(def a 1)\n(def b (+ 1 1))\n(def c 'three')");
+  assert_okb(list.head == a);
+  assert_okb(list.tail == c);
+  assert_okb(a->next_sibling->next_sibling == c);
+  assert_okb(c->prev_sibling == a->next_sibling);
+  assert_eql(c->offset, 26L);
+  assert_eqsn(c->as_list->tail->as_str, c->as_list->tail->str_len, "three");
+  assert_edit_matches(&src, &list);
+
+  // forms right next to the edit are parsed again too, as it may join them
+  status = avoc_source_edit(&src, &list, 0, 0, "(x) ", 4);
+  assert_okb(status == OK);
+  assert_eql(list.item_count, 4L);
+  assert_okb(list.tail == c);
+  status = avoc_source_edit(&src, &list, src.buf_len, 0, "\n(y)", 4);
+  assert_okb(status == OK);
+  assert_eql(list.item_count, 5L);
+  assert_okb(list.tail->prev_sibling != c);
+  assert_edit_matches(&src, &list);
+
+  // removing a whole form and joining two
+  status = avoc_source_edit(&src, &list, 0, 4, "", 0);
+  assert_okb(status == OK);
+  assert_eql(list.item_count, 4L);
+  status = avoc_source_edit(&src, &list, 9, 1, "", 0);
+  assert_okb(status == OK);
+  assert_edit_matches(&src, &list);
+
+  // a broken edit is still applied, the forms it breaks are kept as text
+  // and the edit repairing them parses them again
+  size_t end = src.buf_len;
+  const size_t count = list.item_count;
+  status = avoc_source_edit(&src, &list, end, 0, " (z", 3);
+  assert_ok(status == FAILED);
+  assert_eql(src.buf_len, end + 3);
+  assert_eql(list.item_count, count + 1);
+  assert_eq(list.tail->prev_sibling->type, ITEM_CALL);
+  assert_eq(list.tail->type, ITEM_LAZY);
+  assert_eqsn(list.tail->as_str, list.tail->str_len, "(z");
+  status = avoc_source_edit(&src, &list, end + 3, 0, ")", 1);
+  assert_okb(status == OK);
+  assert_eql(list.item_count, count + 1);
+  assert_eqsn(list.tail->as_list->head->as_sym,
+              list.tail->as_list->head->str_len, "z");
+  assert_edit_matches(&src, &list);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+
+  // an opening bracket swallows the forms after it until it is closed
+  load_string(&src, "(a 1) (b 2)");
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+  a = list.head;
+  status = avoc_source_edit(&src, &list, 6, 0, "(", 1);
+  assert_ok(status == FAILED);
+  assert_eqsn((char *)src.buf_data, src.buf_len, "(a 1) ((b 2)");
+  assert_okb(list.head == a);
+  assert_eql(list.item_count, 2L);
+  assert_eqsn(list.tail->as_str, list.tail->str_len, "((b 2)");
+  assert_ok(avoc_item_force(&src, list.tail) == FAILED);
+  status = avoc_source_edit(&src, &list, 12, 0, ")", 1);
+  assert_okb(status == OK);
+  assert_eqsn((char *)src.buf_data, src.buf_len, "(a 1) ((b 2))");
+  assert_okb(list.head == a);
+  assert_eql(list.item_count, 2L);
+  assert_eq(list.tail->type, ITEM_CALL);
+  assert_edit_matches(&src, &list);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+
+  // the kept text is forced only as one whole list
+  load_string(&src, "(a 1) (b 2) (c 3)");
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+  status = avoc_source_edit(&src, &list, 17, 0, ")", 1);
+  assert_ok(status == FAILED);
+  status = avoc_source_edit(&src, &list, 6, 0, "(", 1);
+  assert_ok(status == FAILED);
+  assert_eqsn((char *)src.buf_data, src.buf_len, "(a 1) ((b 2) (c 3))");
+  avoc_item *b = list.head->next_sibling;
+  assert_eqsn(b->as_str, b->str_len, "((b 2)");
+  assert_ok(avoc_item_force(&src, b) == FAILED);
+  assert_eq(b->type, ITEM_LAZY);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+
+  load_string(&src, "(a 1) (b 2)");
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+  status = avoc_source_edit(&src, &list, 6, 5, "x (b 2))", 8);
+  assert_ok(status == FAILED);
+  assert_eqsn(list.tail->as_str, list.tail->str_len, "x (b 2))");
+  assert_ok(avoc_item_force(&src, list.tail) == FAILED);
+  assert_eq(list.tail->type, ITEM_LAZY);
+
+  // a view source owns its text after the first edit
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+  const char *text = "(a)";
+  avoc_source_init_view(&src, NULL, text, 3);
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+  status = avoc_source_edit(&src, &list, 2, 0, " b", 2);
+  assert_okb(status == OK);
+  assert_eq(src.buf_owned, 1);
+  assert_eqs(text, "(a)");
+  assert_edit_matches(&src, &list);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+}
+
+#ifdef AVOCC_TRACE
+void test_trace() {
+  avoc_source src;
+  avoc_list list;
+  avoc_status status;
+  avoc_trace_stats stats;
+  char buf[512] = {0};
+
+  FILE *out = tmpfile();
+  assert_okb(out != NULL);
+  avoc_reset_trace_stats();
+  avoc_trace_open(out);
+
+  avoc_source_init(&src, "dir/\"file\".avo", "(a 'b' 1)", 9L);
+  avoc_list_init(&list);
+  status = avoc_parse_source(&src, &list);
+  assert_okb(status == OK);
+  avoc_trace_close();
+
+  avoc_get_trace_stats(&stats);
+  assert_eql(stats.token_counts[TOKEN_CALL_S], 1L);
+  assert_eql(stats.token_counts[TOKEN_ID], 1L);
+  assert_eql(stats.token_counts[TOKEN_LIT_STR], 1L);
+  assert_eql(stats.token_counts[TOKEN_LIT_NUM], 1L);
+  assert_eql(stats.token_counts[TOKEN_CALL_E], 1L);
+  assert_eql(stats.phase_calls[AVOC_PHASE_LEX], 6L);
+  assert_eql(stats.phase_calls[AVOC_PHASE_LIST], 1L);
+  assert_eql(stats.phase_calls[AVOC_PHASE_LIT], 2L);
+  assert_eql(stats.phase_calls[AVOC_PHASE_SYM], 1L);
+  assert_ok(stats.phase_ticks[AVOC_PHASE_LEX] > 0);
+
+  rewind(out);
+  size_t len = fread(buf, sizeof(char), sizeof(buf) - 1, out);
+  assert_ok(len > 0);
+  assert_ok(strstr(buf, "\"name\":\"parse\"") != NULL);
+  assert_ok(strstr(buf, "\"file\":\"dir/\\\"file\\\".avo\"") != NULL);
+  assert_ok(buf[0] == '[' && strstr(buf, "}}\n]\n") != NULL);
+  fclose(out);
+
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+}
+#endif
+
+void test_value_boxing() {
+  avoc_value v;
+
+  v = avoc_value_nil();
+  assert_ok(avoc_value_is_nil(v));
+  assert_ok(!avoc_value_is_f64(v) && !avoc_value_is_bol(v));
+
+  v = avoc_value_bol(1);
+  assert_ok(avoc_value_is_bol(v) && !avoc_value_is_nil(v));
+  assert_eq(avoc_value_as_bol(v), 1);
+  assert_eq(avoc_value_as_bol(avoc_value_bol(0)), 0);
+
+  v = avoc_value_i32(-42);
+  assert_ok(avoc_value_is_i32(v) && !avoc_value_is_f64(v));
+  assert_eq(avoc_value_as_i32(v), -42);
+
+  v = avoc_value_f64(-2.5);
+  assert_ok(avoc_value_is_f64(v) && !avoc_value_is_ptr(v));
+  assert_eqf(avoc_value_as_f64(v), -2.5);
+
+  v = avoc_value_f64(0.0 / 0.0);
+  assert_ok(avoc_value_is_f64(v));
+  assert_ok(avoc_value_as_f64(v) != avoc_value_as_f64(v));
+
+  v = avoc_value_ptr(&v);
+  assert_ok(avoc_value_is_ptr(v) && !avoc_value_is_f64(v));
+  assert_ok(!avoc_value_is_i32(v) && !avoc_value_is_bol(v));
+  assert_ok(avoc_value_as_ptr(v) == &v);
+  assert_eql(sizeof(avoc_value), 8L);
+
+  avoc_source src;
+  avoc_token token;
+  avoc_item item;
+  avoc_status status;
+
+  load_string(&src, "[true nil -7 2.5f64 -3i64 0xFFFFFFFFFFu64 "
+                    "0xFFFFFFFFFFFFFFFFu64 'str']");
+  avoc_item_init(&item);
+  status = avoc_next_token(&src, &token);
+  assert_okb(status == OK);
+  status = avoc_parse_lit(&src, &token, &item);
+  assert_okb(status == OK);
+
+  avoc_item *cur = item.as_list->head;
+  assert_okb(avoc_value_from_item(cur, &v) == OK);
+  assert_ok(avoc_value_is_bol(v) && avoc_value_as_bol(v) == 1);
+
+  cur = cur->next_sibling;
+  assert_okb(avoc_value_from_item(cur, &v) == OK);
+  assert_ok(avoc_value_is_nil(v));
+
+  cur = cur->next_sibling;
+  assert_okb(avoc_value_from_item(cur, &v) == OK);
+  assert_ok(avoc_value_is_i32(v));
+  assert_eq(avoc_value_as_i32(v), -7);
+
+  cur = cur->next_sibling;
+  assert_okb(avoc_value_from_item(cur, &v) == OK);
+  assert_ok(avoc_value_is_f64(v));
+  assert_eqf(avoc_value_as_f64(v), 2.5);
+
+  cur = cur->next_sibling;
+  assert_okb(avoc_value_from_item(cur, &v) == OK);
+  assert_ok(avoc_value_is_i32(v));
+  assert_eq(avoc_value_as_i32(v), -3);
+
+  cur = cur->next_sibling;
+  assert_okb(avoc_value_from_item(cur, &v) == OK);
+  assert_ok(avoc_value_is_f64(v));
+  assert_eqf(avoc_value_as_f64(v), 1099511627775.0);
+
+  cur = cur->next_sibling;
+  assert_ok(avoc_value_from_item(cur, &v) == FAILED);
+
+  cur = cur->next_sibling;
+  assert_okb(avoc_value_from_item(cur, &v) == OK);
+  assert_ok(avoc_value_is_ptr(v));
+  assert_ok(avoc_value_as_ptr(v) == cur);
+
+  avoc_item_free(&item);
+  avoc_source_free(&src);
+}
+
+// Items seen by a visitor, as their kind and depth
+typedef struct {
+  int kinds[32];
+  size_t depths[32];
+  size_t count;
+  int stop_kind; // Kind that stops the traversal, -1 for none
+  int skip_kind; // Kind whose children are skipped, -1 for none
+} visit_log;
+
+static avoc_visit log_visit(void *ctx, const avoc_item *item, size_t depth) {
+  visit_log *log = ctx;
+  if (log->count < 32) {
+    log->kinds[log->count] = item->type;
+    log->depths[log->count++] = depth;
+  }
+
+  if ((int)item->type == log->stop_kind) {
+    return AVOC_VISIT_STOP;
+  }
+
+  return (int)item->type == log->skip_kind ? AVOC_VISIT_SKIP : AVOC_VISIT_NEXT;
+}
+
+void test_list_visit() {
+  avoc_source src;
+  avoc_list list;
+
+  load_string(&src, "(def a:(T U) [1 2] ; done\n)\n(f)");
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+
+  visit_log pre = {{0}, {0}, 0L, -1, -1};
+  visit_log post = {{0}, {0}, 0L, -1, -1};
+  assert_okb(avoc_list_visit(&list, log_visit, log_visit, &pre) ==
+             AVOC_VISIT_NEXT);
+  assert_eql(pre.count, 22L);
+
+  pre.count = 0L;
+  assert_okb(avoc_list_visit(&list, log_visit, NULL, &pre) ==
+             AVOC_VISIT_NEXT);
+  assert_okb(avoc_list_visit(&list, NULL, log_visit, &post) ==
+             AVOC_VISIT_NEXT);
+  const int pre_kinds[] = {ITEM_CALL,    ITEM_SYM,     ITEM_SYM,
+                           ITEM_SYM,     ITEM_SYM,     ITEM_LIT_LST,
+                           ITEM_LIT_I32, ITEM_LIT_I32, ITEM_COMMENT,
+                           ITEM_CALL,    ITEM_SYM};
+  const size_t pre_depths[] = {0L, 1L, 1L, 2L, 2L, 1L, 2L, 2L, 1L, 0L, 1L};
+  const int post_kinds[] = {ITEM_SYM,     ITEM_SYM,     ITEM_SYM,
+                            ITEM_SYM,     ITEM_LIT_I32, ITEM_LIT_I32,
+                            ITEM_LIT_LST, ITEM_COMMENT, ITEM_CALL,
+                            ITEM_SYM,     ITEM_CALL};
+  const size_t post_depths[] = {1L, 2L, 2L, 1L, 2L, 2L, 1L, 1L, 0L, 1L, 0L};
+  assert_eql(pre.count, 11L);
+  assert_eql(post.count, 11L);
+  for (size_t i = 0; i < 11; i++) {
+    assert_eq(pre.kinds[i], pre_kinds[i]);
+    assert_eql(pre.depths[i], pre_depths[i]);
+    assert_eq(post.kinds[i], post_kinds[i]);
+    assert_eql(post.depths[i], post_depths[i]);
+  }
+
+  // skipped items still get their post call
+  pre.count = post.count = 0L;
+  pre.skip_kind = ITEM_CALL;
+  assert_okb(avoc_list_visit(&list, log_visit, NULL, &pre) ==
+             AVOC_VISIT_NEXT);
+  assert_eql(pre.count, 2L);
+  post.skip_kind = ITEM_SYM;
+  assert_okb(avoc_list_visit(&list, log_visit, log_visit, &post) ==
+             AVOC_VISIT_NEXT);
+  assert_eql(post.count, 18L);
+
+  pre.count = 0L;
+  pre.skip_kind = -1;
+  pre.stop_kind = ITEM_LIT_I32;
+  assert_okb(avoc_list_visit(&list, log_visit, NULL, &pre) ==
+             AVOC_VISIT_STOP);
+  assert_eql(pre.count, 7L);
+  assert_eq(pre.kinds[6], ITEM_LIT_I32);
+
+  avoc_list empty;
+  avoc_list_init(&empty);
+  pre.count = 0L;
+  assert_okb(avoc_list_visit(&empty, log_visit, log_visit, &pre) ==
+             AVOC_VISIT_NEXT);
+  assert_eql(pre.count, 0L);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+}
+
+// Matches found by a query run
+typedef struct {
+  avoc_match matches[16];
+  size_t count;
+  size_t stop_after; // Stops the run after this many matches, 0 for never
+} match_log;
+
+static avoc_visit log_match(void *ctx, const avoc_match *match) {
+  match_log *log = ctx;
+  if (log->count < 16) {
+    log->matches[log->count++] = *match;
+  }
+
+  return log->count == log->stop_after ? AVOC_VISIT_STOP : AVOC_VISIT_NEXT;
+}
+
+static avoc_status init_query(avoc_query *query, const char *pattern) {
+  return avoc_query_init(query, pattern, strlen(pattern));
+}
+
+// Compares a captured symbol with its expected name.
+static int captured_sym(const avoc_item *item, const char *name) {
+  return item != NULL && item->type == ITEM_SYM &&
+         item->str_len == strlen(name) &&
+         strncmp(item->as_sym, name, item->str_len) == 0;
+}
+
+void test_query() {
+  avoc_source src;
+  avoc_list list;
+
+  load_string(&src, "(def a:i32 1)\n"
+                    "(def b 2)\n"
+                    "(fn [x:i32 ; the first one\n y] (def c:(Vec i32) 'c'))");
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+
+  avoc_query queries[5];
+  assert_okb(init_query(&queries[0], "(def ?name:_ ...)") == OK);
+  assert_okb(init_query(&queries[1], "(def _ 2)") == OK);
+  assert_okb(init_query(&queries[2], "[?x:i32 ?y]") == OK);
+  assert_okb(init_query(&queries[3], "(def ?n:(Vec ?t) 'c')") == OK);
+  assert_okb(init_query(&queries[4], "; any symbol\n?s:?type") == OK);
+  assert_eql(queries[0].capture_count, 1L);
+  assert_eql(queries[2].capture_count, 2L);
+  assert_eql(queries[3].capture_count, 2L);
+  assert_eql(queries[4].capture_count, 2L);
+  assert_eql(queries[1].depth, 1L);
+  assert_eql(queries[3].depth, 2L);
+
+  match_log log = {{{0}}, 0L, 0L};
+  assert_okb(avoc_query_run(&list, queries, 5, log_match, &log) ==
+             AVOC_VISIT_NEXT);
+  assert_eql(log.count, 8L);
+
+  const size_t expected_queries[] = {0L, 4L, 1L, 2L, 4L, 0L, 3L, 4L};
+  const char *expected_captures[] = {"a", "a", NULL, "x", "x", "c", "c", "c"};
+  for (size_t i = 0; i < log.count; i++) {
+    assert_eql(log.matches[i].query, expected_queries[i]);
+    if (expected_captures[i] != NULL) {
+      assert_ok(captured_sym(log.matches[i].captures[0],
+                             expected_captures[i]));
+    }
+  }
+
+  assert_eql(log.matches[2].depth, 0L);
+  assert_ok(captured_sym(log.matches[3].captures[1], "y"));
+  assert_ok(captured_sym(log.matches[6].captures[1], "i32"));
+  assert_eql(log.matches[6].depth, 1L);
+  assert_okb(log.matches[7].item->sym_composed_type != NULL);
+
+  // a single query and a stopped run
+  log.count = 0L;
+  log.stop_after = 2L;
+  assert_okb(avoc_query_run(&list, &queries[4], 1, log_match, &log) ==
+             AVOC_VISIT_STOP);
+  assert_eql(log.count, 2L);
+  assert_eql(log.matches[1].query, 0L);
+  assert_ok(captured_sym(log.matches[1].captures[0], "x"));
+
+  // lists match item by item unless they end with ...
+  avoc_query strict;
+  log.count = 0L;
+  log.stop_after = 0L;
+  assert_okb(init_query(&strict, "(def b)") == OK);
+  assert_okb(avoc_query_run(&list, &strict, 1, log_match, &log) ==
+             AVOC_VISIT_NEXT);
+  assert_eql(log.count, 0L);
+  avoc_query_free(&strict);
+  assert_okb(init_query(&strict, "(fn ...)") == OK);
+  assert_okb(avoc_query_run(&list, &strict, 1, log_match, &log) ==
+             AVOC_VISIT_NEXT);
+  assert_eql(log.count, 1L);
+  avoc_query_free(&strict);
+
+  for (size_t i = 0; i < 5; i++) {
+    avoc_query_free(&queries[i]);
+  }
+
+  avoc_query bad;
+  assert_ok(init_query(&bad, "") == FAILED);
+  assert_ok(init_query(&bad, "(def a") == FAILED);
+  assert_ok(init_query(&bad, "a b") == FAILED);
+  assert_ok(init_query(&bad, "(?a ?b ?c ?d ?e ?f ?g ?h ?i ?j ?k ?l ?m ?n "
+                             "?o ?p ?q)") == FAILED);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+}
+
+// Expands text with exp, returns the status.
+static avoc_status expand_string(avoc_expander *exp, const char *text) {
+  avoc_source src;
+  avoc_list list;
+  load_string(&src, text);
+  avoc_list_init(&list);
+  avoc_status status = avoc_parse_source(&src, &list);
+  if (status == OK) {
+    status = avoc_expand(exp, &src, &list);
+  }
+
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+  return status;
+}
+
+// Expands text with exp, returns it formatted or NULL if it fails.
+static char *expand_format(avoc_expander *exp, const char *text) {
+  avoc_source src;
+  avoc_list list;
+  load_string(&src, text);
+  avoc_list_init(&list);
+  char *formatted = NULL;
+  if (avoc_parse_source(&src, &list) == OK &&
+      avoc_expand(exp, &src, &list) == OK) {
+    formatted = format_tree(&list);
+  }
+
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+  return formatted;
+}
+
+void test_expand() {
+  avoc_alloc_stats before, after;
+  avoc_get_alloc_stats(&before);
+
+  avoc_source src;
+  avoc_list list;
+  load_string(&src,
+              "(macro swap [a b] (let [tmp ,a] (set ,a ,b) (set ,b tmp)))\n"
+              "(macro unless [c & body] (if ,c nil (do ,@body)))\n"
+              "(macro twice [x] (do ,x ,x))\n"
+              "(fn f [tmp x]\n"
+              "  (swap tmp x)\n"
+              "  (swap tmp x)\n"
+              "  (unless (swap x tmp) (print 1) (print 2))\n"
+              "  (twice (unless a)))");
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+
+  avoc_expander exp;
+  avoc_expander_init(&exp);
+  assert_okb(avoc_expand(&exp, &src, &list) == OK);
+  assert_eql(list.item_count, 1L);
+  assert_eql(exp.stats.macros, 3L);
+  assert_eql(exp.stats.expansions, 7L);
+  assert_eql(exp.stats.cache_hits, 2L);
+  assert_eql(exp.stats.output_items, 55L);
+
+  // bound names are renamed, identical calls share their expansion
+  const char *expected =
+      "(fn\n"
+      "  f\n"
+      "  [tmp x]\n"
+      "  (let [tmp#1 tmp] (set tmp x) (set x tmp#1))\n"
+      "  (let [tmp#1 tmp] (set tmp x) (set x tmp#1))\n"
+      "  (if (let [tmp#3 x] (set x tmp) (set tmp tmp#3)) nil (do (print 1) "
+      "(print 2)))\n"
+      "  (do (if a nil (do)) (if a nil (do))))\n";
+  char *expanded = format_tree(&list);
+  assert_okb(expanded != NULL);
+  assert_eqs(expanded, expected);
+
+  const avoc_item *first = list.head->as_list->head->next_sibling->next_sibling
+                               ->next_sibling;
+  assert_okb(first->as_list == first->next_sibling->as_list);
+  assert_eql(first->as_list->refs, 3L);
+  assert_eql(first->offset, 154L);
+  assert_eql(first->next_sibling->offset, 169L);
+
+  // hashes are updated as if the expansion was parsed
+  avoc_source fresh_src;
+  avoc_list fresh;
+  load_string(&fresh_src, expanded);
+  avoc_list_init(&fresh);
+  assert_okb(avoc_parse_source(&fresh_src, &fresh) == OK);
+  assert_okb(fresh.hash == list.hash);
+  avoc_list_free(&fresh);
+  avoc_source_free(&fresh_src);
+  free(expanded);
+
+  // macros stay defined for the next sources
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+  assert_okb(expand_string(&exp, "(f (swap tmp x) (twice 1))") == OK);
+  assert_eql(exp.stats.expansions, 9L);
+  assert_eql(exp.stats.cache_hits, 3L);
+
+  assert_ok(expand_string(&exp, "(macro swap [a] ,a)") == FAILED);
+  assert_ok(expand_string(&exp, "(f (swap 1))") == FAILED);
+  assert_ok(expand_string(&exp, "(f (twice 1 2))") == FAILED);
+  assert_ok(expand_string(&exp, "(f (unless))") == FAILED);
+  assert_ok(expand_string(&exp, "(macro m [a] ,b)") == FAILED);
+  assert_ok(expand_string(&exp, "(macro m [a] ,@a)") == FAILED);
+  assert_ok(expand_string(&exp, "(macro m [& a] (f ,a))") == FAILED);
+  assert_ok(expand_string(&exp, "(macro m [a &] ,a)") == FAILED);
+  assert_ok(expand_string(&exp, "(macro m [& a b] ,a)") == FAILED);
+  assert_ok(expand_string(&exp, "(macro m [a:i32] ,a)") == FAILED);
+  assert_ok(expand_string(&exp, "(macro m [a])") == FAILED);
+  assert_eql(exp.stats.macros, 3L);
+
+  // expansions expanding forever are cut
+  assert_ok(expand_string(&exp, "(macro loop [x] (loop ,x)) (f (loop 1))") ==
+            FAILED);
+  assert_okb(expand_string(&exp, "(macro id [x] ,x) (f (id (id 1)))") == OK);
+  avoc_expander_free(&exp);
+
+  // renamed names skip the ones the program spells
+  avoc_expander_init(&exp);
+  char *swapped = expand_format(
+      &exp, "(macro swap [a b] (let [tmp ,a] (set ,a ,b) (set ,b tmp)))\n"
+            "(f (swap x tmp#1))");
+  assert_okb(swapped != NULL);
+  assert_eqs(swapped ? swapped : "",
+             "(f (let [tmp#2 x] (set x tmp#1) (set tmp#1 tmp#2)))\n");
+  free(swapped);
+
+  // defining a macro drops the expansions calling it before it existed
+  char *outer = expand_format(&exp, "(macro outer [x] (inner ,x))\n"
+                                    "(f (outer 1))");
+  assert_okb(outer != NULL);
+  assert_eqs(outer ? outer : "", "(f (inner 1))\n");
+  free(outer);
+  outer = expand_format(&exp, "(macro inner [x] (g ,x))\n"
+                              "(f (outer 1))");
+  assert_okb(outer != NULL);
+  assert_eqs(outer ? outer : "", "(f (g 1))\n");
+  free(outer);
+
+  // comments may come before macro
+  char *commented = expand_format(&exp, "(; c\n macro m [x] (f ,x)) (m 1)");
+  assert_okb(commented != NULL);
+  assert_eqs(commented ? commented : "", "(f 1)\n");
+  free(commented);
+  avoc_expander_free(&exp);
+
+  avoc_get_alloc_stats(&after);
+  assert_eql(after.bytes_in_use, before.bytes_in_use);
+}
+
+void test_snapshot() {
+  avoc_source src;
+  avoc_list list;
+  const char *text = "(def a:i32 1)\n"
+                     "(def s 'tab\\there' ; note\n)\n"
+                     "(f [1u32 2i64 3u64 -4.5f32 6.0 true nil]\n"
+                     "   x:(Vec (T U)) <g>)";
+  load_string(&src, text);
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+
+  string_sink image = {NULL, 0L, 0L, 0L};
+  assert_okb(avoc_snapshot_write(&list, sink_write, &image) == OK);
+  assert_eql(image.writes, 1L);
+  assert_okb(avoc_snapshot_write(&list, failing_write, NULL) == FAILED);
+
+  char *expected = format_tree(&list);
+  const uint64_t hash = list.hash;
+  const size_t last_offset = list.tail->offset;
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+
+  // the loaded tree only depends on the image
+  avoc_alloc_stats before, after;
+  avoc_get_alloc_stats(&before);
+  avoc_list loaded;
+  avoc_list_init(&loaded);
+  assert_okb(avoc_snapshot_load(image.data, image.len, &loaded) == OK);
+  assert_eql(loaded.item_count, 3L);
+  assert_okb(loaded.hash == hash);
+  assert_eql(loaded.tail->offset, last_offset);
+  const avoc_item *str = loaded.head->next_sibling->as_list->tail->prev_sibling;
+  assert_okb(str->type == ITEM_LIT_STR);
+  assert_eqsn(str->as_str, str->str_len, "tab\there");
+  assert_okb(str->as_str > image.data && str->as_str < image.data + image.len);
+
+  char *formatted = format_tree(&loaded);
+  assert_okb(formatted != NULL && expected != NULL);
+  assert_eqs(formatted, expected);
+  free(formatted);
+  free(expected);
+  avoc_list_free(&loaded);
+  avoc_list_init(&loaded);
+
+  // broken images fail without leaving items behind
+  const size_t cuts[] = {0L, 7L, 12L, 16L, image.len / 2, image.len - 1};
+  for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++) {
+    assert_ok(avoc_snapshot_load(image.data, cuts[i], &loaded) == FAILED);
+    assert_okb(loaded.head == NULL && loaded.item_count == 0);
+  }
+
+  sink_write(&image, "x", 1);
+  assert_ok(avoc_snapshot_load(image.data, image.len, &loaded) == FAILED);
+  image.data[16] = 100;
+  assert_ok(avoc_snapshot_load(image.data, image.len - 1, &loaded) == FAILED);
+  image.data[0] = 'a';
+  assert_ok(avoc_snapshot_load(image.data, image.len - 1, &loaded) == FAILED);
+  free(image.data);
+
+  // scalars narrower than their 64 bit payload leave the rest zeroed, the
+  // payload of the last item ends the image
+  const char *narrow[] = {"(f 1)", "(f 1u32)", "(f 1.5f32)", "(f true)",
+                          "(f nil)"};
+  for (size_t i = 0; i < sizeof(narrow) / sizeof(narrow[0]); i++) {
+    load_string(&src, narrow[i]);
+    avoc_list_init(&list);
+    assert_okb(avoc_parse_source(&src, &list) == OK);
+    string_sink scalar = {NULL, 0L, 0L, 0L};
+    assert_okb(avoc_snapshot_write(&list, sink_write, &scalar) == OK);
+    avoc_list_free(&list);
+    avoc_source_free(&src);
+    assert_okb(avoc_snapshot_load(scalar.data, scalar.len, &loaded) == OK);
+    avoc_list_free(&loaded);
+    avoc_list_init(&loaded);
+    scalar.data[scalar.len - 1] = (char)0x80;
+    assert_ok(avoc_snapshot_load(scalar.data, scalar.len, &loaded) == FAILED);
+    assert_okb(loaded.head == NULL);
+    free(scalar.data);
+  }
+
+  avoc_get_alloc_stats(&after);
+  assert_eql(after.bytes_in_use, before.bytes_in_use);
+
+  // lazy forms are refused as their source is not in the image
+  load_string(&src, "(a 1) (b 2)");
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source_lazy(&src, &list) == OK);
+  string_sink lazy_image = {NULL, 0L, 0L, 0L};
+  assert_ok(avoc_snapshot_write(&list, sink_write, &lazy_image) == FAILED);
+  assert_eql(lazy_image.writes, 0L);
+  assert_okb(avoc_item_force(&src, list.head) == OK);
+  assert_okb(avoc_item_force(&src, list.tail) == OK);
+  assert_okb(avoc_snapshot_write(&list, sink_write, &lazy_image) == OK);
+  free(lazy_image.data);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+
+  avoc_list empty;
+  avoc_list_init(&empty);
+  string_sink empty_image = {NULL, 0L, 0L, 0L};
+  assert_okb(avoc_snapshot_write(&empty, sink_write, &empty_image) == OK);
+  assert_eql(empty_image.len, 16L);
+  assert_okb(avoc_snapshot_load(empty_image.data, empty_image.len, &empty) ==
+             OK);
+  assert_okb(empty.head == NULL);
+  free(empty_image.data);
+}
+
+void test_array() {
+  avoc_source src;
+  avoc_list list;
+  load_string(&src, "(f [1 -2 3] [0.5f64 1.5f64 -2.0f64] [1 2.0] []\n"
+                    "   [2147483647 1] (g 1 2) [4294967295u32 3u32 0u32]\n"
+                    "   [2u64 3u64])");
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+
+  avoc_alloc_stats before, after;
+  avoc_get_alloc_stats(&before);
+  const avoc_item *ints = list.head->as_list->head->next_sibling;
+  const avoc_item *floats = ints->next_sibling;
+  const avoc_item *mixed = floats->next_sibling;
+  const avoc_item *empty = mixed->next_sibling;
+  const avoc_item *large = empty->next_sibling;
+  assert_eq(ints->as_list->item_type, ITEM_LIT_I32);
+  assert_eq(floats->as_list->item_type, ITEM_LIT_F64);
+  assert_eq(mixed->as_list->item_type, -1);
+  assert_eq(empty->as_list->item_type, -1);
+  assert_eq(large->next_sibling->as_list->item_type, -1);
+  assert_eq(list.head->as_list->item_type, -1);
+  assert_eq(list.item_type, ITEM_CALL);
+
+  avoc_array a, b, c;
+  assert_ok(avoc_array_from_list(mixed->as_list, &a) == FAILED);
+  assert_ok(avoc_array_from_list(empty->as_list, &a) == FAILED);
+  assert_ok(avoc_array_from_list(list.head->as_list, &a) == FAILED);
+
+  // signed integers wrap around
+  assert_okb(avoc_array_from_list(ints->as_list, &a) == OK);
+  assert_eql(a.count, 3L);
+  assert_eq(((int *)a.data)[1], -2);
+  avoc_item result;
+  assert_okb(avoc_array_reduce(&a, AVOC_ARRAY_SUM, &result) == OK);
+  assert_okb(result.type == ITEM_LIT_I32);
+  assert_eq(result.as_i32, 2);
+  assert_okb(avoc_array_reduce(&a, AVOC_ARRAY_MIN, &result) == OK);
+  assert_eq(result.as_i32, -2);
+  assert_okb(avoc_array_reduce(&a, AVOC_ARRAY_MAX, &result) == OK);
+  assert_eq(result.as_i32, 3);
+  assert_okb(avoc_array_dot(&a, &a, &result) == OK);
+  assert_eq(result.as_i32, 14);
+  assert_okb(avoc_array_map(&a, &a, AVOC_ARRAY_MUL, &c) == OK);
+  assert_eq(((int *)c.data)[1], 4);
+  avoc_array_free(&c);
+  assert_okb(avoc_array_map(&a, &a, AVOC_ARRAY_DIV, &c) == OK);
+  assert_eq(((int *)c.data)[2], 1);
+  avoc_array_free(&c);
+
+  avoc_array_init(&b, AVOC_ARRAY_I32, 3L);
+  assert_ok(avoc_array_map(&a, &b, AVOC_ARRAY_DIV, &c) == FAILED);
+  avoc_array_free(&b);
+  avoc_array_free(&a);
+
+  assert_okb(avoc_array_from_list(large->as_list, &a) == OK);
+  assert_okb(avoc_array_reduce(&a, AVOC_ARRAY_SUM, &result) == OK);
+  assert_eq(result.as_i32, INT_MIN);
+  assert_okb(avoc_array_map(&a, &a, AVOC_ARRAY_ADD, &c) == OK);
+  assert_eq(((int *)c.data)[0], -2);
+  avoc_array_free(&c);
+  ((int *)a.data)[0] = INT_MIN;
+  ((int *)a.data)[1] = -1;
+  avoc_array_init(&b, AVOC_ARRAY_I32, 2L);
+  ((int *)b.data)[0] = -1;
+  ((int *)b.data)[1] = -1;
+  assert_okb(avoc_array_map(&a, &b, AVOC_ARRAY_DIV, &c) == OK);
+  assert_eq(((int *)c.data)[0], INT_MIN);
+  assert_eq(((int *)c.data)[1], 1);
+  avoc_array_free(&c);
+  avoc_array_free(&b);
+
+  // the same for longs, which cannot be divided in a wider type
+  avoc_array wide, minus;
+  avoc_array_init(&wide, AVOC_ARRAY_I64, 2L);
+  avoc_array_init(&minus, AVOC_ARRAY_I64, 2L);
+  ((long *)wide.data)[0] = LONG_MIN;
+  ((long *)wide.data)[1] = 7L;
+  ((long *)minus.data)[0] = -1L;
+  ((long *)minus.data)[1] = -1L;
+  assert_okb(avoc_array_map(&wide, &minus, AVOC_ARRAY_DIV, &c) == OK);
+  assert_okb(((long *)c.data)[0] == LONG_MIN);
+  assert_eql(((long *)c.data)[1], -7L);
+  avoc_array_free(&c);
+  ((long *)minus.data)[1] = 0L;
+  c.data = NULL;
+  assert_ok(avoc_array_map(&wide, &minus, AVOC_ARRAY_DIV, &c) == FAILED);
+  assert_okb(c.data == NULL);
+  assert_okb(avoc_array_map(&wide, &minus, AVOC_ARRAY_MUL, &c) == OK);
+  avoc_array_free(&c);
+  avoc_array_free(&minus);
+  avoc_array_free(&wide);
+
+  // both arrays need the same kind and count
+  assert_okb(avoc_array_from_list(floats->as_list, &b) == OK);
+  assert_ok(avoc_array_map(&a, &b, AVOC_ARRAY_ADD, &c) == FAILED);
+  assert_ok(avoc_array_dot(&a, &b, &result) == FAILED);
+  avoc_array_free(&a);
+  assert_okb(avoc_array_dot(&b, &b, &result) == OK);
+  assert_okb(result.type == ITEM_LIT_F64);
+  assert_okb(result.as_f64 == 6.5);
+  avoc_array_free(&b);
+
+  avoc_array_init(&a, AVOC_ARRAY_F64, 0L);
+  assert_okb(avoc_array_reduce(&a, AVOC_ARRAY_SUM, &result) == OK);
+  assert_okb(result.as_f64 == 0.0);
+  assert_ok(avoc_array_reduce(&a, AVOC_ARRAY_MAX, &result) == FAILED);
+  avoc_array_free(&a);
+
+  // every vector width gives the scalar results, tails included
+  const size_t count = 11L;
+  avoc_array_init(&a, AVOC_ARRAY_F64, count);
+  avoc_array_init(&b, AVOC_ARRAY_F64, count);
+  double *x = a.data;
+  double *y = b.data;
+  for (size_t i = 0; i < count; i++) {
+    x[i] = (double)i - 6.0;
+    y[i] = 0.5 * (double)(i + 1);
+  }
+
+  const avoc_array_op ops[] = {AVOC_ARRAY_ADD, AVOC_ARRAY_SUB, AVOC_ARRAY_MUL,
+                               AVOC_ARRAY_DIV};
+  for (int simd = AVOC_SIMD_NONE; simd <= AVOC_SIMD_AVX2; simd++) {
+    assert_okb(avoc_array_set_simd((avoc_simd)simd) <= (avoc_simd)simd);
+    for (size_t op = 0; op < sizeof(ops) / sizeof(ops[0]); op++) {
+      assert_okb(avoc_array_map(&a, &b, ops[op], &c) == OK);
+      for (size_t i = 0; i < count; i++) {
+        double expected = ops[op] == AVOC_ARRAY_ADD   ? x[i] + y[i]
+                          : ops[op] == AVOC_ARRAY_SUB ? x[i] - y[i]
+                          : ops[op] == AVOC_ARRAY_MUL ? x[i] * y[i]
+                                                      : x[i] / y[i];
+        assert_okb(((double *)c.data)[i] == expected);
+      }
+      avoc_array_free(&c);
+    }
+
+    assert_okb(avoc_array_reduce(&a, AVOC_ARRAY_SUM, &result) == OK);
+    assert_okb(result.as_f64 == -11.0);
+    assert_okb(avoc_array_reduce(&a, AVOC_ARRAY_MIN, &result) == OK);
+    assert_okb(result.as_f64 == -6.0);
+    assert_okb(avoc_array_reduce(&b, AVOC_ARRAY_MAX, &result) == OK);
+    assert_okb(result.as_f64 == 5.5);
+    assert_okb(avoc_array_dot(&a, &b, &result) == OK);
+    assert_okb(result.as_f64 == 22.0);
+  }
+
+  avoc_array_set_simd(AVOC_SIMD_AVX2);
+  avoc_array_free(&a);
+  avoc_array_free(&b);
+
+  // unsigned integers compare and divide as unsigned
+  const avoc_item *unsigned_ints = large->next_sibling->next_sibling;
+  assert_eq(unsigned_ints->as_list->item_type, ITEM_LIT_U32);
+  assert_okb(avoc_array_from_list(unsigned_ints->as_list, &a) == OK);
+  assert_okb(a.kind == AVOC_ARRAY_U32);
+  assert_okb(avoc_array_reduce(&a, AVOC_ARRAY_MAX, &result) == OK);
+  assert_okb(result.type == ITEM_LIT_U32);
+  assert_okb(result.as_u32 == UINT_MAX);
+  assert_okb(avoc_array_reduce(&a, AVOC_ARRAY_SUM, &result) == OK);
+  assert_okb(result.as_u32 == 2U);
+  assert_okb(avoc_array_map(&a, &a, AVOC_ARRAY_ADD, &c) == OK);
+  assert_okb(((unsigned int *)c.data)[0] == UINT_MAX - 1U);
+  assert_ok(avoc_array_map(&c, &a, AVOC_ARRAY_DIV, &b) == FAILED);
+  ((unsigned int *)c.data)[2] = 1U;
+  avoc_array_free(&a);
+  assert_okb(avoc_array_map(&c, &c, AVOC_ARRAY_DIV, &a) == OK);
+  assert_okb(((unsigned int *)a.data)[0] == 1U);
+  avoc_array_free(&c);
+  avoc_array_free(&a);
+
+  const avoc_item *unsigned_longs = unsigned_ints->next_sibling;
+  assert_okb(avoc_array_from_list(unsigned_longs->as_list, &a) == OK);
+  assert_okb(a.kind == AVOC_ARRAY_U64);
+  assert_okb(avoc_array_reduce(&a, AVOC_ARRAY_MIN, &result) == OK);
+  assert_okb(result.type == ITEM_LIT_U64);
+  assert_okb(result.as_u64 == 2UL);
+  assert_okb(avoc_array_dot(&a, &a, &result) == OK);
+  assert_okb(result.as_u64 == 13UL);
+  avoc_array_init(&b, AVOC_ARRAY_U64, 2L);
+  assert_ok(avoc_array_map(&a, &b, AVOC_ARRAY_DIV, &c) == FAILED);
+  avoc_array_free(&b);
+  avoc_array_free(&a);
+
+  // every kind gives the scalar results with vector instructions, the
+  // integers have arbitrary bits and the floats sum exactly in any order
+  const avoc_array_kind kinds[] = {AVOC_ARRAY_U32, AVOC_ARRAY_U64,
+                                   AVOC_ARRAY_I32, AVOC_ARRAY_I64,
+                                   AVOC_ARRAY_F32, AVOC_ARRAY_F64};
+  const avoc_array_reduction reductions[] = {AVOC_ARRAY_SUM, AVOC_ARRAY_MIN,
+                                             AVOC_ARRAY_MAX};
+  for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+    const size_t n = 19L;
+    avoc_array_init(&a, kinds[k], n);
+    avoc_array_init(&b, kinds[k], n);
+    for (size_t i = 0; i < n; i++) {
+      const unsigned long bits = (i + 1) * 0x9E3779B97F4A7C15UL;
+      switch (kinds[k]) {
+      case AVOC_ARRAY_U32:
+      case AVOC_ARRAY_I32:
+        ((unsigned int *)a.data)[i] = (unsigned int)(bits >> 17);
+        ((unsigned int *)b.data)[i] = (unsigned int)(bits >> 29) | 1U;
+        break;
+      case AVOC_ARRAY_U64:
+      case AVOC_ARRAY_I64:
+        ((unsigned long *)a.data)[i] = bits;
+        ((unsigned long *)b.data)[i] = (bits >> 7) | 1UL;
+        break;
+      case AVOC_ARRAY_F32:
+        ((float *)a.data)[i] = (float)i - 9.0f;
+        ((float *)b.data)[i] = 0.5f * (float)(i + 1);
+        break;
+      case AVOC_ARRAY_F64:
+        ((double *)a.data)[i] = (double)i - 9.0;
+        ((double *)b.data)[i] = 0.5 * (double)(i + 1);
+        break;
+      }
+    }
+
+    avoc_array scalar[4];
+    avoc_item reduced[4];
+    avoc_array_set_simd(AVOC_SIMD_NONE);
+    for (size_t op = 0; op < 4; op++) {
+      assert_okb(avoc_array_map(&a, &b, ops[op], &scalar[op]) == OK);
+    }
+
+    for (size_t r = 0; r < 3; r++) {
+      assert_okb(avoc_array_reduce(&a, reductions[r], &reduced[r]) == OK);
+    }
+
+    assert_okb(avoc_array_dot(&a, &b, &reduced[3]) == OK);
+    for (int simd = AVOC_SIMD_SSE2; simd <= AVOC_SIMD_AVX2; simd++) {
+      avoc_array_set_simd((avoc_simd)simd);
+      for (size_t op = 0; op < 4; op++) {
+        assert_okb(avoc_array_map(&a, &b, ops[op], &c) == OK);
+        assert_okb(memcmp(c.data, scalar[op].data,
+                          n * (kinds[k] == AVOC_ARRAY_U32 ||
+                                       kinds[k] == AVOC_ARRAY_I32 ||
+                                       kinds[k] == AVOC_ARRAY_F32
+                                   ? 4
+                                   : 8)) == 0);
+        avoc_array_free(&c);
+      }
+
+      for (size_t r = 0; r < 4; r++) {
+        if (r < 3) {
+          assert_okb(avoc_array_reduce(&a, reductions[r], &result) == OK);
+        } else {
+          assert_okb(avoc_array_dot(&a, &b, &result) == OK);
+        }
+        assert_okb(result.as_u64 == reduced[r].as_u64);
+        assert_okb(result.hash == reduced[r].hash);
+      }
+    }
+
+    for (size_t op = 0; op < 4; op++) {
+      avoc_array_free(&scalar[op]);
+    }
+
+    avoc_array_free(&a);
+    avoc_array_free(&b);
+  }
+
+  avoc_array_set_simd(AVOC_SIMD_AVX2);
+  avoc_get_alloc_stats(&after);
+  assert_eql(after.bytes_in_use, before.bytes_in_use);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+}
+
+void test_pvec() {
+  avoc_source src;
+  avoc_list list;
+  load_string(&src, "(v [1 2.5f64 true nil 'four' [5]])");
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+
+  avoc_alloc_stats before, after;
+  avoc_get_alloc_stats(&before);
+  const avoc_list *literal = list.head->as_list->tail->as_list;
+  avoc_pvec lit;
+  assert_okb(avoc_pvec_from_list(literal, &lit) == OK);
+  assert_eql(lit.count, 6L);
+  assert_okb(avoc_pvec_get(&lit, 0) == avoc_value_i32(1));
+  assert_okb(avoc_pvec_get(&lit, 1) == avoc_value_f64(2.5));
+  assert_okb(avoc_pvec_get(&lit, 3) == avoc_value_nil());
+  assert_okb(avoc_value_as_ptr(avoc_pvec_get(&lit, 5)) == literal->tail);
+  avoc_pvec_free(&lit);
+
+  // every version keeps its elements, across the growth of the tail, of the
+  // trie and of its root
+  const size_t count = 2200L;
+  avoc_pvec *versions = calloc(count + 1, sizeof(avoc_pvec));
+  avoc_pvec_init(&versions[0]);
+  int same = 1;
+  for (size_t i = 0; i < count; i++) {
+    same &= avoc_pvec_push(&versions[i], avoc_value_i32((int)i),
+                           &versions[i + 1]) == OK;
+  }
+
+  for (size_t v = 0; v <= count; v += 97) {
+    same &= versions[v].count == v;
+    for (size_t i = 0; i < v; i++) {
+      same &= avoc_pvec_get(&versions[v], i) == avoc_value_i32((int)i);
+    }
+  }
+
+  assert_okb(same);
+
+  // updates copy the path to the element only
+  avoc_pvec set;
+  const size_t indices[] = {0L, 31L, 32L, 1055L, 1056L, 2199L};
+  avoc_pvec_copy(&versions[count], &set);
+  for (size_t i = 0; i < sizeof(indices) / sizeof(indices[0]); i++) {
+    avoc_pvec next;
+    assert_okb(avoc_pvec_set(&set, indices[i], avoc_value_bol(1), &next) ==
+               OK);
+    assert_okb(avoc_pvec_get(&next, indices[i]) == avoc_value_bol(1));
+    assert_okb(avoc_pvec_get(&set, indices[i]) ==
+               avoc_value_i32((int)indices[i]));
+    avoc_pvec_free(&set);
+    set = next;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    same &= avoc_pvec_get(&versions[count], i) == avoc_value_i32((int)i);
+  }
+
+  assert_okb(same);
+
+  // a transient changes its own nodes in place and leaves its source alone
+  avoc_pvec builder;
+  avoc_pvec_transient(&set, &builder);
+  for (size_t i = 0; i < count; i++) {
+    same &= avoc_pvec_transient_set(&builder, i, avoc_value_i32(-(int)i)) ==
+            OK;
+  }
+
+  avoc_alloc_stats mid;
+  avoc_get_alloc_stats(&mid);
+  for (size_t i = 0; i < count; i += 3) {
+    same &= avoc_pvec_transient_set(&builder, i, avoc_value_nil()) == OK;
+  }
+
+  for (size_t i = 0; i < 100; i++) {
+    same &= avoc_pvec_transient_push(&builder, avoc_value_i32(7)) == OK;
+  }
+
+  assert_okb(same);
+
+  avoc_get_alloc_stats(&after);
+  assert_okb(after.alloc_count - mid.alloc_count <= 4);
+  avoc_pvec_persistent(&builder);
+  assert_eql(builder.count, count + 100);
+  assert_okb(avoc_pvec_get(&builder, 3) == avoc_value_nil());
+  assert_okb(avoc_pvec_get(&builder, 4) == avoc_value_i32(-4));
+  assert_okb(avoc_pvec_get(&builder, count + 99) == avoc_value_i32(7));
+  assert_okb(avoc_pvec_get(&set, 4) == avoc_value_i32(4));
+  assert_okb(avoc_pvec_get(&set, 0) == avoc_value_bol(1));
+
+  // once persistent its nodes are shared again
+  avoc_pvec next;
+  assert_okb(avoc_pvec_set(&builder, 4, avoc_value_i32(4), &next) == OK);
+  assert_okb(avoc_pvec_get(&builder, 4) == avoc_value_i32(-4));
+  avoc_pvec_free(&next);
+  avoc_pvec_free(&builder);
+  avoc_pvec_free(&set);
+  for (size_t v = 0; v <= count; v++) {
+    avoc_pvec_free(&versions[v]);
+  }
+
+  free(versions);
+  avoc_get_alloc_stats(&after);
+  assert_eql(after.bytes_in_use, before.bytes_in_use);
+
+  // 64 bits integers out of the range of values fail
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+  load_string(&src, "(v [1 9007199254740993i64])");
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+  literal = list.head->as_list->tail->as_list;
+  assert_ok(avoc_pvec_from_list(literal, &lit) == FAILED);
+  assert_eql(lit.count, 0L);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+}
+
+void test_plist() {
+  avoc_source src;
+  avoc_list list;
+  load_string(&src, "(v [1 2 3])");
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+
+  avoc_alloc_stats before, after;
+  avoc_get_alloc_stats(&before);
+  avoc_plist nums, rest, more;
+  const avoc_list *literal = list.head->as_list->tail->as_list;
+  assert_okb(avoc_plist_from_list(literal, &nums) == OK);
+  assert_eql(nums.count, 3L);
+  assert_okb(avoc_plist_first(&nums) == avoc_value_i32(1));
+
+  // lists consing onto the rest share its cells
+  avoc_plist_rest(&nums, &rest);
+  assert_okb(avoc_plist_first(&rest) == avoc_value_i32(2));
+  assert_okb(avoc_plist_cons(&rest, avoc_value_i32(0), &more) == OK);
+  assert_eql(more.count, 3L);
+  assert_okb(avoc_plist_first(&more) == avoc_value_i32(0));
+  avoc_plist_free(&nums);
+  avoc_plist_free(&rest);
+  avoc_plist tail;
+  avoc_plist_rest(&more, &tail);
+  avoc_plist_free(&more);
+  assert_okb(avoc_plist_first(&tail) == avoc_value_i32(2));
+  avoc_plist_rest(&tail, &rest);
+  avoc_plist_free(&tail);
+  assert_okb(avoc_plist_first(&rest) == avoc_value_i32(3));
+  assert_eql(rest.count, 1L);
+  avoc_plist_free(&rest);
+  avoc_get_alloc_stats(&after);
+  assert_eql(after.bytes_in_use, before.bytes_in_use);
+
+  // long lists are freed without recursion
+  avoc_plist_init(&nums);
+  int consed = 1;
+  for (int i = 0; i < 200000; i++) {
+    consed &= avoc_plist_cons(&nums, avoc_value_i32(i), &more) == OK;
+    avoc_plist_free(&nums);
+    nums = more;
+  }
+
+  assert_okb(consed);
+  assert_eql(nums.count, 200000L);
+  avoc_plist_free(&nums);
+  avoc_get_alloc_stats(&after);
+  assert_eql(after.bytes_in_use, before.bytes_in_use);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
+}
+
+void test_pmap() {
+  avoc_alloc_stats before, after;
+  avoc_get_alloc_stats(&before);
+  avoc_pmap empty, map, next;
+  avoc_value value;
+  avoc_pmap_init(&empty);
+  assert_ok(avoc_pmap_get(&empty, avoc_value_nil(), &value) == FAILED);
+
+  // keys are looked up by value, versions keep their keys
+  assert_okb(avoc_pmap_put(&empty, avoc_value_i32(1), avoc_value_nil(),
+                           &map) == OK);
+  assert_okb(avoc_pmap_put(&map, avoc_value_f64(1.0), avoc_value_bol(1),
+                           &next) == OK);
+  assert_eql(next.count, 2L);
+  assert_okb(avoc_pmap_get(&next, avoc_value_f64(1.0), &value) == OK);
+  assert_okb(value == avoc_value_bol(1));
+  assert_ok(avoc_pmap_get(&map, avoc_value_f64(1.0), &value) == FAILED);
+  avoc_pmap_free(&map);
+  assert_okb(avoc_pmap_put(&next, avoc_value_i32(1), avoc_value_i32(2),
+                           &map) == OK);
+  assert_eql(map.count, 2L);
+  assert_okb(avoc_pmap_get(&map, avoc_value_i32(1), &value) == OK);
+  assert_okb(value == avoc_value_i32(2));
+  assert_okb(avoc_pmap_get(&next, avoc_value_i32(1), &value) == OK);
+  assert_okb(value == avoc_value_nil());
+  avoc_pmap_free(&next);
+  avoc_pmap_free(&map);
+
+  // enough keys to share slots over several levels
+  const int count = 20000;
+  avoc_pmap builder;
+  avoc_pmap_transient(&empty, &builder);
+  int same = 1;
+  for (int i = 0; i < count; i++) {
+    same &= avoc_pmap_transient_put(&builder, avoc_value_i32(i),
+                                    avoc_value_i32(i * 2)) == OK;
+  }
+
+  avoc_pmap_persistent(&builder);
+  assert_eql(builder.count, (size_t)count);
+  avoc_pmap_copy(&builder, &map);
+  for (int i = 0; i < count; i += 2) {
+    same &= avoc_pmap_put(&map, avoc_value_i32(i), avoc_value_nil(),
+                          &next) == OK;
+    avoc_pmap_free(&map);
+    map = next;
+  }
+
+  assert_eql(map.count, (size_t)count);
+  for (int i = 0; i < count; i++) {
+    same &= avoc_pmap_get(&builder, avoc_value_i32(i), &value) == OK &&
+            value == avoc_value_i32(i * 2);
+    same &= avoc_pmap_get(&map, avoc_value_i32(i), &value) == OK &&
+            value == (i % 2 == 0 ? avoc_value_nil() : avoc_value_i32(i * 2));
+  }
+
+  assert_okb(same);
+
+  assert_ok(avoc_pmap_get(&map, avoc_value_i32(count), &value) == FAILED);
+  avoc_pmap_free(&map);
+  avoc_pmap_free(&builder);
+  avoc_get_alloc_stats(&after);
+  assert_eql(after.bytes_in_use, before.bytes_in_use);
+}
+
+// Elements of an array tested by keep_odd(), each worker marking its own
+typedef struct {
+  const int *base;
+  unsigned char *tested;
+} odd_ctx;
+
+static int keep_odd(void *ctx, const void *elem) {
+  odd_ctx *odd = ctx;
+  const int *x = elem;
+  odd->tested[x - odd->base]++;
+  return *x % 2 != 0;
+}
+
+static int keep_nonzero(void *ctx, const void *elem) {
+  (void)ctx;
+  return *(const int *)elem != 0;
+}
+
+void test_pool() {
+  avoc_alloc_stats before, after;
+  avoc_get_alloc_stats(&before);
+
+  // several chunks per worker and a partial last one
+  const size_t count = 100003L;
+  avoc_array a, b, c, serial;
+  avoc_array_init(&a, AVOC_ARRAY_I64, count);
+  avoc_array_init(&b, AVOC_ARRAY_I64, count);
+  for (size_t i = 0; i < count; i++) {
+    ((long *)a.data)[i] = (long)(i * 7919L % 1000L) - 500L;
+    ((long *)b.data)[i] = (long)(i % 13L) + 1L;
+  }
+
+  avoc_array floats, odd;
+  avoc_array_init(&floats, AVOC_ARRAY_F64, count);
+  avoc_array_init(&odd, AVOC_ARRAY_I32, count);
+  for (size_t i = 0; i < count; i++) {
+    // whole numbers add up exactly in any order
+    ((double *)floats.data)[i] = (double)(i % 101L) - 50.0;
+    ((int *)odd.data)[i] = (int)(i * 31L % 97L);
+  }
+
+  const avoc_array_op ops[] = {AVOC_ARRAY_ADD, AVOC_ARRAY_SUB, AVOC_ARRAY_MUL,
+                               AVOC_ARRAY_DIV};
+  const avoc_array_reduction reductions[] = {AVOC_ARRAY_SUM, AVOC_ARRAY_MIN,
+                                             AVOC_ARRAY_MAX};
+  const size_t threads[] = {1L, 2L, 4L};
+  for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+    avoc_pool *pool = avoc_pool_new(threads[t]);
+    assert_okb(pool != NULL);
+    assert_eql(avoc_pool_threads(pool), threads[t]);
+
+    // the parallel kernels give what the serial ones give
+    int same = 1;
+    for (size_t op = 0; op < sizeof(ops) / sizeof(ops[0]); op++) {
+      same &= avoc_array_pmap(pool, &a, &b, ops[op], &c) == OK;
+      same &= avoc_array_map(&a, &b, ops[op], &serial) == OK;
+      same &= c.count == count &&
+              memcmp(c.data, serial.data, count * sizeof(long)) == 0;
+      avoc_array_free(&serial);
+      avoc_array_free(&c);
+    }
+
+    for (size_t r = 0; r < sizeof(reductions) / sizeof(reductions[0]); r++) {
+      avoc_item par, ser;
+      same &= avoc_array_preduce(pool, &a, reductions[r], &par) == OK;
+      same &= avoc_array_reduce(&a, reductions[r], &ser) == OK;
+      same &= par.type == ITEM_LIT_I64 && par.as_i64 == ser.as_i64 &&
+              par.hash == ser.hash;
+      same &= avoc_array_preduce(pool, &floats, reductions[r], &par) == OK;
+      same &= avoc_array_reduce(&floats, reductions[r], &ser) == OK;
+      same &= par.type == ITEM_LIT_F64 && par.as_f64 == ser.as_f64;
+    }
+
+    assert_okb(same);
+
+    // kept elements stay in order and every element is tested once
+    odd_ctx ctx = {odd.data, calloc(count, 1)};
+    assert_okb(avoc_array_pfilter(pool, &odd, keep_odd, &ctx, &c) == OK);
+    size_t kept = 0L;
+    for (size_t i = 0; i < count; i++) {
+      const int x = ((int *)odd.data)[i];
+      same &= ctx.tested[i] == 1;
+      same &= x % 2 == 0 || (kept < c.count && ((int *)c.data)[kept++] == x);
+    }
+
+    free(ctx.tested);
+
+    assert_okb(same);
+    assert_eql(c.count, kept);
+    assert_okb(c.kind == AVOC_ARRAY_I32);
+    avoc_array_free(&c);
+
+    // a zero in any chunk fails the division and leaves no array
+    ((long *)b.data)[count - 1] = 0L;
+    c.data = NULL;
+    assert_ok(avoc_array_pmap(pool, &a, &b, AVOC_ARRAY_DIV, &c) == FAILED);
+    assert_okb(c.data == NULL);
+    ((long *)b.data)[count - 1] = 1L;
+    assert_ok(avoc_array_pmap(pool, &a, &odd, AVOC_ARRAY_ADD, &c) == FAILED);
+
+    // empty arrays run no job
+    avoc_array empty;
+    avoc_item result;
+    avoc_array_init(&empty, AVOC_ARRAY_F64, 0L);
+    assert_okb(avoc_array_pmap(pool, &empty, &empty, AVOC_ARRAY_DIV, &c) ==
+               OK);
+    assert_eql(c.count, 0L);
+    avoc_array_free(&c);
+    assert_okb(avoc_array_preduce(pool, &empty, AVOC_ARRAY_SUM, &result) ==
+               OK);
+    assert_okb(result.as_f64 == 0.0);
+    assert_ok(avoc_array_preduce(pool, &empty, AVOC_ARRAY_MIN, &result) ==
+              FAILED);
+    assert_okb(avoc_array_pfilter(pool, &empty, keep_odd, NULL, &c) == OK);
+    assert_eql(c.count, 0L);
+    avoc_array_free(&c);
+    avoc_array_free(&empty);
+    avoc_pool_free(pool);
+  }
+
+  avoc_array_free(&odd);
+  avoc_array_free(&floats);
+  avoc_array_free(&b);
+  avoc_array_free(&a);
+  avoc_get_alloc_stats(&after);
+  assert_eql(after.bytes_in_use, before.bytes_in_use);
+}
+
+static void *failing_malloc(void *ctx, size_t size) {
+  (void)ctx;
+  (void)size;
+  return NULL;
+}
+
+static void *failing_realloc(void *ctx, void *ptr, size_t old_size,
+                             size_t new_size) {
+  (void)ctx;
+  (void)ptr;
+  (void)old_size;
+  (void)new_size;
+  return NULL;
+}
+
+// Counts allocations as counting_ctx and fails those beyond budget
+typedef struct {
+  counting_ctx count;
+  size_t budget;
+} budget_ctx;
+
+static void *budget_malloc(void *ctx, size_t size) {
+  budget_ctx *budget = ctx;
+  return budget->count.allocs++ < budget->budget ? malloc(size) : NULL;
+}
+
+static void *budget_realloc(void *ctx, void *ptr, size_t old_size,
+                            size_t new_size) {
+  budget_ctx *budget = ctx;
+  (void)old_size;
+  return budget->count.allocs++ < budget->budget ? realloc(ptr, new_size)
+                                                 : NULL;
+}
+
+// Program whose parse and expansion allocate in every way they can: escapes,
+// numbers, composed types, shared lists and macro tables
+static const char budget_text[] =
+    "(macro twice [x] (let [y ,x] (do y y)))\n"
+    "(def s:(list str) [\"e\\x41\\u00e1\" 'b' 1.5 0x10u32])\n"
+    "(twice (f [1 2 [3]]))\n(twice (f [1 2 [3]]))";
+
+// Parses budget_text shared and lazily, forces and expands it with the
+// allocator set, then formats the expanded tree into formatted. Everything
+// the library allocated is released, whether it failed or not.
+static avoc_status parse_with(const avoc_allocator *alloc, char **formatted) {
+  avoc_source src, view;
+  avoc_list list, lazy;
+  avoc_expander exp;
+  avoc_list_init(&list);
+  avoc_list_init(&lazy);
+  avoc_expander_init(&exp);
+  avoc_set_allocator(alloc);
+  avoc_status status =
+      avoc_source_init(&src, "budget", budget_text, strlen(budget_text));
+  avoc_status view_status = avoc_source_init_view(
+      &view, "lazy", budget_text, strlen(budget_text));
+  if (status == OK && view_status == OK) {
+    status = avoc_parse_source_shared(&src, &list);
+  }
+
+  if (status == OK && view_status == OK) {
+    status = avoc_parse_source_lazy(&view, &lazy);
+  }
+
+  if (status == OK && view_status == OK) {
+    status = avoc_item_force(&view, lazy.tail);
+  }
+
+  if (status == OK && view_status == OK) {
+    status = avoc_item_materialize(lazy.tail->as_list->head);
+  }
+
+  if (status == OK && view_status == OK) {
+    status = avoc_expand(&exp, &src, &list);
+  }
+
+  // Positions are found without the line index when it cannot be built
+  size_t row, col;
+  avoc_source_position(&src, strlen(budget_text), &row, &col);
+  avoc_set_allocator(NULL);
+  status = status == OK && view_status == OK && row == 4 && col == 22
+               ? OK
+               : FAILED;
+  if (status == OK) {
+    *formatted = format_tree(&list);
+  }
+
+  avoc_expander_free(&exp);
+  avoc_list_free(&lazy);
+  avoc_list_free(&list);
+  avoc_source_free(&view);
+  avoc_source_free(&src);
+  return status;
+}
+
+void test_alloc_failure() {
+  avoc_source src;
+  avoc_list list;
+  load_string(&src, "(a [b (c)] 'd')\n(e)");
+  avoc_list_init(&list);
+  assert_okb(avoc_parse_source(&src, &list) == OK);
+  char *expected = format_tree(&list);
+
+  // traversals fail cleanly when their scratch stacks cannot be allocated
+  counting_ctx ctx = {0L, 0L};
+  avoc_allocator alloc = {failing_malloc, failing_realloc, counting_free,
+                          &ctx};
+  avoc_set_allocator(&alloc);
+  avoc_tree_stats tree;
+  string_sink sink = {NULL, 0L, 0L, 0L};
+  assert_ok(avoc_list_stats(&list, &tree) == FAILED);
+  assert_ok(avoc_list_visit(&list, NULL, NULL, NULL) == AVOC_VISIT_STOP);
+  assert_ok(avoc_format_list(&list, NULL, sink_write, &sink) == FAILED);
+  assert_ok(avoc_snapshot_write(&list, sink_write, &sink) == FAILED);
+  assert_ok(avoc_source_edit(&src, &list, 1L, 1L, "x", 1L) == FAILED);
+  assert_eql(sink.writes, 0L);
+  assert_eql(ctx.frees, 0L);
+  avoc_set_allocator(NULL);
+
+  // arrays that cannot be allocated are left empty
+  avoc_source nums_src;
+  avoc_list nums;
+  load_string(&nums_src, "(f [1 2 3])");
+  avoc_list_init(&nums);
+  assert_okb(avoc_parse_source(&nums_src, &nums) == OK);
+  const avoc_list *ints = nums.head->as_list->tail->as_list;
+  avoc_array a, sums;
+  assert_okb(avoc_array_from_list(ints, &a) == OK);
+  avoc_set_allocator(&alloc);
+  assert_ok(avoc_array_init(&sums, AVOC_ARRAY_I32, 3L) == FAILED);
+  assert_okb(sums.count == 0L && sums.data == NULL);
+  assert_ok(avoc_array_from_list(ints, &sums) == FAILED);
+  assert_eql(sums.count, 0L);
+  assert_ok(avoc_array_map(&a, &a, AVOC_ARRAY_ADD, &sums) == FAILED);
+  assert_eql(sums.count, 0L);
+  assert_eql(ctx.frees, 0L);
+  avoc_set_allocator(NULL);
+  avoc_array_free(&a);
+  avoc_list_free(&nums);
+  avoc_source_free(&nums_src);
+
+  // persistent updates leave their source and an empty result
+  avoc_pvec vec, vec_next;
+  avoc_pvec_init(&vec);
+  for (int i = 0; i < 40; i++) {
+    avoc_pvec_push(&vec, avoc_value_i32(i), &vec_next);
+    avoc_pvec_free(&vec);
+    vec = vec_next;
+  }
+
+  avoc_plist cells, cells_next;
+  avoc_plist_init(&cells);
+  avoc_pmap map, map_next;
+  avoc_pmap_init(&map);
+  avoc_set_allocator(&alloc);
+  assert_ok(avoc_pvec_push(&vec, avoc_value_nil(), &vec_next) == FAILED);
+  assert_eql(vec_next.count, 0L);
+  assert_ok(avoc_pvec_set(&vec, 3, avoc_value_nil(), &vec_next) == FAILED);
+  assert_ok(avoc_plist_cons(&cells, avoc_value_nil(), &cells_next) == FAILED);
+  assert_ok(avoc_pmap_put(&map, avoc_value_nil(), avoc_value_nil(),
+                          &map_next) == FAILED);
+  assert_eql(map_next.count, 0L);
+  assert_eql(ctx.frees, 0L);
+  avoc_set_allocator(NULL);
+  assert_eql(vec.count, 40L);
+  int same = 1;
+  for (int i = 0; i < 40; i++) {
+    same &= avoc_pvec_get(&vec, (size_t)i) == avoc_value_i32(i);
+  }
+
+  assert_okb(same);
+
+  // transients failing halfway through copying a path keep their elements,
+  // here growing the root of the trie takes three nodes
+  avoc_pvec builder;
+  avoc_pvec_transient(&vec, &builder);
+  for (int i = 40; i < 1056; i++) {
+    avoc_pvec_transient_push(&builder, avoc_value_i32(i));
+  }
+
+  avoc_pvec_persistent(&builder);
+  avoc_pvec_free(&vec);
+  budget_ctx budget = {{0L, 0L}, 0L};
+  avoc_allocator budget_alloc = {budget_malloc, budget_realloc,
+                                 counting_free, &budget};
+  avoc_status status = FAILED;
+  for (; status != OK; budget.budget++) {
+    avoc_pvec_transient(&builder, &vec);
+    budget.count.allocs = 0L;
+    avoc_set_allocator(&budget_alloc);
+    status = avoc_pvec_transient_push(&vec, avoc_value_nil());
+    avoc_set_allocator(NULL);
+    same &= vec.count == (status == OK ? 1057L : 1056L);
+    for (size_t i = 0; i < 1056; i++) {
+      same &= avoc_pvec_get(&vec, i) == avoc_value_i32((int)i);
+    }
+    avoc_pvec_free(&vec);
+  }
+
+  assert_eql(budget.budget, 4L);
+  assert_okb(same);
+  avoc_pvec_free(&builder);
+
+  avoc_pmap_transient(&map, &map_next);
+  for (int i = 0; i < 1000; i++) {
+    avoc_pmap_transient_put(&map_next, avoc_value_i32(i), avoc_value_nil());
+  }
+
+  for (int key = 1000; key < 1100; key++) {
+    status = FAILED;
+    for (budget.budget = 0L; status != OK; budget.budget++) {
+      budget.count.allocs = 0L;
+      avoc_set_allocator(&budget_alloc);
+      status = avoc_pmap_transient_put(&map_next, avoc_value_i32(key),
+                                       avoc_value_nil());
+      avoc_set_allocator(NULL);
+      same &= map_next.count == (size_t)(status == OK ? key + 1 : key);
+    }
+  }
+
+  avoc_value value;
+  for (int i = 0; i < 1100; i++) {
+    same &= avoc_pmap_get(&map_next, avoc_value_i32(i), &value) == OK;
+  }
+
+  assert_okb(same);
+  avoc_pmap_free(&map_next);
+
+  // parsing and expanding fail cleanly wherever memory runs out
+  char *parsed = NULL;
+  char *unlimited = NULL;
+  avoc_alloc_stats before, after;
+  assert_okb(parse_with(NULL, &unlimited) == OK);
+  status = FAILED;
+  for (budget.budget = 0L; status != OK; budget.budget++) {
+    budget.count.allocs = 0L;
+    avoc_get_alloc_stats(&before);
+    status = parse_with(&budget_alloc, &parsed);
+    avoc_get_alloc_stats(&after);
+    same &= after.bytes_in_use == before.bytes_in_use;
+  }
+
+  assert_okb(same);
+  assert_okb(budget.budget > 50);
+  assert_okb(parsed != NULL && unlimited != NULL);
+  assert_eqs(parsed != NULL ? parsed : "", unlimited != NULL ? unlimited : "");
+  free(parsed);
+  free(unlimited);
+
+  // module graphs fail cleanly wherever memory runs out
+  status = FAILED;
+  for (budget.budget = 0L; status != OK; budget.budget++) {
+    budget.count.allocs = 0L;
+    avoc_get_alloc_stats(&before);
+    avoc_set_allocator(&budget_alloc);
+    avoc_module_graph graph;
+    avoc_module_graph_init(&graph);
+    status = add_module(&graph, "app", "(import math) (main)");
+    if (status == OK) {
+      status = add_module(&graph, "math", "(import base) (def r (* pi 2))");
+    }
+
+    if (status == OK) {
+      status = add_module(&graph, "base", "(def pi:f64 3.14)");
+    }
+
+    if (status == OK) {
+      status = avoc_module_graph_build(&graph, NULL);
+    }
+
+    same &= status != OK || (graph.order != NULL && graph.order[0] == 2L);
+    avoc_module_graph_free(&graph);
+    avoc_set_allocator(NULL);
+    avoc_get_alloc_stats(&after);
+    same &= after.bytes_in_use == before.bytes_in_use;
+  }
+
+  assert_okb(same);
+  assert_okb(budget.budget > 10);
+
+  // snapshots fail to load wherever memory runs out, leaving no item
+  avoc_source snap_src;
+  avoc_list snap_tree;
+  load_string(&snap_src, "(def a:i32 1) (f [1 2.0] x:(Vec T) (g 'h'))");
+  avoc_list_init(&snap_tree);
+  assert_okb(avoc_parse_source(&snap_src, &snap_tree) == OK);
+  string_sink image = {NULL, 0L, 0L, 0L};
+  assert_okb(avoc_snapshot_write(&snap_tree, sink_write, &image) == OK);
+  avoc_list_free(&snap_tree);
+  avoc_source_free(&snap_src);
+  status = FAILED;
+  for (budget.budget = 0L; status != OK; budget.budget++) {
+    budget.count.allocs = 0L;
+    avoc_get_alloc_stats(&before);
+    avoc_set_allocator(&budget_alloc);
+    avoc_list_init(&snap_tree);
+    status = avoc_snapshot_load(image.data, image.len, &snap_tree);
+    same &= status == OK || snap_tree.head == NULL;
+    avoc_list_free(&snap_tree);
+    avoc_set_allocator(NULL);
+    avoc_get_alloc_stats(&after);
+    same &= after.bytes_in_use == before.bytes_in_use;
+  }
+
+  assert_okb(same);
+  assert_okb(budget.budget > 10);
+  free(image.data);
+
+  // the parallel kernels fail before running when their buffers or result
+  // cannot be allocated
+  avoc_pool *pool = avoc_pool_new(2L);
+  assert_okb(pool != NULL);
+  assert_okb(avoc_array_init(&a, AVOC_ARRAY_I32, 1000L) == OK);
+  for (int i = 0; i < 1000; i++) {
+    ((int *)a.data)[i] = i % 3;
+  }
+
+  status = FAILED;
+  for (budget.budget = 0L; status != OK; budget.budget++) {
+    budget.count.allocs = 0L;
+    avoc_get_alloc_stats(&before);
+    avoc_set_allocator(&budget_alloc);
+    status = avoc_array_pmap(pool, &a, &a, AVOC_ARRAY_ADD, &sums);
+    avoc_set_allocator(NULL);
+    avoc_get_alloc_stats(&after);
+    same &= status == OK || (sums.count == 0L &&
+                             after.bytes_in_use == before.bytes_in_use);
+  }
+
+  assert_eql(budget.budget, 2L);
+  assert_eql(sums.count, 1000L);
+  avoc_array_free(&sums);
+  status = FAILED;
+  for (budget.budget = 0L; status != OK; budget.budget++) {
+    budget.count.allocs = 0L;
+    avoc_get_alloc_stats(&before);
+    avoc_set_allocator(&budget_alloc);
+    status = avoc_array_pfilter(pool, &a, keep_nonzero, NULL, &sums);
+    avoc_set_allocator(NULL);
+    avoc_get_alloc_stats(&after);
+    same &= status == OK || after.bytes_in_use == before.bytes_in_use;
+  }
+
+  assert_okb(same);
+  assert_eql(budget.budget, 4L);
+  assert_eql(sums.count, 666L);
+  avoc_array_free(&sums);
+  avoc_array_free(&a);
+  avoc_pool_free(pool);
+
+  avoc_pvec_free(&vec);
+
+  char *formatted = format_tree(&list);
+  assert_okb(formatted != NULL && expected != NULL);
+  assert_eqs(formatted, expected);
+  free(formatted);
+  free(expected);
+  avoc_list_free(&list);
+  avoc_source_free(&src);
 }
 
 int main() {
   trun("test_source_init_free", test_source_init_free);
   trun("test_source_move_fwd_ascii", test_source_move_fwd_ascii);
   trun("test_source_move_fwd_utf8", test_source_move_fwd_utf8);
-  trun("test_source_move_fwd_newl", test_source_move_fwd_newl);
+  trun("test_source_position", test_source_position);
   trun("test_token_init", test_token_init);
   trun("test_token_next_singlechar", test_token_next_singlechar);
   trun("test_token_next_comments", test_token_next_comments);
@@ -1431,7 +4127,9 @@ int main() {
   trun("test_token_next_nilbol_lit", test_token_next_nilbol_lit);
   trun("test_token_next_id", test_token_next_id);
   trun("test_token_edge_cases", test_token_edge_cases);
+  trun("test_keywords", test_keywords);
   trun("test_lists", test_lists);
+  trun("test_lists_free_deep", test_lists_free_deep);
   trun("test_parse_bol_lit", test_parse_bol_lit);
   trun("test_parse_int_lit", test_parse_int_lit);
   trun("test_parse_flt_lit", test_parse_flt_lit);
@@ -1439,10 +4137,33 @@ int main() {
   trun("test_parse_lst_lit", test_parse_lst_lit);
   trun("test_parse_sym_no_type", test_parse_sym_no_type);
   trun("test_parse_sym_with_ord_type", test_parse_sym_with_ord_type);
+  trun("test_parse_comment", test_parse_comment);
   trun("test_parse_item_no_lists", test_parse_item_no_lists);
   trun("test_parse_lists", test_parse_calls);
   trun("test_parse_sym_with_composed_type", test_parse_sym_with_composed_type);
   trun("test_parse_source", test_parse_source);
+  trun("test_parse_source_lazy", test_parse_source_lazy);
+  trun("test_alloc_stats", test_alloc_stats);
+  trun("test_format", test_format);
+  trun("test_structural_hash", test_structural_hash);
+  trun("test_parse_source_shared", test_parse_source_shared);
+  trun("test_module_graph", test_module_graph);
+  trun("test_item_at", test_item_at);
+  trun("test_source_edit", test_source_edit);
+  trun("test_list_visit", test_list_visit);
+  trun("test_query", test_query);
+  trun("test_expand", test_expand);
+  trun("test_snapshot", test_snapshot);
+  trun("test_array", test_array);
+  trun("test_pvec", test_pvec);
+  trun("test_plist", test_plist);
+  trun("test_pmap", test_pmap);
+  trun("test_pool", test_pool);
+  trun("test_alloc_failure", test_alloc_failure);
+#ifdef AVOCC_TRACE
+  trun("test_trace", test_trace);
+#endif
+  trun("test_value_boxing", test_value_boxing);
   tresults();
   return 0;
 }
@@ -92,6 +92,20 @@ __attribute__((unused)) static int tfails = 0;
 // Fail if two strings are different
 #define assert_eqs(a, b) tequal_base(strcmp(a, b) == 0, a, b, "%s")
 
+// Fail if a string of the given length differs from a NUL terminated one
+#define assert_eqsn(a, alen, b)                                                \
+  do {                                                                         \
+    ++ttotal;                                                                  \
+    if ((alen) != strlen(b) || strncmp(a, b, alen) != 0) {                     \
+      if (tfails == 0) {                                                       \
+        printf("\n");                                                          \
+      }                                                                        \
+      ++tfails;                                                                \
+      printf("%s:%d: (%.*s != %s)\n", __FILE__, __LINE__, (int)(alen), (a),    \
+             (b));                                                             \
+    }                                                                          \
+  } while (0)
+
 // Fail if two float or double arguments are different
 #define assert_eqf(a, b)                                                       \
   tequal_base(fabs((double)(a) - (double)(b)) <= LTEST_FLOAT_TOLERANCE &&      \